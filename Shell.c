@@ -4,35 +4,724 @@
  * A simple Unix shell implementation in C.
  * Features:
  *   - Execution of commands with arguments
- *   - Input redirection (with '<') and output redirection (with '>')
+ *   - Redirection: '<', '>', '>>', numbered ("2>"), duplicated ("2>&1", ">&-") and here-strings
+ *     ("<<<", fed from a memfd)
  *   - Pipelining of multiple commands with '|'
  *   - Background execution with '&'
+ *   - Command lists with ';', '&&' and '||', parsed once into a list / and-or / pipeline tree
+ *   - for / while / until loops whose bodies are parsed once and re-run; $NAME, $?, $$ expansion
+ *   - Shell variables, quoting, "export" / "unset"; children get a cached environment block
+ *   - Pathname expansion (*, ?, [...]) backed by a directory cache keyed by (dev, inode, mtime)
  *   - Built-in commands: "cd" to change directory, "exit" to exit the shell
+ *   - Fork-free builtins for hot utilities: echo, printf, test/[, true, false, pwd; builtins
+ *     also work as pipeline stages (forked without exec, or in-process as the last stage)
+ *   - Commands are launched with posix_spawn (fork/exec kept as a fallback, SHELL_SPAWN=fork)
+ *   - Resolved command paths are cached in a hash table ("hash" builtin)
+ *   - Raw-mode line editor with Ctrl-R search over an mmap'd, offset-indexed history file
+ *   - Tab completion of commands (PATH executable index refreshed by directory mtime) and files
+ *   - Script mode ("output script.sh") and "-c command" mode with a block-buffered line reader
+ *   - Per-line bump arena for parsed commands: no fixed limit on arguments or pipeline length
+ *   - Job control: job table fed by a SIGCHLD self-pipe, process group per pipeline,
+ *     built-ins "jobs", "fg", "bg", "wait" and "kill"
+ *   - One event loop (io_uring, epoll fallback) for child reaping, feeders, input and "parallel"
+ *   - "parallel -j N" built-in: bounded worker pool with output kept in task order
+ *   - "coproc [NAME] CMD": warm worker processes reached through $NAME_IN / $NAME_OUT pipes
+ *   - "on HOSTS -- CMD": remote fan-out over pooled ssh control connections, per-host prefixes
+ *   - "memo CMD < in > out": stdout cache keyed by argv, binary, input identities and environment
+ *   - "time" prefix and SHELL_TRACE=<fd> JSON tracing of per-segment wall/CPU/RSS/faults
+ *   - SHELL_STATS=1 counters in /dev/shm, summed across running shells by "output --stat [SEC]"
+ *   - Process substitution: "<(LIST)" / ">(LIST)" words become /dev/fd paths to pipes
+ *   - "cat FILE | ..." and "< FILE | ..." are fed by the shell with splice(), without a process
+ *   - "set -o" options, including pipe buffer sizing (pipesize, F_SETPIPE_SZ) and packet mode
+ *   - "ulimit" and a "run --cgroup=NAME --cpu=N --mem=SIZE ..." prefix (cgroup v2, setrlimit)
+ *   - "set -o builtin-filters": head, tail, fixed-string grep and wc as SIMD-scanning builtins
+ *   - "set -o pinstages[=numa]": stages of a pipeline bound to CPUs sharing L2/L3 (and a node)
+ *   - LRU cache of parsed command lines keyed by a hash of the raw line ("shellstat" counters)
  * The code follows best practices in indentation, naming, modularity, memory management, and error handling.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <spawn.h>
+#include <termios.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/magic.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ARENA_BLOCK 65536     // Default size of a line arena block
+#define ARENA_ALIGN 16        // Alignment of every arena allocation
+#define INITIAL_ARGS 8        // Initial argv capacity of a pipeline segment
+#define INITIAL_SEGMENTS 4    // Initial capacity of the pipeline segment array
+#define PATH_CACHE_SIZE 256   // Buckets in the command path hash table (power of two)
+#define READ_CHUNK 65536      // Bytes requested per read() by the line reader
+#define FEEDER_CHUNK (1 << 20)  // Bytes requested per splice() by the input feeder
+#define FILTER_CHUNK 131072     // Bytes read per call by the builtin text filters
+#define STAT_MAGIC 0x31545353u  // "SST1": first word of an initialized shared counter block
+#define STAT_SPAWN_BUCKETS 24   // Spawn latency histogram: bucket i counts launches under 2^i us
+// Add to a counter of the shell's shared block; relaxed, as forked stages share the block
+#define STAT_ADD(field, n)                                                                  \
+    do {                                                                                    \
+        if (stat_block != NULL) {                                                           \
+            __atomic_fetch_add(&stat_block->counters.field, (uint64_t)(n), __ATOMIC_RELAXED); \
+        }                                                                                   \
+    } while (0)
+#define PARSE_CACHE_BUCKETS 512 // Buckets in the parsed-line cache (power of two)
+#define PARSE_CACHE_DEFAULT 256 // Default number of parsed lines kept (set -o parsecache=N)
+#define PARSE_CACHE_BLOCK 1024  // Arena block size of one cached line
+#define VAR_TABLE_SIZE 64       // Buckets in the shell variable table (power of two)
+#define DIR_CACHE_BUCKETS 64    // Buckets in the glob directory cache (power of two)
+#define DIR_CACHE_MAX 128       // Directories kept by the glob cache
+#define DIR_CACHE_RACY_SEC 2    // A directory modified this recently is not trusted from cache
+#define HISTORY_MAGIC 0x31494853u  // "SHI1": first word of a history index file
+#define HISTORY_INDEX_MIN 4096  // Initial number of offsets a history index has room for
+#define EDITOR_SEARCH_MAX 256   // Longest Ctrl-R search string
+#define CTRL_KEY(c) ((c) & 0x1f)  // Byte sent by Ctrl + a letter
+#define COMPLETION_LIST_MAX 100 // Ask before listing more completions than this
+#define COPROC_MAX 16           // Coprocesses that can be open at the same time
+#define RUN_RLIMIT_MAX 8         // Resource limits one "run" prefix can set
+#define CGROUP_PERIOD_US 100000 // cpu.max period used by "run --cpu=N"
+#define PIN_NODE_WORDS 16       // Words of a NUMA node mask (1024 nodes)
+#define PIN_MPOL_DEFAULT 0      // set_mempolicy modes (numaif.h, without linking libnuma)
+#define PIN_MPOL_PREFERRED 1
+#define ON_JOBS_DEFAULT 32      // Hosts "on" runs a command on at once (on -j N)
+#define ON_PERSIST_SEC 600      // Idle seconds an ssh control connection is kept (ControlPersist)
+#define EVENT_RING_ENTRIES 64   // Submission slots of the event loop's io_uring
+#define EVENT_BATCH 64          // Ready descriptors handled per event loop wake-up
+#define EVENT_REMOVE_TAG UINT64_MAX  // user_data of io_uring poll removals (no handler)
+
+// Kind of a redirection kept in a command's ordered redirection list
+typedef enum {
+    REDIR_READ,              // [N]< FILE
+    REDIR_WRITE,             // [N]> FILE
+    REDIR_APPEND,            // [N]>> FILE
+    REDIR_HERE,              // [N]<<< WORD (fed from memory, no file on disk)
+    REDIR_DUP,               // N>&M / N<&M
+    REDIR_CLOSE              // N>&- / N<&-
+} RedirKind;
+
+// A redirection that is not a plain "<" / ">" / ">>" / "<<<" of stdin or stdout
+typedef struct {
+    RedirKind kind;          // What to do with fd
+    int fd;                  // Descriptor redirected
+    int source;              // REDIR_DUP: descriptor copied onto fd
+    char *target;            // File name or here-string word; REDIR_DUP: a "$..." source word or NULL
+} Redirect;
 
-#define MAX_ARGS 128          // Maximum number of arguments for a command
-#define MAX_PIPE 16           // Maximum number of pipeline segments in a command line
+// A process substitution "<(LIST)" or ">(LIST)": a word replaced by a /dev/fd path to a pipe
+typedef struct {
+    char *word;              // The word in args or a redirection (the text, for job listings)
+    struct AndOr *list;      // Commands run in a subshell on the other end of the pipe
+    bool output;             // ">(LIST)": the command writes to the path and LIST reads it
+} ProcSubst;
 
 // Structure to represent a parsed command or a pipeline segment
 typedef struct {
-    char *args[MAX_ARGS];    // Arguments for the command (NULL-terminated list)
+    char **args;             // Arguments for the command (NULL-terminated list, arena memory)
+    int argc;                // Number of arguments in args
     char *input_file;        // Input redirection file (NULL if none)
     char *output_file;       // Output redirection file (NULL if none)
+    char *here_string;       // "<<< WORD" feeding stdin instead of input_file (NULL if none)
+    bool append;             // output_file was given with ">>" (O_APPEND)
+    Redirect *redirs;        // Other redirections, applied in order after input/output_file
+    int nredirs;             // Number of entries in redirs
+    ProcSubst *substs;       // Process substitutions among the words (started before each run)
+    int nsubsts;             // Number of entries in substs
+    char **assigns;          // "NAME=value" prefixes, once expanded (see nassign)
+    int nassign;             // Parsed: leading assignment words of args; expanded: size of assigns
     bool background;         // True if command should run in the background
+    bool expand;             // Has a '$', a wildcard or an assignment (expanded before each run)
+    struct Loop *loop;       // Compound command (for / while / until loop), NULL for a simple one
+    pid_t pid;               // Process launched for this segment (-1 if none)
 } Command;
 
+// Operator that ends a pipeline of a command list
+typedef enum {
+    LIST_END,                // End of the line
+    LIST_SEQ,                // ';'
+    LIST_BACKGROUND,         // '&'
+    LIST_AND,                // '&&'
+    LIST_OR,                 // '||'
+    LIST_NEWLINE,            // '\n' inside a multi-line command (empty pipelines allowed)
+    LIST_DO,                 // Reserved word "do" in command position
+    LIST_DONE                // Reserved word "done" in command position
+} ListOp;
+
+// A pipeline inside an and-or list
+typedef struct Pipeline {
+    Command *commands;       // Pipeline segments
+    int num_commands;        // Number of segments
+    ListOp join;             // LIST_AND or LIST_OR joining it to the previous pipeline (LIST_SEQ if first)
+    struct Pipeline *next;   // Next pipeline of the same and-or list
+} Pipeline;
+
+// An and-or list: pipelines joined by "&&" / "||", ended by ';', '&' or the end of the line
+typedef struct AndOr {
+    Pipeline *first;         // First pipeline
+    bool background;         // Ended by '&': run the whole list asynchronously
+    struct AndOr *next;      // Next and-or list of the command line
+} AndOr;
+
+// Kind of loop
+typedef enum {
+    LOOP_FOR,                // for NAME in WORD...; do BODY; done
+    LOOP_WHILE,              // while CONDITION; do BODY; done
+    LOOP_UNTIL               // until CONDITION; do BODY; done
+} LoopKind;
+
+// A loop, parsed once; its body tree is run again on every iteration
+typedef struct Loop {
+    LoopKind kind;           // for, while or until
+    char *var;               // for: loop variable name
+    char **words;            // for: word list (NULL-terminated)
+    int nwords;              // for: number of words
+    bool expand;             // for: some word contains '$'
+    AndOr *condition;        // while / until: condition list
+    AndOr *body;             // Loop body
+} Loop;
+
+// One block of a bump arena
+typedef struct ArenaBlock {
+    struct ArenaBlock *next; // Next block in the chain
+    size_t size;             // Usable bytes in data
+    size_t used;             // Bytes handed out so far
+    _Alignas(ARENA_ALIGN) char data[];  // Block payload: starts, like every allocation, ARENA_ALIGN-aligned
+} ArenaBlock;
+
+// Bump allocator holding everything parsed from one command line
+typedef struct {
+    ArenaBlock *head;        // First block (kept across resets)
+    ArenaBlock *current;     // Block allocations are served from
+    void *last;              // Most recent allocation (can be grown in place)
+    size_t block_size;       // Minimum block size (0 for ARENA_BLOCK)
+} Arena;
+
+// Position in an arena to roll back to (allocations are released in LIFO order)
+typedef struct {
+    ArenaBlock *block;       // Block that was current (NULL if nothing was allocated yet)
+    size_t used;             // Bytes used in that block
+} ArenaMark;
+
+// A shell variable
+typedef struct ShellVar {
+    char *name;              // Variable name
+    char *value;             // Current value (reused while a new value fits), NULL if unset
+    size_t cap;              // Allocated size of value
+    bool exported;           // Passed to child processes ("export")
+    struct ShellVar *next;   // Next variable in the same bucket
+} ShellVar;
+
+// A field being built by expand_word, with the same text as a glob pattern
+typedef struct {
+    char *text;              // Field text (arena memory, NULL until something is appended)
+    size_t len;              // Length of text
+    size_t cap;              // Allocated size of text
+    char *pattern;           // Text with quoted wildcard characters escaped by '\'
+    size_t pattern_len;      // Length of pattern
+    size_t pattern_cap;      // Allocated size of pattern
+    bool exists;             // The field is produced even if empty ("" or quotes)
+    bool glob;               // Has an unquoted '*', '?' or '['
+    bool track_glob;         // Build pattern (argument words only)
+} Field;
+
+// One entry of a cached directory
+typedef struct {
+    size_t offset;           // Name, as an offset in the directory's pool
+    size_t len;              // Length of the name
+    unsigned char type;      // d_type from readdir (DT_UNKNOWN if the file system has none)
+} DirName;
+
+// A directory read by the glob cache
+typedef struct DirCache {
+    dev_t dev;               // Device and inode: the cache key
+    ino_t ino;
+    struct timespec mtime;   // Directory mtime when it was read
+    DirName *names;          // Entries sorted by name (without "." and "..")
+    size_t count;            // Number of entries
+    size_t cap;              // Allocated slots in names
+    char *pool;              // NUL-terminated names back to back
+    size_t pool_cap;         // Allocated size of pool
+    bool racy;               // Read too soon after a change to be trusted next time
+    int busy;                // Globs walking it: while nonzero it is neither refilled nor recycled
+    unsigned long long used; // dir_cache_tick when last used (for LRU recycling)
+    struct DirCache *next;   // Next directory in the same bucket
+} DirCache;
+
+// Executables of one PATH directory, kept for command completion
+typedef struct {
+    char *dir;               // Directory as written in PATH ("." for an empty entry)
+    dev_t dev;               // Device and inode when listed
+    ino_t ino;
+    struct timespec mtime;   // Directory mtime when listed
+    bool listed;             // names holds the directory's executables
+    bool racy;               // Listed too soon after a change to be trusted next time
+    char **names;            // Executable names, sorted (pointing into pool)
+    size_t count;            // Number of names
+    char *pool;              // NUL-terminated names back to back
+} CompletionDir;
+
+// One completion candidate
+typedef struct {
+    const char *name;        // Candidate (not owned: a builtin, index, cache or glob cache name)
+    size_t len;              // Length of name
+    bool dir;                // A directory: completed with '/' instead of ' '
+} Completion;
+
+// A coprocess started by "coproc": a background job with pipes to and from the shell
+typedef struct Coproc {
+    char *name;              // Name: prefix of its NAME_IN, NAME_OUT and NAME_PID variables
+    pid_t pid;               // Process id
+    int in_fd;               // Write end of the pipe to its stdin (NAME_IN, -1 after "coproc -c")
+    int out_fd;              // Read end of the pipe from its stdout (NAME_OUT)
+    struct Coproc *next;     // Next coprocess
+} Coproc;
+
+// A host reached by "on", whose ssh control connection is kept between runs
+typedef struct OnHost {
+    char *name;              // Host name as given on the command line
+    unsigned long long runs;     // Commands run on it
+    unsigned long long reused;   // Runs that found its control connection already up
+    struct OnHost *next;     // Next host
+} OnHost;
+
+// Placement of pipeline stages (set -o pinstages)
+typedef enum {
+    PIN_OFF,                 // Stages run wherever the scheduler puts them
+    PIN_CPU,                 // Each stage is bound to one CPU, neighbours sharing a cache
+    PIN_NUMA                 // As PIN_CPU, and memory is preferably taken from that CPU's node
+} PinMode;
+
+// A CPU that pipeline stages can be bound to, with its place in the cache hierarchy
+typedef struct {
+    int cpu;                 // CPU number
+    int node;                // NUMA node (0 without NUMA information)
+    int llc;                 // Lowest CPU sharing its last-level cache: the cache domain id
+    int thread;              // Position among the SMT siblings of its core (0 = first)
+} PinCpu;
+
+// Kernel interface the event loop waits through (event_init)
+typedef enum {
+    EVENT_NONE,              // Not set up yet (or dropped by a subshell)
+    EVENT_URING,             // io_uring: one-shot poll requests armed and reaped through shared rings
+    EVENT_EPOLL              // epoll: descriptors registered once, level-triggered
+} EventBackend;
+
+// Called by the event loop with the poll events a watched descriptor is ready for
+typedef void (*EventHandler)(void *data, short revents);
+
+// One descriptor watched by the event loop
+typedef struct {
+    int fd;                  // Descriptor (-1: free slot)
+    short events;            // POLLIN or POLLOUT
+    bool armed;              // io_uring: a poll request for it is in flight
+    unsigned gen;            // Bumped when the slot is freed: completions of an older watch are ignored
+    EventHandler handler;    // Called once the descriptor is ready
+    void *data;              // Handler argument
+} EventWatch;
+
+// An io_uring instance with its submission and completion rings mapped into the shell
+typedef struct {
+    int fd;                  // Ring descriptor
+    unsigned *sq_head;       // Submission ring: first entry the kernel has not consumed
+    unsigned *sq_tail;       // Submission ring: next entry the shell fills
+    unsigned sq_mask;        // Submission ring size - 1
+    unsigned sq_entries;     // Submission ring size
+    unsigned *sq_array;      // Submission ring: indexes into sqes
+    struct io_uring_sqe *sqes;  // Submission entries
+    unsigned *cq_head;       // Completion ring: next entry the shell reads
+    unsigned *cq_tail;       // Completion ring: next entry the kernel fills
+    unsigned cq_mask;        // Completion ring size - 1
+    struct io_uring_cqe *cqes;  // Completion entries
+    void *sq_map;            // Mapping of the submission ring (and the completion ring if shared)
+    size_t sq_map_len;       // Length of sq_map
+    void *cq_map;            // Mapping of the completion ring (sq_map with IORING_FEAT_SINGLE_MMAP)
+    size_t cq_map_len;       // Length of cq_map
+    size_t sqes_len;         // Length of the sqes mapping
+    unsigned queued;         // Entries filled but not yet submitted
+} EventRing;
+
+// A command line kept in the parse cache with the tree parsed from it
+typedef struct ParseEntry {
+    char *line;              // Raw input line (the key, in arena memory)
+    size_t len;              // Length of line
+    uint32_t hash;           // line_hash() of line
+    AndOr *list;             // Parsed tree (NULL for a blank or comment line)
+    Arena arena;             // Owns the key, the parsed copy of the line and the tree
+    struct ParseEntry *next; // Next entry in the same bucket
+    struct ParseEntry *newer;  // LRU neighbour towards the most recently used entry
+    struct ParseEntry *older;  // LRU neighbour towards the least recently used entry
+} ParseEntry;
+
+// Character classes used by the command-line lexer
+enum {
+    CC_WORD = 0,             // Part of a word
+    CC_END,                  // End of the line (NUL)
+    CC_SPACE,                // Blank separating words
+    CC_PIPE,                 // '|'
+    CC_LESS,                 // '<'
+    CC_GREAT,                // '>'
+    CC_AMP,                  // '&'
+    CC_SEMI,                 // ';'
+    CC_NEWLINE               // '\n' (only inside multi-line commands)
+};
+
+// Bytes that end a word: every non-CC_WORD entry of char_class except NUL
+#define WORD_DELIMITERS " \t\n\v\f\r|<>&;"
+// Characters that end the fast scan of a word: delimiters and quoting characters
+#define WORD_SPECIALS WORD_DELIMITERS "'\"\\"
+
+// Lexer dispatch table: one lookup per input byte replaces the strsep/strcmp passes
+static const unsigned char char_class[256] = {
+    ['\0'] = CC_END,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_NEWLINE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['|'] = CC_PIPE, ['<'] = CC_LESS, ['>'] = CC_GREAT, ['&'] = CC_AMP, [';'] = CC_SEMI,
+};
+
+// Block-buffered line reader over a file descriptor or an in-memory string
+typedef struct {
+    int fd;                  // Source descriptor (-1 for an in-memory string)
+    char *buf;               // Buffered input; lines are NUL-terminated in place
+    size_t cap;              // Allocated size of buf
+    size_t start;            // Offset of the first unconsumed byte
+    size_t end;              // Offset one past the last buffered byte
+    bool eof;                // True once the source is exhausted
+} LineReader;
+
+// Header of a history index file, followed by the offset of every entry of the history file
+typedef struct {
+    uint32_t magic;          // HISTORY_MAGIC (anything else: the index is rebuilt)
+    uint32_t count;          // Entries indexed
+    uint64_t covered;        // Bytes of the history file the entries cover (ends after a '\n')
+    uint32_t offsets[];      // Start of each entry in the history file, oldest first
+} HistoryIndex;
+
+// Keys the line editor decodes from escape sequences (plain bytes stand for themselves)
+enum {
+    KEY_NONE = 256,          // Unknown sequence (ignored)
+    KEY_ESCAPE,              // A lone ESC
+    KEY_UP,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_WORD_LEFT,           // Alt-b
+    KEY_WORD_RIGHT           // Alt-f
+};
+
+// State of the interactive line editor (kept across lines so its buffers are reused)
+typedef struct {
+    char *buf;               // Line being edited (NUL-terminated)
+    size_t len;              // Bytes in buf
+    size_t cap;              // Allocated size of buf
+    size_t pos;              // Cursor position (byte offset in buf)
+    long hist_pos;           // History entry shown (-1: the line being typed)
+    char *saved;             // The line being typed while browsing history
+    char *out;               // Redraw buffer
+    size_t out_cap;          // Allocated size of out
+} LineEditor;
+
+// How external commands are started
+typedef enum {
+    SPAWN_POSIX,             // posix_spawn (vfork-style, no page table copy)
+    SPAWN_FORK               // classic fork() + execve()
+} SpawnMode;
+
+// Entry in the command path hash table
+typedef struct PathEntry {
+    char *name;              // Command name as typed (no '/')
+    char *path;              // Resolved absolute or relative path
+    unsigned hits;           // Number of launches served from this entry
+    bool pinned;             // Set with "hash -p": survives PATH changes
+    struct PathEntry *next;  // Next entry in the same bucket
+} PathEntry;
+
+// One process of a job
+typedef struct {
+    pid_t pid;               // Process id
+    int status;              // Wait status once the process has terminated
+    bool exited;             // True once the process has terminated
+    bool stopped;            // True while the process is stopped
+    struct rusage usage;     // Resource usage reported by wait4 at exit
+    long long end_ns;        // Monotonic time the process was reaped
+    char *name;              // Segment command text (only kept for "time" and tracing)
+} JobProc;
+
+// One descriptor move a child makes before exec, planned by the parent (child_plan)
+typedef struct {
+    int from;                // Descriptor to duplicate (-1 to close "to")
+    int to;                  // Descriptor it lands on
+    bool opened;             // from was opened for this child: the parent closes its copy
+} ChildAction;
+
+// The descriptor moves of one child, in order
+typedef struct {
+    ChildAction *actions;    // The moves (expand_arena)
+    int nactions;            // Entries in actions
+} ChildPlan;
+
+// Limits of a "run" prefix, applied by every process of its pipeline before exec
+typedef struct {
+    const char *cgroup;      // --cgroup=NAME: path under the cgroup v2 mount (NULL for none)
+    const char *cpu;         // --cpu=N: CPU bandwidth written to cpu.max (NULL to leave it)
+    const char *mem;         // --mem=SIZE: memory.max (NULL to leave it)
+    const char *cpuset;      // --cpuset=LIST: cpuset.cpus, cores of its own (NULL to leave it)
+    int cgroup_fd;           // cgroup.procs of the cgroup, open while launching (-1 for none)
+    int nrlimits;            // Entries in resources and values
+    int resources[RUN_RLIMIT_MAX];  // setrlimit() resources (--nofile, --nproc, --as, ...)
+    rlim_t values[RUN_RLIMIT_MAX];  // Soft and hard limit for each of them
+} RunLimits;
+
+// A launched pipeline tracked in the job table
+typedef struct Job {
+    int id;                  // Job number, as in "%1"
+    pid_t pgid;              // Process group (first process of the pipeline)
+    char *text;              // Command text for "jobs" (NULL while running in the foreground)
+    JobProc *procs;          // One entry per launched segment
+    int nprocs;              // Number of entries in procs
+    int live;                // Processes that have not terminated yet
+    bool foreground;         // True while the shell is waiting for the job
+    bool notified;           // True once the current state has been reported
+    bool timed;              // Report resource usage on completion ("time" prefix)
+    long long seq;           // Sequence number of the job (trace output)
+    long long start_ns;      // Monotonic time just before the first spawn
+    long long parse_ns;      // Time the shell spent parsing the line
+    long long launch_ns;     // Time the shell spent launching every segment
+    long pipe_size;          // Inter-stage pipe buffer size (0 = kernel default)
+    int builtin_status;      // Exit code of a last stage run in the shell or never started (-1 if none)
+    JobProc shell_stage;     // That last stage's time and usage when run in the shell, for "time"
+                             // and tracing (pid 0 if none; see job_stage())
+    const RunLimits *limits; // "run" prefix, only while launching (NULL if none)
+    struct Job *next;        // Next (older) job
+} Job;
+
+// One command line run by the "parallel" builtin
+typedef struct {
+    char *line;              // Command line to parse and launch
+    Job *job;                // Running job (NULL before launch and after completion)
+    int out_fd;              // Read end of the output capture pipe (-1 once drained)
+    char *buf;               // Output captured while an earlier task is still running
+    size_t len;              // Bytes in buf
+    size_t cap;              // Allocated size of buf
+    int code;                // Exit code once finished
+    bool launched;           // True once the task was started (or failed to parse)
+    bool finished;           // True once its processes exited and its output was drained
+    int watch;               // Event loop watch on out_fd (-1 if none)
+    short revents;           // Events reported for out_fd since it was last read
+    const char *prefix;      // Written before each output line, streamed as it completes (NULL: task order)
+} ParallelTask;
+
+// A file copied into a pipe by the shell while the next segment reads it
+typedef struct {
+    int in_fd;               // File being fed
+    int out_fd;              // Write end of the pipe to the next segment (non-blocking)
+    int watch;               // Event loop watch waiting for room in the pipe (-1 if none)
+    char *buf;               // read/write fallback buffer (NULL while splice() works)
+    size_t off;              // Bytes of buf already written
+    size_t len;              // Bytes in buf
+    char *label;             // Error message prefix ("cat: FILE" or "shell: FILE")
+} Feeder;
+
+// A command implemented inside the shell
+typedef struct {
+    const char *name;        // Command name
+    int (*run)(Command *cmd);  // Implementation, returns the exit code
+    bool stage_safe;         // May run in the shell process as the last stage of a pipeline
+    bool own_redirections;   // Opens its own < and > files (they are not applied for it)
+} Builtin;
+
+// Counters a shell publishes for "output --stat" (SHELL_STATS=1); all 64-bit, summed word by word
+typedef struct {
+    uint64_t lines;          // Command lines parsed or served from the parse cache
+    uint64_t parse_ns;       // Time spent getting their trees
+    uint64_t parse_hits;     // Lines served by the parse cache
+    uint64_t parse_misses;   // Lines parsed and cached
+    uint64_t path_hits;      // Command paths served by the path cache
+    uint64_t path_misses;    // Command paths found by walking PATH
+    uint64_t pipelines;      // Pipelines run (a single command counts as one)
+    uint64_t commands;       // Pipeline segments run, in the shell or as processes
+    uint64_t processes;      // Processes started: external commands and forked builtin stages
+    uint64_t spawn_ns;       // Time spent starting external commands
+    uint64_t spawn_hist[STAT_SPAWN_BUCKETS];  // Those launches by latency, in powers of two of us
+    uint64_t jobs_live;      // Jobs in the job table now (created minus removed)
+    uint64_t jobs_done;      // Jobs finished
+    uint64_t job_ns;         // Wall time of the finished jobs
+    uint64_t feeder_bytes;   // Bytes moved into pipes by feeders ("cat FILE | ...")
+    uint64_t filter_bytes;   // Bytes read by builtin text filters
+} StatCounters;
+
+// One shell's shared counter block: a file in the stats directory, mapped shared
+typedef struct {
+    uint32_t magic;          // STAT_MAGIC, stored last when the block is set up
+    uint32_t size;           // sizeof(StatBlock) of the shell that wrote it
+    int32_t pid;             // The shell's process id
+    uint32_t reserved;       // Keeps the counters 8-byte aligned
+    StatCounters counters;   // Updated with relaxed atomics, read without locks
+} StatBlock;
+
+// Utility a builtin text filter stands in for (set -o builtin-filters)
+typedef enum {
+    FILTER_HEAD,
+    FILTER_TAIL,
+    FILTER_GREP,
+    FILTER_WC
+} FilterKind;
+
+// Options of a builtin text filter, as parsed by filter_parse
+typedef struct {
+    FilterKind kind;         // Which utility
+    long long count;         // head, tail: lines (or with head -c, bytes) to copy
+    bool bytes;              // head -c: count bytes instead of lines
+    bool fixed;              // grep -F
+    bool invert;             // grep -v: select lines without the pattern
+    bool count_only;         // grep -c: print the number of selected lines
+    bool quiet;              // grep -q: print nothing, stop at the first match
+    bool lines;              // wc -l
+    bool words;              // wc -w
+    bool chars;              // wc -c
+    const char *pattern;     // grep: the fixed string
+    const char *file;        // Input file (NULL for stdin)
+} FilterArgs;
+
+// Recursive-descent state of the "test" / "[" builtin
+typedef struct {
+    char **args;             // Operands (without the closing "]")
+    int count;               // Number of operands
+    int pos;                 // Next operand to consume
+    bool error;              // A syntax or integer error was reported
+} TestParser;
+
+extern char **environ;
+
+static SpawnMode spawn_mode = SPAWN_POSIX;
+static int spawn_failure;        // Exit code of the last segment that could not be started (127 or 1)
+static PathEntry *path_cache[PATH_CACHE_SIZE];
+static char *path_cache_path;    // Value of PATH the cache was filled against
+static Job *job_list;            // Job table, newest first
+static int sigchld_pipe[2] = {-1, -1};  // Self-pipe written by the SIGCHLD handler
+static bool job_control;         // Interactive: process groups and terminal hand-off
+static pid_t shell_pgid;         // Process group of the shell itself
+static struct termios shell_tmodes;     // Terminal modes restored after foreground jobs
+static int last_status;          // Exit code of the last foreground pipeline
+static Arena line_arena;         // Everything parsed from the current command line
+static FILE *trace_out;          // SHELL_TRACE destination (NULL when tracing is off)
+static long long job_seq;        // Jobs started so far
+static long long last_parse_ns;  // Parse time of the current line
+static long pipe_size_default;   // set -o pipesize: inter-stage pipe buffer size (0 = default)
+static bool pipe_size_warned;    // An F_SETPIPE_SZ failure was already reported
+static bool pipe_packet_mode;    // set -o pipepacket: O_DIRECT inter-stage pipes
+static bool builtin_filters;     // set -o builtin-filters: run head, tail, grep, wc in the shell
+static unsigned long long filter_runs;   // Builtin filter commands run
+static unsigned long long filter_bytes;  // Input bytes they read
+static StatBlock *stat_block;    // This shell's shared counters (NULL unless SHELL_STATS is set)
+static char *stat_path;          // File backing stat_block, removed at exit
+static bool exit_requested;      // "exit" ran in the shell process: leave the read loop
+static ParseEntry *parse_cache[PARSE_CACHE_BUCKETS];
+static ParseEntry *parse_cache_newest;  // Most recently used cached line
+static ParseEntry *parse_cache_oldest;  // Next line to evict
+static int parse_cache_count;    // Lines in the parse cache
+static int parse_cache_limit = PARSE_CACHE_DEFAULT;  // set -o parsecache: capacity (0 = off)
+static unsigned long long parse_cache_hits;    // Lines served from the parse cache
+static unsigned long long parse_cache_misses;  // Lines parsed and added to the cache
+static ShellVar *shell_vars[VAR_TABLE_SIZE];
+static char **positional;        // $0, $1, ...: "-c TEXT NAME ARGS...", or the script and its ARGS
+static int npositional;          // Entries in positional ($# is one less)
+static Arena expand_arena;       // Expanded copies of commands while they run
+static char **env_block;         // Environment for children, built from the exported variables
+static bool env_dirty = true;    // An exported variable changed since env_block was built
+static Arena env_arena;          // Owns env_block
+static unsigned long long env_builds;  // Times env_block was (re)built
+static DirCache *dir_cache[DIR_CACHE_BUCKETS];
+static int dir_cache_count;      // Directories in the glob cache
+static unsigned long long dir_cache_tick;  // Lookups so far (LRU clock)
+static unsigned long long dir_cache_hits;  // Directory listings served from the cache
+static unsigned long long dir_cache_reads; // Directories read with readdir()
+static int loop_depth;           // Loops currently running
+static int loop_break;           // Loop levels still to leave ("break N")
+static bool loop_continue;       // "continue": start the next iteration of the innermost loop
+static char *history_file;       // History file (NULL until history is first used)
+static int history_fd = -1;      // History file, opened O_APPEND
+static int history_index_fd = -1;  // Offset index of the history file (FILE.idx)
+static const char *history_map;  // Read-only mapping of the history file
+static size_t history_map_len;   // Bytes of history_map
+static HistoryIndex *history_index;  // Shared mapping of the index file
+static size_t history_index_cap; // Offsets the index mapping has room for
+static bool history_failed;      // History cannot be opened: do not try again
+static char *history_last;       // Last line recorded (an immediate repeat is not recorded)
+static unsigned long long history_indexed;  // Entries this shell added to the index
+static LineEditor line_editor;   // Interactive line editor
+static bool editor_enabled;      // Lines are read with the line editor (interactive terminal)
+static bool editor_cancelled;    // Ctrl-C dropped the line being edited
+static CompletionDir *completion_dirs;  // Executable index: one entry per PATH directory
+static int completion_ndirs;     // Entries in completion_dirs
+static char *completion_path;    // PATH the executable index was built for
+static unsigned long long completion_dir_reads;  // PATH directories listed for completion
+static unsigned long long completion_lookups;    // Command completions served
+static Coproc *coproc_list;      // Open coprocesses, newest first
+static int coproc_count;         // Entries in coproc_list
+static OnHost *on_hosts;          // Hosts "on" has connected to, newest first
+static char *on_control_dir;     // Directory of the ssh control sockets (created on first use)
+static unsigned long long on_runs;    // Host runs started by "on"
+static unsigned long long on_reused;  // Runs that found a live control connection
+static char *memo_dir;           // Directory of the "memo" output cache (created on first use)
+static unsigned long long memo_hits;    // "memo" pipelines answered from the cache
+static unsigned long long memo_misses;  // "memo" pipelines that had to run
+static unsigned long long memo_stored;  // Outputs added to the cache
+static PinMode pin_mode;         // set -o pinstages: bind the stages of a pipeline to CPUs
+static PinCpu *pin_cpus;         // Allowed CPUs ordered by node, cache domain and SMT thread
+static int pin_ncpus;            // Entries in pin_cpus (0 until the topology has been read)
+static int pin_cursor;           // Entry of pin_cpus the next pipeline starts from
+static int pin_saved_mode = -1;  // The shell's own memory policy (-1: NUMA policy unavailable)
+static unsigned long pin_saved_nodes[PIN_NODE_WORDS];  // Node mask of that policy
+static unsigned long long pin_stages;  // Stages bound to a CPU so far
+static int pin_child_cpu = -1;   // CPU the stage being launched binds to before exec (-1: none)
+static volatile sig_atomic_t interrupted;  // SIGINT received while a builtin waits on children
+static EventBackend event_backend;  // How the event loop waits (EVENT_NONE until event_init)
+static EventRing event_ring;     // io_uring instance of the EVENT_URING backend
+static int event_epoll_fd = -1;  // epoll instance of the EVENT_EPOLL backend
+static EventWatch *event_watches;  // Watched descriptors, indexed by watch id
+static int event_nwatches;       // Slots of event_watches in use or freed (high-water mark)
+static int event_watch_cap;      // Allocated slots of event_watches
+static int event_feeders;        // Feeders in flight: blocking reads must keep the loop running
+static bool sigpipe_default;     // A subshell: SIGPIPE kills it, as a closed pipe ends a loop stage
+static unsigned long long event_waits;  // Times the event loop went to sleep
+
 /**
  * trim_whitespace - Remove leading and trailing whitespace from a string.
  * @str: The string to trim (modified in place).
@@ -56,378 +745,10962 @@ char *trim_whitespace(char *str) {
         *end = '\0';
         end--;
     }
-    return str;
+    return str;
+}
+
+/**
+ * arena_new_block - Allocate an arena block with at least @size usable bytes.
+ * @arena: The arena the block is for (gives the minimum block size).
+ * @size: Minimum payload size.
+ * Return: The new block, or NULL on allocation failure.
+ */
+ArenaBlock *arena_new_block(const Arena *arena, size_t size) {
+    size_t min_size = arena->block_size ? arena->block_size : ARENA_BLOCK;
+    if (size < min_size) {
+        size = min_size;
+    }
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * arena_alloc - Allocate memory from an arena.
+ * @arena: The arena.
+ * @size: Number of bytes needed.
+ * Return: Pointer to ARENA_ALIGN-aligned memory valid until arena_reset, or NULL on failure.
+ *
+ * Blocks are chained and reused after a reset, so a steady stream of command lines
+ * reaches a fixed footprint and stops calling malloc altogether.
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (arena->head == NULL) {
+        arena->head = arena_new_block(arena, size);
+        if (arena->head == NULL) {
+            return NULL;
+        }
+        arena->current = arena->head;
+    }
+    ArenaBlock *block = arena->current;
+    while (block->size - block->used < size) {
+        if (block->next == NULL) {
+            block->next = arena_new_block(arena, size);
+            if (block->next == NULL) {
+                return NULL;
+            }
+        }
+        block = block->next;
+    }
+    arena->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+/**
+ * arena_grow - Resize an arena allocation, extending it in place when it is the latest one.
+ * @arena: The arena.
+ * @ptr: The allocation to grow (may be NULL).
+ * @old_size: Current size of the allocation.
+ * @new_size: Required size.
+ * Return: Pointer to the (possibly moved) allocation, or NULL on failure.
+ */
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr != NULL && ptr == arena->last) {
+        ArenaBlock *block = arena->current;
+        size_t offset = (size_t)((char *)ptr - block->data);
+        size_t aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + aligned <= block->size) {
+            block->used = offset + aligned;
+            return ptr;
+        }
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (grown != NULL && ptr != NULL) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+/**
+ * arena_reset - Release every allocation of an arena at once.
+ * @arena: The arena.
+ *
+ * Standard-sized blocks are kept for the next line; oversized ones are freed so a single
+ * huge line does not pin its memory for the rest of the session.
+ */
+void arena_reset(Arena *arena) {
+    ArenaBlock **link = &arena->head;
+    while (*link != NULL) {
+        ArenaBlock *block = *link;
+        if (block->size > (arena->block_size ? arena->block_size : ARENA_BLOCK)) {
+            *link = block->next;
+            free(block);
+            continue;
+        }
+        block->used = 0;
+        link = &block->next;
+    }
+    arena->current = arena->head;
+    arena->last = NULL;
+}
+
+/**
+ * arena_mark - Record the current end of an arena.
+ * @arena: The arena.
+ * Return: A mark for arena_release().
+ */
+ArenaMark arena_mark(const Arena *arena) {
+    ArenaMark mark = {arena->current, arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+/**
+ * arena_release - Free every allocation made after a mark.
+ * @arena: The arena.
+ * @mark: A mark taken with arena_mark() (later marks become invalid).
+ *
+ * Lets nested users share one arena: each releases what it allocated, the blocks stay.
+ */
+void arena_release(Arena *arena, ArenaMark mark) {
+    ArenaBlock *block = mark.block ? mark.block : arena->head;
+    if (block == NULL) {
+        return;
+    }
+    block->used = mark.block ? mark.used : 0;
+    for (ArenaBlock *later = block->next; later != NULL; later = later->next) {
+        later->used = 0;
+    }
+    arena->current = block;
+    arena->last = NULL;
+}
+
+/**
+ * arena_free - Free all memory owned by an arena.
+ * @arena: The arena.
+ */
+void arena_free(Arena *arena) {
+    while (arena->head != NULL) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->current = NULL;
+    arena->last = NULL;
+}
+
+// Loops contain lists, which contain pipelines, which may contain loops
+int parse_loop(char **cursor, Arena *arena, LoopKind kind, Loop **loop);
+
+// Process substitutions contain lists as well
+int parse_list(char **cursor, Arena *arena, AndOr **list, ListOp *term);
+
+// Defined below: a process substitution keeps a copy of its text
+char *arena_strndup(Arena *arena, const char *text, size_t len);
+
+/**
+ * is_name - Check whether a word is a valid variable name.
+ * @word: Start of the word.
+ * @len: Its length.
+ * Return: true for a letter or '_' followed by letters, digits or '_'.
+ */
+bool is_name(const char *word, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)word[0]) || word[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if (!(isalnum((unsigned char)word[i]) || word[i] == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * is_glob_pattern - Check whether a word contains pathname expansion characters.
+ * @word: Start of the word.
+ * @len: Its length.
+ * Return: true for a '*' or '?', or a '[' with a ']' after it (a lone "[" is the test
+ *         builtin, not a pattern).
+ */
+bool is_glob_pattern(const char *word, size_t len) {
+    if (memchr(word, '*', len) != NULL || memchr(word, '?', len) != NULL) {
+        return true;
+    }
+    const char *open = memchr(word, '[', len);
+    return open != NULL && memchr(open, ']', len - (size_t)(open - word)) != NULL;
+}
+
+/**
+ * scan_word - Find the end of a word, stepping over quoted and escaped characters.
+ * @word: Start of the word.
+ * @quoted: Output: set if the word contains quotes or backslashes.
+ * Return: Length of the word, or -1 if a quote or a trailing backslash leaves it open at
+ *         the end of the text.
+ *
+ * A word without quoting characters, the common case, takes a single strcspn() call.
+ */
+ssize_t scan_word(const char *word, bool *quoted) {
+    size_t len = strcspn(word, WORD_SPECIALS);
+    *quoted = false;
+    while (word[len] == '\'' || word[len] == '"' || word[len] == '\\') {
+        char c = word[len++];
+        *quoted = true;
+        if (c == '\\') {
+            if (word[len] == '\0') {
+                return -1;
+            }
+            len++;
+        } else if (c == '\'') {
+            const char *close = strchr(word + len, '\'');
+            if (close == NULL) {
+                return -1;
+            }
+            len = (size_t)(close - word) + 1;
+        } else {
+            while (word[len] != '"') {
+                if (word[len] == '\0') {
+                    return -1;
+                }
+                len += word[len] == '\\' && word[len + 1] != '\0' ? 2 : 1;
+            }
+            len++;
+        }
+        len += strcspn(word + len, WORD_SPECIALS);
+    }
+    return (ssize_t)len;
+}
+
+/**
+ * dequote - Remove the quotes and escaping backslashes of a word, in place.
+ * @word: The word (NUL-terminated).
+ *
+ * Single quotes keep everything literal; in double quotes a backslash only escapes '$',
+ * '`', '"', '\' and newline. A backslash-newline joins two lines and disappears.
+ */
+void dequote(char *word) {
+    char *out = word;
+    char quote = 0;
+    for (const char *p = word; *p != '\0'; ++p) {
+        if (quote == '\'') {
+            if (*p == '\'') {
+                quote = 0;
+            } else {
+                *out++ = *p;
+            }
+            continue;
+        }
+        if (*p == '\'' && quote == 0) {
+            quote = '\'';
+            continue;
+        }
+        if (*p == '"') {
+            quote = quote ? 0 : '"';
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0' && (quote == 0 || strchr("$`\"\\\n", p[1]) != NULL)) {
+            p++;
+            if (*p == '\n') {
+                continue;
+            }
+        }
+        *out++ = *p;
+    }
+    *out = '\0';
+}
+
+/**
+ * redirect_token - Spell a redirection operator for an error message.
+ * @cls: CC_LESS or CC_GREAT.
+ * @kind: Kind of redirection the operator makes.
+ * Return: Static operator text.
+ */
+const char *redirect_token(int cls, RedirKind kind) {
+    switch (kind) {
+    case REDIR_APPEND:
+        return ">>";
+    case REDIR_HERE:
+        return "<<<";
+    case REDIR_DUP:
+    case REDIR_CLOSE:
+        return cls == CC_LESS ? "<&" : ">&";
+    default:
+        return cls == CC_LESS ? "<" : ">";
+    }
+}
+
+/**
+ * parse_proc_subst - Parse a process substitution "<(LIST)" or ">(LIST)".
+ * @text: Start of the word (the '<' or '>').
+ * @arena: Arena that receives the tree.
+ * @list: Output parameter for the parsed LIST.
+ * Return: Length of the word up to and including its closing ')', -1 if the text ends
+ *         before that ')' (the command continues on the next line), or -2 on a syntax
+ *         error (a message is printed).
+ *
+ * Quotes and nested parentheses are stepped over when looking for the closing ')'. LIST is
+ * parsed from a copy, so the word keeps its text for job listings.
+ */
+ssize_t parse_proc_subst(const char *text, Arena *arena, AndOr **list) {
+    size_t len = 2;
+    int depth = 1;
+    while (depth > 0) {
+        char c = text[len];
+        if (c == '\0' || (c == '\\' && text[len + 1] == '\0')) {
+            return -1;
+        }
+        if (c == '\\') {
+            len += 2;
+        } else if (c == '\'') {
+            const char *close = strchr(text + len + 1, '\'');
+            if (close == NULL) {
+                return -1;
+            }
+            len = (size_t)(close - text) + 1;
+        } else if (c == '"') {
+            for (len++; text[len] != '"'; len += text[len] == '\\' && text[len + 1] != '\0' ? 2 : 1) {
+                if (text[len] == '\0') {
+                    return -1;
+                }
+            }
+            len++;
+        } else {
+            depth += c == '(' ? 1 : c == ')' ? -1 : 0;
+            len++;
+        }
+    }
+    if (char_class[(unsigned char)text[len]] == CC_WORD) {
+        fprintf(stderr, "syntax error near unexpected token '%.*s'\n", (int)strcspn(text + len, WORD_DELIMITERS),
+                text + len);
+        return -2;
+    }
+    char *inner = arena_strndup(arena, text + 2, len - 3);
+    if (inner == NULL) {
+        perror("shell: malloc");
+        return -2;
+    }
+    ListOp term;
+    int parsed = parse_list(&inner, arena, list, &term);
+    if (parsed != 0 || term != LIST_END || *list == NULL) {
+        if (parsed >= 0) {
+            fprintf(stderr, "syntax error: %s in '%.*s'\n",
+                    parsed > 0 || term == LIST_END ? "missing command" : "unexpected 'do' or 'done'", (int)len, text);
+        }
+        return -2;
+    }
+    return (ssize_t)len;
+}
+
+/**
+ * parse_pipeline - Parse one pipeline of a command line into Command structures.
+ * @cursor: In: start of the pipeline text (modified during parsing). Out: just past the
+ *          operator that ended the pipeline.
+ * @arena: Arena that receives the Command array and every argv array.
+ * @commands: Output parameter for the array of parsed Command structures.
+ * @num_commands: Output parameter for number of commands (pipeline segments) parsed; 0 for
+ *                an empty pipeline at the end of the line (after a trailing ';' or '&').
+ * @op: Output parameter for the operator that ended the pipeline.
+ * Return: 0 on successful parse, -1 on syntax error, 1 if the text ends inside a loop.
+ *
+ * The line is lexed in a single pass driven by the char_class table. Words are recorded as
+ * pointers into the input and NUL-terminated in place at the byte that ends them; the
+ * operators '|', '<', '>', '&' and ';' delimit words with or without surrounding blanks.
+ * '|' separates pipeline segments, '<' and '>' take the next word as a redirection file,
+ * as do ">>" (append) and "<<<" (here-string: the word itself is the input). Digits written
+ * right before one of these ("2>", "0<") select the descriptor, and ">&N" / "<&N" / ">&-"
+ * duplicate or close one; such redirections, and any given after one, are kept in order in
+ * cmd->redirs. "<(LIST)" and ">(LIST)" are words of their own, recorded in cmd->substs
+ * (parse_proc_subst). ';', '&', "&&", "||" and newlines end the pipeline ('&' marks its last segment as
+ * background). "for", "while" and "until" in command position, or after "coproc [NAME]",
+ * start a loop (parse_loop); "do" and "done" there end the pipeline so the enclosing loop can take over. A '#' at the
+ * start of a word comments out the rest of the line.
+ * This function prints error messages to stderr for any syntactic errors (e.g., missing command
+ * name, missing file for redirection, or misplacement of operators) and returns -1 in such cases.
+ * Segments and argv arrays have no fixed limit: both grow by doubling inside the arena,
+ * usually in place.
+ */
+int parse_pipeline(char **cursor, Arena *arena, Command **commands, int *num_commands, ListOp *op) {
+    char *p = *cursor;
+    ListOp end = LIST_END;
+    int segment_count = 0;
+    int arg_index = 0;
+    int input_count = 0;
+    int output_count = 0;
+    int pending = CC_WORD;       // redirection operator still waiting for its file name
+    RedirKind pending_kind = REDIR_READ; // what the pending operator does
+    int pending_fd = 0;          // descriptor the pending operator redirects
+    int io_number = -1;          // "N" written just before a '<' / '>' operator
+    int redir_cap = 0;           // allocated slots in cmd->redirs
+    int subst_cap = 0;           // allocated slots in cmd->substs
+    int held = -1;               // class of a delimiter overwritten by a word's terminator
+    bool seg_empty = true;       // no characters at all since the last '|'
+    bool seg_blank = true;       // only blanks since the last '|'
+    int segment_cap = INITIAL_SEGMENTS;
+    int arg_cap = INITIAL_ARGS;
+    Command *segments = arena_alloc(arena, sizeof(Command) * (size_t)segment_cap);
+    char **args = arena_alloc(arena, sizeof(char *) * (size_t)arg_cap);
+    if (segments == NULL || args == NULL) {
+        perror("shell: malloc");
+        return -1;
+    }
+    Command *cmd = &segments[0];
+    cmd->args = args;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->here_string = NULL;
+    cmd->append = false;
+    cmd->redirs = NULL;
+    cmd->nredirs = 0;
+    cmd->substs = NULL;
+    cmd->nsubsts = 0;
+    cmd->background = false;
+    cmd->assigns = NULL;
+    cmd->nassign = 0;
+    cmd->expand = false;
+    cmd->loop = NULL;
+    cmd->pid = -1;
+
+    while (1) {
+        int cls = held >= 0 ? held : char_class[(unsigned char)*p];
+        held = -1;
+        if (cls == CC_SPACE) {
+            seg_empty = false;
+            p++;
+            continue;
+        }
+        if (cls == CC_PIPE || cls == CC_AMP || cls == CC_SEMI || cls == CC_NEWLINE || cls == CC_END) {
+            // '|' ends a segment; the list operators end the whole pipeline
+            int width = 1;
+            bool pipe = false;
+            if (cls == CC_PIPE) {
+                if (p[1] == '|') {
+                    end = LIST_OR;
+                    width = 2;
+                } else {
+                    pipe = true;
+                }
+            } else if (cls == CC_AMP) {
+                end = p[1] == '&' ? LIST_AND : LIST_BACKGROUND;
+                width = p[1] == '&' ? 2 : 1;
+            } else if (cls == CC_SEMI) {
+                end = LIST_SEQ;
+            } else if (cls == CC_NEWLINE) {
+                end = LIST_NEWLINE;
+            } else {
+                width = 0;
+            }
+            if (!pipe && segment_count == 0 && seg_blank) {
+                // Empty pipeline: allowed only at the end of the line or of a line of a loop
+                if (end != LIST_END && end != LIST_NEWLINE) {
+                    fprintf(stderr, "syntax error near unexpected token '%s'\n",
+                            end == LIST_SEQ ? ";" : end == LIST_BACKGROUND ? "&" : end == LIST_AND ? "&&" : "||");
+                    return -1;
+                }
+                *num_commands = 0;
+                *op = end;
+                *cursor = p + width;
+                return 0;
+            }
+            if (seg_empty) {
+                // Empty segment (e.g., "||" or "|" at beginning/end)
+                fprintf(stderr, "shell: syntax error near unexpected token '|'\n");
+                return -1;
+            }
+            if (seg_blank) {
+                // Segment has no command (only whitespace)
+                if (segment_count > 0 || pipe) {
+                    fprintf(stderr, "missing command in pipeline\n");
+                } else {
+                    fprintf(stderr, "missing command\n");
+                }
+                return -1;
+            }
+            if (pending != CC_WORD) {
+                fprintf(stderr, "syntax error near unexpected token '%s'\n", redirect_token(pending, pending_kind));
+                return -1;
+            }
+            cmd->args[arg_index] = NULL;
+            cmd->argc = arg_index;
+            if (arg_index == 0 && !(segment_count == 0 && pipe && cmd->input_file != NULL &&
+                                    cmd->output_file == NULL && cmd->nredirs == 0)) {
+                // No command found in this segment (only redirections or '&'); a leading
+                // "< FILE |" is allowed and fed into the pipeline by the shell
+                fprintf(stderr, "missing command\n");
+                return -1;
+            }
+            segment_count++;
+            if (!pipe) {
+                cmd->background = end == LIST_BACKGROUND;
+                p += width;
+                break;
+            }
+            // Start the next segment
+            if (segment_count == segment_cap) {
+                segments = arena_grow(arena, segments, sizeof(Command) * (size_t)segment_cap,
+                                      sizeof(Command) * (size_t)segment_cap * 2);
+                segment_cap *= 2;
+            }
+            arg_cap = INITIAL_ARGS;
+            args = arena_alloc(arena, sizeof(char *) * (size_t)arg_cap);
+            if (segments == NULL || args == NULL) {
+                perror("shell: malloc");
+                return -1;
+            }
+            cmd = &segments[segment_count];
+            cmd->args = args;
+            cmd->input_file = NULL;
+            cmd->output_file = NULL;
+            cmd->here_string = NULL;
+            cmd->append = false;
+            cmd->redirs = NULL;
+            cmd->nredirs = 0;
+            cmd->substs = NULL;
+            cmd->nsubsts = 0;
+            cmd->background = false;
+            cmd->assigns = NULL;
+            cmd->nassign = 0;
+            cmd->expand = false;
+            cmd->loop = NULL;
+            cmd->pid = -1;
+            arg_index = 0;
+            input_count = 0;
+            output_count = 0;
+            redir_cap = 0;
+            subst_cap = 0;
+            seg_empty = true;
+            seg_blank = true;
+            p++;
+            continue;
+        }
+        if (*p == '#') {
+            // Comment: skip to the end of the line
+            p += strcspn(p, "\n");
+            continue;
+        }
+        seg_empty = false;
+        seg_blank = false;
+        if ((cls == CC_LESS || cls == CC_GREAT) && p[1] != '(') {
+            // "<", ">", ">>", "<<<", ">&" and "<&", optionally after an IO number
+            int width = 1;
+            RedirKind kind = cls == CC_LESS ? REDIR_READ : REDIR_WRITE;
+            if (cls == CC_GREAT && p[1] == '>') {
+                kind = REDIR_APPEND;
+                width = 2;
+            } else if (cls == CC_LESS && p[1] == '<') {
+                if (p[2] != '<') {
+                    fprintf(stderr, "shell: here-documents are not supported (use <<< WORD)\n");
+                    return -1;
+                }
+                kind = REDIR_HERE;
+                width = 3;
+            } else if (p[1] == '&') {
+                kind = REDIR_DUP;
+                width = 2;
+            }
+            if (pending != CC_WORD) {
+                fprintf(stderr, "syntax error near unexpected token '%s'\n", redirect_token(cls, kind));
+                return -1;
+            }
+            pending = cls;
+            pending_kind = kind;
+            pending_fd = io_number >= 0 ? io_number : cls == CC_LESS ? 0 : 1;
+            io_number = -1;
+            p += width;
+            continue;
+        }
+
+        // Word: scan to its first unquoted delimiter and terminate it in place
+        char *word = p;
+        bool quoted = false;
+        AndOr *subst = NULL;     // "<(LIST)" / ">(LIST)": the parsed LIST
+        ssize_t scanned;
+        if (cls == CC_WORD) {
+            scanned = scan_word(p, &quoted);
+        } else if (io_number >= 0) {
+            fprintf(stderr, "syntax error near unexpected token '('\n");
+            return -1;
+        } else {
+            scanned = parse_proc_subst(p, arena, &subst);
+        }
+        if (scanned == -2) {
+            return -1;
+        }
+        if (scanned < 0) {
+            return 1;  // A quote is still open: the word continues on the next line
+        }
+        size_t len = (size_t)scanned;
+        if (pending == CC_WORD && !quoted && (word[len] == '<' || word[len] == '>') &&
+            strspn(word, "0123456789") == len) {
+            // "2>", "0<" ...: the digits name the descriptor of the operator that follows
+            long number = strtol(word, NULL, 10);
+            if (len > 4 || number > INT_MAX / 2) {
+                fprintf(stderr, "shell: %.*s: bad file descriptor\n", (int)len, word);
+                return -1;
+            }
+            io_number = (int)number;
+            p += len;
+            continue;
+        }
+        if (cmd->loop != NULL && pending == CC_WORD) {
+            fprintf(stderr, "syntax error near unexpected token '%.*s'\n", (int)len, word);
+            return -1;
+        }
+        // "coproc [NAME] while ...": a loop may also follow the coproc prefix, as its body
+        bool coproc_body = pending == CC_WORD && !quoted && cmd->loop == NULL && cmd->nassign == 0 &&
+                           (arg_index == 1 || arg_index == 2) && strcmp(cmd->args[0], "coproc") == 0 &&
+                           (arg_index == 1 || is_name(cmd->args[1], strlen(cmd->args[1])));
+        if ((arg_index == 0 && pending == CC_WORD && !quoted && cmd->input_file == NULL && cmd->output_file == NULL &&
+             cmd->here_string == NULL && cmd->nredirs == 0) ||
+            coproc_body) {
+            // Reserved words are only recognised in command position
+            if (!coproc_body && ((len == 2 && memcmp(word, "do", 2) == 0) || (len == 4 && memcmp(word, "done", 4) == 0))) {
+                if (segment_count > 0) {
+                    fprintf(stderr, "syntax error near unexpected token '%.*s'\n", (int)len, word);
+                    return -1;
+                }
+                *num_commands = 0;
+                *op = len == 2 ? LIST_DO : LIST_DONE;
+                *cursor = word + len;
+                return 0;
+            }
+            int kind = len == 3 && memcmp(word, "for", 3) == 0     ? LOOP_FOR
+                       : len == 5 && memcmp(word, "while", 5) == 0 ? LOOP_WHILE
+                       : len == 5 && memcmp(word, "until", 5) == 0 ? LOOP_UNTIL
+                                                                   : -1;
+            if (kind >= 0) {
+                p = word + len;
+                int parsed = parse_loop(&p, arena, (LoopKind)kind, &cmd->loop);
+                if (parsed != 0) {
+                    return parsed;
+                }
+                cmd->args[arg_index++] = kind == LOOP_FOR ? "for" : kind == LOOP_WHILE ? "while" : "until";
+                continue;
+            }
+        }
+        bool special = subst == NULL && (memchr(word, '$', len) != NULL || is_glob_pattern(word, len));
+        if (pending == CC_WORD && arg_index == cmd->nassign) {
+            // NAME=value before the command word is an assignment
+            const char *eq = memchr(word, '=', len);
+            if (eq != NULL && is_name(word, (size_t)(eq - word))) {
+                cmd->nassign++;
+                cmd->expand = true;
+            }
+        }
+        cmd->expand |= special;
+        if (subst != NULL) {
+            // Started, and replaced by its /dev/fd path, on every run (see proc_subst_start)
+            if (cmd->nsubsts == subst_cap) {
+                int cap = subst_cap == 0 ? 2 : subst_cap * 2;
+                cmd->substs = cmd->substs == NULL
+                                  ? arena_alloc(arena, sizeof(ProcSubst) * (size_t)cap)
+                                  : arena_grow(arena, cmd->substs, sizeof(ProcSubst) * (size_t)subst_cap,
+                                               sizeof(ProcSubst) * (size_t)cap);
+                if (cmd->substs == NULL) {
+                    perror("shell: malloc");
+                    return -1;
+                }
+                subst_cap = cap;
+            }
+            ProcSubst *entry = &cmd->substs[cmd->nsubsts++];
+            entry->word = word;
+            entry->list = subst;
+            entry->output = *word == '>';
+            cmd->expand = true;  // The words are replaced in a copy: the tree may be cached
+        }
+        p += len;
+        if (*p != '\0') {
+            held = char_class[(unsigned char)*p];
+            *p = '\0';
+        }
+        if (quoted && !special) {
+            dequote(word);  // Words with a '$' or a wildcard keep their quotes until expanded
+        }
+        if (pending != CC_WORD && cmd->nredirs == 0 && pending_kind != REDIR_DUP &&
+            pending_fd == (pending == CC_LESS ? 0 : 1)) {
+            // Plain stdin / stdout redirection (nothing order-sensitive before it)
+            if (pending == CC_LESS) {
+                if (input_count++ > 0) {
+                    fprintf(stderr, "cannot redirect input more than once\n");
+                    return -1;
+                }
+                if (pending_kind == REDIR_HERE) {
+                    cmd->here_string = word;
+                } else {
+                    cmd->input_file = word;
+                }
+            } else {
+                if (output_count++ > 0) {
+                    fprintf(stderr, "cannot redirect output more than once\n");
+                    return -1;
+                }
+                cmd->output_file = word;
+                cmd->append = pending_kind == REDIR_APPEND;
+            }
+        } else if (pending != CC_WORD) {
+            // Numbered, duplicating or later redirection: kept in order
+            if (cmd->nredirs == redir_cap) {
+                int cap = redir_cap == 0 ? 2 : redir_cap * 2;
+                cmd->redirs = cmd->redirs == NULL
+                                  ? arena_alloc(arena, sizeof(Redirect) * (size_t)cap)
+                                  : arena_grow(arena, cmd->redirs, sizeof(Redirect) * (size_t)redir_cap,
+                                               sizeof(Redirect) * (size_t)cap);
+                if (cmd->redirs == NULL) {
+                    perror("shell: malloc");
+                    return -1;
+                }
+                redir_cap = cap;
+            }
+            Redirect *redir = &cmd->redirs[cmd->nredirs++];
+            redir->kind = pending_kind;
+            redir->fd = pending_fd;
+            redir->source = -1;
+            redir->target = word;
+            if (pending_kind == REDIR_DUP) {
+                redir->target = NULL;
+                if (special) {
+                    redir->target = word;  // ">&$FD": resolved by redirect_source() once expanded
+                } else if (strcmp(word, "-") == 0) {
+                    redir->kind = REDIR_CLOSE;
+                } else if (word[0] != '\0' && strspn(word, "0123456789") == strlen(word) && strlen(word) <= 4) {
+                    redir->source = atoi(word);
+                } else {
+                    fprintf(stderr, "shell: %s: file descriptor expected after '%s'\n", word,
+                            pending == CC_LESS ? "<&" : ">&");
+                    return -1;
+                }
+            }
+        } else {
+            // Normal argument token (keep one slot for the NULL terminator)
+            if (arg_index + 1 == arg_cap) {
+                cmd->args = arena_grow(arena, cmd->args, sizeof(char *) * (size_t)arg_cap,
+                                       sizeof(char *) * (size_t)arg_cap * 2);
+                if (cmd->args == NULL) {
+                    perror("shell: malloc");
+                    return -1;
+                }
+                arg_cap *= 2;
+            }
+            cmd->args[arg_index++] = word;
+        }
+        pending = CC_WORD;
+    }
+
+    *commands = segments;
+    *num_commands = segment_count;
+    *op = end;
+    *cursor = p;
+    return 0;
+}
+
+/**
+ * parse_list - Parse a list of and-or lists up to the end of the text or a "do" / "done".
+ * @cursor: In: start of the list text (modified during parsing). Out: just past the word
+ *          or end of text that ended the list.
+ * @arena: Arena that receives the tree.
+ * @list: Output parameter for the first and-or list (NULL if the list has no command).
+ * @term: Output parameter for what ended the list: LIST_END, LIST_DO or LIST_DONE.
+ * Return: 0 on success, -1 on syntax error (a message is printed), 1 if the text ends
+ *         right after "&&" / "||" or inside a loop.
+ *
+ * The tree has three levels: a list of and-or lists separated by ';', '&' or newlines, each
+ * and-or list is a chain of pipelines joined by "&&" and "||", and each pipeline is an array
+ * of Command segments (see parse_pipeline). Blank lines between commands are skipped.
+ */
+int parse_list(char **cursor, Arena *arena, AndOr **list, ListOp *term) {
+    AndOr **link = list;
+    AndOr *current = NULL;
+    Pipeline **pipe_link = NULL;
+    ListOp join = LIST_SEQ;
+    *list = NULL;
+    while (1) {
+        Command *commands;
+        int num_commands;
+        ListOp op;
+        int parsed = parse_pipeline(cursor, arena, &commands, &num_commands, &op);
+        if (parsed != 0) {
+            return parsed;
+        }
+        if (num_commands == 0) {
+            if (op == LIST_NEWLINE) {
+                continue;  // Blank line, also allowed after "&&" and "||"
+            }
+            if (join == LIST_AND || join == LIST_OR) {
+                if (op == LIST_END) {
+                    return 1;  // The command continues on the next line
+                }
+                fprintf(stderr, "syntax error: missing command after '%s'\n", join == LIST_AND ? "&&" : "||");
+                return -1;
+            }
+            *term = op;
+            return 0;
+        }
+        Pipeline *pipeline = arena_alloc(arena, sizeof(Pipeline));
+        if (pipeline == NULL) {
+            perror("shell: malloc");
+            return -1;
+        }
+        pipeline->commands = commands;
+        pipeline->num_commands = num_commands;
+        pipeline->join = join;
+        pipeline->next = NULL;
+        if (join == LIST_SEQ) {
+            // First pipeline of a new and-or list
+            AndOr *item = arena_alloc(arena, sizeof(AndOr));
+            if (item == NULL) {
+                perror("shell: malloc");
+                return -1;
+            }
+            item->first = pipeline;
+            item->background = false;
+            item->next = NULL;
+            *link = item;
+            link = &item->next;
+            current = item;
+            pipe_link = &pipeline->next;
+        } else {
+            *pipe_link = pipeline;
+            pipe_link = &pipeline->next;
+        }
+        if (op == LIST_END) {
+            *term = op;
+            return 0;
+        }
+        if (op == LIST_BACKGROUND) {
+            // The '&' applies to the whole and-or list, not to its last pipeline alone
+            current->background = true;
+            commands[num_commands - 1].background = current->first == pipeline;
+        }
+        join = op == LIST_AND || op == LIST_OR ? op : LIST_SEQ;
+    }
+}
+
+/**
+ * arena_strndup - Copy part of a string into an arena.
+ * @arena: The arena.
+ * @text: Start of the text.
+ * @len: Number of bytes to copy.
+ * Return: The NUL-terminated copy, or NULL on allocation failure.
+ */
+char *arena_strndup(Arena *arena, const char *text, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * parse_loop - Parse a loop after its "for", "while" or "until" keyword.
+ * @cursor: In: just past the keyword. Out: just past the closing "done".
+ * @arena: Arena that receives the loop.
+ * @kind: Which loop the keyword started.
+ * @loop: Output parameter for the parsed loop.
+ * Return: 0 on success, -1 on syntax error (a message is printed), 1 if the text ends
+ *         before the closing "done".
+ *
+ * Accepted forms, on one line or several:
+ *   for NAME [in WORD...] ; do LIST done
+ *   while LIST ; do LIST done      (until LIST ; do LIST done)
+ * The condition and the body are parsed into trees once; the loop runs them again on each
+ * iteration, and the for-loop words are expanded when the loop starts.
+ */
+int parse_loop(char **cursor, Arena *arena, LoopKind kind, Loop **loop) {
+    Loop *node = arena_alloc(arena, sizeof(Loop));
+    if (node == NULL) {
+        perror("shell: malloc");
+        return -1;
+    }
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    char *p = *cursor;
+    ListOp term;
+    int parsed;
+    if (kind == LOOP_FOR) {
+        p += strspn(p, " \t\v\f\r");
+        size_t len = strcspn(p, WORD_DELIMITERS);
+        if (!is_name(p, len)) {
+            fprintf(stderr, "for: '%.*s': not a valid identifier\n", (int)len, p);
+            return -1;
+        }
+        node->var = arena_strndup(arena, p, len);
+        p += len;
+        p += strspn(p, " \t\v\f\r\n");
+        int cap = INITIAL_ARGS;
+        node->words = arena_alloc(arena, sizeof(char *) * (size_t)cap);
+        if (node->var == NULL || node->words == NULL) {
+            perror("shell: malloc");
+            return -1;
+        }
+        if (strncmp(p, "in", 2) == 0 && char_class[(unsigned char)p[2]] != CC_WORD) {
+            // Word list, up to ';' or the end of the line
+            p += 2;
+            while (1) {
+                p += strspn(p, " \t\v\f\r");
+                if (*p == ';' || *p == '\n') {
+                    p++;
+                    break;
+                }
+                if (*p == '\0') {
+                    return 1;
+                }
+                bool quoted;
+                ssize_t scanned = scan_word(p, &quoted);
+                if (scanned < 0) {
+                    return 1;
+                }
+                len = (size_t)scanned;
+                if (len == 0) {
+                    fprintf(stderr, "syntax error near unexpected token '%c'\n", *p);
+                    return -1;
+                }
+                if (node->nwords + 1 == cap) {
+                    node->words = arena_grow(arena, node->words, sizeof(char *) * (size_t)cap,
+                                             sizeof(char *) * (size_t)cap * 2);
+                    cap *= 2;
+                }
+                char *word = node->words ? arena_strndup(arena, p, len) : NULL;
+                if (word == NULL) {
+                    perror("shell: malloc");
+                    return -1;
+                }
+                if (memchr(word, '$', len) != NULL || is_glob_pattern(word, len)) {
+                    node->expand = true;
+                } else if (quoted) {
+                    dequote(word);
+                }
+                node->words[node->nwords++] = word;
+                p += len;
+            }
+        } else if (*p == ';') {
+            p++;
+        }
+        node->words[node->nwords] = NULL;
+        // Nothing but blank lines may come before "do"
+        AndOr *none;
+        parsed = parse_list(&p, arena, &none, &term);
+        if (parsed == 0 && none == NULL && term == LIST_END) {
+            return 1;  // "do" is on a later line
+        }
+        if (parsed == 0 && (none != NULL || term != LIST_DO)) {
+            fprintf(stderr, "syntax error: expected 'do' in for loop\n");
+            return -1;
+        }
+    } else {
+        parsed = parse_list(&p, arena, &node->condition, &term);
+        if (parsed == 0 && term == LIST_END) {
+            return 1;  // The condition ended with the line: "do" is on a later line
+        }
+        if (parsed == 0 && (node->condition == NULL || term != LIST_DO)) {
+            fprintf(stderr, "syntax error: expected 'do' after %s condition\n", kind == LOOP_WHILE ? "while" : "until");
+            return -1;
+        }
+    }
+    if (parsed != 0) {
+        return parsed;
+    }
+    parsed = parse_list(&p, arena, &node->body, &term);
+    if (parsed != 0) {
+        return parsed;
+    }
+    if (term == LIST_END) {
+        return 1;  // "done" is on a later line
+    }
+    if (node->body == NULL || term != LIST_DONE) {
+        fprintf(stderr, "syntax error near unexpected token '%s'\n", term == LIST_DO ? "do" : "done");
+        return -1;
+    }
+    *loop = node;
+    *cursor = p;
+    return 0;
+}
+
+/**
+ * parse_command - Parse an input command line into a list of and-or lists.
+ * @input: The command line string (will be modified during parsing).
+ * @arena: Arena that receives the whole tree.
+ * @list: Output parameter for the first and-or list (NULL if the line has no command).
+ * Return: 0 on successful parse, -1 on syntax error (a message is printed), 1 if the
+ *         command is incomplete and continues on the next line (an open loop, or a
+ *         trailing "&&" / "||").
+ *
+ * The whole line is parsed once, before anything runs (see parse_list).
+ */
+int parse_command(char *input, Arena *arena, AndOr **list) {
+    if (input == NULL) {
+        return -1;
+    }
+    char *p = input;
+    ListOp term;
+    int parsed = parse_list(&p, arena, list, &term);
+    if (parsed == 0 && term != LIST_END) {
+        fprintf(stderr, "syntax error near unexpected token '%s'\n", term == LIST_DO ? "do" : "done");
+        return -1;
+    }
+    return parsed;
+}
+
+/**
+ * line_hash - Hash a raw command line.
+ * @line: The line.
+ * @len: Its length.
+ * Return: The 32-bit hash.
+ *
+ * Mixes eight bytes per step (multiply and xor-shift, as in FNV-1a but on 64-bit words), so
+ * a hit costs a fraction of the parse it replaces even in an unoptimised build.
+ */
+uint32_t line_hash(const char *line, size_t len) {
+    uint64_t h = 14695981039346656037ull ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, line + i, 8);
+        h = (h ^ word) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+        h = (h ^ (unsigned char)line[i]) * 1099511628211ull;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/**
+ * parse_cache_detach - Take an entry off the LRU list.
+ * @entry: The cached line.
+ */
+void parse_cache_detach(ParseEntry *entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        parse_cache_newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        parse_cache_oldest = entry->newer;
+    }
+}
+
+/**
+ * parse_cache_push - Make an entry the most recently used one.
+ * @entry: A cached line that is not on the LRU list.
+ */
+void parse_cache_push(ParseEntry *entry) {
+    entry->older = parse_cache_newest;
+    entry->newer = NULL;
+    if (parse_cache_newest != NULL) {
+        parse_cache_newest->newer = entry;
+    } else {
+        parse_cache_oldest = entry;
+    }
+    parse_cache_newest = entry;
+}
+
+/**
+ * parse_cache_evict - Remove the least recently used line from the cache.
+ * Return: The removed entry; the caller frees or reuses it.
+ */
+ParseEntry *parse_cache_evict(void) {
+    ParseEntry *entry = parse_cache_oldest;
+    parse_cache_detach(entry);
+    for (ParseEntry **link = &parse_cache[entry->hash & (PARSE_CACHE_BUCKETS - 1)]; *link != NULL;
+         link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    parse_cache_count--;
+    return entry;
+}
+
+/**
+ * parse_cache_trim - Evict least recently used lines until at most @limit remain.
+ * @limit: Number of entries to keep.
+ *
+ * Only called between command lines, so no evicted tree is still being executed.
+ */
+void parse_cache_trim(int limit) {
+    while (parse_cache_count > limit && parse_cache_oldest != NULL) {
+        ParseEntry *entry = parse_cache_evict();
+        arena_free(&entry->arena);
+        free(entry);
+    }
+}
+
+/**
+ * parse_line - Parse a raw input line, reusing the tree of an identical earlier line.
+ * @line: The line as read (never modified).
+ * @list: Output parameter for the parsed tree (NULL for a blank or comment line).
+ * Return: 0 on success, -1 on a syntax error (a message is printed), 1 if the command
+ *         continues on the next line (@line itself is left unchanged).
+ *
+ * The cache is keyed by a hash of the raw line, so a repeated line skips both
+ * trim_whitespace and parse_command. A miss copies the line into a small arena of its own,
+ * parses the copy there and keeps the result; once parse_cache_limit lines are cached the
+ * least recently used one is evicted and its arena reused. Lines with syntax errors are not
+ * cached. Without the cache a copy of the line is parsed into line_arena.
+ */
+int parse_line(const char *line, AndOr **list) {
+    parse_cache_trim(parse_cache_limit);
+    if (parse_cache_limit == 0) {
+        // Parse a copy: an incomplete line is parsed again once the next one is appended
+        char *copy = arena_strndup(&line_arena, line, strlen(line));
+        if (copy == NULL) {
+            perror("shell: malloc");
+            return -1;
+        }
+        char *trimmed = trim_whitespace(copy);
+        *list = NULL;
+        if (*trimmed == '\0' || *trimmed == '#') {
+            return 0;  // Blank line or comment (including a "#!" interpreter line)
+        }
+        return parse_command(trimmed, &line_arena, list);
+    }
+    size_t len = strlen(line);
+    uint32_t hash = line_hash(line, len);
+    for (ParseEntry *entry = parse_cache[hash & (PARSE_CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->line, line, len) == 0) {
+            parse_cache_hits++;
+            STAT_ADD(parse_hits, 1);
+            if (entry != parse_cache_newest) {
+                parse_cache_detach(entry);
+                parse_cache_push(entry);
+            }
+            *list = entry->list;
+            return 0;
+        }
+    }
+    parse_cache_misses++;
+    STAT_ADD(parse_misses, 1);
+    ParseEntry *entry;
+    if (parse_cache_count >= parse_cache_limit) {
+        // Reuse the evicted entry and its arena blocks
+        entry = parse_cache_evict();
+        arena_reset(&entry->arena);
+        entry->list = NULL;
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL) {
+            perror("shell: malloc");
+            return -1;
+        }
+        entry->arena.block_size = PARSE_CACHE_BLOCK;
+    }
+    entry->line = arena_alloc(&entry->arena, len + 1);
+    char *copy = arena_alloc(&entry->arena, len + 1);
+    if (entry->line == NULL || copy == NULL) {
+        perror("shell: malloc");
+        arena_free(&entry->arena);
+        free(entry);
+        return -1;
+    }
+    memcpy(entry->line, line, len + 1);
+    memcpy(copy, line, len + 1);
+    entry->len = len;
+    entry->hash = hash;
+    char *trimmed = trim_whitespace(copy);
+    int parsed = *trimmed != '\0' && *trimmed != '#' ? parse_command(trimmed, &entry->arena, &entry->list) : 0;
+    if (parsed != 0) {
+        arena_free(&entry->arena);
+        free(entry);
+        return parsed;
+    }
+    entry->next = parse_cache[hash & (PARSE_CACHE_BUCKETS - 1)];
+    parse_cache[hash & (PARSE_CACHE_BUCKETS - 1)] = entry;
+    parse_cache_push(entry);
+    parse_cache_count++;
+    *list = entry->list;
+    return 0;
+}
+
+/**
+ * var_find - Look up a shell variable.
+ * @name: Variable name (not necessarily NUL-terminated).
+ * @len: Length of the name.
+ * Return: The variable, or NULL if the shell does not know the name.
+ */
+ShellVar *var_find(const char *name, size_t len) {
+    unsigned h = line_hash(name, len) & (VAR_TABLE_SIZE - 1);
+    for (ShellVar *var = shell_vars[h]; var != NULL; var = var->next) {
+        if (strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * var_get - Get the value of a variable.
+ * @name: Variable name (not necessarily NUL-terminated).
+ * @len: Length of the name.
+ * Return: The value, or NULL if the variable is unset.
+ *
+ * The environment is imported at startup (var_import_environ), so this is the only place
+ * variable values are looked up.
+ */
+const char *var_get(const char *name, size_t len) {
+    const ShellVar *var = var_find(name, len);
+    return var != NULL ? var->value : NULL;
+}
+
+/**
+ * var_create - Find a shell variable, adding it (with no value, not exported) if it is new.
+ * @name: Variable name (not necessarily NUL-terminated).
+ * @len: Length of the name.
+ * Return: The variable, or NULL on allocation failure.
+ */
+ShellVar *var_create(const char *name, size_t len) {
+    ShellVar *var = var_find(name, len);
+    if (var != NULL) {
+        return var;
+    }
+    var = calloc(1, sizeof(*var));
+    if (var == NULL || (var->name = strndup(name, len)) == NULL) {
+        free(var);
+        perror("shell: malloc");
+        return NULL;
+    }
+    unsigned h = line_hash(name, len) & (VAR_TABLE_SIZE - 1);
+    var->next = shell_vars[h];
+    shell_vars[h] = var;
+    return var;
+}
+
+/**
+ * var_assign - Store a new value in a variable.
+ * @var: The variable.
+ * @value: New value.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * The value buffer is reused while the new value fits, so a loop variable costs no
+ * allocation per iteration. Changing an exported variable invalidates the environment block.
+ */
+int var_assign(ShellVar *var, const char *value) {
+    if (var->exported) {
+        env_dirty = true;
+    }
+    size_t len = strlen(value);
+    if (len + 1 > var->cap) {
+        size_t cap = len + 1 < 32 ? 32 : len + 1;
+        char *grown = realloc(var->value, cap);
+        if (grown == NULL) {
+            perror("shell: malloc");
+            return -1;
+        }
+        var->value = grown;
+        var->cap = cap;
+    }
+    memcpy(var->value, value, len + 1);
+    return 0;
+}
+
+/**
+ * var_set - Set a shell variable.
+ * @name: Variable name (NUL-terminated).
+ * @value: New value.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int var_set(const char *name, const char *value) {
+    ShellVar *var = var_create(name, strlen(name));
+    return var != NULL ? var_assign(var, value) : -1;
+}
+
+/**
+ * var_set_word - Apply a "NAME=value" word.
+ * @word: The word (the name part has been checked by the parser).
+ * @export: Also mark the variable for export to child processes.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int var_set_word(const char *word, bool export) {
+    const char *eq = strchr(word, '=');
+    ShellVar *var = var_create(word, (size_t)(eq - word));
+    if (var == NULL) {
+        return -1;
+    }
+    if (export && !var->exported) {
+        var->exported = true;
+        env_dirty = true;
+    }
+    return var_assign(var, eq + 1);
+}
+
+/**
+ * var_unset - Remove a shell variable.
+ * @name: Variable name (NUL-terminated).
+ */
+void var_unset(const char *name) {
+    size_t len = strlen(name);
+    for (ShellVar **link = &shell_vars[line_hash(name, len) & (VAR_TABLE_SIZE - 1)]; *link != NULL;
+         link = &(*link)->next) {
+        ShellVar *var = *link;
+        if (strcmp(var->name, name) == 0) {
+            if (var->exported) {
+                env_dirty = true;
+            }
+            *link = var->next;
+            free(var->name);
+            free(var->value);
+            free(var);
+            return;
+        }
+    }
+}
+
+/**
+ * var_import_environ - Load the environment the shell was started with as exported variables.
+ */
+void var_import_environ(void) {
+    for (char **entry = environ; *entry != NULL; ++entry) {
+        const char *eq = strchr(*entry, '=');
+        if (eq != NULL && eq != *entry) {
+            var_set_word(*entry, true);
+        }
+    }
+}
+
+/**
+ * shell_envp - Get the environment block for child processes.
+ * Return: A NULL-terminated "NAME=value" array of the exported variables.
+ *
+ * The block is built lazily and kept until an exported variable changes, so launching a
+ * command normally costs no environment work at all. Spawned children copy it at exec.
+ */
+char **shell_envp(void) {
+    if (!env_dirty && env_block != NULL) {
+        return env_block;
+    }
+    arena_reset(&env_arena);
+    size_t count = 0;
+    for (int i = 0; i < VAR_TABLE_SIZE; ++i) {
+        for (const ShellVar *var = shell_vars[i]; var != NULL; var = var->next) {
+            count += var->exported && var->value != NULL;
+        }
+    }
+    char **block = arena_alloc(&env_arena, sizeof(char *) * (count + 1));
+    if (block == NULL) {
+        perror("shell: malloc");
+        return environ;
+    }
+    size_t n = 0;
+    for (int i = 0; i < VAR_TABLE_SIZE; ++i) {
+        for (const ShellVar *var = shell_vars[i]; var != NULL; var = var->next) {
+            if (!var->exported || var->value == NULL) {
+                continue;
+            }
+            size_t name_len = strlen(var->name);
+            size_t value_len = strlen(var->value);
+            char *entry = arena_alloc(&env_arena, name_len + value_len + 2);
+            if (entry == NULL) {
+                perror("shell: malloc");
+                return environ;
+            }
+            memcpy(entry, var->name, name_len);
+            entry[name_len] = '=';
+            memcpy(entry + name_len + 1, var->value, value_len + 1);
+            block[n++] = entry;
+        }
+    }
+    block[n] = NULL;
+    env_block = block;
+    env_dirty = false;
+    env_builds++;
+    return block;
+}
+
+/**
+ * command_envp - Get the environment for one command.
+ * @cmd: The command (after expansion: cmd->assigns holds its "NAME=value" prefixes).
+ * Return: The shared block, or for a command with prefix assignments a copy in expand_arena
+ *         with those entries replaced or added (the shared block on allocation failure).
+ */
+char **command_envp(const Command *cmd) {
+    char **base = shell_envp();
+    if (cmd->nassign == 0) {
+        return base;
+    }
+    size_t count = 0;
+    while (base[count] != NULL) {
+        count++;
+    }
+    char **envp = arena_alloc(&expand_arena, sizeof(char *) * (count + (size_t)cmd->nassign + 1));
+    if (envp == NULL) {
+        return base;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool replaced = false;
+        for (int j = 0; j < cmd->nassign && !replaced; ++j) {
+            size_t name_len = (size_t)(strchr(cmd->assigns[j], '=') - cmd->assigns[j]) + 1;
+            replaced = strncmp(base[i], cmd->assigns[j], name_len) == 0;
+        }
+        if (!replaced) {
+            envp[n++] = base[i];
+        }
+    }
+    for (int j = 0; j < cmd->nassign; ++j) {
+        envp[n++] = cmd->assigns[j];
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+/**
+ * append_text - Append bytes to a string being built in an arena.
+ * @arena: The arena (the string must be its latest allocation to grow in place).
+ * @out: The string.
+ * @len: In/out: current length.
+ * @cap: In/out: allocated size.
+ * @text: Bytes to append.
+ * @n: Number of bytes.
+ * Return: The (possibly moved) string, or NULL on allocation failure.
+ */
+char *append_text(Arena *arena, char *out, size_t *len, size_t *cap, const char *text, size_t n) {
+    if (out == NULL || *len + n + 1 > *cap) {
+        size_t grown = (*len + n + 1) * 2;
+        out = out == NULL ? arena_alloc(arena, grown) : arena_grow(arena, out, *cap, grown);
+        if (out == NULL) {
+            return NULL;
+        }
+        *cap = grown;
+    }
+    memcpy(out + *len, text, n);
+    *len += n;
+    out[*len] = '\0';
+    return out;
+}
+
+/**
+ * push_word - Append a word to an argv array being built in an arena.
+ * @arena: The arena.
+ * @words: In/out: the array (kept NULL-terminated).
+ * @count: In/out: number of words.
+ * @cap: In/out: allocated slots.
+ * @word: The word.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int push_word(Arena *arena, char ***words, int *count, int *cap, char *word) {
+    if (*count + 1 >= *cap) {
+        int grown = *cap < INITIAL_ARGS ? INITIAL_ARGS : *cap * 2;
+        char **array = *words == NULL ? arena_alloc(arena, sizeof(char *) * (size_t)grown)
+                                      : arena_grow(arena, *words, sizeof(char *) * (size_t)*cap,
+                                                   sizeof(char *) * (size_t)grown);
+        if (array == NULL) {
+            return -1;
+        }
+        *words = array;
+        *cap = grown;
+    }
+    (*words)[(*count)++] = word;
+    (*words)[*count] = NULL;
+    return 0;
+}
+
+/**
+ * variable_value - Look up the parameter a '$' starts.
+ * @p: In: just past the '$'. Out: past the parameter name.
+ * @number: Scratch buffer for $?, $$ and $#.
+ * @size: Size of number.
+ * Return: The value (NULL if unset), or "$" for a '$' that starts no parameter.
+ *
+ * Handles $NAME, ${NAME}, $? (last exit status), $$ (pid of the shell), and the positional
+ * parameters $0 to $9, ${N} and $# (their count, $0 aside). "$@", "$*", shift and "set --"
+ * are not supported.
+ */
+const char *variable_value(const char **p, char *number, size_t size) {
+    const char *s = *p;
+    if (*s == '?' || *s == '$' || *s == '#') {
+        snprintf(number, size, "%d",
+                 *s == '?' ? last_status : *s == '$' ? (int)getpid() : npositional > 0 ? npositional - 1 : 0);
+        *p = s + 1;
+        return number;
+    }
+    if (isdigit((unsigned char)*s)) {
+        // One digit, as in other shells: "$10" is $1 followed by a 0
+        *p = s + 1;
+        return *s - '0' < npositional ? positional[*s - '0'] : NULL;
+    }
+    if (*s == '{') {
+        const char *close = strchr(s, '}');
+        size_t len = close != NULL ? (size_t)(close - s - 1) : 0;
+        if (len > 0 && strspn(s + 1, "0123456789") == len) {
+            long n = strtol(s + 1, NULL, 10);
+            *p = close + 1;
+            return n < npositional ? positional[n] : NULL;
+        }
+        if (close != NULL && is_name(s + 1, len)) {
+            *p = close + 1;
+            return var_get(s + 1, len);
+        }
+        return "$";
+    }
+    if (isalpha((unsigned char)*s) || *s == '_') {
+        size_t n = 1;
+        while (isalnum((unsigned char)s[n]) || s[n] == '_') {
+            n++;
+        }
+        *p = s + n;
+        return var_get(s, n);
+    }
+    return "$";
+}
+
+/**
+ * needs_expansion - Check whether a parsed word was kept as written for expand_word.
+ * @word: The word.
+ * Return: true if it has a '$' or wildcards (the parser unquoted every other word).
+ */
+bool needs_expansion(const char *word) {
+    if ((word[0] == '<' || word[0] == '>') && word[1] == '(') {
+        return false;  // Process substitution: replaced by execute_commands, never expanded
+    }
+    return strchr(word, '$') != NULL || is_glob_pattern(word, strlen(word));
+}
+
+/**
+ * dir_name_compare - qsort_r() comparator ordering the entries of a cached directory.
+ * @a: A DirName.
+ * @b: A DirName.
+ * @pool: The directory's name pool.
+ * Return: strcmp() order of the two names.
+ */
+int dir_name_compare(const void *a, const void *b, void *pool) {
+    return strcmp((char *)pool + ((const DirName *)a)->offset, (char *)pool + ((const DirName *)b)->offset);
+}
+
+/**
+ * dir_cache_fill - Read a directory into a cache entry.
+ * @dir: The cache entry (its previous contents are replaced).
+ * @path: Path of the directory.
+ * Return: 0 on success, -1 if the directory could not be read.
+ */
+int dir_cache_fill(DirCache *dir, const char *path) {
+    DIR *stream = opendir(path);
+    if (stream == NULL) {
+        return -1;
+    }
+    size_t used = 0;
+    dir->count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        size_t len = strlen(name);
+        if (used + len + 1 > dir->pool_cap) {
+            size_t cap = dir->pool_cap ? dir->pool_cap * 2 : 4096;
+            while (used + len + 1 > cap) {
+                cap *= 2;
+            }
+            char *pool = realloc(dir->pool, cap);
+            if (pool == NULL) {
+                closedir(stream);
+                return -1;
+            }
+            dir->pool = pool;
+            dir->pool_cap = cap;
+        }
+        if (dir->count == dir->cap) {
+            size_t cap = dir->cap ? dir->cap * 2 : 64;
+            DirName *names = realloc(dir->names, sizeof(DirName) * cap);
+            if (names == NULL) {
+                closedir(stream);
+                return -1;
+            }
+            dir->names = names;
+            dir->cap = cap;
+        }
+        memcpy(dir->pool + used, name, len + 1);
+        dir->names[dir->count].offset = used;
+        dir->names[dir->count].len = len;
+        dir->names[dir->count].type = entry->d_type;
+        dir->count++;
+        used += len + 1;
+    }
+    closedir(stream);
+    qsort_r(dir->names, dir->count, sizeof(DirName), dir_name_compare, dir->pool);
+    dir_cache_reads++;
+    return 0;
+}
+
+/**
+ * dir_cache_get - Get the sorted entries of a directory, from the cache when still valid.
+ * @path: Path of the directory.
+ * Return: The cache entry, or NULL if @path is not a readable directory.
+ *
+ * Entries are keyed by (device, inode) and trusted while the directory's mtime is unchanged,
+ * so a repeated glob over a large directory costs one stat() instead of a readdir() pass.
+ * A directory modified within the last DIR_CACHE_RACY_SEC seconds could change again
+ * without its mtime moving, so it is read again until it has been quiet that long.
+ */
+DirCache *dir_cache_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    unsigned bucket = (unsigned)(((uint64_t)st.st_dev * 31 + (uint64_t)st.st_ino) & (DIR_CACHE_BUCKETS - 1));
+    DirCache *dir = dir_cache[bucket];
+    while (dir != NULL && (dir->dev != st.st_dev || dir->ino != st.st_ino)) {
+        dir = dir->next;
+    }
+    if (dir != NULL && (dir->busy || (!dir->racy && dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                      dir->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        dir->used = ++dir_cache_tick;
+        dir_cache_hits++;
+        return dir;
+    }
+    if (dir == NULL) {
+        if (dir_cache_count >= DIR_CACHE_MAX) {
+            // Recycle the least recently used directory
+            DirCache **victim = NULL;
+            for (int i = 0; i < DIR_CACHE_BUCKETS; ++i) {
+                for (DirCache **link = &dir_cache[i]; *link != NULL; link = &(*link)->next) {
+                    if (!(*link)->busy && (victim == NULL || (*link)->used < (*victim)->used)) {
+                        victim = link;
+                    }
+                }
+            }
+            dir = victim ? *victim : NULL;
+            if (dir != NULL) {
+                *victim = dir->next;
+            }
+        }
+        if (dir == NULL) {
+            dir = calloc(1, sizeof(*dir));
+            if (dir == NULL) {
+                return NULL;
+            }
+            dir_cache_count++;
+        }
+        dir->dev = st.st_dev;
+        dir->ino = st.st_ino;
+        dir->next = dir_cache[bucket];
+        dir_cache[bucket] = dir;
+    }
+    dir->mtime = st.st_mtim;
+    if (dir_cache_fill(dir, path) != 0) {
+        dir->count = 0;
+        dir->racy = true;
+        return NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->racy = now.tv_sec - st.st_mtim.tv_sec < DIR_CACHE_RACY_SEC;
+    dir->used = ++dir_cache_tick;
+    return dir;
+}
+
+/**
+ * glob_has_wildcards - Check a pattern component for wildcards that are not escaped.
+ * @comp: The component (NUL-terminated).
+ * Return: true if it has an unescaped '*', '?', or '[' followed by a ']'.
+ */
+bool glob_has_wildcards(const char *comp) {
+    bool open = false;
+    for (const char *p = comp; *p != '\0'; ++p) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '*' || *p == '?' || (open && *p == ']')) {
+            return true;
+        } else if (*p == '[') {
+            open = true;
+        }
+    }
+    return false;
+}
+
+/**
+ * glob_unescape - Copy a pattern component without its escaping backslashes.
+ * @out: Destination.
+ * @pattern: The component.
+ * @len: Its length.
+ * Return: Length of the copy.
+ */
+size_t glob_unescape(char *out, const char *pattern, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (pattern[i] == '\\' && i + 1 < len) {
+            i++;
+        }
+        out[n++] = pattern[i];
+    }
+    return n;
+}
+
+/**
+ * glob_walk - Match the rest of a pattern against the file system.
+ * @arena: Arena that receives the matching paths.
+ * @path: Buffer holding the path matched so far (PATH_MAX bytes).
+ * @path_len: Length of the path so far (0, or ending in '/').
+ * @pattern: Rest of the pattern.
+ * @words: In/out: argv array the matches are appended to (see push_word).
+ * @count: In/out: number of words.
+ * @cap: In/out: allocated slots.
+ * Return: Number of matches added, or -1 on allocation failure.
+ *
+ * Components without wildcards are appended as they are; the others are matched against
+ * the cached, sorted entries of the directory, so the matches come out sorted. Names
+ * starting with '.' only match a pattern that starts with '.'. "*SUFFIX" patterns, the
+ * common "*.log" case, are matched with one memcmp() per entry instead of fnmatch().
+ */
+int glob_walk(Arena *arena, char *path, size_t path_len, const char *pattern, char ***words, int *count,
+              int *cap) {
+    while (*pattern == '/') {
+        if (path_len + 1 >= PATH_MAX) {
+            return 0;
+        }
+        path[path_len++] = '/';
+        pattern++;
+    }
+    const char *slash = strchr(pattern, '/');
+    size_t comp_len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    if (comp_len > NAME_MAX * 2 || path_len + comp_len + 2 >= PATH_MAX) {
+        return 0;
+    }
+    char comp[NAME_MAX * 2 + 2];
+    memcpy(comp, pattern, comp_len);
+    comp[comp_len] = '\0';
+    if (!glob_has_wildcards(comp)) {
+        // Literal component: no directory read needed
+        path_len += glob_unescape(path + path_len, comp, comp_len);
+        path[path_len] = '\0';
+        if (slash != NULL) {
+            path[path_len++] = '/';
+            return glob_walk(arena, path, path_len, slash + 1, words, count, cap);
+        }
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            return 0;
+        }
+        char *match = arena_strndup(arena, path, path_len);
+        return match != NULL && push_word(arena, words, count, cap, match) == 0 ? 1 : -1;
+    }
+    path[path_len] = '\0';
+    DirCache *dir = dir_cache_get(path_len ? path : ".");
+    if (dir == NULL) {
+        return 0;
+    }
+    // "*SUFFIX" with nothing special in SUFFIX: compare the tail directly
+    bool suffix_only = comp[0] == '*' && strpbrk(comp + 1, "*?[\\") == NULL;
+    size_t suffix_len = comp_len - 1;
+    int matches = 0;
+    dir->busy += slash != NULL;
+    for (size_t i = 0; i < dir->count; ++i) {
+        const DirName *entry = &dir->names[i];
+        const char *name = dir->pool + entry->offset;
+        if (suffix_only) {
+            if (name[0] == '.' || entry->len < suffix_len || memcmp(name + entry->len - suffix_len, comp + 1, suffix_len) != 0) {
+                continue;
+            }
+        } else if (fnmatch(comp, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        if (path_len + entry->len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + path_len, name, entry->len + 1);
+        int found;
+        if (slash != NULL) {
+            // Only directories can match a component followed by '/'
+            struct stat st;
+            if (entry->type != DT_DIR &&
+                ((entry->type != DT_LNK && entry->type != DT_UNKNOWN) || stat(path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+                continue;
+            }
+            path[path_len + entry->len] = '/';
+            found = glob_walk(arena, path, path_len + entry->len + 1, slash + 1, words, count, cap);
+        } else {
+            char *match = arena_strndup(arena, path, path_len + entry->len);
+            found = match != NULL && push_word(arena, words, count, cap, match) == 0 ? 1 : -1;
+        }
+        if (found < 0) {
+            matches = -1;
+            break;
+        }
+        matches += found;
+    }
+    dir->busy -= slash != NULL;
+    return matches;
+}
+
+/**
+ * glob_expand - Expand a pathname pattern into the matching paths.
+ * @arena: Arena that receives the matches.
+ * @pattern: The pattern (quoted characters escaped with '\').
+ * @words: In/out: argv array the matches are appended to (see push_word).
+ * @count: In/out: number of words.
+ * @cap: In/out: allocated slots.
+ * Return: Number of matches added (0 if nothing matched), or -1 on allocation failure.
+ */
+int glob_expand(Arena *arena, const char *pattern, char ***words, int *count, int *cap) {
+    char path[PATH_MAX];
+    return glob_walk(arena, path, 0, pattern, words, count, cap);
+}
+
+/**
+ * field_append - Append text to the field being built by expand_word.
+ * @arena: Arena holding the field.
+ * @field: The field.
+ * @text: Bytes to append.
+ * @n: Number of bytes.
+ * @quoted: The text was quoted: its wildcard characters are escaped in the pattern.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int field_append(Arena *arena, Field *field, const char *text, size_t n, bool quoted) {
+    field->exists = true;
+    if ((field->text = append_text(arena, field->text, &field->len, &field->cap, text, n)) == NULL) {
+        return -1;
+    }
+    if (!field->track_glob) {
+        return 0;
+    }
+    if (!quoted) {
+        field->glob |= is_glob_pattern(text, n) || memchr(text, '[', n) != NULL;
+        field->pattern = append_text(arena, field->pattern, &field->pattern_len, &field->pattern_cap, text, n);
+        return field->pattern == NULL ? -1 : 0;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (strchr("*?[]\\", text[i]) != NULL &&
+            (field->pattern = append_text(arena, field->pattern, &field->pattern_len, &field->pattern_cap, "\\", 1)) == NULL) {
+            return -1;
+        }
+        if ((field->pattern = append_text(arena, field->pattern, &field->pattern_len, &field->pattern_cap, text + i, 1)) == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * field_finish - Add a finished field to an argv array and start a new one.
+ * @arena: Arena holding the field.
+ * @field: The field (reset on return).
+ * @words: In/out: argv array (see push_word).
+ * @count: In/out: number of words.
+ * @cap: In/out: allocated slots.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * A field with unquoted wildcards becomes the sorted list of matching paths; if nothing
+ * matches it is kept as written (without its quotes).
+ */
+int field_finish(Arena *arena, Field *field, char ***words, int *count, int *cap) {
+    int status = 0;
+    if (field->exists) {
+        int matches = field->glob ? glob_expand(arena, field->pattern, words, count, cap) : 0;
+        if (matches < 0) {
+            return -1;
+        }
+        if (matches == 0) {
+            if (field->text == NULL && (field->text = append_text(arena, NULL, &field->len, &field->cap, "", 0)) == NULL) {
+                return -1;
+            }
+            status = push_word(arena, words, count, cap, field->text);
+        }
+    }
+    bool track_glob = field->track_glob;
+    memset(field, 0, sizeof(*field));
+    field->track_glob = track_glob;
+    return status;
+}
+
+/**
+ * expand_word - Substitute variables in a word, expand its wildcards and remove its quotes.
+ * @arena: Arena that receives the fields.
+ * @word: The word, as written (quotes still in place).
+ * @split: Argument context: split unquoted expansions into fields on blanks and expand
+ *         unquoted wildcards (false: always exactly one field, as for a file name).
+ * @words: In/out: argv array the fields are appended to (see push_word).
+ * @count: In/out: number of words.
+ * @cap: In/out: allocated slots.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * Text in single quotes is literal; in double quotes only '$' and the backslash escapes of
+ * '$', '"', '\' and newline are special. An unquoted expansion that is empty adds no field,
+ * while "" or "$empty" adds an empty one. Quoted wildcards match only themselves.
+ */
+int expand_word(Arena *arena, const char *word, bool split, char ***words, int *count, int *cap) {
+    Field field;
+    memset(&field, 0, sizeof(field));
+    field.track_glob = split;
+    field.exists = !split;
+    bool in_double = false;
+    int status = 0;
+    const char *p = word;
+    while (*p != '\0' && status == 0) {
+        if (*p == '\'' && !in_double) {
+            const char *close = strchr(p + 1, '\'');
+            size_t n = close ? (size_t)(close - p - 1) : strlen(p + 1);
+            status = field_append(arena, &field, p + 1, n, true);
+            p = close ? close + 1 : p + 1 + n;
+        } else if (*p == '"') {
+            in_double = !in_double;
+            field.exists = true;
+            p++;
+        } else if (*p == '\\' && p[1] != '\0') {
+            if (p[1] == '\n') {
+                p += 2;
+                continue;
+            }
+            bool escapes = !in_double || strchr("$`\"\\", p[1]) != NULL;
+            if (!escapes) {
+                status = field_append(arena, &field, p, 1, true);
+            }
+            if (status == 0) {
+                status = field_append(arena, &field, p + 1, 1, true);
+            }
+            p += 2;
+        } else if (*p == '$') {
+            char number[24];
+            p++;
+            const char *value = variable_value(&p, number, sizeof(number));
+            if (value == NULL) {
+                field.exists |= in_double;
+            } else if (in_double || !split) {
+                status = field_append(arena, &field, value, strlen(value), in_double);
+            } else {
+                // Unquoted: blanks in the value separate fields
+                while (*value != '\0' && status == 0) {
+                    size_t run = strcspn(value, " \t\n");
+                    if (run > 0) {
+                        status = field_append(arena, &field, value, run, false);
+                        value += run;
+                    }
+                    if (*value != '\0' && status == 0) {
+                        value += strspn(value, " \t\n");
+                        status = field_finish(arena, &field, words, count, cap);
+                    }
+                }
+            }
+        } else {
+            size_t run = strcspn(p, in_double ? "\"\\$" : "'\"\\$");
+            run = run == 0 ? 1 : run;
+            status = field_append(arena, &field, p, run, in_double);
+            p += run;
+        }
+    }
+    return status == 0 ? field_finish(arena, &field, words, count, cap) : -1;
+}
+
+/**
+ * expand_string - Expand a word that must stay a single field (file names, assignments).
+ * @arena: Arena that receives the result.
+ * @word: The word, as written.
+ * Return: The expanded word, or NULL on allocation failure.
+ */
+char *expand_string(Arena *arena, char *word) {
+    if (!needs_expansion(word)) {
+        return word;  // Already unquoted by the parser
+    }
+    char **words = NULL;
+    int count = 0;
+    int cap = 0;
+    if (expand_word(arena, word, false, &words, &count, &cap) != 0 || count != 1) {
+        return NULL;
+    }
+    return words[0];
+}
+
+/**
+ * expand_commands - Make a copy of a pipeline with its variables substituted.
+ * @commands: The pipeline segments (left unchanged: they may belong to a cached tree).
+ * @num_commands: Number of segments.
+ * Return: The expanded copy in expand_arena, or NULL on allocation failure.
+ *
+ * Only segments the parser marked (a '$', a wildcard or a leading assignment) are copied word
+ * by word. Words that contain '$' or wildcards are expanded, split into fields and globbed;
+ * the others were already unquoted by the parser. Leading "NAME=value" words move from args to assigns.
+ */
+Command *expand_commands(const Command *commands, int num_commands) {
+    Command *copy = arena_alloc(&expand_arena, sizeof(Command) * (size_t)num_commands);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, commands, sizeof(Command) * (size_t)num_commands);
+    for (int i = 0; i < num_commands; ++i) {
+        if (!copy[i].expand) {
+            continue;
+        }
+        const Command *cmd = &commands[i];
+        copy[i].assigns = NULL;
+        for (int j = 0; j < cmd->nassign; ++j) {
+            if (copy[i].assigns == NULL &&
+                (copy[i].assigns = arena_alloc(&expand_arena, sizeof(char *) * (size_t)cmd->nassign)) == NULL) {
+                return NULL;
+            }
+            if ((copy[i].assigns[j] = expand_string(&expand_arena, cmd->args[j])) == NULL) {
+                return NULL;
+            }
+        }
+        char **args = NULL;
+        int argc = 0;
+        int cap = 0;
+        if (push_word(&expand_arena, &args, &argc, &cap, NULL) != 0) {
+            return NULL;
+        }
+        argc = 0;
+        for (int j = cmd->nassign; j < cmd->argc; ++j) {
+            int status = !needs_expansion(cmd->args[j])
+                             ? push_word(&expand_arena, &args, &argc, &cap, cmd->args[j])
+                             : expand_word(&expand_arena, cmd->args[j], true, &args, &argc, &cap);
+            if (status != 0) {
+                return NULL;
+            }
+        }
+        copy[i].args = args;
+        copy[i].argc = argc;
+        copy[i].expand = false;
+        if (cmd->input_file != NULL && (copy[i].input_file = expand_string(&expand_arena, cmd->input_file)) == NULL) {
+            return NULL;
+        }
+        if (cmd->output_file != NULL &&
+            (copy[i].output_file = expand_string(&expand_arena, cmd->output_file)) == NULL) {
+            return NULL;
+        }
+        if (cmd->here_string != NULL &&
+            (copy[i].here_string = expand_string(&expand_arena, cmd->here_string)) == NULL) {
+            return NULL;
+        }
+        if (cmd->nredirs > 0) {
+            copy[i].redirs = arena_alloc(&expand_arena, sizeof(Redirect) * (size_t)cmd->nredirs);
+            if (copy[i].redirs == NULL) {
+                return NULL;
+            }
+            for (int j = 0; j < cmd->nredirs; ++j) {
+                copy[i].redirs[j] = cmd->redirs[j];
+                if (cmd->redirs[j].target != NULL &&
+                    (copy[i].redirs[j].target = expand_string(&expand_arena, cmd->redirs[j].target)) == NULL) {
+                    return NULL;
+                }
+            }
+        }
+    }
+    return copy;
+}
+
+// Defined below: here-strings are written with the shell's short-write loop
+int write_all(int fd, const char *buf, size_t len);
+
+/**
+ * here_string_fd - Open a descriptor that reads back a here-string.
+ * @text: The (expanded) word; a newline is appended as in other shells.
+ * Return: A close-on-exec descriptor positioned at the start of the text, or -1 on error
+ *         (an error message is printed).
+ *
+ * The text goes into an anonymous memfd, so nothing touches the disk and any length
+ * works. Kernels without memfd_create get a pipe instead, which holds up to one pipe
+ * buffer because nobody reads it until the command starts.
+ */
+int here_string_fd(const char *text) {
+    size_t len = strlen(text);
+    int fd = memfd_create("here-string", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (write_all(fd, text, len) != 0 || write_all(fd, "\n", 1) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+            perror("shell: here-string");
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        perror("shell: pipe");
+        return -1;
+    }
+    int size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    if (size < 0 || len >= (size_t)size) {
+        fprintf(stderr, "shell: here-string too long for a pipe\n");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    int status = write_all(pipefd[1], text, len) == 0 && write_all(pipefd[1], "\n", 1) == 0 ? 0 : -1;
+    close(pipefd[1]);
+    if (status != 0) {
+        perror("shell: here-string");
+        close(pipefd[0]);
+        return -1;
+    }
+    return pipefd[0];
+}
+
+/**
+ * redirect_open - Open the file (or here-string) of one redirection.
+ * @redir: A REDIR_READ, REDIR_WRITE, REDIR_APPEND or REDIR_HERE redirection.
+ * Return: A close-on-exec descriptor, or -1 if it cannot be opened (an error message is printed).
+ */
+int redirect_open(const Redirect *redir) {
+    int fd;
+    switch (redir->kind) {
+    case REDIR_HERE:
+        return here_string_fd(redir->target);
+    case REDIR_READ:
+        fd = open(redir->target, O_RDONLY | O_CLOEXEC);
+        break;
+    case REDIR_APPEND:
+        fd = open(redir->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        break;
+    default:
+        fd = open(redir->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        break;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "shell: %s: %s\n", redir->target, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * redirect_source - Get the descriptor a REDIR_DUP redirection copies.
+ * @redir: The redirection.
+ * Return: The descriptor, -2 if the expanded source word is "-" (close instead), or -1 if
+ *         it is not a descriptor number (an error message is printed).
+ *
+ * The source is normally known at parse time; a word like "$CHECK_IN" is only known once
+ * expanded, so it is read here.
+ */
+int redirect_source(const Redirect *redir) {
+    if (redir->target == NULL) {
+        return redir->source;
+    }
+    if (strcmp(redir->target, "-") == 0) {
+        return -2;
+    }
+    size_t len = strlen(redir->target);
+    if (len == 0 || len > 4 || strspn(redir->target, "0123456789") != len) {
+        fprintf(stderr, "shell: %s: file descriptor expected\n", redir->target);
+        return -1;
+    }
+    return atoi(redir->target);
+}
+
+/**
+ * redirect_restore - Undo redirect_apply() in reverse order.
+ * @cmd: The command whose redirs were applied.
+ * @saved: The slots filled by redirect_apply().
+ * @count: Number of redirections applied (cmd->nredirs after a successful apply).
+ */
+void redirect_restore(const Command *cmd, const int *saved, int count) {
+    for (int i = count - 1; i >= 0; --i) {
+        int fd = cmd->redirs[i].fd;
+        if (saved[2 * i] >= 0) {
+            dup3(saved[2 * i], fd, (saved[2 * i + 1] & FD_CLOEXEC) ? O_CLOEXEC : 0);
+            close(saved[2 * i]);
+        } else {
+            close(fd);
+        }
+    }
+}
+
+/**
+ * redirect_apply - Apply a command's ordered redirection list in the current process.
+ * @cmd: The command whose redirs are applied.
+ * @saved: If not NULL, receives two slots per redirection: a close-on-exec copy (at fd 10
+ *         or above) of the descriptor it replaced, or -1 if that descriptor was closed, and
+ *         the descriptor's flags (so a close-on-exec shell descriptor stays one); pass it to
+ *         redirect_restore() afterwards. NULL in a child that never goes back.
+ * Return: 0 on success, -1 on error (an error message is printed and, with @saved, the
+ *         redirections already applied are undone).
+ */
+int redirect_apply(const Command *cmd, int *saved) {
+    for (int i = 0; i < cmd->nredirs; ++i) {
+        const Redirect *redir = &cmd->redirs[i];
+        if (saved != NULL) {
+            saved[2 * i + 1] = fcntl(redir->fd, F_GETFD);
+            saved[2 * i] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10);
+            if (saved[2 * i] < 0 && errno != EBADF) {
+                perror("shell: fcntl");
+                redirect_restore(cmd, saved, i);
+                return -1;
+            }
+        }
+        int status = 0;
+        int source = redir->kind == REDIR_DUP ? redirect_source(redir) : -2;
+        if (redir->kind == REDIR_CLOSE || (redir->kind == REDIR_DUP && source == -2)) {
+            close(redir->fd);
+        } else if (redir->kind == REDIR_DUP) {
+            if (source < 0 || (source != redir->fd && dup2(source, redir->fd) < 0)) {
+                if (source >= 0) {
+                    fprintf(stderr, "shell: %d: %s\n", source, strerror(errno));
+                }
+                status = -1;
+            }
+        } else {
+            int fd = redirect_open(redir);
+            if (fd < 0) {
+                status = -1;
+            } else if (fd == redir->fd) {
+                status = fcntl(fd, F_SETFD, 0);  // Already in place: only keep it across exec
+            } else {
+                status = dup2(fd, redir->fd) < 0 ? -1 : 0;
+                if (status != 0) {
+                    fprintf(stderr, "shell: %d: %s\n", redir->fd, strerror(errno));
+                }
+                close(fd);
+            }
+        }
+        if (status != 0) {
+            if (saved != NULL) {
+                redirect_restore(cmd, saved, i + 1);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * redirect_io - Configure input/output redirection for a command in the child process.
+ * @cmd: The Command structure containing redirection info.
+ * Return: 0 on success, -1 if an error occurs (and an error message is printed).
+ */
+int redirect_io(const Command *cmd) {
+    if (cmd->input_file || cmd->here_string) {
+        int fd = cmd->here_string != NULL ? here_string_fd(cmd->here_string) : open(cmd->input_file, O_RDONLY);
+        if (fd < 0) {
+            if (cmd->here_string == NULL) {
+                fprintf(stderr, "%s : File not found\n", cmd->input_file);
+            }
+            return -1;
+        }
+        if (dup2(fd, STDIN_FILENO) < 0) {
+            fprintf(stderr, "error duplicating file descriptor for input: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    if (cmd->output_file) {
+        int fd = open(cmd->output_file, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: Cannot create file\n", cmd->output_file);
+            return -1;
+        }
+        if (dup2(fd, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "error duplicating file descriptor for output: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    return redirect_apply(cmd, NULL);
+}
+
+/**
+ * path_hash - Hash a command name into a path cache bucket (FNV-1a).
+ * @name: The command name.
+ * Return: Bucket index in path_cache.
+ */
+unsigned path_hash(const char *name) {
+    unsigned h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h & (PATH_CACHE_SIZE - 1);
+}
+
+/**
+ * path_cache_clear - Drop cached command paths.
+ * @keep_pinned: If true, entries added with "hash -p" are kept.
+ */
+void path_cache_clear(bool keep_pinned) {
+    for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+        PathEntry **link = &path_cache[i];
+        while (*link != NULL) {
+            PathEntry *entry = *link;
+            if (keep_pinned && entry->pinned) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+/**
+ * path_cache_find - Look up a command name in the path cache.
+ * @name: The command name.
+ * Return: The cache entry, or NULL if the name is not cached.
+ */
+PathEntry *path_cache_find(const char *name) {
+    for (PathEntry *entry = path_cache[path_hash(name)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * path_cache_insert - Add or replace the cached path for a command name.
+ * @name: The command name.
+ * @path: The resolved path (copied).
+ * @pinned: True if the entry should survive PATH changes.
+ * Return: The cache entry, or NULL on allocation failure.
+ */
+PathEntry *path_cache_insert(const char *name, const char *path, bool pinned) {
+    PathEntry *entry = path_cache_find(name);
+    if (entry != NULL) {
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            return NULL;
+        }
+        free(entry->path);
+        entry->path = copy;
+        entry->pinned = pinned;
+        return entry;
+    }
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    if (entry->name == NULL || entry->path == NULL) {
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    entry->pinned = pinned;
+    unsigned bucket = path_hash(name);
+    entry->next = path_cache[bucket];
+    path_cache[bucket] = entry;
+    return entry;
+}
+
+/**
+ * path_cache_remove - Forget the cached path for a command name.
+ * @name: The command name.
+ * Return: true if an entry was removed.
+ */
+bool path_cache_remove(const char *name) {
+    for (PathEntry **link = &path_cache[path_hash(name)]; *link != NULL; link = &(*link)->next) {
+        PathEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * path_cache_validate - Invalidate the path cache if PATH changed since it was filled.
+ */
+void path_cache_validate(void) {
+    const char *path = var_get("PATH", 4);
+    if (path == NULL) {
+        path = "";
+    }
+    if (path_cache_path != NULL && strcmp(path_cache_path, path) == 0) {
+        return;
+    }
+    path_cache_clear(true);
+    free(path_cache_path);
+    path_cache_path = strdup(path);
+}
+
+/**
+ * search_path - Walk $PATH looking for an executable regular file.
+ * @name: The command name (must not contain '/').
+ * @buf: Buffer receiving the full path.
+ * @size: Size of buf.
+ * Return: true if an executable was found.
+ *
+ * Only stat() and access() are called, so a forked child may use it before exec.
+ */
+bool search_path(const char *name, char *buf, size_t size) {
+    const char *dir = path_cache_path;
+    size_t name_len = strlen(name);
+    while (dir != NULL) {
+        const char *colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+        if (dir_len == 0) {
+            // An empty PATH element means the current directory
+            dir = ".";
+            dir_len = 1;
+        }
+        if (dir_len + name_len + 2 <= size) {
+            memcpy(buf, dir, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+                return true;
+            }
+        }
+        dir = colon ? colon + 1 : NULL;
+    }
+    return false;
+}
+
+/**
+ * lookup_command - Resolve a command name to the path that will be executed.
+ * @name: The command name (args[0]).
+ * Return: The path to execute, or NULL if the command was not found in PATH.
+ *
+ * Names containing a '/' are returned unchanged. Other names are served from the
+ * path cache, which is filled on first use and dropped whenever PATH changes, so
+ * only the first launch of a command pays for the $PATH walk.
+ */
+const char *lookup_command(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    path_cache_validate();
+    PathEntry *entry = path_cache_find(name);
+    if (entry == NULL) {
+        char buf[PATH_MAX];
+        if (!search_path(name, buf, sizeof(buf))) {
+            return NULL;
+        }
+        entry = path_cache_insert(name, buf, false);
+        if (entry == NULL) {
+            return NULL;
+        }
+        STAT_ADD(path_misses, 1);
+    } else {
+        STAT_ADD(path_hits, 1);
+    }
+    entry->hits++;
+    return entry->path;
+}
+
+/**
+ * builtin_hash - Implement the "hash" built-in command.
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 on error.
+ *
+ * hash            list cached commands and their hit counts
+ * hash -r         forget every cached path
+ * hash -d NAME    forget the cached path for NAME
+ * hash -p PATH NAME  pin NAME to PATH
+ * hash NAME...    resolve and cache each NAME
+ */
+int builtin_hash(Command *cmd) {
+    char **args = cmd->args;
+    path_cache_validate();
+    if (args[1] == NULL) {
+        bool header = false;
+        for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+            for (PathEntry *entry = path_cache[i]; entry != NULL; entry = entry->next) {
+                if (!header) {
+                    printf("hits\tcommand\n");
+                    header = true;
+                }
+                printf("%4u\t%s%s\n", entry->hits, entry->path, entry->pinned ? " (pinned)" : "");
+            }
+        }
+        if (!header) {
+            printf("hash: hash table empty\n");
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        path_cache_clear(false);
+        return 0;
+    }
+    if (strcmp(args[1], "-p") == 0) {
+        if (args[2] == NULL || args[3] == NULL) {
+            fprintf(stderr, "hash: usage: hash -p path name\n");
+            return 1;
+        }
+        if (strchr(args[3], '/') != NULL) {
+            fprintf(stderr, "hash: %s: name must not contain '/'\n", args[3]);
+            return 1;
+        }
+        return path_cache_insert(args[3], args[2], true) != NULL ? 0 : 1;
+    }
+    if (strcmp(args[1], "-d") == 0) {
+        int status = 0;
+        for (int i = 2; args[i] != NULL; ++i) {
+            if (!path_cache_remove(args[i])) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; ++i) {
+        if (strchr(args[i], '/') != NULL) {
+            continue;
+        }
+        path_cache_remove(args[i]);
+        char buf[PATH_MAX];
+        if (!search_path(args[i], buf, sizeof(buf)) || path_cache_insert(args[i], buf, false) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * write_all - Write a whole buffer to a descriptor, retrying on short writes.
+ * @fd: The descriptor.
+ * @buf: The data.
+ * @len: Number of bytes.
+ * Return: 0 on success, -1 on error.
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * now_ns - Read the monotonic clock.
+ * Return: Nanoseconds since an arbitrary fixed point.
+ */
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * timeval_us - Convert a struct timeval to microseconds.
+ * @tv: The time value.
+ * Return: Microseconds.
+ */
+long long timeval_us(struct timeval tv) {
+    return (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * argv_join - Join an argument vector with single spaces.
+ * @args: The arguments.
+ * @argc: Number of arguments.
+ * Return: A malloc'd string, or NULL on allocation failure.
+ */
+char *argv_join(char **args, int argc) {
+    size_t len = 1;
+    for (int i = 0; i < argc; ++i) {
+        len += strlen(args[i]) + 1;
+    }
+    char *text = malloc(len);
+    if (text == NULL) {
+        return NULL;
+    }
+    char *p = text;
+    for (int i = 0; i < argc; ++i) {
+        if (i > 0) {
+            *p++ = ' ';
+        }
+        p = stpcpy(p, args[i]);
+    }
+    *p = '\0';
+    return text;
+}
+
+/**
+ * event_ring_close - Unmap and close the event loop's io_uring instance.
+ */
+void event_ring_close(void) {
+    EventRing *ring = &event_ring;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * event_ring_open - Create the io_uring instance of the event loop and map its rings.
+ * Return: 0 on success, -1 if io_uring is unavailable (ENOSYS, or disabled by policy).
+ *
+ * The raw system calls are used so the shell needs no liburing.
+ */
+int event_ring_open(void) {
+    EventRing *ring = &event_ring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(SYS_io_uring_setup, EVENT_RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        event_ring_close();
+        return -1;
+    }
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * event_ring_enter - Submit the queued io_uring entries and optionally wait for a completion.
+ * @wait: Number of completions to wait for (0: submit only).
+ * Return: 0 on success (also when a signal cut the wait short), -1 on error.
+ */
+int event_ring_enter(unsigned wait) {
+    EventRing *ring = &event_ring;
+    int n = (int)syscall(SYS_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+    if (n < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+    }
+    ring->queued -= (unsigned)n < ring->queued ? (unsigned)n : ring->queued;
+    return 0;
+}
+
+/**
+ * event_ring_sqe - Take the next free submission entry, flushing the ring if it is full.
+ * Return: A zeroed entry, or NULL if the ring could not be flushed.
+ */
+struct io_uring_sqe *event_ring_sqe(void) {
+    EventRing *ring = &event_ring;
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (event_ring_enter(0) < 0) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+/**
+ * event_tag - Build the completion tag of a watch: its slot and generation.
+ * @id: The watch id.
+ * Return: The tag (io_uring user_data, epoll data.u64).
+ */
+uint64_t event_tag(int id) {
+    return (uint64_t)event_watches[id].gen << 32 | (uint32_t)id;
+}
+
+/**
+ * event_init - Set up the event loop, preferring io_uring and falling back to epoll.
+ * Return: 0 on success, -1 if neither is available (a message is printed).
+ *
+ * SHELL_EVENTS=epoll skips io_uring. Calling it again after event_reset() starts afresh.
+ */
+int event_init(void) {
+    const char *want = getenv("SHELL_EVENTS");
+    if ((want == NULL || strcmp(want, "epoll") != 0) && event_ring_open() == 0) {
+        event_backend = EVENT_URING;
+        return 0;
+    }
+    event_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_epoll_fd < 0) {
+        perror("shell: epoll_create1");
+        return -1;
+    }
+    event_backend = EVENT_EPOLL;
+    return 0;
+}
+
+/**
+ * event_reset - Drop the event loop inherited from the parent (in a forked subshell).
+ *
+ * Watches and feeders belong to the parent. The io_uring rings are shared memory, so the
+ * child must unmap them before it could ever submit into the parent's ring.
+ */
+void event_reset(void) {
+    if (event_backend == EVENT_URING) {
+        event_ring_close();
+    } else if (event_epoll_fd >= 0) {
+        close(event_epoll_fd);
+    }
+    event_epoll_fd = -1;
+    event_backend = EVENT_NONE;
+    event_nwatches = 0;  // The table itself is reused: no free() in a child that may not own malloc's locks
+    event_feeders = 0;
+}
+
+/**
+ * event_watch - Start watching a descriptor.
+ * @fd: The descriptor.
+ * @events: POLLIN or POLLOUT.
+ * @handler: Called from event_run_once() each time fd is ready (level-triggered).
+ * @data: Handler argument.
+ * Return: The watch id, or -1 on error (errno set; EPERM for files epoll cannot watch).
+ */
+int event_watch(int fd, short events, EventHandler handler, void *data) {
+    int id = 0;
+    while (id < event_nwatches && event_watches[id].fd >= 0) {
+        id++;
+    }
+    if (id == event_watch_cap) {
+        int cap = event_watch_cap ? event_watch_cap * 2 : 16;
+        EventWatch *grown = realloc(event_watches, sizeof(EventWatch) * (size_t)cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        memset(grown + event_watch_cap, 0, sizeof(EventWatch) * (size_t)(cap - event_watch_cap));
+        event_watches = grown;
+        event_watch_cap = cap;
+    }
+    EventWatch *w = &event_watches[id];
+    w->fd = fd;
+    w->events = events;
+    w->armed = false;
+    w->handler = handler;
+    w->data = data;
+    if (event_backend == EVENT_EPOLL) {
+        struct epoll_event ev = {.events = (uint32_t)events, .data.u64 = event_tag(id)};
+        if (epoll_ctl(event_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            w->fd = -1;
+            return -1;
+        }
+    }
+    if (id == event_nwatches) {
+        event_nwatches++;
+    }
+    return id;
+}
+
+/**
+ * event_unwatch - Stop watching a descriptor; call it before closing the descriptor.
+ * @id: The watch id (-1 is ignored).
+ *
+ * An armed io_uring poll holds a reference to the file, so it is cancelled right away: a pipe
+ * closed by the shell must not stay open inside the kernel.
+ */
+void event_unwatch(int id) {
+    if (id < 0 || id >= event_nwatches || event_watches[id].fd < 0) {
+        return;
+    }
+    EventWatch *w = &event_watches[id];
+    if (event_backend == EVENT_URING && w->armed) {
+        struct io_uring_sqe *sqe = event_ring_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = event_tag(id);
+            sqe->user_data = EVENT_REMOVE_TAG;
+            event_ring_enter(0);
+        }
+    } else if (event_backend == EVENT_EPOLL) {
+        epoll_ctl(event_epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+    }
+    w->fd = -1;
+    w->armed = false;
+    w->gen++;
+    while (event_nwatches > 0 && event_watches[event_nwatches - 1].fd < 0) {
+        event_nwatches--;
+    }
+}
+
+/**
+ * event_run_once - Sleep until a watched descriptor is ready, then run its handler.
+ * Return: 0 once handlers ran or a signal arrived, -1 on error.
+ *
+ * With io_uring every watch without a poll in flight is armed in the same io_uring_enter()
+ * that sleeps, so a wait costs one system call however many descriptors are watched. The
+ * polls are one-shot and re-armed on the next wait: that gives the level-triggered behaviour
+ * the callers rely on (a reader that left data in a pipe is woken again), which multishot
+ * polls do not.
+ */
+int event_run_once(void) {
+    uint64_t ready[EVENT_BATCH];
+    short revents[EVENT_BATCH];
+    int nready = 0;
+    event_waits++;
+    if (event_backend == EVENT_URING) {
+        EventRing *ring = &event_ring;
+        for (int id = 0; id < event_nwatches; ++id) {
+            EventWatch *w = &event_watches[id];
+            if (w->fd < 0 || w->armed) {
+                continue;
+            }
+            struct io_uring_sqe *sqe = event_ring_sqe();
+            if (sqe == NULL) {
+                return -1;
+            }
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = w->fd;
+            sqe->poll32_events = (uint32_t)w->events;
+            sqe->user_data = event_tag(id);
+            w->armed = true;
+        }
+        if (event_ring_enter(1) < 0) {
+            return -1;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && nready < EVENT_BATCH; ++head) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->user_data == EVENT_REMOVE_TAG) {
+                continue;
+            }
+            int id = (int)(uint32_t)cqe->user_data;
+            if (id >= event_nwatches || event_watches[id].gen != (unsigned)(cqe->user_data >> 32)) {
+                continue;  // Completion of a watch removed meanwhile
+            }
+            event_watches[id].armed = false;
+            ready[nready] = cqe->user_data;
+            revents[nready++] = cqe->res >= 0 ? (short)cqe->res : POLLERR;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    } else if (event_backend == EVENT_EPOLL) {
+        struct epoll_event evs[EVENT_BATCH];
+        int n = epoll_wait(event_epoll_fd, evs, EVENT_BATCH, -1);
+        if (n < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            ready[nready] = evs[i].data.u64;
+            revents[nready++] = (short)evs[i].events;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    // A handler may add or remove watches, so each one is looked up again by its tag
+    for (int i = 0; i < nready; ++i) {
+        int id = (int)(uint32_t)ready[i];
+        if (id < event_nwatches && event_watches[id].fd >= 0 && event_watches[id].gen == (unsigned)(ready[i] >> 32)) {
+            event_watches[id].handler(event_watches[id].data, revents[i]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * event_flag - Event handler that records the ready events in a short.
+ * @data: The short to set.
+ * @revents: The ready events.
+ */
+void event_flag(void *data, short revents) {
+    *(short *)data = revents;
+}
+
+/**
+ * sigchld_handler - SIGCHLD handler: wake the main loop through the self-pipe.
+ * @sig: The signal number (unused).
+ *
+ * Only write(2) is used here; children are reaped by reap_children() in the main loop,
+ * which keeps the job table single-threaded.
+ */
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "c", 1) < 0) {
+        // Pipe full: a wake-up is already pending
+    }
+    errno = saved_errno;
+}
+
+// Defined below: collects child status changes
+void reap_children(void);
+
+/**
+ * sigchld_event - Event handler of the SIGCHLD self-pipe: reap whatever changed state.
+ * @data: Unused.
+ * @revents: Unused.
+ */
+void sigchld_event(void *data, short revents) {
+    (void)data;
+    (void)revents;
+    reap_children();
+}
+
+/**
+ * job_signals_init - Install the SIGCHLD self-pipe and, if interactive, take the terminal.
+ * @interactive: True if the shell reads commands from a terminal.
+ * Return: 0 on success, -1 on error (a message is printed).
+ *
+ * The self-pipe is the event loop's first watch: child exits and stops reach the loop as one
+ * readable descriptor however many jobs run. In interactive mode the shell places itself in
+ * its own process group, owns the terminal and ignores the job-control signals; each
+ * pipeline then gets its own process group.
+ */
+int job_signals_init(bool interactive) {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("shell: pipe");
+        return -1;
+    }
+    if (event_init() != 0) {
+        return -1;
+    }
+    if (event_watch(sigchld_pipe[0], POLLIN, sigchld_event, NULL) < 0) {
+        perror("shell: event loop");
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        perror("shell: sigaction");
+        return -1;
+    }
+    // Writes into pipes (feeders, parallel output) report EPIPE instead of killing the shell
+    signal(SIGPIPE, SIG_IGN);
+    if (!interactive) {
+        return 0;
+    }
+    // Wait until we are in the foreground before taking over the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(0, 0) < 0) {
+        // Session leaders cannot change group; keep the current one
+        shell_pgid = getpgrp();
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control = true;
+    return 0;
+}
+
+/**
+ * job_create - Add an empty job to the job table.
+ * @nprocs: Number of pipeline segments the job may launch.
+ * Return: The new job, or NULL on allocation failure.
+ */
+Job *job_create(int nprocs) {
+    Job *job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return NULL;
+    }
+    job->procs = calloc((size_t)nprocs, sizeof(JobProc));
+    if (job->procs == NULL) {
+        free(job);
+        return NULL;
+    }
+    job->id = job_list ? job_list->id + 1 : 1;
+    job->seq = ++job_seq;
+    job->pipe_size = pipe_size_default;
+    job->builtin_status = -1;
+    job->next = job_list;
+    job_list = job;
+    STAT_ADD(jobs_live, 1);
+    return job;
+}
+
+/**
+ * job_remove - Remove a job from the job table and free it.
+ * @job: The job to remove.
+ */
+void job_remove(Job *job) {
+    for (Job **link = &job_list; *link != NULL; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    for (int i = 0; i < job->nprocs; ++i) {
+        free(job->procs[i].name);
+    }
+    free(job->shell_stage.name);
+    free(job->procs);
+    free(job->text);
+    free(job);
+    STAT_ADD(jobs_live, -1);
+}
+
+/**
+ * job_stages - Count the stages of a job that "time" and tracing report on.
+ * @job: The job.
+ * Return: Its processes, plus one if its last stage ran in the shell.
+ */
+int job_stages(const Job *job) {
+    return job->nprocs + (job->shell_stage.pid != 0);
+}
+
+/**
+ * job_stage - Get one reported stage of a job.
+ * @job: The job.
+ * @i: Index below job_stages(job).
+ * Return: The process entry, or shell_stage for the in-shell last stage.
+ */
+const JobProc *job_stage(const Job *job, int i) {
+    return i < job->nprocs ? &job->procs[i] : &job->shell_stage;
+}
+
+/**
+ * job_shell_stage - Record a builtin stage that ran in the shell, for "time" and tracing.
+ * @job: The job.
+ * @cmd: The stage.
+ * @status: Its exit code.
+ * @before: RUSAGE_SELF of the shell just before it ran; the stage is charged the difference.
+ */
+void job_shell_stage(Job *job, const Command *cmd, int status, const struct rusage *before) {
+    JobProc *proc = &job->shell_stage;
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    proc->pid = getpid();
+    proc->status = (status & 0xff) << 8;
+    proc->exited = true;
+    proc->end_ns = now_ns();
+    proc->usage.ru_utime.tv_sec = after.ru_utime.tv_sec - before->ru_utime.tv_sec;
+    proc->usage.ru_utime.tv_usec = after.ru_utime.tv_usec - before->ru_utime.tv_usec;
+    proc->usage.ru_stime.tv_sec = after.ru_stime.tv_sec - before->ru_stime.tv_sec;
+    proc->usage.ru_stime.tv_usec = after.ru_stime.tv_usec - before->ru_stime.tv_usec;
+    proc->usage.ru_maxrss = after.ru_maxrss;
+    proc->usage.ru_minflt = after.ru_minflt - before->ru_minflt;
+    proc->usage.ru_majflt = after.ru_majflt - before->ru_majflt;
+    proc->name = argv_join(cmd->args, cmd->argc);
+}
+
+/**
+ * job_add_process - Register a launched process with its job.
+ * @job: The job.
+ * @pid: The process id.
+ */
+void job_add_process(Job *job, pid_t pid) {
+    JobProc *proc = &job->procs[job->nprocs++];
+    proc->pid = pid;
+    job->live++;
+    if (job->pgid == 0) {
+        job->pgid = pid;
+    }
+}
+
+/**
+ * job_record - Store a status change reported by wait4 in the job table.
+ * @pid: The process whose state changed.
+ * @status: The wait status.
+ * @usage: Resource usage of the process (meaningful once it has terminated).
+ */
+void job_record(pid_t pid, int status, const struct rusage *usage) {
+    for (Job *job = job_list; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; ++i) {
+            JobProc *proc = &job->procs[i];
+            if (proc->pid != pid || proc->exited) {
+                continue;
+            }
+            if (WIFSTOPPED(status)) {
+                proc->stopped = true;
+            } else if (WIFCONTINUED(status)) {
+                // Resumed by fg/bg/kill, which already reported it
+                proc->stopped = false;
+                return;
+            } else {
+                proc->exited = true;
+                proc->stopped = false;
+                proc->status = status;
+                proc->usage = *usage;
+                proc->end_ns = now_ns();
+                job->live--;
+            }
+            job->notified = false;
+            return;
+        }
+    }
+}
+
+/**
+ * reap_children - Collect every pending child status change without blocking.
+ *
+ * Called whenever the SIGCHLD self-pipe is readable, so exited background processes are
+ * reaped while the shell sits at the prompt instead of piling up as zombies.
+ */
+void reap_children(void) {
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+        continue;
+    }
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        job_record(pid, status, &usage);
+    }
+}
+
+/**
+ * job_is_stopped - Check whether every live process of a job is stopped.
+ * @job: The job.
+ * Return: true if the job has live processes and all of them are stopped.
+ */
+bool job_is_stopped(const Job *job) {
+    if (job->live == 0) {
+        return false;
+    }
+    for (int i = 0; i < job->nprocs; ++i) {
+        if (!job->procs[i].exited && !job->procs[i].stopped) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * exit_code - Convert a wait status into a shell exit code.
+ * @status: The wait status.
+ * Return: The exit status, or 128 + signal number for a killed or stopped process.
+ */
+int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 0;
+}
+
+/**
+ * job_exit_code - Exit code of a job: that of its last segment.
+ * @job: The job.
+ * Return: The exit code (127 if the last segment was not found, 1 if its redirections failed).
+ */
+int job_exit_code(const Job *job) {
+    if (job->builtin_status >= 0) {
+        // The last stage was a builtin run by the shell itself, or was never started
+        return job->builtin_status;
+    }
+    if (job->nprocs == 0) {
+        return 127;
+    }
+    const JobProc *last = &job->procs[job->nprocs - 1];
+    if (last->stopped) {
+        return 128 + SIGTSTP;
+    }
+    return exit_code(last->status);
+}
+
+/**
+ * wait_for_job - Block until a job terminates or stops.
+ * @job: The job to wait for.
+ *
+ * The wait runs the event loop, woken by the SIGCHLD self-pipe, so input feeders keep
+ * flowing while the shell waits. Any other child that changes state meanwhile is recorded
+ * as well, so waiting for one job never leaves zombies of another behind.
+ */
+void wait_for_job(Job *job) {
+    reap_children();
+    while (job->live > 0 && !job_is_stopped(job) && event_run_once() == 0) {
+        continue;
+    }
+    // Without a working event loop, block in wait4() instead
+    while (job->live > 0 && !job_is_stopped(job)) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // ECHILD: nothing left to wait for
+        }
+        job_record(pid, status, &usage);
+    }
+}
+
+/**
+ * job_text - Build the command text shown for a job.
+ * @commands: The pipeline segments.
+ * @num_commands: Number of segments.
+ * Return: A malloc'd string such as "sleep 10 | cat &", or NULL on allocation failure.
+ */
+char *job_text(const Command *commands, int num_commands) {
+    size_t len = 3;
+    for (int i = 0; i < num_commands; ++i) {
+        for (int j = 0; j < commands[i].argc; ++j) {
+            len += strlen(commands[i].args[j]) + 1;
+        }
+        len += 3;
+    }
+    char *text = malloc(len);
+    if (text == NULL) {
+        return NULL;
+    }
+    char *p = text;
+    for (int i = 0; i < num_commands; ++i) {
+        if (i > 0) {
+            p = stpcpy(p, " | ");
+        }
+        for (int j = 0; j < commands[i].argc; ++j) {
+            if (j > 0) {
+                *p++ = ' ';
+            }
+            p = stpcpy(p, commands[i].args[j]);
+        }
+    }
+    if (num_commands > 0 && commands[num_commands - 1].background) {
+        p = stpcpy(p, " &");
+    }
+    *p = '\0';
+    return text;
+}
+
+/**
+ * time_report - Print the "time" summary of a finished job to stderr.
+ * @job: The job.
+ *
+ * The totals mimic other shells; each pipeline segment then gets its own line with wall
+ * time, CPU time, peak RSS and page faults from wait4, followed by the shell's own parse
+ * and launch overhead for the line.
+ */
+void time_report(const Job *job) {
+    long long end = job->start_ns;
+    long long user = 0;
+    long long sys = 0;
+    int stages = job_stages(job);
+    for (int i = 0; i < stages; ++i) {
+        const JobProc *proc = job_stage(job, i);
+        if (proc->end_ns > end) {
+            end = proc->end_ns;
+        }
+        user += timeval_us(proc->usage.ru_utime);
+        sys += timeval_us(proc->usage.ru_stime);
+    }
+    fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n",
+            (double)(end - job->start_ns) / 1e9, (double)user / 1e6, (double)sys / 1e6);
+    for (int i = 0; stages > 1 && i < stages; ++i) {
+        const JobProc *proc = job_stage(job, i);
+        fprintf(stderr, "  stage %d  real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  faults %ld/%ld  %s\n",
+                i + 1, (double)(proc->end_ns - job->start_ns) / 1e9,
+                (double)timeval_us(proc->usage.ru_utime) / 1e6,
+                (double)timeval_us(proc->usage.ru_stime) / 1e6,
+                proc->usage.ru_maxrss, proc->usage.ru_minflt, proc->usage.ru_majflt,
+                proc->name ? proc->name : "");
+    }
+    if (stages == 1) {
+        const JobProc *proc = job_stage(job, 0);
+        fprintf(stderr, "maxrss\t%ldKB\nfaults\t%ld minor, %ld major\n",
+                proc->usage.ru_maxrss, proc->usage.ru_minflt, proc->usage.ru_majflt);
+    }
+    fprintf(stderr, "shell\tparse %.3fms  launch %.3fms\n",
+            (double)job->parse_ns / 1e6, (double)job->launch_ns / 1e6);
+}
+
+/**
+ * json_string - Write a string as a JSON string literal.
+ * @out: The stream.
+ * @str: The string (NULL writes an empty string).
+ */
+void json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)(str ? str : ""); *p; ++p) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * trace_report - Emit one JSON line per pipeline segment of a finished job (SHELL_TRACE).
+ * @job: The job.
+ *
+ * A builtin run in the shell (a last stage, or a whole command, see run_pipeline()) has a
+ * line too: its pid is the shell's and its CPU time and faults are what the shell used
+ * while it ran.
+ */
+void trace_report(const Job *job) {
+    int stages = job_stages(job);
+    for (int i = 0; i < stages; ++i) {
+        const JobProc *proc = job_stage(job, i);
+        fprintf(trace_out, "{\"seq\":%lld,\"stage\":%d,\"stages\":%d,\"pid\":%d,\"cmd\":",
+                job->seq, i, stages, proc->pid);
+        json_string(trace_out, proc->name);
+        fprintf(trace_out, ",\"status\":%d,\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,"
+                "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"parse_us\":%lld,\"launch_us\":%lld}\n",
+                exit_code(proc->status), (proc->end_ns - job->start_ns) / 1000,
+                timeval_us(proc->usage.ru_utime), timeval_us(proc->usage.ru_stime),
+                proc->usage.ru_maxrss, proc->usage.ru_minflt, proc->usage.ru_majflt,
+                job->parse_ns / 1000, job->launch_ns / 1000);
+    }
+    fflush(trace_out);
+}
+
+/**
+ * job_finish - Report a terminated job ("time", SHELL_TRACE) and remove it from the table.
+ * @job: The job; every process must have exited.
+ */
+void job_finish(Job *job) {
+    STAT_ADD(jobs_done, 1);
+    STAT_ADD(job_ns, now_ns() - job->start_ns);
+    if (job->timed) {
+        time_report(job);
+    }
+    if (trace_out != NULL && job_stages(job) > 0) {
+        trace_report(job);
+    }
+    job_remove(job);
+}
+
+/**
+ * trace_init - Enable trace mode if SHELL_TRACE names an open file descriptor.
+ *
+ * SHELL_TRACE=3 writes one JSON object per pipeline segment to fd 3 as each job finishes.
+ */
+void trace_init(void) {
+    const char *value = getenv("SHELL_TRACE");
+    if (value == NULL || *value == '\0') {
+        return;
+    }
+    char *end;
+    long fd = strtol(value, &end, 10);
+    if (*end != '\0' || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0) {
+        fprintf(stderr, "shell: SHELL_TRACE=%s: not an open file descriptor\n", value);
+        return;
+    }
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+    trace_out = fdopen((int)fd, "a");
+}
+
+/**
+ * stat_spawn - Record the latency of one external command launch in the shared counters.
+ * @ns: Time spawn_command() took.
+ */
+void stat_spawn(long long ns) {
+    uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    STAT_ADD(spawn_ns, ns);
+    STAT_ADD(spawn_hist[bucket < STAT_SPAWN_BUCKETS ? bucket : STAT_SPAWN_BUCKETS - 1], 1);
+}
+
+/**
+ * stat_dir - Find (and optionally create) the directory of the shared counter blocks.
+ * @buf: Receives the path.
+ * @size: Size of buf.
+ * @create: Create the directory if it does not exist yet.
+ * Return: 0 if it is a private directory of this user, -1 otherwise (with @create, a message
+ *         is printed).
+ *
+ * SHELL_STATS=/some/dir groups shells under a directory of the caller's choosing; any other
+ * value uses /dev/shm/shell-stats-UID, so the blocks live in memory and vanish at reboot.
+ */
+int stat_dir(char *buf, size_t size, bool create) {
+    const char *value = getenv("SHELL_STATS");
+    if (value != NULL && value[0] == '/') {
+        snprintf(buf, size, "%s", value);
+    } else {
+        snprintf(buf, size, "/dev/shm/shell-stats-%u", (unsigned)getuid());
+    }
+    if (create && mkdir(buf, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "shell: SHELL_STATS: %s: %s\n", buf, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (lstat(buf, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        if (create) {
+            fprintf(stderr, "shell: SHELL_STATS: %s: not a private directory of this user\n", buf);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * stat_init - Publish this shell's counters in shared memory if SHELL_STATS is set.
+ *
+ * The block is a file named after the pid in the stats directory, mapped shared. Any old
+ * file of that name is unlinked rather than truncated, so a reader that still maps it never
+ * faults, and the magic word is stored last, so a reader never sums a half-made block.
+ */
+void stat_init(void) {
+    const char *value = getenv("SHELL_STATS");
+    char dir[PATH_MAX];
+    if (value == NULL || *value == '\0' || strcmp(value, "0") == 0 || stat_dir(dir, sizeof(dir), true) != 0) {
+        return;
+    }
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/%d", dir, (int)getpid());
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    StatBlock *block = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, sizeof(StatBlock)) == 0) {
+        block = mmap(NULL, sizeof(StatBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (block == MAP_FAILED || (stat_path = strdup(path)) == NULL) {
+        fprintf(stderr, "shell: SHELL_STATS: %s: %s\n", path, strerror(errno));
+        if (block != MAP_FAILED) {
+            munmap(block, sizeof(StatBlock));
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return;
+    }
+    close(fd);
+    block->size = sizeof(StatBlock);
+    block->pid = (int32_t)getpid();
+    __atomic_store_n(&block->magic, STAT_MAGIC, __ATOMIC_RELEASE);
+    stat_block = block;
+}
+
+/**
+ * stat_close - Withdraw this shell's counter block (at exit).
+ */
+void stat_close(void) {
+    if (stat_block != NULL) {
+        unlink(stat_path);
+        munmap(stat_block, sizeof(StatBlock));
+        stat_block = NULL;
+    }
+    free(stat_path);
+    stat_path = NULL;
+}
+
+/**
+ * stat_collect - Sum the counter blocks of every live shell.
+ * @dir: The stats directory.
+ * @total: Receives the sums.
+ * @live: Receives the number of shells summed.
+ * @stale: Receives the number of blocks of shells that died without removing theirs
+ *         (they are removed now).
+ *
+ * Blocks are mapped read-only and read with relaxed atomic loads: the shells are never
+ * stopped, locked or signalled (kill() with signal 0 only checks that the pid exists).
+ */
+void stat_collect(const char *dir, StatCounters *total, int *live, int *stale) {
+    memset(total, 0, sizeof(*total));
+    *live = 0;
+    *stale = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;  // No shell has published counters yet
+    }
+    uint64_t *sum = (uint64_t *)total;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[strspn(entry->d_name, "0123456789")] != '\0') {
+            continue;
+        }
+        int fd = openat(dirfd(d), entry->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(StatBlock)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;  // Gone, or still being set up
+        }
+        const StatBlock *block = mmap(NULL, sizeof(StatBlock), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (block == MAP_FAILED) {
+            continue;
+        }
+        if (__atomic_load_n(&block->magic, __ATOMIC_ACQUIRE) == STAT_MAGIC && block->size >= sizeof(StatBlock)) {
+            if (kill((pid_t)block->pid, 0) == 0 || errno == EPERM) {
+                const uint64_t *counters = (const uint64_t *)&block->counters;
+                for (size_t i = 0; i < sizeof(StatCounters) / sizeof(uint64_t); ++i) {
+                    sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+                }
+                (*live)++;
+            } else if (unlinkat(dirfd(d), entry->d_name, 0) == 0) {
+                (*stale)++;
+            }
+        }
+        munmap((void *)block, sizeof(StatBlock));
+    }
+    closedir(d);
+}
+
+/**
+ * stat_percentile - Estimate a percentile of the spawn latency histogram.
+ * @c: The counters.
+ * @count: Launches in the histogram.
+ * @fraction: The percentile, e.g. 0.99.
+ * Return: Upper bound in microseconds of the bucket the percentile falls in, or 0 if there
+ *         are no launches yet (as the mean is then shown as 0).
+ */
+uint64_t stat_percentile(const StatCounters *c, uint64_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_SPAWN_BUCKETS; ++i) {
+        seen += c->spawn_hist[i];
+        if ((double)seen >= fraction * (double)count) {
+            return (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (STAT_SPAWN_BUCKETS - 1);
+}
+
+/**
+ * stat_report - Print the counters of all live shells, once or every few seconds.
+ * @interval: Seconds between reports (0 for a single one).
+ * Return: 0.
+ *
+ * This is "output --stat [SECONDS]" and "shellstat -a". Counters are totals over the shells
+ * running now. With an interval each report also gives per-second rates since the last one.
+ */
+int stat_report(long interval) {
+    char dir[PATH_MAX];
+    stat_dir(dir, sizeof(dir), false);
+    StatCounters prev = {0};
+    long long prev_ns = 0;
+    for (;;) {
+        StatCounters c;
+        int live, stale;
+        long long now = now_ns();
+        stat_collect(dir, &c, &live, &stale);
+        uint64_t spawns = 0;
+        for (int i = 0; i < STAT_SPAWN_BUCKETS; ++i) {
+            spawns += c.spawn_hist[i];
+        }
+        uint64_t parse_total = c.parse_hits + c.parse_misses;
+        uint64_t path_total = c.path_hits + c.path_misses;
+        printf("shells\tlive=%d stale_removed=%d dir=%s\n", live, stale, dir);
+        printf("lines\tcount=%llu parse_mean_us=%.1f\n", (unsigned long long)c.lines,
+               c.lines ? (double)c.parse_ns / 1e3 / (double)c.lines : 0.0);
+        printf("parsecache\thits=%llu misses=%llu hit_rate=%.1f%%\n", (unsigned long long)c.parse_hits,
+               (unsigned long long)c.parse_misses, parse_total ? 100.0 * (double)c.parse_hits / (double)parse_total : 0.0);
+        printf("pathcache\thits=%llu misses=%llu hit_rate=%.1f%%\n", (unsigned long long)c.path_hits,
+               (unsigned long long)c.path_misses, path_total ? 100.0 * (double)c.path_hits / (double)path_total : 0.0);
+        printf("pipelines\tcount=%llu commands=%llu processes=%llu\n", (unsigned long long)c.pipelines,
+               (unsigned long long)c.commands, (unsigned long long)c.processes);
+        printf("spawn\tcount=%llu mean_us=%.1f p50_us<=%llu p90_us<=%llu p99_us<=%llu\n", (unsigned long long)spawns,
+               spawns ? (double)c.spawn_ns / 1e3 / (double)spawns : 0.0,
+               (unsigned long long)stat_percentile(&c, spawns, 0.50),
+               (unsigned long long)stat_percentile(&c, spawns, 0.90),
+               (unsigned long long)stat_percentile(&c, spawns, 0.99));
+        printf("spawn_hist");
+        for (int i = 0; i < STAT_SPAWN_BUCKETS; ++i) {
+            if (c.spawn_hist[i] != 0) {
+                printf(" <%lluus=%llu", 1ULL << i, (unsigned long long)c.spawn_hist[i]);
+            }
+        }
+        printf("\njobs\tlive=%llu done=%llu mean_wall_ms=%.2f\n", (unsigned long long)c.jobs_live,
+               (unsigned long long)c.jobs_done, c.jobs_done ? (double)c.job_ns / 1e6 / (double)c.jobs_done : 0.0);
+        printf("bytes\tfeeder=%llu filter=%llu\n", (unsigned long long)c.feeder_bytes, (unsigned long long)c.filter_bytes);
+        if (prev_ns != 0) {
+            // Shells that exited since the last report can make a rate negative: show 0
+            double sec = (double)(now - prev_ns) / 1e9;
+            printf("rate\tlines/s=%.1f pipelines/s=%.1f processes/s=%.1f\n",
+                   c.lines > prev.lines ? (double)(c.lines - prev.lines) / sec : 0.0,
+                   c.pipelines > prev.pipelines ? (double)(c.pipelines - prev.pipelines) / sec : 0.0,
+                   c.processes > prev.processes ? (double)(c.processes - prev.processes) / sec : 0.0);
+        }
+        fflush(stdout);
+        if (interval <= 0) {
+            return 0;
+        }
+        prev = c;
+        prev_ns = now;
+        sleep((unsigned)interval);
+        printf("\n");
+    }
+}
+
+/**
+ * job_print - Print one line of job status, as used by "jobs" and notifications.
+ * @job: The job.
+ * @show_pids: True to list every process id ("jobs -l").
+ */
+void job_print(const Job *job, bool show_pids) {
+    char state[32];
+    char mark = job == job_list ? '+' : (job_list && job == job_list->next ? '-' : ' ');
+    if (job->live > 0) {
+        snprintf(state, sizeof(state), "%s", job_is_stopped(job) ? "Stopped" : "Running");
+    } else {
+        int status = job->procs[job->nprocs - 1].status;
+        if (WIFSIGNALED(status)) {
+            snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+        } else if (WEXITSTATUS(status) != 0) {
+            snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+        } else {
+            snprintf(state, sizeof(state), "Done");
+        }
+    }
+    printf("[%d]%c  ", job->id, mark);
+    if (show_pids) {
+        for (int i = 0; i < job->nprocs; ++i) {
+            printf("%d ", job->procs[i].pid);
+        }
+    }
+    printf("%-24s%s\n", state, job->text ? job->text : "");
+}
+
+/**
+ * job_notify - Report background jobs whose state changed and drop finished ones.
+ * @interactive: True to print notifications (scripts only clean up).
+ */
+void job_notify(bool interactive) {
+    Job *job = job_list;
+    while (job != NULL) {
+        Job *next = job->next;
+        if (!job->foreground && !job->notified) {
+            if (interactive) {
+                job_print(job, false);
+            }
+            job->notified = true;
+        }
+        if (!job->foreground && job->live == 0) {
+            job_finish(job);
+        }
+        job = next;
+    }
+    fflush(stdout);
+}
+
+/**
+ * job_signal - Send a signal to every process of a job.
+ * @job: The job.
+ * @sig: The signal.
+ *
+ * Under job control the whole process group is signalled; otherwise each live process is.
+ */
+void job_signal(const Job *job, int sig) {
+    if (job_control) {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int i = 0; i < job->nprocs; ++i) {
+        if (!job->procs[i].exited) {
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+/**
+ * job_foreground - Give a job the terminal and wait for it to finish or stop.
+ * @job: The job.
+ * @resume: True to send SIGCONT first (for "fg" on a stopped job).
+ * Return: The job's exit code.
+ */
+int job_foreground(Job *job, bool resume) {
+    job->foreground = true;
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (resume) {
+        for (int i = 0; i < job->nprocs; ++i) {
+            job->procs[i].stopped = false;
+        }
+        job_signal(job, SIGCONT);
+    }
+    wait_for_job(job);
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    return job_exit_code(job);
+}
+
+/**
+ * job_from_spec - Resolve a job specification ("%n", "%%", "%+", "%-" or a pid).
+ * @spec: The specification, or NULL for the current job.
+ * @builtin: Name of the calling builtin, used in error messages.
+ * Return: The job, or NULL if there is no such job (an error message is printed).
+ */
+Job *job_from_spec(const char *spec, const char *builtin) {
+    Job *job = NULL;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0) {
+        job = job_list;
+    } else if (strcmp(spec, "%-") == 0) {
+        job = job_list ? job_list->next : NULL;
+    } else if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        for (job = job_list; job != NULL && job->id != id; job = job->next) {
+            continue;
+        }
+    } else {
+        pid_t pid = (pid_t)atoi(spec);
+        for (job = job_list; job != NULL; job = job->next) {
+            bool match = false;
+            for (int i = 0; i < job->nprocs; ++i) {
+                match = match || job->procs[i].pid == pid;
+            }
+            if (match) {
+                break;
+            }
+        }
+    }
+    if (job == NULL) {
+        fprintf(stderr, "%s: %s: no such job\n", builtin, spec ? spec : "current");
+    }
+    return job;
+}
+
+/**
+ * builtin_jobs - Implement "jobs [-l] [-p]": list background and stopped jobs.
+ * @cmd: The parsed builtin command.
+ * Return: 0.
+ */
+int builtin_jobs(Command *cmd) {
+    char **args = cmd->args;
+    bool show_pids = false;
+    bool pids_only = false;
+    for (int i = 1; args[i] != NULL; ++i) {
+        show_pids = show_pids || strcmp(args[i], "-l") == 0;
+        pids_only = pids_only || strcmp(args[i], "-p") == 0;
+    }
+    reap_children();
+    // The table is newest-first; list oldest-first like other shells
+    int count = 0;
+    for (Job *job = job_list; job != NULL; job = job->next) {
+        count++;
+    }
+    for (int n = count; n > 0; --n) {
+        Job *job = job_list;
+        for (int i = 1; i < n; ++i) {
+            job = job->next;
+        }
+        if (job->foreground) {
+            continue;
+        }
+        if (pids_only) {
+            printf("%d\n", job->pgid);
+        } else {
+            job_print(job, show_pids);
+        }
+        job->notified = true;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * builtin_fg - Implement "fg [JOB]": resume a job in the foreground.
+ * @cmd: The parsed builtin command.
+ * Return: The job's exit code, or 1 on error.
+ */
+int builtin_fg(Command *cmd) {
+    char **args = cmd->args;
+    if (!job_control) {
+        fprintf(stderr, "fg: no job control\n");
+        return 1;
+    }
+    Job *job = job_from_spec(args[1], "fg");
+    if (job == NULL) {
+        return 1;
+    }
+    printf("%s\n", job->text ? job->text : "");
+    fflush(stdout);
+    int code = job_foreground(job, true);
+    if (job_is_stopped(job)) {
+        job->foreground = false;
+        printf("\n");
+        job_print(job, false);
+        job->notified = true;
+    } else {
+        job_finish(job);
+    }
+    return code;
+}
+
+/**
+ * builtin_bg - Implement "bg [JOB]": resume a stopped job in the background.
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 on error.
+ */
+int builtin_bg(Command *cmd) {
+    char **args = cmd->args;
+    if (!job_control) {
+        fprintf(stderr, "bg: no job control\n");
+        return 1;
+    }
+    Job *job = job_from_spec(args[1], "bg");
+    if (job == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < job->nprocs; ++i) {
+        job->procs[i].stopped = false;
+    }
+    job->foreground = false;
+    job->notified = true;
+    job_signal(job, SIGCONT);
+    printf("[%d]  %s\n", job->id, job->text ? job->text : "");
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * builtin_wait - Implement "wait [JOB|PID...]": wait for background jobs to finish.
+ * @cmd: The parsed builtin command.
+ * Return: Exit code of the last job waited for (0 when waiting for all jobs).
+ */
+int builtin_wait(Command *cmd) {
+    char **args = cmd->args;
+    if (args[1] == NULL) {
+        for (Job *job = job_list; job != NULL; job = job->next) {
+            if (!job->foreground && !job_is_stopped(job)) {
+                wait_for_job(job);
+            }
+        }
+        return 0;
+    }
+    int code = 0;
+    for (int i = 1; args[i] != NULL; ++i) {
+        Job *job = job_from_spec(args[i], "wait");
+        if (job == NULL) {
+            code = 127;
+            continue;
+        }
+        wait_for_job(job);
+        code = job_exit_code(job);
+    }
+    return code;
+}
+
+// Signal names accepted by "kill -NAME" and listed by "kill -l"
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH},
+};
+
+/**
+ * signal_from_name - Parse a signal given as a number, "TERM" or "SIGTERM".
+ * @name: The signal name or number.
+ * Return: The signal number, or -1 if unknown.
+ */
+int signal_from_name(const char *name) {
+    if (isdigit((unsigned char)*name)) {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); ++i) {
+        if (strcasecmp(signal_names[i].name, name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+/**
+ * builtin_kill - Implement "kill [-s SIG | -SIG] JOB|PID..." and "kill -l".
+ * @cmd: The parsed builtin command.
+ * Return: 0 if every target was signalled, 1 otherwise.
+ *
+ * A job is signalled as a whole: through its process group under job control, or process by
+ * process otherwise.
+ */
+int builtin_kill(Command *cmd) {
+    char **args = cmd->args;
+    int sig = SIGTERM;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-l") == 0) {
+        for (size_t n = 0; n < sizeof(signal_names) / sizeof(signal_names[0]); ++n) {
+            printf("%2d) SIG%s\n", signal_names[n].number, signal_names[n].name);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if (args[i] != NULL && strcmp(args[i], "-s") == 0 && args[i + 1] != NULL) {
+        sig = signal_from_name(args[i + 1]);
+        i += 2;
+    } else if (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0') {
+        sig = signal_from_name(args[i] + 1);
+        i++;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "kill: invalid signal specification\n");
+        return 1;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -sigspec] pid | jobspec ...\n");
+        return 1;
+    }
+    int code = 0;
+    for (; args[i] != NULL; ++i) {
+        if (args[i][0] != '%') {
+            if (kill((pid_t)atoi(args[i]), sig) < 0) {
+                fprintf(stderr, "kill: (%s) - %s\n", args[i], strerror(errno));
+                code = 1;
+            }
+            continue;
+        }
+        Job *job = job_from_spec(args[i], "kill");
+        if (job == NULL) {
+            code = 1;
+            continue;
+        }
+        job_signal(job, sig);
+        if ((sig == SIGTERM || sig == SIGHUP) && job_is_stopped(job)) {
+            // A stopped process only acts on these once it is continued
+            job_signal(job, SIGCONT);
+        }
+    }
+    return code;
+}
+
+/**
+ * job_hangup_all - Send SIGHUP (and SIGCONT) to stopped jobs before the shell exits.
+ */
+void job_hangup_all(void) {
+    for (Job *job = job_list; job != NULL; job = job->next) {
+        if (job_is_stopped(job)) {
+            job_signal(job, SIGHUP);
+            job_signal(job, SIGCONT);
+        }
+    }
+    while (job_list != NULL) {
+        job_remove(job_list);
+    }
+}
+
+/**
+ * reader_open_fd - Initialize a line reader over a file descriptor.
+ * @reader: The reader to initialize.
+ * @fd: The descriptor to read from (owned by the caller).
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int reader_open_fd(LineReader *reader, int fd) {
+    reader->fd = fd;
+    reader->cap = READ_CHUNK;
+    reader->buf = malloc(reader->cap + 1);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    return reader->buf ? 0 : -1;
+}
+
+/**
+ * reader_open_string - Initialize a line reader over a copy of a string ("-c" mode).
+ * @reader: The reader to initialize.
+ * @text: The command text, possibly containing several lines.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int reader_open_string(LineReader *reader, const char *text) {
+    size_t len = strlen(text);
+    reader->fd = -1;
+    reader->cap = len;
+    reader->buf = malloc(len + 1);
+    if (reader->buf == NULL) {
+        return -1;
+    }
+    memcpy(reader->buf, text, len);
+    reader->start = 0;
+    reader->end = len;
+    reader->eof = true;
+    return 0;
+}
+
+/**
+ * wait_for_input - Block until a descriptor is readable, running the event loop meanwhile.
+ * @fd: The input descriptor.
+ * Return: 0 once fd is readable (or at EOF/error), -1 if the event loop fails.
+ *
+ * Background jobs that exit while the shell sits at the prompt are reaped immediately
+ * rather than on the next line, and input feeders keep filling their pipes.
+ */
+int wait_for_input(int fd) {
+    short ready = 0;
+    int id = event_watch(fd, POLLIN, event_flag, &ready);
+    if (id < 0) {
+        // Regular files and /dev/null are always readable (epoll refuses them)
+        return errno == EPERM ? 0 : -1;
+    }
+    int err = 0;
+    while (ready == 0 && (err = event_run_once()) == 0) {
+        continue;
+    }
+    event_unwatch(id);
+    return err;
+}
+
+/**
+ * reader_next_line - Return the next input line without its newline.
+ * @reader: The reader.
+ * Return: Pointer to the NUL-terminated line inside the reader's buffer (valid until the
+ *         next call), or NULL at end of input.
+ *
+ * Input is pulled in READ_CHUNK blocks and split with memchr, so a large script costs one
+ * read() per 64KB rather than one stdio refill and copy per line.
+ */
+char *reader_next_line(LineReader *reader) {
+    size_t scanned = reader->start;
+    while (1) {
+        char *nl = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (nl != NULL) {
+            char *line = reader->buf + reader->start;
+            *nl = '\0';
+            reader->start = (size_t)(nl - reader->buf) + 1;
+            return line;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a trailing newline
+            char *line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+        // Move the partial line to the front, growing the buffer if it is full
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->cap - reader->end < READ_CHUNK / 2) {
+            char *grown = realloc(reader->buf, reader->cap * 2 + 1);
+            if (grown == NULL) {
+                perror("shell: realloc");
+                reader->eof = true;
+                continue;
+            }
+            reader->buf = grown;
+            reader->cap *= 2;
+        }
+        scanned = reader->end;
+        if (wait_for_input(reader->fd) < 0) {
+            reader->eof = true;
+            continue;
+        }
+        ssize_t nread = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            reader->eof = true;
+            continue;
+        }
+        reader->end += (size_t)nread;
+    }
+}
+
+/**
+ * history_open - Open the history file and its index on first use.
+ * Return: 0 if history is available, -1 otherwise.
+ *
+ * The file is $HISTFILE, or ~/.shell_history if HISTFILE is unset; an empty HISTFILE turns
+ * history off. The index lives next to it as FILE.idx. Nothing is read here: main() never
+ * calls this, so a large history costs nothing at startup.
+ */
+int history_open(void) {
+    if (history_fd >= 0) {
+        return 0;
+    }
+    if (history_failed) {
+        return -1;
+    }
+    history_failed = true;
+    const char *file = var_get("HISTFILE", 8);
+    const char *home = var_get("HOME", 4);
+    if (file == NULL && home != NULL && *home != '\0') {
+        if (asprintf(&history_file, "%s/.shell_history", home) < 0) {
+            history_file = NULL;
+        }
+    } else if (file != NULL && *file != '\0') {
+        history_file = strdup(file);
+    }
+    if (history_file == NULL) {
+        return -1;
+    }
+    char *index_file;
+    if (asprintf(&index_file, "%s.idx", history_file) < 0) {
+        return -1;
+    }
+    history_fd = open(history_file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history_fd >= 0) {
+        history_index_fd = open(index_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if (history_fd < 0 || history_index_fd < 0) {
+        fprintf(stderr, "shell: %s: %s\n", history_fd < 0 ? history_file : index_file, strerror(errno));
+        if (history_fd >= 0) {
+            close(history_fd);
+            history_fd = -1;
+        }
+        free(index_file);
+        return -1;
+    }
+    free(index_file);
+    history_failed = false;
+    return 0;
+}
+
+/**
+ * history_index_reserve - Make sure the index mapping has room for @count offsets.
+ * @count: Number of entries the index must be able to hold.
+ * Return: 0 on success, -1 on error (an error message is printed).
+ *
+ * The index file grows by doubling and is mapped shared, so offsets written into it are
+ * what every other shell using the same history sees.
+ */
+int history_index_reserve(size_t count) {
+    if (history_index != NULL && count <= history_index_cap) {
+        return 0;
+    }
+    size_t cap = history_index_cap ? history_index_cap : HISTORY_INDEX_MIN;
+    while (cap < count) {
+        cap *= 2;
+    }
+    size_t bytes = sizeof(HistoryIndex) + cap * sizeof(uint32_t);
+    struct stat st;
+    if (fstat(history_index_fd, &st) != 0) {
+        perror("shell: history index");
+        return -1;
+    }
+    if ((size_t)st.st_size > bytes) {
+        // Grown by another shell: map all of it
+        cap = ((size_t)st.st_size - sizeof(HistoryIndex)) / sizeof(uint32_t);
+        bytes = sizeof(HistoryIndex) + cap * sizeof(uint32_t);
+    } else if ((size_t)st.st_size < bytes && ftruncate(history_index_fd, (off_t)bytes) != 0) {
+        perror("shell: history index");
+        return -1;
+    }
+    void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, history_index_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("shell: mmap");
+        return -1;
+    }
+    if (history_index != NULL) {
+        munmap(history_index, sizeof(HistoryIndex) + history_index_cap * sizeof(uint32_t));
+    }
+    history_index = map;
+    history_index_cap = cap;
+    return 0;
+}
+
+/**
+ * history_sync - Bring the history mapping and its index up to date with the file.
+ * Return: 0 on success, -1 if history is unavailable.
+ *
+ * Costs one fstat() when nothing changed. When the file grew (this shell or another one
+ * appended), it is mapped again and only the new bytes are scanned for entries. An index
+ * that does not match the file (new, truncated or replaced history) is rebuilt from scratch.
+ */
+int history_sync(void) {
+    if (history_open() != 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(history_fd, &st) != 0) {
+        perror("shell: history");
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "shell: %s: history file larger than 4 GiB\n", history_file);
+        return -1;
+    }
+    if (size != history_map_len) {
+        if (history_map != NULL) {
+            munmap((void *)history_map, history_map_len);
+            history_map = NULL;
+            history_map_len = 0;
+        }
+        if (size > 0) {
+            void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, history_fd, 0);
+            if (map == MAP_FAILED) {
+                perror("shell: mmap");
+                return -1;
+            }
+            history_map = map;
+            history_map_len = size;
+        }
+    }
+    if (history_index_reserve(0) != 0) {
+        return -1;
+    }
+    HistoryIndex *index = history_index;
+    if (index->magic != HISTORY_MAGIC || index->covered > size || index->count > history_index_cap ||
+        (index->count > 0 && index->offsets[index->count - 1] >= index->covered) ||
+        (index->covered > 0 && history_map[index->covered - 1] != '\n')) {
+        index->magic = HISTORY_MAGIC;
+        index->count = 0;
+        index->covered = 0;
+    }
+    size_t at = index->covered;
+    uint32_t first = index->count;
+    uint32_t count = first;
+    while (at < size) {
+        const char *nl = memchr(history_map + at, '\n', size - at);
+        if (nl == NULL) {
+            break;  // Last line still being written
+        }
+        if (count == history_index_cap) {
+            index->count = count;
+            index->covered = at;
+            if (history_index_reserve((size_t)count + 1) != 0) {
+                return -1;
+            }
+            index = history_index;
+        }
+        index->offsets[count++] = (uint32_t)at;
+        at = (size_t)(nl - history_map) + 1;
+    }
+    history_indexed += count - first;
+    index->count = count;
+    index->covered = at;
+    return 0;
+}
+
+/**
+ * history_entry - Get one history entry.
+ * @i: Entry number (0 is the oldest); must be below history_index->count.
+ * @len: Output parameter for the entry length (without its newline).
+ * Return: The entry text in the history mapping (not NUL-terminated).
+ */
+const char *history_entry(uint32_t i, size_t *len) {
+    size_t start = history_index->offsets[i];
+    size_t end = i + 1 < history_index->count ? history_index->offsets[i + 1] : history_index->covered;
+    *len = end - start - 1;
+    return history_map + start;
+}
+
+/**
+ * history_add - Append a line typed at the prompt to the history file.
+ * @line: The line (without newline).
+ *
+ * Blank lines and a repeat of the previous line are not recorded. The entry is one
+ * O_APPEND write, so shells sharing the file never interleave inside an entry. Only the
+ * file is written; the index picks the entry up the next time history is searched.
+ */
+void history_add(const char *line) {
+    size_t len = strlen(line);
+    if (strspn(line, " \t") == len || (history_last != NULL && strcmp(history_last, line) == 0) ||
+        history_open() != 0) {
+        return;
+    }
+    struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+    if (writev(history_fd, iov, 2) < 0) {
+        perror("shell: history");
+        return;
+    }
+    free(history_last);
+    history_last = strdup(line);
+}
+
+/**
+ * history_search - Find the newest history entry at or before @from containing a string.
+ * @needle: The text searched for.
+ * @len: Length of needle.
+ * @from: Entry to start at, going back in time.
+ * @skip: Entries equal to this text are passed over (NULL for none).
+ * @at: Output parameter for the offset of the match in the entry.
+ * Return: The entry number, or -1 if no entry matches.
+ */
+long history_search(const char *needle, size_t len, long from, const char *skip, size_t *at) {
+    size_t skip_len = skip != NULL ? strlen(skip) : 0;
+    for (long i = from; i >= 0; --i) {
+        size_t n;
+        const char *entry = history_entry((uint32_t)i, &n);
+        const char *hit = memmem(entry, n, needle, len);
+        if (hit != NULL && !(skip != NULL && n == skip_len && memcmp(entry, skip, n) == 0)) {
+            *at = (size_t)(hit - entry);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * history_close - Unmap and close the history at exit.
+ */
+void history_close(void) {
+    if (history_map != NULL) {
+        munmap((void *)history_map, history_map_len);
+    }
+    if (history_index != NULL) {
+        munmap(history_index, sizeof(HistoryIndex) + history_index_cap * sizeof(uint32_t));
+    }
+    if (history_fd >= 0) {
+        close(history_fd);
+        close(history_index_fd);
+    }
+    free(history_file);
+    free(history_last);
+}
+
+/**
+ * builtin_history - "history [N]": list the last N history entries (all by default).
+ * @cmd: The command.
+ * Return: 0 on success, 1 if history is unavailable, 2 on a usage error.
+ */
+int builtin_history(Command *cmd) {
+    long n = -1;
+    if (cmd->args[1] != NULL) {
+        char *end;
+        n = strtol(cmd->args[1], &end, 10);
+        if (*end != '\0' || end == cmd->args[1] || n < 0 || cmd->args[2] != NULL) {
+            fprintf(stderr, "history: usage: history [N]\n");
+            return 2;
+        }
+    }
+    if (history_sync() != 0) {
+        return 1;
+    }
+    long count = history_index->count;
+    for (long i = n >= 0 && n < count ? count - n : 0; i < count; ++i) {
+        size_t len;
+        const char *entry = history_entry((uint32_t)i, &len);
+        printf("%5ld  %.*s\n", i + 1, (int)len, entry);
+    }
+    return 0;
+}
+
+/**
+ * editor_byte - Read one more byte of an escape sequence.
+ * Return: The byte, or -1 if none follows within a few milliseconds (a lone ESC).
+ */
+int editor_byte(void) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    unsigned char c;
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &c, 1) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+/**
+ * editor_key - Read one key press from the terminal.
+ * Return: The byte typed, a KEY_* code for a recognised escape sequence, KEY_NONE for an
+ *         unknown one, or -1 at end of input.
+ */
+int editor_key(void) {
+    unsigned char c;
+    ssize_t n;
+    if (wait_for_input(STDIN_FILENO) < 0) {
+        return -1;
+    }
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    if (c != '\x1b') {
+        return c;
+    }
+    int first = editor_byte();
+    if (first == 'b' || first == 'f') {
+        return first == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;  // Alt-b / Alt-f
+    }
+    if (first != '[' && first != 'O') {
+        return first < 0 ? KEY_ESCAPE : KEY_NONE;
+    }
+    int second = editor_byte();
+    switch (second) {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    }
+    if (first == '[' && second >= '0' && second <= '9') {
+        // ESC [ N ~ (and the ESC [ 1 ; 5 C style with modifiers, which is ignored)
+        int last = editor_byte();
+        while (last >= 0 && last != '~' && !isalpha(last)) {
+            last = editor_byte();
+        }
+        if (last == '~') {
+            switch (second) {
+            case '1':
+            case '7':
+                return KEY_HOME;
+            case '4':
+            case '8':
+                return KEY_END;
+            case '3':
+                return KEY_DELETE;
+            }
+        }
+    }
+    return KEY_NONE;
+}
+
+/**
+ * text_columns - Count the terminal columns a piece of UTF-8 text takes (one per character).
+ * @s: The text.
+ * @n: Length in bytes.
+ * Return: Number of characters (bytes that are not UTF-8 continuation bytes).
+ */
+size_t text_columns(const char *s, size_t n) {
+    size_t cols = 0;
+    for (size_t i = 0; i < n; ++i) {
+        cols += ((unsigned char)s[i] & 0xC0) != 0x80;
+    }
+    return cols;
+}
+
+/**
+ * editor_step - Move a byte offset of the edited line by one character.
+ * @ed: The editor.
+ * @pos: Starting offset.
+ * @dir: -1 to go left, 1 to go right.
+ * Return: The new offset (clamped to the line).
+ */
+size_t editor_step(const LineEditor *ed, size_t pos, int dir) {
+    if (dir < 0) {
+        while (pos > 0 && ((unsigned char)ed->buf[--pos] & 0xC0) == 0x80) {
+        }
+    } else {
+        while (pos < ed->len && ((unsigned char)ed->buf[++pos] & 0xC0) == 0x80) {
+        }
+    }
+    return pos;
+}
+
+/**
+ * editor_refresh - Redraw the prompt and the edited line, and place the cursor.
+ * @ed: The editor.
+ * @prompt: Prompt to show in front of the line.
+ *
+ * A line wider than the terminal scrolls horizontally so that the cursor stays visible.
+ * The whole line is drawn with one write().
+ */
+void editor_refresh(LineEditor *ed, const char *prompt) {
+    struct winsize ws;
+    size_t cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t prompt_len = strlen(prompt);
+    size_t prompt_cols = text_columns(prompt, prompt_len);
+    size_t avail = cols > prompt_cols + 1 ? cols - prompt_cols - 1 : 1;
+    size_t start = 0;
+    size_t cursor = text_columns(ed->buf, ed->pos);
+    while (cursor >= avail) {
+        start = editor_step(ed, start, 1);
+        cursor--;
+    }
+    size_t end = start;
+    for (size_t shown = 0; end < ed->len && shown < avail; ++shown) {
+        end = editor_step(ed, end, 1);
+    }
+    size_t need = prompt_len + (end - start) + 32;
+    if (need > ed->out_cap) {
+        char *grown = realloc(ed->out, need);
+        if (grown == NULL) {
+            return;
+        }
+        ed->out = grown;
+        ed->out_cap = need;
+    }
+    char *p = ed->out;
+    *p++ = '\r';
+    p = mempcpy(p, prompt, prompt_len);
+    p = mempcpy(p, ed->buf + start, end - start);
+    p = stpcpy(p, "\x1b[K\r");
+    if (prompt_cols + cursor > 0) {
+        p += sprintf(p, "\x1b[%zuC", prompt_cols + cursor);
+    }
+    write_all(STDOUT_FILENO, ed->out, (size_t)(p - ed->out));
+}
+
+/**
+ * editor_set - Replace the edited line and put the cursor at its end.
+ * @ed: The editor.
+ * @text: New contents (need not be NUL-terminated).
+ * @len: Length of text.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int editor_set(LineEditor *ed, const char *text, size_t len) {
+    if (len + 1 > ed->cap) {
+        char *grown = realloc(ed->buf, len + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        ed->buf = grown;
+        ed->cap = len + 1;
+    }
+    memmove(ed->buf, text, len);
+    ed->buf[len] = '\0';
+    ed->len = len;
+    ed->pos = len;
+    return 0;
+}
+
+/**
+ * editor_insert - Insert bytes at the cursor.
+ * @ed: The editor.
+ * @text: Bytes to insert.
+ * @len: Number of bytes.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int editor_insert(LineEditor *ed, const char *text, size_t len) {
+    if (ed->len + len + 1 > ed->cap) {
+        size_t cap = ed->cap ? ed->cap * 2 : 128;
+        while (cap < ed->len + len + 1) {
+            cap *= 2;
+        }
+        char *grown = realloc(ed->buf, cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        ed->buf = grown;
+        ed->cap = cap;
+    }
+    memmove(ed->buf + ed->pos + len, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    memcpy(ed->buf + ed->pos, text, len);
+    ed->len += len;
+    ed->pos += len;
+    return 0;
+}
+
+/**
+ * editor_delete - Delete the bytes between two offsets of the edited line.
+ * @ed: The editor.
+ * @from: First byte to delete.
+ * @to: One past the last byte to delete.
+ */
+void editor_delete(LineEditor *ed, size_t from, size_t to) {
+    memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+    ed->len -= to - from;
+    ed->pos = from;
+}
+
+/**
+ * editor_history - Show the previous or next history entry (Up / Down).
+ * @ed: The editor.
+ * @dir: -1 for an older entry, 1 for a newer one.
+ *
+ * The line being typed is kept aside while browsing and comes back below the newest entry.
+ */
+void editor_history(LineEditor *ed, int dir) {
+    if (history_sync() != 0 || history_index->count == 0) {
+        return;
+    }
+    long count = history_index->count;
+    if (ed->hist_pos < 0) {
+        if (dir > 0) {
+            return;
+        }
+        free(ed->saved);
+        ed->saved = strdup(ed->buf);
+        ed->hist_pos = count - 1;
+    } else if (dir < 0) {
+        if (ed->hist_pos == 0) {
+            return;
+        }
+        ed->hist_pos--;
+    } else if (ed->hist_pos + 1 >= count) {
+        ed->hist_pos = -1;
+        editor_set(ed, ed->saved != NULL ? ed->saved : "", ed->saved != NULL ? strlen(ed->saved) : 0);
+        return;
+    } else {
+        ed->hist_pos++;
+    }
+    size_t len;
+    const char *entry = history_entry((uint32_t)ed->hist_pos, &len);
+    editor_set(ed, entry, len);
+}
+
+/**
+ * editor_search - Ctrl-R incremental reverse search through the history.
+ * @ed: The editor; its line shows the current match.
+ * Return: KEY_NONE if the search was cancelled or simply ended, otherwise the key that
+ *         ended it (Enter, an edit or movement key), which the caller then processes on
+ *         the matched line.
+ *
+ * Every key typed extends the query and searches again from the current match; Ctrl-R
+ * goes on to older matches and Ctrl-G / Ctrl-C / ESC bring back the original line. The
+ * search walks entries through the offset index, so even a million-entry history is
+ * scanned in milliseconds without being loaded.
+ */
+int editor_search(LineEditor *ed) {
+    if (history_sync() != 0) {
+        return KEY_NONE;
+    }
+    char *original = strdup(ed->buf);
+    size_t original_pos = ed->pos;
+    char query[EDITOR_SEARCH_MAX];
+    size_t qlen = 0;
+    long match = (long)history_index->count - 1;
+    bool failed = false;
+    int key;
+    while (1) {
+        char prompt[EDITOR_SEARCH_MAX + 32];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", failed ? "failed " : "", (int)qlen, query);
+        editor_refresh(ed, prompt);
+        key = editor_key();
+        long from;
+        const char *skip = NULL;
+        if (key == CTRL_KEY('r')) {
+            from = match;
+            skip = ed->buf;  // Next older match with a different text
+        } else if (key == 127 || key == CTRL_KEY('h')) {
+            if (qlen > 0) {
+                qlen--;
+            }
+            from = (long)history_index->count - 1;
+        } else if (key >= 32 && key < 127) {
+            if (qlen + 1 < sizeof(query)) {
+                query[qlen++] = (char)key;
+            }
+            from = match;
+        } else {
+            break;
+        }
+        size_t at;
+        long found = qlen > 0 ? history_search(query, qlen, from, skip, &at) : -1;
+        failed = qlen > 0 && found < 0;
+        if (found >= 0) {
+            match = found;
+            size_t len;
+            const char *entry = history_entry((uint32_t)found, &len);
+            editor_set(ed, entry, len);
+            ed->pos = at;
+            ed->hist_pos = found;
+        }
+    }
+    if (key == CTRL_KEY('g') || key == CTRL_KEY('c') || key == KEY_ESCAPE || key < 0) {
+        if (original != NULL) {
+            editor_set(ed, original, strlen(original));
+            ed->pos = original_pos;
+        }
+        key = KEY_NONE;
+    }
+    free(original);
+    return key;
+}
+
+// Defined below: completion searches the builtin table
+bool editor_complete(LineEditor *ed, bool list_all);
+
+/**
+ * editor_read_line - Read a line from the terminal with editing and history.
+ * @prompt: The prompt.
+ * Return: The line (valid until the next call), or NULL at end of input (Ctrl-D on an
+ *         empty line). If the terminal cannot be put in raw mode, editing is turned off
+ *         (editor_enabled) and NULL is returned so the caller reads the line itself.
+ *
+ * The terminal is in raw mode only while the line is typed; the shell's saved modes are
+ * put back before returning, so commands always start on a sane terminal. Keys: arrows,
+ * Home/End, Ctrl-A/E/B/F, Alt-B/F, Backspace/Delete, Ctrl-K/U/W, Ctrl-L, Up/Down and
+ * Ctrl-P/N for history, Ctrl-R for reverse search, Tab to complete (twice to list the
+ * candidates), Ctrl-C to drop the line.
+ */
+char *editor_read_line(const char *prompt) {
+    LineEditor *ed = &line_editor;
+    struct termios raw = shell_tmodes;
+    raw.c_iflag &= ~(tcflag_t)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    fflush(stdout);
+    if (editor_set(ed, "", 0) != 0 || tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) != 0) {
+        editor_enabled = false;
+        return NULL;
+    }
+    ed->hist_pos = -1;
+    editor_cancelled = false;
+    char *line = ed->buf;
+    int key = KEY_NONE;
+    bool tab_again = false;      // The previous key was a Tab that inserted nothing
+    while (1) {
+        if (key == KEY_NONE) {
+            editor_refresh(ed, prompt);
+            key = editor_key();
+        }
+        int pressed = key;
+        bool after_tab = tab_again;
+        key = KEY_NONE;
+        tab_again = false;
+        if (pressed == CTRL_KEY('r')) {
+            key = editor_search(ed);
+            continue;
+        }
+        if (pressed < 0 || (pressed == CTRL_KEY('d') && ed->len == 0)) {
+            line = NULL;
+            break;
+        }
+        if (pressed == '\r' || pressed == '\n') {
+            ed->pos = ed->len;
+            editor_refresh(ed, prompt);
+            write_all(STDOUT_FILENO, "\n", 1);
+            line = ed->buf;
+            break;
+        }
+        if (pressed == CTRL_KEY('c')) {
+            write_all(STDOUT_FILENO, "^C\n", 3);
+            editor_set(ed, "", 0);
+            editor_cancelled = true;
+            line = ed->buf;
+            break;
+        }
+        switch (pressed) {
+        case 127:
+        case CTRL_KEY('h'):
+            if (ed->pos > 0) {
+                editor_delete(ed, editor_step(ed, ed->pos, -1), ed->pos);
+            }
+            break;
+        case KEY_DELETE:
+        case CTRL_KEY('d'):
+            if (ed->pos < ed->len) {
+                editor_delete(ed, ed->pos, editor_step(ed, ed->pos, 1));
+            }
+            break;
+        case KEY_LEFT:
+        case CTRL_KEY('b'):
+            ed->pos = editor_step(ed, ed->pos, -1);
+            break;
+        case KEY_RIGHT:
+        case CTRL_KEY('f'):
+            ed->pos = editor_step(ed, ed->pos, 1);
+            break;
+        case KEY_HOME:
+        case CTRL_KEY('a'):
+            ed->pos = 0;
+            break;
+        case KEY_END:
+        case CTRL_KEY('e'):
+            ed->pos = ed->len;
+            break;
+        case KEY_WORD_LEFT:
+            while (ed->pos > 0 && ed->buf[ed->pos - 1] == ' ') {
+                ed->pos--;
+            }
+            while (ed->pos > 0 && ed->buf[ed->pos - 1] != ' ') {
+                ed->pos--;
+            }
+            break;
+        case KEY_WORD_RIGHT:
+            while (ed->pos < ed->len && ed->buf[ed->pos] == ' ') {
+                ed->pos++;
+            }
+            while (ed->pos < ed->len && ed->buf[ed->pos] != ' ') {
+                ed->pos++;
+            }
+            break;
+        case KEY_UP:
+        case CTRL_KEY('p'):
+            editor_history(ed, -1);
+            break;
+        case KEY_DOWN:
+        case CTRL_KEY('n'):
+            editor_history(ed, 1);
+            break;
+        case CTRL_KEY('k'):
+            ed->buf[ed->pos] = '\0';
+            ed->len = ed->pos;
+            break;
+        case CTRL_KEY('u'):
+            editor_delete(ed, 0, ed->pos);
+            break;
+        case CTRL_KEY('w'): {
+            size_t from = ed->pos;
+            while (from > 0 && ed->buf[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && ed->buf[from - 1] != ' ') {
+                from--;
+            }
+            editor_delete(ed, from, ed->pos);
+            break;
+        }
+        case CTRL_KEY('l'):
+            write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            break;
+        case '\t':
+            tab_again = !editor_complete(ed, after_tab);
+            break;
+        default:
+            if (pressed >= 32 && pressed < 256 && pressed != 127) {
+                char c = (char)pressed;
+                editor_insert(ed, &c, 1);
+            }
+            break;
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    return line;
+}
+
+/**
+ * open_redirections - Open the redirection files of a command in the parent process.
+ * @cmd: The Command structure containing redirection info.
+ * @in_fd: Output parameter for the input file descriptor (-1 if none).
+ * @out_fd: Output parameter for the output file descriptor (-1 if none).
+ * Return: 0 on success, -1 if a file cannot be opened (and an error message is printed).
+ *
+ * The descriptors are opened close-on-exec; the spawn file actions dup2 them onto
+ * stdin/stdout in the child, which clears the flag on the duplicate only.
+ */
+int open_redirections(const Command *cmd, int *in_fd, int *out_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
+    if (cmd->here_string) {
+        if ((*in_fd = here_string_fd(cmd->here_string)) < 0) {
+            return -1;
+        }
+    } else if (cmd->input_file) {
+        *in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
+            fprintf(stderr, "%s : File not found\n", cmd->input_file);
+            return -1;
+        }
+    }
+    if (cmd->output_file) {
+        *out_fd = open(cmd->output_file, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644);
+        if (*out_fd < 0) {
+            fprintf(stderr, "%s: Cannot create file\n", cmd->output_file);
+            if (*in_fd != -1) {
+                close(*in_fd);
+                *in_fd = -1;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * child_plan_close - Close the parent's copies of the descriptors opened for a child.
+ * @plan: From child_plan().
+ */
+void child_plan_close(const ChildPlan *plan) {
+    for (int i = 0; i < plan->nactions; ++i) {
+        if (plan->actions[i].opened) {
+            close(plan->actions[i].from);
+        }
+    }
+}
+
+/**
+ * child_plan - Open a command's redirections in the parent and plan the child's descriptor moves.
+ * @cmd: The command to launch.
+ * @plan: Receives the moves, in the order the child makes them ("<" and ">" first, then the
+ *        redirection list), with the descriptors opened for it; release with child_plan_close().
+ * Return: 0 on success, -1 if a file cannot be opened or a duplicated descriptor is not open
+ *         (an error message is printed and nothing is left open).
+ *
+ * Files and here-strings are opened close-on-exec here, so all the child has left to do is
+ * dup2() and close(). Both engines share the plan: posix_spawn as file actions, the fork path
+ * with raw system calls (child_apply), so every message that needs formatting is printed by
+ * the parent. A duplicated source may be a descriptor an earlier move creates ("3>log >&3").
+ */
+int child_plan(const Command *cmd, ChildPlan *plan) {
+    plan->nactions = 0;
+    plan->actions = arena_alloc(&expand_arena, sizeof(ChildAction) * (size_t)(cmd->nredirs + 2));
+    if (plan->actions == NULL) {
+        perror("shell: malloc");
+        return -1;
+    }
+    int redir_in, redir_out;
+    if (open_redirections(cmd, &redir_in, &redir_out) != 0) {
+        return -1;
+    }
+    if (redir_in != -1) {
+        plan->actions[plan->nactions++] = (ChildAction){redir_in, STDIN_FILENO, true};
+    }
+    if (redir_out != -1) {
+        plan->actions[plan->nactions++] = (ChildAction){redir_out, STDOUT_FILENO, true};
+    }
+    for (int i = 0; i < cmd->nredirs; ++i) {
+        const Redirect *redir = &cmd->redirs[i];
+        int source = redir->kind == REDIR_DUP ? redirect_source(redir) : -2;
+        ChildAction action = {-1, redir->fd, false};
+        if (redir->kind == REDIR_DUP && source == -1) {
+            child_plan_close(plan);
+            return -1;
+        }
+        if (redir->kind == REDIR_DUP && source >= 0) {
+            int made = -1;
+            for (int j = plan->nactions - 1; j >= 0 && made == -1; --j) {
+                made = plan->actions[j].to == source ? (plan->actions[j].from >= 0 ? 1 : 0) : -1;
+            }
+            if (made == 0 || (made == -1 && fcntl(source, F_GETFD) < 0)) {
+                fprintf(stderr, "shell: %d: %s\n", source, strerror(made == 0 ? EBADF : errno));
+                child_plan_close(plan);
+                return -1;
+            }
+            action.from = source;
+        } else if (redir->kind != REDIR_DUP && redir->kind != REDIR_CLOSE) {
+            if ((action.from = redirect_open(redir)) < 0) {
+                child_plan_close(plan);
+                return -1;
+            }
+            action.opened = true;
+        }
+        plan->actions[plan->nactions++] = action;
+    }
+    // An opened file must not sit where an earlier move lands ("6>a 5>b" with a at 5)
+    int above = 0;
+    for (int i = 0; i < plan->nactions; ++i) {
+        above = plan->actions[i].to >= above ? plan->actions[i].to + 1 : above;
+    }
+    for (int i = 1; i < plan->nactions; ++i) {
+        ChildAction *action = &plan->actions[i];
+        for (int j = 0; j < i && action->opened; ++j) {
+            if (plan->actions[j].to == action->from) {
+                int moved = fcntl(action->from, F_DUPFD_CLOEXEC, above);
+                if (moved < 0) {
+                    perror("shell: fcntl");
+                    child_plan_close(plan);
+                    return -1;
+                }
+                close(action->from);
+                action->from = moved;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * child_append - Append a string to a message being built without stdio.
+ * @buf: The message buffer.
+ * @len: In/out: bytes used.
+ * @cap: Size of buf.
+ * @text: Text to append (NULL appends nothing); truncated if it does not fit.
+ */
+void child_append(char *buf, size_t *len, size_t cap, const char *text) {
+    for (; text != NULL && *text != '\0' && *len < cap; ++text) {
+        buf[(*len)++] = *text;
+    }
+}
+
+/**
+ * child_error - Report a failure in a forked child without stdio, malloc or locks.
+ * @prefix: Start of the message, e.g. "shell: " or the command name.
+ * @detail: Text that follows it (NULL for none).
+ * @fd: A descriptor number to add after that (-1 for none).
+ * @err: errno value whose description ends the message, after ": " (0 for none).
+ *
+ * The pieces are copied into a stack buffer and written with one write(2); the errno text
+ * comes from strerrordesc_np(), a table lookup, unlike the locale-dependent strerror().
+ * That keeps the child path async-signal-safe, as it has to be after fork() in a process
+ * that may hold stdio or allocator locks, and under vfork().
+ */
+void child_error(const char *prefix, const char *detail, int fd, int err) {
+    char buf[512];
+    size_t len = 0;
+    child_append(buf, &len, sizeof(buf) - 1, prefix);
+    child_append(buf, &len, sizeof(buf) - 1, detail);
+    if (fd >= 0) {
+        char digits[12];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + fd % 10);
+            fd /= 10;
+        } while (fd > 0);
+        while (n > 0 && len < sizeof(buf) - 1) {
+            buf[len++] = digits[--n];
+        }
+    }
+    if (err != 0) {
+        const char *text = strerrordesc_np(err);
+        child_append(buf, &len, sizeof(buf) - 1, ": ");
+        child_append(buf, &len, sizeof(buf) - 1, text != NULL ? text : "Unknown error");
+    }
+    buf[len++] = '\n';
+    ssize_t written = write(STDERR_FILENO, buf, len);
+    (void)written;
+}
+
+/**
+ * child_apply - Make the planned descriptor moves in a forked child.
+ * @plan: From child_plan() in the parent.
+ * Return: 0 on success, -1 if a move failed (reported with child_error()).
+ *
+ * A descriptor opened exactly where it belongs only has its close-on-exec flag cleared.
+ * The parent's copies are closed by exec, being close-on-exec.
+ */
+int child_apply(const ChildPlan *plan) {
+    for (int i = 0; i < plan->nactions; ++i) {
+        const ChildAction *action = &plan->actions[i];
+        int status;
+        if (action->from < 0) {
+            close(action->to);
+            status = 0;
+        } else if (action->from == action->to) {
+            status = fcntl(action->to, F_SETFD, 0);
+        } else {
+            status = dup2(action->from, action->to);
+        }
+        if (status < 0) {
+            child_error("shell: ", NULL, action->to, errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Defined below: a stage placed by set -o pinstages is bound to its CPU before exec
+int pin_affinity(int cpu);
+
+/**
+ * spawn_posix - Launch a pipeline segment with posix_spawn.
+ * @cmd: The command to launch.
+ * @path: The resolved executable path (from lookup_command).
+ * @job: The job the process belongs to (gives its process group).
+ * @in_fd: Pipe read end to use as stdin (-1 to inherit).
+ * @out_fd: Pipe write end to use as stdout (-1 to inherit).
+ * Return: The child's pid, or -1 if it could not be started (an error message is printed).
+ *
+ * The pipe wiring and redirections that the fork path performs in the child are expressed
+ * as posix_spawn file actions. glibc implements posix_spawn with clone(CLONE_VM|CLONE_VFORK),
+ * so the shell's page tables are never copied and exec failures are reported synchronously.
+ * Signal dispositions the shell ignores for job control are reset in the child. The child's
+ * environment is the cached block of exported variables (command_envp), not rebuilt here.
+ */
+pid_t spawn_posix(const Command *cmd, const char *path, const Job *job, int in_fd, int out_fd) {
+    ChildPlan plan;
+    if (child_plan(cmd, &plan) != 0) {
+        spawn_failure = 1;
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < plan.nactions; ++i) {
+        if (plan.actions[i].from < 0) {
+            posix_spawn_file_actions_addclose(&actions, plan.actions[i].to);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, plan.actions[i].from, plan.actions[i].to);
+        }
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGTTIN);
+    sigaddset(&mask, SIGTTOU);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (job_control) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, job->pgid);
+#ifdef POSIX_SPAWN_TCSETPGROUP
+        if (job->foreground) {
+            // Hand over the terminal in the child, before exec, so it can never hit SIGTTIN
+            flags |= POSIX_SPAWN_TCSETPGROUP;
+            posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+        }
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    char **envp = command_envp(cmd);
+    cpu_set_t shell_cpus;  // The shell's affinity as it is now, even if changed by taskset -p
+    bool pinned = false;
+    if (pin_child_cpu >= 0) {
+        if (sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) != 0 || pin_affinity(pin_child_cpu) != 0) {
+            // The stage still runs, unpinned, and is not counted as placed
+            fprintf(stderr, "shell: pinstages: cpu %d: %s\n", pin_child_cpu, strerror(errno));
+            pin_child_cpu = -1;
+        } else {
+            pinned = true;
+        }
+    }
+    int err = posix_spawn(&pid, path, &actions, &attr, cmd->args, envp);
+    if (err == ENOENT && path != cmd->args[0]) {
+        // The cached binary disappeared: drop the entry and walk PATH again
+        path_cache_remove(cmd->args[0]);
+        path = lookup_command(cmd->args[0]);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, cmd->args, envp) : ENOENT;
+    }
+    if (pinned) {
+        sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    child_plan_close(&plan);
+    if (err != 0) {
+        if (err == ENOENT) {
+            fprintf(stderr, "%s: Command not found\n", cmd->args[0]);
+        } else {
+            fprintf(stderr, "%s: %s\n", cmd->args[0], strerror(err));
+        }
+        spawn_failure = err == ENOENT ? 127 : 126;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * parse_rlimit - Parse a resource limit value.
+ * @text: "unlimited", or a number of units; with a unit of 1 byte, K/M/G/T suffixes are accepted.
+ * @unit: Bytes (or seconds, or items) per unit.
+ * @value: Receives the limit.
+ * Return: 0 on success, -1 if the text is not a valid limit.
+ */
+int parse_rlimit(const char *text, rlim_t unit, rlim_t *value) {
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || !isdigit((unsigned char)*text)) {
+        return -1;
+    }
+    const char *suffixes = "KMGT";
+    const char *suffix = unit == 1 && *end != '\0' ? strchr(suffixes, toupper((unsigned char)*end)) : NULL;
+    for (const char *p = suffixes; suffix != NULL && p <= suffix; ++p) {
+        if (number > ULLONG_MAX / 1024) {
+            return -1;
+        }
+        number *= 1024;
+    }
+    if (suffix != NULL) {
+        end++;
+    }
+    if (*end != '\0' || number > (unsigned long long)(RLIM_INFINITY - 1) / unit) {
+        return -1;
+    }
+    *value = (rlim_t)(number * unit);
+    return 0;
+}
+
+/**
+ * cgroup_mount - Find where the cgroup v2 hierarchy is mounted.
+ * Return: The mount point (static, found once), or NULL if there is none.
+ */
+const char *cgroup_mount(void) {
+    static char mount[PATH_MAX];
+    if (mount[0] != '\0') {
+        return mount;
+    }
+    FILE *mounts = fopen("/proc/self/mounts", "re");
+    if (mounts == NULL) {
+        return NULL;
+    }
+    char line[PATH_MAX + 256];
+    while (fgets(line, sizeof(line), mounts) != NULL) {
+        char dir[PATH_MAX];
+        char type[32];
+        if (sscanf(line, "%*s %4095s %31s", dir, type) == 2 && strcmp(type, "cgroup2") == 0) {
+            snprintf(mount, sizeof(mount), "%s", dir);
+            break;
+        }
+    }
+    fclose(mounts);
+    return mount[0] != '\0' ? mount : NULL;
+}
+
+/**
+ * cgroup_write - Write a value to a cgroup interface file.
+ * @dir: The cgroup directory.
+ * @file: The interface file (cpu.max, memory.max, ...).
+ * @value: Text to write.
+ * Return: 0 on success, -1 with errno set on failure.
+ */
+int cgroup_write(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+/**
+ * run_limits_parse - Parse the options of a "run" prefix.
+ * @args: The words after "run".
+ * @limits: Receives the options (cgroup_fd is set to -1).
+ * Return: Number of words used (options and a closing "--"), or -1 on an invalid option
+ *         (a message is printed).
+ *
+ * Options: --cgroup=NAME --cpu=N --mem=SIZE --cpuset=LIST for cgroup v2 placement, and
+ * --nofile=N --nproc=N --as=SIZE --cputime=SECONDS --core=SIZE for setrlimit() limits.
+ */
+int run_limits_parse(char **args, RunLimits *limits) {
+    static const struct {
+        const char *name;
+        int resource;
+    } rlimit_options[] = {
+        {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC}, {"as", RLIMIT_AS},
+        {"cputime", RLIMIT_CPU},   {"core", RLIMIT_CORE},
+    };
+    memset(limits, 0, sizeof(*limits));
+    limits->cgroup_fd = -1;
+    int used = 0;
+    for (; args[used] != NULL && strncmp(args[used], "--", 2) == 0; ++used) {
+        char *option = args[used] + 2;
+        if (*option == '\0') {
+            return used + 1;  // "--": the command follows
+        }
+        char *value = strchr(option, '=');
+        size_t len = value ? (size_t)(value - option) : strlen(option);
+        // The name is checked first, so "--bogus" is reported as such even without a value
+        const char **setting = NULL;
+        size_t i = 0;
+        if (len == 6 && strncmp(option, "cgroup", 6) == 0) {
+            setting = &limits->cgroup;
+        } else if (len == 3 && strncmp(option, "cpu", 3) == 0) {
+            setting = &limits->cpu;
+        } else if (len == 3 && strncmp(option, "mem", 3) == 0) {
+            setting = &limits->mem;
+        } else if (len == 6 && strncmp(option, "cpuset", 6) == 0) {
+            setting = &limits->cpuset;
+        } else {
+            while (i < sizeof(rlimit_options) / sizeof(rlimit_options[0]) &&
+                   !(strlen(rlimit_options[i].name) == len && strncmp(option, rlimit_options[i].name, len) == 0)) {
+                i++;
+            }
+            if (i == sizeof(rlimit_options) / sizeof(rlimit_options[0])) {
+                fprintf(stderr, "run: --%.*s: invalid option\n", (int)len, option);
+                return -1;
+            }
+        }
+        if (value == NULL || *++value == '\0') {
+            fprintf(stderr, "run: --%.*s: a value is required\n", (int)len, option);
+            return -1;
+        }
+        if (setting != NULL) {
+            *setting = value;
+        } else {
+            rlim_t limit;
+            if (parse_rlimit(value, 1, &limit) != 0 || limits->nrlimits == RUN_RLIMIT_MAX) {
+                fprintf(stderr, "run: --%.*s: invalid limit '%s'\n", (int)len, option, value);
+                return -1;
+            }
+            limits->resources[limits->nrlimits] = rlimit_options[i].resource;
+            limits->values[limits->nrlimits++] = limit;
+        }
+    }
+    if (limits->cgroup == NULL && (limits->cpu || limits->mem || limits->cpuset)) {
+        fprintf(stderr, "run: --cpu, --mem and --cpuset need --cgroup=NAME\n");
+        return -1;
+    }
+    return used;
+}
+
+/**
+ * run_limits_open - Create and configure the cgroup of a "run" prefix.
+ * @limits: The parsed options; cgroup_fd receives its open cgroup.procs.
+ * Return: 0 on success (or without --cgroup), -1 on failure (a message is printed).
+ *
+ * NAME is a path below the cgroup v2 mount; missing directories are created, and the cpu,
+ * memory and cpuset controllers the options need are enabled on the way down (a parent
+ * that refuses, for example because it still holds processes, shows up as the interface
+ * file being absent). Writing cgroup.procs is left to each child, before it execs.
+ */
+int run_limits_open(RunLimits *limits) {
+    if (limits->cgroup == NULL) {
+        return 0;
+    }
+    const char *mount = cgroup_mount();
+    if (mount == NULL) {
+        fprintf(stderr, "run: no cgroup v2 hierarchy is mounted\n");
+        return -1;
+    }
+    char controllers[64] = "";
+    snprintf(controllers, sizeof(controllers), "%s%s%s", limits->cpu ? "+cpu " : "", limits->mem ? "+memory " : "",
+             limits->cpuset ? "+cpuset" : "");
+    char dir[PATH_MAX];
+    size_t len = (size_t)snprintf(dir, sizeof(dir), "%s", mount);
+    for (const char *name = limits->cgroup; *name != '\0';) {
+        name += strspn(name, "/");
+        size_t part = strcspn(name, "/");
+        if (part == 0) {
+            break;
+        }
+        if (controllers[0] != '\0') {
+            cgroup_write(dir, "cgroup.subtree_control", controllers);  // May already be enabled
+        }
+        if (len + part + 2 > sizeof(dir) || (part == 1 && name[0] == '.') ||
+            (part == 2 && strncmp(name, "..", 2) == 0)) {
+            fprintf(stderr, "run: --cgroup=%s: invalid cgroup name\n", limits->cgroup);
+            return -1;
+        }
+        len += (size_t)snprintf(dir + len, sizeof(dir) - len, "/%.*s", (int)part, name);
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "run: %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+        name += part;
+    }
+    char value[64];
+    if (limits->cpu != NULL) {
+        char *end;
+        double cpus = strtod(limits->cpu, &end);
+        if (end == limits->cpu || *end != '\0' || !(cpus > 0.0 && cpus < 1e6)) {
+            fprintf(stderr, "run: --cpu=%s: expected a number of CPUs\n", limits->cpu);
+            return -1;
+        }
+        snprintf(value, sizeof(value), "%lld %d", (long long)(cpus * CGROUP_PERIOD_US), CGROUP_PERIOD_US);
+    }
+    const char *files[] = {"cpu.max", "memory.max", "cpuset.cpus"};
+    const char *values[] = {limits->cpu ? value : NULL, limits->mem, limits->cpuset};
+    for (int i = 0; i < 3; ++i) {
+        if (values[i] != NULL && cgroup_write(dir, files[i], values[i]) != 0) {
+            fprintf(stderr, "run: %s/%s: %s\n", dir, files[i],
+                    errno == ENOENT ? "controller not enabled for this cgroup" : strerror(errno));
+            return -1;
+        }
+    }
+    char procs[PATH_MAX + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    limits->cgroup_fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (limits->cgroup_fd < 0) {
+        fprintf(stderr, "run: %s: %s\n", procs, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * run_limits_enter - Apply the limits of a "run" prefix to the calling child, before exec.
+ * @limits: The limits.
+ * Return: 0 on success, -1 on failure (a message is printed): the child must not run unlimited.
+ *
+ * Writing "0" to cgroup.procs moves the writer itself, so every process the command starts
+ * is born inside the cgroup. Soft and hard limits are both set, so the command cannot raise
+ * them again. This runs between fork and exec, so failures go through child_error().
+ */
+int run_limits_enter(const RunLimits *limits) {
+    if (limits->cgroup_fd >= 0 && write(limits->cgroup_fd, "0", 1) != 1) {
+        child_error("run: cannot join cgroup ", limits->cgroup, -1, errno);
+        return -1;
+    }
+    for (int i = 0; i < limits->nrlimits; ++i) {
+        struct rlimit limit = {limits->values[i], limits->values[i]};
+        if (setrlimit(limits->resources[i], &limit) != 0) {
+            child_error("run: setrlimit", NULL, -1, errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * child_enter - Prepare a freshly forked child to run a pipeline segment.
+ * @job: The job the process belongs to (gives its process group).
+ * @in_fd: Pipe read end to use as stdin (-1 to inherit).
+ * @out_fd: Pipe write end to use as stdout (-1 to inherit).
+ *
+ * Joins the job's process group, resets the signals the shell ignores or handles, binds
+ * itself to the stage's CPU under set -o pinstages (a failure is reported, the stage runs
+ * unpinned), and wires the pipe ends onto stdin/stdout.
+ */
+void child_enter(const Job *job, int in_fd, int out_fd) {
+    if (job_control) {
+        setpgid(0, job->pgid);
+        if (job->foreground) {
+            tcsetpgrp(STDIN_FILENO, job->pgid ? job->pgid : getpid());
+        }
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    if (pin_child_cpu >= 0 && pin_affinity(pin_child_cpu) != 0) {
+        child_error("shell: pinstages: cpu ", NULL, pin_child_cpu, errno);
+    }
+    if (in_fd != -1) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+}
+
+/**
+ * spawn_fork - Launch a pipeline segment with fork() and execve() (fallback path).
+ * @cmd: The command to launch.
+ * @path: The resolved executable path (from lookup_command).
+ * @job: The job the process belongs to (gives its process group).
+ * @in_fd: Pipe read end to use as stdin (-1 to inherit).
+ * @out_fd: Pipe write end to use as stdout (-1 to inherit).
+ * Return: The child's pid, or -1 if it could not be started (an error message is printed).
+ *
+ * Everything that allocates or formats is done before the fork: the redirections are opened
+ * and planned (child_plan) and the environment block is built. Between fork and exec the
+ * child only makes system calls and reports failures with preformatted pieces and write(2)
+ * (child_error), so the path stays async-signal-safe and would survive a move to vfork().
+ * A stale path cache entry is retried with search_path(), which only stats candidates.
+ */
+pid_t spawn_fork(const Command *cmd, const char *path, const Job *job, int in_fd, int out_fd) {
+    ChildPlan plan;
+    if (child_plan(cmd, &plan) != 0) {
+        spawn_failure = 1;
+        return -1;
+    }
+    char **envp = command_envp(cmd);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("shell: fork");
+        child_plan_close(&plan);
+        spawn_failure = 1;
+        return -1;
+    }
+    if (pid == 0) {
+        // Child process
+        child_enter(job, in_fd, out_fd);
+        if (job->limits != NULL && run_limits_enter(job->limits) != 0) {
+            _exit(126);
+        }
+        if (child_apply(&plan) != 0) {
+            _exit(1);
+        }
+        execve(path, cmd->args, envp);
+        if (errno == ENOENT && path != cmd->args[0]) {
+            // Stale cache entry: walk PATH again (the parent's cache is left as it is)
+            char found[PATH_MAX];
+            if (search_path(cmd->args[0], found, sizeof(found))) {
+                execve(found, cmd->args, envp);
+            }
+        }
+        // If exec returns, an error occurred
+        if (errno == ENOENT) {
+            child_error(cmd->args[0], ": Command not found", -1, 0);
+            _exit(127);
+        }
+        child_error(cmd->args[0], NULL, -1, errno);
+        _exit(126);
+    }
+    child_plan_close(&plan);
+    if (job_control) {
+        // Also set the group from the parent so it is in place whichever side runs first
+        setpgid(pid, job->pgid ? job->pgid : pid);
+    }
+    return pid;
+}
+
+/**
+ * spawn_command - Launch one pipeline segment using the configured spawn engine.
+ * @cmd: The command to launch.
+ * @job: The job the process belongs to (pgid 0 starts a new process group).
+ * @in_fd: Pipe read end to use as stdin (-1 to inherit).
+ * @out_fd: Pipe write end to use as stdout (-1 to inherit).
+ * Return: The child's pid, or -1 if no process was started (spawn_failure then holds the
+ *         exit code the segment gets: 127 if the command was not found, 126 if it could not
+ *         be executed, 1 otherwise).
+ *
+ * Pipe descriptors are created close-on-exec, so the child only keeps the ends it dup2'd.
+ * The executable is resolved through the path cache, so no PATH walk happens here. Jobs
+ * with "run" limits always use fork + exec: posix_spawn has nowhere to apply them.
+ */
+pid_t spawn_command(const Command *cmd, const Job *job, int in_fd, int out_fd) {
+    const char *path = lookup_command(cmd->args[0]);
+    if (path == NULL) {
+        fprintf(stderr, "%s: Command not found\n", cmd->args[0]);
+        spawn_failure = 127;
+        return -1;
+    }
+    // The plan and environment copy are only needed until the child is started
+    ArenaMark mark = arena_mark(&expand_arena);
+    long long start = stat_block != NULL ? now_ns() : 0;
+    pid_t pid;
+    if (spawn_mode == SPAWN_FORK || job->limits != NULL) {
+        // "run" limits are applied by the child between fork and exec
+        pid = spawn_fork(cmd, path, job, in_fd, out_fd);
+    } else {
+        pid = spawn_posix(cmd, path, job, in_fd, out_fd);
+    }
+    arena_release(&expand_arena, mark);
+    if (stat_block != NULL && pid > 0) {
+        stat_spawn(now_ns() - start);
+    }
+    return pid;
+}
+
+/**
+ * parse_count - Parse a positive decimal count, such as the N of "-j N".
+ * @text: The count.
+ * Return: The count, or -1 if the text is not a whole number from 1 to INT_MAX.
+ */
+long parse_count(const char *text) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value <= 0 || value > INT_MAX) {
+        return -1;
+    }
+    return value;
+}
+
+/**
+ * parse_size - Parse a byte count with an optional K, M or G suffix.
+ * @text: The size, e.g. "65536", "256K" or "1M".
+ * Return: The size in bytes, or -1 if the text is not a valid size.
+ */
+long parse_size(const char *text) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || value < 0) {
+        return -1;
+    }
+    long mult = 1;
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        mult = 1024L;
+        end++;
+        break;
+    case 'M':
+        mult = 1024L * 1024L;
+        end++;
+        break;
+    case 'G':
+        mult = 1024L * 1024L * 1024L;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0' || value > INT_MAX / mult) {
+        return -1;
+    }
+    return value * mult;
+}
+
+/**
+ * make_pipe - Create an inter-stage pipe with the requested buffer size.
+ * @fds: Receives the read and write ends (both close-on-exec).
+ * @size: Buffer size for F_SETPIPE_SZ (0 keeps the kernel default of 64KB).
+ * @packet: Create the pipe in packet mode (O_DIRECT).
+ * Return: 0 on success, -1 if the pipe could not be created.
+ *
+ * Larger buffers let the writer run further ahead of the reader, so high-volume pipelines
+ * switch context less often. The kernel rounds the size up to a power-of-two number of pages
+ * and caps unprivileged users at /proc/sys/fs/pipe-max-size; a refused size only warns.
+ * In packet mode (set -o pipepacket, for inter-stage pipes) the pipe is created with
+ * O_DIRECT, so each write is delivered as one record.
+ */
+int make_pipe(int fds[2], long size, bool packet) {
+    if (pipe2(fds, O_CLOEXEC | (packet ? O_DIRECT : 0)) < 0) {
+        return -1;
+    }
+    if (size > 0 && fcntl(fds[1], F_SETPIPE_SZ, (int)size) < 0 && !pipe_size_warned) {
+        fprintf(stderr, "shell: pipesize %ld: %s\n", size, strerror(errno));
+        pipe_size_warned = true;
+    }
+    return 0;
+}
+
+/**
+ * sysfs_read - Read a small sysfs attribute.
+ * @path: The attribute file.
+ * @buf: Receives the NUL-terminated contents.
+ * @size: Size of buf.
+ * Return: Number of bytes read, or -1 if the file cannot be read.
+ */
+ssize_t sysfs_read(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/**
+ * cpu_list_read - Read a sysfs CPU list ("0-3,8,10-11") into a CPU set.
+ * @path: The list file.
+ * @set: Receives the CPUs.
+ * Return: The lowest CPU of the list, or -1 if the file cannot be read or lists none.
+ */
+int cpu_list_read(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    CPU_ZERO(set);
+    if (sysfs_read(path, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    int lowest = -1;
+    char *p = buf;
+    while (isdigit((unsigned char)*p)) {
+        long first = strtol(p, &p, 10);
+        long last = *p == '-' ? strtol(p + 1, &p, 10) : first;
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET((int)cpu, set);
+        }
+        if (lowest < 0 || first < lowest) {
+            lowest = (int)first;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return lowest;
+}
+
+/**
+ * pin_cpu_compare - qsort() comparator ordering CPUs for stage placement.
+ * @a: A PinCpu.
+ * @b: A PinCpu.
+ * Return: Order by node, cache domain, SMT thread and CPU number.
+ */
+int pin_cpu_compare(const void *a, const void *b) {
+    const PinCpu *x = a;
+    const PinCpu *y = b;
+    if (x->node != y->node) {
+        return x->node - y->node;
+    }
+    if (x->llc != y->llc) {
+        return x->llc - y->llc;
+    }
+    return x->thread != y->thread ? x->thread - y->thread : x->cpu - y->cpu;
+}
+
+/**
+ * pin_topology_load - Find out which of the shell's CPUs share a cache and a NUMA node.
+ * Return: 0 on success, -1 if the allowed CPUs cannot be determined (a message is printed).
+ *
+ * A CPU's cache domain is the highest data or unified cache level listed under
+ * /sys/devices/system/cpu/cpuN/cache, its node comes from /sys/devices/system/node. The
+ * allowed CPUs are sorted so that consecutive entries share a node and a cache domain, first
+ * threads of every core ahead of their SMT siblings: adjacent stages then pass pipe data
+ * through a shared L2/L3 without competing for one core. Missing sysfs files only lose that
+ * ordering. Read once; the shell's memory policy is saved at the same time.
+ */
+int pin_topology_load(void) {
+    if (pin_ncpus > 0) {
+        return 0;
+    }
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("shell: sched_getaffinity");
+        return -1;
+    }
+    PinCpu *cpus = malloc(sizeof(PinCpu) * (size_t)CPU_COUNT(&allowed));
+    if (cpus == NULL) {
+        perror("shell: malloc");
+        return -1;
+    }
+    int node_of[CPU_SETSIZE] = {0};
+    char path[128];
+    cpu_set_t set;
+    DIR *nodes = opendir("/sys/devices/system/node");
+    for (struct dirent *entry; nodes != NULL && (entry = readdir(nodes)) != NULL;) {
+        int node;
+        char tail;
+        if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (cpu_list_read(path, &set) >= 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    node_of[cpu] = node;
+                }
+            }
+        }
+    }
+    if (nodes != NULL) {
+        closedir(nodes);
+    }
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        PinCpu *entry = &cpus[count++];
+        entry->cpu = cpu;
+        entry->node = node_of[cpu];
+        entry->llc = cpu;
+        entry->thread = 0;
+        int best = 0;
+        for (int index = 0;; ++index) {
+            char text[32];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            if (sysfs_read(path, text, sizeof(text)) < 0) {
+                break;
+            }
+            int level = atoi(text);
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, index);
+            if (level <= best || (sysfs_read(path, text, sizeof(text)) > 0 && strncmp(text, "Instruction", 11) == 0)) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            int lowest = cpu_list_read(path, &set);
+            if (lowest >= 0) {
+                best = level;
+                entry->llc = lowest;
+            }
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (cpu_list_read(path, &set) >= 0) {
+            for (int sibling = 0; sibling < cpu; ++sibling) {
+                entry->thread += CPU_ISSET(sibling, &set) ? 1 : 0;
+            }
+        }
+    }
+    qsort(cpus, (size_t)count, sizeof(PinCpu), pin_cpu_compare);
+    pin_cpus = cpus;
+    pin_ncpus = count;
+    int mode;
+    if (syscall(SYS_get_mempolicy, &mode, pin_saved_nodes, PIN_NODE_WORDS * 8 * sizeof(unsigned long), NULL, 0UL) ==
+        0) {
+        pin_saved_mode = mode;
+    }
+    return count > 0 ? 0 : -1;
+}
+
+/**
+ * pin_domain_equal - Check whether two entries of pin_cpus share a node and a cache.
+ * @a: Index of an entry.
+ * @b: Index of another entry.
+ * Return: true if they are in the same cache domain.
+ */
+bool pin_domain_equal(int a, int b) {
+    return pin_cpus[a].node == pin_cpus[b].node && pin_cpus[a].llc == pin_cpus[b].llc;
+}
+
+/**
+ * pin_pipeline_start - Choose the CPUs for the stages of a pipeline.
+ * @num_commands: Number of segments.
+ * Return: Index in pin_cpus of the first segment's CPU (segment i takes the entry i places
+ *         further, wrapping around), or -1 if the stages are not placed.
+ *
+ * Only pipelines of two or more segments are placed; a single command keeps every CPU, as
+ * it may have threads of its own. Pipelines take turns through pin_cpus, so concurrent ones
+ * land on different CPUs; one that fits in a cache domain but would straddle two starts at
+ * the next domain instead.
+ */
+int pin_pipeline_start(int num_commands) {
+    if (pin_mode == PIN_OFF || num_commands < 2 || pin_topology_load() != 0) {
+        return -1;
+    }
+    int start = pin_cursor % pin_ncpus;
+    int first = start;
+    int end = start;
+    while (first > 0 && pin_domain_equal(first - 1, start)) {
+        first--;
+    }
+    while (end < pin_ncpus && pin_domain_equal(end, start)) {
+        end++;
+    }
+    if (start + num_commands > end && end - first >= num_commands) {
+        start = end % pin_ncpus;
+    }
+    pin_cursor = (start + num_commands) % pin_ncpus;
+    return start;
+}
+
+/**
+ * pin_memory - Set the memory policy the next child inherits (set -o pinstages=numa).
+ * @node: NUMA node to take memory from preferably, or -1 to restore the shell's own policy.
+ *
+ * The policy belongs to the calling thread and is kept by fork, posix_spawn and exec, so a
+ * stage's first allocations (the dynamic loader's included) already come from its node.
+ */
+void pin_memory(int node) {
+    if (pin_saved_mode < 0) {
+        return;
+    }
+    if (node < 0) {
+        bool nodes = pin_saved_mode != PIN_MPOL_DEFAULT;
+        syscall(SYS_set_mempolicy, pin_saved_mode, nodes ? pin_saved_nodes : NULL,
+                nodes ? PIN_NODE_WORDS * 8 * sizeof(unsigned long) : 0UL);
+        return;
+    }
+    unsigned long mask[PIN_NODE_WORDS] = {0};
+    size_t bits = 8 * sizeof(unsigned long);
+    if ((size_t)node < PIN_NODE_WORDS * bits) {
+        mask[(size_t)node / bits] = 1UL << ((size_t)node % bits);
+        syscall(SYS_set_mempolicy, PIN_MPOL_PREFERRED, mask, PIN_NODE_WORDS * bits);
+    }
+}
+
+/**
+ * pin_affinity - Bind the calling thread to one CPU.
+ * @cpu: The CPU.
+ * Return: 0 on success, -1 on error (errno is set).
+ *
+ * A forked stage binds itself in child_enter(); for posix_spawn, which has no affinity
+ * attribute, the shell binds itself around the spawn and the child inherits it, as with
+ * pin_memory(). spawn_posix() reads the shell's affinity just before and puts that back,
+ * so a change made meanwhile (taskset -p) survives. Either way the affinity is set before
+ * exec, so every thread the stage later starts inherits it too.
+ */
+int pin_affinity(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * builtin_set - Implement "set -o [NAME[=VALUE]]" and "set +o NAME".
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 on an unknown option or invalid value.
+ *
+ * Options:
+ *   pipesize=SIZE   buffer size of inter-stage pipes (K/M/G suffixes; "set +o" restores 64KB)
+ *   pipepacket      create inter-stage pipes in O_DIRECT packet mode
+ *   parsecache=N    number of parsed command lines kept for reuse (0 disables the cache)
+ *   spawn=ENGINE    "posix" (posix_spawn) or "fork" (fork + exec)
+ *   pinstages[=numa] bind the stages of each pipeline to CPUs sharing a cache (and, with
+ *                   "numa", prefer memory from their node)
+ *   builtin-filters run head, tail, fixed-string grep and wc inside the shell
+ */
+int builtin_set(Command *cmd) {
+    char **args = cmd->args;
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+        printf("pipesize\t%ld\n", pipe_size_default);
+        printf("pipepacket\t%s\n", pipe_packet_mode ? "on" : "off");
+        printf("spawn\t\t%s\n", spawn_mode == SPAWN_FORK ? "fork" : "posix");
+        printf("parsecache\t%d\n", parse_cache_limit);
+        printf("pinstages\t%s\n", pin_mode == PIN_NUMA ? "numa" : pin_mode == PIN_CPU ? "cpu" : "off");
+        printf("builtin-filters\t%s\n", builtin_filters ? "on" : "off");
+        fflush(stdout);
+        return 0;
+    }
+    bool enable = strcmp(args[1], "-o") == 0;
+    if ((!enable && strcmp(args[1], "+o") != 0) || args[2] == NULL) {
+        fprintf(stderr, "set: usage: set [-o name[=value]] [+o name]\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 2; args[i] != NULL; ++i) {
+        char *name = args[i];
+        char *value = strchr(name, '=');
+        size_t name_len = value ? (size_t)(value - name) : strlen(name);
+        if (value != NULL) {
+            value++;
+        }
+        if (strncmp(name, "pipesize", name_len) == 0 && name_len == 8) {
+            long size = enable && value ? parse_size(value) : 0;
+            if (size < 0 || (enable && value == NULL)) {
+                fprintf(stderr, "set: pipesize: invalid size '%s'\n", value ? value : "");
+                status = 1;
+                continue;
+            }
+            pipe_size_default = size;
+            pipe_size_warned = false;
+        } else if (strncmp(name, "parsecache", name_len) == 0 && name_len == 10) {
+            // Takes effect before the next line is parsed: the running tree may be cached
+            long limit = enable && value ? strtol(value, &value, 10) : 0;
+            if (limit < 0 || limit > INT_MAX || (enable && (value == NULL || *value != '\0'))) {
+                fprintf(stderr, "set: parsecache: invalid size\n");
+                status = 1;
+                continue;
+            }
+            parse_cache_limit = (int)limit;
+        } else if (strncmp(name, "pipepacket", name_len) == 0 && name_len == 10) {
+            pipe_packet_mode = enable;
+        } else if (strncmp(name, "builtin-filters", name_len) == 0 && name_len == 15) {
+            builtin_filters = enable;
+        } else if (strncmp(name, "pinstages", name_len) == 0 && name_len == 9) {
+            PinMode mode = !enable ? PIN_OFF : value == NULL || strcmp(value, "cpu") == 0 ? PIN_CPU
+                                           : strcmp(value, "numa") == 0                 ? PIN_NUMA
+                                                                                          : PIN_OFF;
+            if (enable && mode == PIN_OFF) {
+                fprintf(stderr, "set: pinstages: expected 'cpu' or 'numa'\n");
+                status = 1;
+                continue;
+            }
+            if (mode != PIN_OFF && pin_topology_load() != 0) {
+                status = 1;
+                continue;
+            }
+            if (mode == PIN_NUMA && pin_saved_mode < 0) {
+                fprintf(stderr, "set: pinstages: no NUMA memory policy on this system, binding CPUs only\n");
+                mode = PIN_CPU;
+            }
+            pin_mode = mode;
+        } else if (strncmp(name, "spawn", name_len) == 0 && name_len == 5) {
+            if (!enable || (value && strcmp(value, "posix") == 0)) {
+                spawn_mode = SPAWN_POSIX;
+            } else if (value && strcmp(value, "fork") == 0) {
+                spawn_mode = SPAWN_FORK;
+            } else {
+                fprintf(stderr, "set: spawn: expected 'posix' or 'fork'\n");
+                status = 1;
+            }
+        } else {
+            fprintf(stderr, "set: %.*s: invalid option name\n", (int)name_len, name);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * ulimit_print - Print one resource limit in the units of its ulimit option.
+ * @value: The limit.
+ * @unit: Its unit in bytes (or seconds, or items).
+ */
+void ulimit_print(rlim_t value, rlim_t unit) {
+    if (value == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(value / unit));
+    }
+}
+
+/**
+ * builtin_ulimit - Implement "ulimit [-H|-S] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [LIMIT]]".
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 if a limit cannot be read or set, 2 on a usage error.
+ *
+ * Limits are those of the shell, inherited by everything it launches afterwards (limits for
+ * one pipeline only are the "run" prefix). Sizes are in KB, -c and -f in 1024-byte blocks,
+ * -t in seconds. Without -H or -S a new value sets both the soft and the hard limit; the
+ * soft limit is printed. Without an option, -f is meant.
+ */
+int builtin_ulimit(Command *cmd) {
+    static const struct {
+        char option;
+        int resource;
+        rlim_t unit;
+        const char *name;
+    } limits[] = {
+        {'c', RLIMIT_CORE, 1024, "core file size (blocks)"},
+        {'d', RLIMIT_DATA, 1024, "data seg size (KB)"},
+        {'f', RLIMIT_FSIZE, 1024, "file size (blocks)"},
+        {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (KB)"},
+        {'m', RLIMIT_RSS, 1024, "max memory size (KB)"},
+        {'n', RLIMIT_NOFILE, 1, "open files"},
+        {'s', RLIMIT_STACK, 1024, "stack size (KB)"},
+        {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+        {'u', RLIMIT_NPROC, 1, "max user processes"},
+        {'v', RLIMIT_AS, 1024, "virtual memory (KB)"},
+    };
+    const size_t count = sizeof(limits) / sizeof(limits[0]);
+    bool hard = false;
+    bool soft = false;
+    bool all = false;
+    size_t which = 2;  // -f
+    int i = 1;
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; ++i) {
+        for (const char *opt = cmd->args[i] + 1; *opt != '\0'; ++opt) {
+            size_t j = 0;
+            while (j < count && limits[j].option != *opt) {
+                j++;
+            }
+            if (*opt == 'H' || *opt == 'S') {
+                hard |= *opt == 'H';
+                soft |= *opt == 'S';
+            } else if (*opt == 'a') {
+                all = true;
+            } else if (j < count) {
+                which = j;
+            } else {
+                fprintf(stderr, "ulimit: -%c: invalid option\n"
+                                "ulimit: usage: ulimit [-H|-S] [-a | -cdflmnstuv [LIMIT]]\n",
+                        *opt);
+                return 2;
+            }
+        }
+    }
+    if (all) {
+        for (size_t j = 0; j < count; ++j) {
+            struct rlimit limit;
+            if (getrlimit(limits[j].resource, &limit) == 0) {
+                printf("%-26s(-%c) ", limits[j].name, limits[j].option);
+                ulimit_print(hard ? limit.rlim_max : limit.rlim_cur, limits[j].unit);
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+    struct rlimit limit;
+    if (getrlimit(limits[which].resource, &limit) != 0) {
+        fprintf(stderr, "ulimit: -%c: %s\n", limits[which].option, strerror(errno));
+        return 1;
+    }
+    if (cmd->args[i] == NULL) {
+        ulimit_print(hard && !soft ? limit.rlim_max : limit.rlim_cur, limits[which].unit);
+        fflush(stdout);
+        return 0;
+    }
+    rlim_t value;
+    if (cmd->args[i + 1] != NULL || parse_rlimit(cmd->args[i], limits[which].unit, &value) != 0) {
+        fprintf(stderr, "ulimit: %s: invalid limit\n", cmd->args[i]);
+        return 2;
+    }
+    if (hard || !soft) {
+        limit.rlim_max = value;
+    }
+    if (soft || !hard || limit.rlim_cur > value) {
+        limit.rlim_cur = value;
+    }
+    if (setrlimit(limits[which].resource, &limit) != 0) {
+        fprintf(stderr, "ulimit: -%c: cannot set limit: %s\n", limits[which].option, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * feeder_stage_file - Check whether a pipeline's first segment can be fed by the shell.
+ * @commands: The pipeline segments.
+ * @num_commands: Number of segments.
+ * Return: The file to feed into the first pipe, or NULL if the segment must be launched.
+ *
+ * Two shapes qualify when another segment follows: "< FILE" with no command, and a plain
+ * "cat FILE" (no options, no redirections). Both only copy a file into the pipe, which the
+ * shell can do with splice() instead of a fork+exec and a userspace copy.
+ */
+const char *feeder_stage_file(const Command *commands, int num_commands) {
+    const Command *cmd = &commands[0];
+    if (num_commands < 2 || cmd->output_file != NULL || cmd->here_string != NULL || cmd->nredirs > 0) {
+        return NULL;
+    }
+    if (cmd->argc == 0) {
+        return cmd->input_file;
+    }
+    if (cmd->argc != 2 || cmd->input_file != NULL || strcmp(cmd->args[0], "cat") != 0 || cmd->args[1][0] == '-') {
+        return NULL;
+    }
+    // "hash -p path cat" means the user wants that binary, not the built-in copy
+    const PathEntry *entry = path_cache_find("cat");
+    return entry != NULL && entry->pinned ? NULL : cmd->args[1];
+}
+
+/**
+ * feeder_transfer - Move as much of a feeder's file into its pipe as fits right now.
+ * @feed: The feeder.
+ * Return: true once the transfer is over (end of file, or the reader went away), false if
+ *         the pipe is full and the feeder must wait for room.
+ *
+ * splice() moves pages from the page cache into the pipe without a userspace copy; files
+ * that do not support it fall back to read/write through feed->buf. A reader that exits
+ * early makes the write fail with EPIPE (SIGPIPE is ignored or blocked, see feeder_pump()),
+ * which ends the transfer. Any other error (reading a directory, an I/O error) is reported
+ * like cat does.
+ */
+bool feeder_transfer(Feeder *feed) {
+    for (;;) {
+        ssize_t n;
+        if (feed->buf == NULL) {
+            n = splice(feed->in_fd, NULL, feed->out_fd, NULL, FEEDER_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0 || (n < 0 && errno == EINTR)) {
+                STAT_ADD(feeder_bytes, n > 0 ? n : 0);
+                continue;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                feed->buf = malloc(READ_CHUNK);
+                if (feed->buf != NULL) {
+                    continue;
+                }
+            }
+            // End of file, a full pipe (wait for room), or EPIPE and other errors
+            if (n < 0 && errno != EAGAIN && errno != EPIPE) {
+                fprintf(stderr, "%s: %s\n", feed->label, strerror(errno));
+            }
+            return n == 0 || errno != EAGAIN;
+        }
+        if (feed->off == feed->len) {
+            n = read(feed->in_fd, feed->buf, READ_CHUNK);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                fprintf(stderr, "%s: %s\n", feed->label, strerror(errno));
+            }
+            if (n <= 0) {
+                return true;
+            }
+            feed->off = 0;
+            feed->len = (size_t)n;
+        }
+        n = write(feed->out_fd, feed->buf + feed->off, feed->len - feed->off);
+        if (n > 0) {
+            feed->off += (size_t)n;
+            STAT_ADD(feeder_bytes, n);
+        } else if (errno != EINTR) {
+            return errno != EAGAIN;
+        }
+    }
+}
+
+/**
+ * feeder_pump - Run feeder_transfer() without letting a gone reader kill the shell.
+ * @feed: The feeder.
+ * Return: As feeder_transfer().
+ *
+ * The top-level shell ignores SIGPIPE. A subshell does not (subshell_enter()), so there
+ * SIGPIPE is blocked around the transfer and one raised by its own write is taken back.
+ */
+bool feeder_pump(Feeder *feed) {
+    if (!sigpipe_default) {
+        return feeder_transfer(feed);
+    }
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+    bool done = feeder_transfer(feed);
+    const struct timespec none = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &none) == SIGPIPE) {
+        // Raised by the transfer's write into a pipe with no reader
+    }
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return done;
+}
+
+/**
+ * feeder_finish - Close a feeder's descriptors and free it.
+ * @feed: The feeder.
+ */
+void feeder_finish(Feeder *feed) {
+    if (feed->watch >= 0) {
+        event_unwatch(feed->watch);
+        event_feeders--;
+    }
+    close(feed->in_fd);
+    close(feed->out_fd);
+    free(feed->buf);
+    free(feed->label);
+    free(feed);
+}
+
+/**
+ * feeder_event - Event handler of a feeder's pipe: refill it now that there is room.
+ * @data: The feeder.
+ * @revents: Unused (an error on the pipe shows up as EPIPE from the write).
+ */
+void feeder_event(void *data, short revents) {
+    (void)revents;
+    if (feeder_pump(data)) {
+        feeder_finish(data);
+    }
+}
+
+/**
+ * start_feeder - Open a file and feed it into a pipe from the shell's event loop.
+ * @cmd: The first pipeline segment ("< FILE" or "cat FILE").
+ * @file: The file to feed (from feeder_stage_file).
+ * @out_fd: Write end of the pipe to the second segment; owned by the feeder on success.
+ * Return: 0 if the feeder was started, -1 if the file cannot be opened (an error message is
+ *         printed), 1 if it is not a file the shell feeds (out_fd is left to the caller).
+ *
+ * Only regular files outside /proc are fed. A FIFO or terminal could block the shell in
+ * open() or read(), and a /proc file such as /proc/self/comm describes whoever reads it,
+ * so for those the caller launches a real cat. The pipe is filled right away, so a file
+ * that fits in it never reaches the loop. A larger one is refilled whenever the loop
+ * reports room in the pipe: the shell's waits (for a job, for input, in "parallel") all
+ * run the loop, so no thread is needed per feeder.
+ */
+int start_feeder(const Command *cmd, const char *file, int out_fd) {
+    struct stat st;
+    if (stat(file, &st) == 0 && !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    int in_fd;
+    if (cmd->argc == 0) {
+        // "< FILE": same open and error message as a redirected command
+        int unused;
+        if (open_redirections(cmd, &in_fd, &unused) != 0) {
+            return -1;
+        }
+    } else {
+        in_fd = open(file, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (in_fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            return -1;
+        }
+    }
+    struct statfs fs;
+    if (fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode) || (fstatfs(in_fd, &fs) == 0 && fs.f_type == PROC_SUPER_MAGIC)) {
+        close(in_fd);
+        return 1;
+    }
+    Feeder *feed = calloc(1, sizeof(*feed));
+    if (feed == NULL || asprintf(&feed->label, "%s: %s", cmd->argc == 0 ? "shell" : "cat", file) < 0) {
+        perror("shell: malloc");
+        free(feed);
+        close(in_fd);
+        return -1;
+    }
+    feed->in_fd = in_fd;
+    feed->out_fd = out_fd;
+    feed->watch = -1;
+    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+    if (feeder_pump(feed)) {
+        feeder_finish(feed);
+        return 0;
+    }
+    feed->watch = event_watch(out_fd, POLLOUT, feeder_event, feed);
+    if (feed->watch < 0) {
+        perror("shell: event loop");
+        close(in_fd);
+        free(feed->buf);
+        free(feed->label);
+        free(feed);
+        return -1;
+    }
+    event_feeders++;
+    return 0;
+}
+
+/**
+ * feeder_detach - Hand the feeders still running over to a helper process (before exiting).
+ *
+ * A background "cat FILE | cmd &" is fed by the shell itself, so exiting would cut cmd's
+ * input short. The forked helper keeps running the event loop until every feeder is done,
+ * the way a real cat would have outlived the shell; the shell exits without waiting.
+ */
+void feeder_detach(void) {
+    if (event_feeders == 0) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("shell: fork");
+        return;
+    }
+    if (pid == 0) {
+        while (event_feeders > 0 && event_run_once() == 0) {
+        }
+        _exit(0);
+    }
+}
+
+/**
+ * builtin_cd - Implement "cd [DIR]": change the working directory (HOME by default).
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 on error.
+ */
+int builtin_cd(Command *cmd) {
+    const char *dir = cmd->args[1];
+    if (dir == NULL) {
+        // Change to HOME directory if no argument
+        dir = var_get("HOME", 4);
+        if (dir == NULL) {
+            dir = ".";
+        }
+    }
+    if (chdir(dir) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", cmd->args[1] ? cmd->args[1] : dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * builtin_exit - Implement "exit [N]": leave the shell with status N (default: last status).
+ * @cmd: The parsed builtin command.
+ * Return: The exit status.
+ *
+ * Inside a pipeline the builtin runs in a forked copy of the shell, which simply exits.
+ */
+int builtin_exit(Command *cmd) {
+    int code = last_status;
+    if (cmd->args[1] != NULL) {
+        char *end;
+        code = (int)(strtol(cmd->args[1], &end, 10) & 0xff);
+        if (end == cmd->args[1] || *end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", cmd->args[1]);
+            code = 2;
+        }
+    }
+    exit_requested = true;
+    return code;
+}
+
+/**
+ * builtin_true - Implement "true" (and ":"): do nothing, successfully.
+ * @cmd: The parsed builtin command (unused).
+ * Return: 0.
+ */
+int builtin_true(Command *cmd) {
+    (void)cmd;
+    return 0;
+}
+
+/**
+ * builtin_false - Implement "false": do nothing, unsuccessfully.
+ * @cmd: The parsed builtin command (unused).
+ * Return: 1.
+ */
+int builtin_false(Command *cmd) {
+    (void)cmd;
+    return 1;
+}
+
+/**
+ * builtin_pwd - Implement "pwd": print the working directory.
+ * @cmd: The parsed builtin command (unused).
+ * Return: 0 on success, 1 on error.
+ */
+int builtin_pwd(Command *cmd) {
+    (void)cmd;
+    char dir[PATH_MAX];
+    if (getcwd(dir, sizeof(dir)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(dir);
+    return 0;
+}
+
+/**
+ * builtin_shellstat - Implement "shellstat [-r | -a]": print the shell's internal counters.
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 on an unknown option.
+ *
+ * Reports the parse cache (lines cached, capacity, hits, misses), the command path cache
+ * (entries and launches served), the child environment block (exported variables, times
+ * built) and the glob directory cache (directories kept, listings served, readdir passes),
+ * then history, completion, stage pinning (CPUs known, stages bound), "on" (hosts, runs, runs
+ * over an already open ssh connection), "memo" (hits, misses, outputs stored), the builtin
+ * text filters (enabled, runs, input bytes) and the event loop (backend, descriptors
+ * watched, feeders in flight, waits). -r resets the parse cache
+ * counters afterwards. -a instead prints the shared counters summed over every shell running
+ * with SHELL_STATS set (see stat_report()).
+ */
+int builtin_shellstat(Command *cmd) {
+    bool reset = false;
+    if (cmd->args[1] != NULL) {
+        if (strcmp(cmd->args[1], "-a") == 0 && cmd->args[2] == NULL) {
+            return stat_report(0);
+        }
+        if (strcmp(cmd->args[1], "-r") != 0) {
+            fprintf(stderr, "shellstat: usage: shellstat [-r | -a]\n");
+            return 1;
+        }
+        reset = true;
+    }
+    unsigned long long lookups = parse_cache_hits + parse_cache_misses;
+    printf("parsecache\tentries=%d limit=%d hits=%llu misses=%llu hit_rate=%.1f%%\n", parse_cache_count,
+           parse_cache_limit, parse_cache_hits, parse_cache_misses,
+           lookups ? 100.0 * (double)parse_cache_hits / (double)lookups : 0.0);
+    int entries = 0;
+    unsigned long long hits = 0;
+    for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+        for (const PathEntry *entry = path_cache[i]; entry != NULL; entry = entry->next) {
+            entries++;
+            hits += entry->hits;
+        }
+    }
+    printf("pathcache\tentries=%d hits=%llu\n", entries, hits);
+    int exported = 0;
+    for (int i = 0; i < VAR_TABLE_SIZE; ++i) {
+        for (const ShellVar *var = shell_vars[i]; var != NULL; var = var->next) {
+            exported += var->exported;
+        }
+    }
+    printf("environ\texported=%d builds=%llu\n", exported, env_builds);
+    printf("globcache\tdirs=%d hits=%llu reads=%llu\n", dir_cache_count, dir_cache_hits, dir_cache_reads);
+    printf("history\tentries=%u indexed=%llu\n", history_index != NULL ? history_index->count : 0, history_indexed);
+    printf("completion\tdirs=%d reads=%llu lookups=%llu\n", completion_ndirs, completion_dir_reads, completion_lookups);
+    printf("pinstages\tcpus=%d stages=%llu\n", pin_ncpus, pin_stages);
+    int on_count = 0;
+    for (const OnHost *host = on_hosts; host != NULL; host = host->next) {
+        on_count++;
+    }
+    printf("remote\thosts=%d runs=%llu reused=%llu hit_rate=%.1f%%\n", on_count, on_runs, on_reused,
+           on_runs ? 100.0 * (double)on_reused / (double)on_runs : 0.0);
+    printf("memo\thits=%llu misses=%llu stored=%llu\n", memo_hits, memo_misses, memo_stored);
+    printf("filters\t%s runs=%llu bytes=%llu\n", builtin_filters ? "on" : "off", filter_runs, filter_bytes);
+    int watches = 0;
+    for (int i = 0; i < event_nwatches; ++i) {
+        watches += event_watches[i].fd >= 0;
+    }
+    printf("events\tbackend=%s watches=%d feeders=%d waits=%llu\n",
+           event_backend == EVENT_URING ? "io_uring" : event_backend == EVENT_EPOLL ? "epoll" : "none", watches,
+           event_feeders, event_waits);
+    if (reset) {
+        parse_cache_hits = 0;
+        parse_cache_misses = 0;
+    }
+    return 0;
+}
+
+/**
+ * unescape_char - Decode one backslash escape sequence.
+ * @p: In: points just after the backslash. Out: advanced past the sequence.
+ * @zero_octal: True if octal escapes are written "\0nnn" (echo, %b), false for "\nnn" (printf).
+ * Return: The decoded byte, or -1 for "\c" (stop all output).
+ */
+int unescape_char(const char **p, bool zero_octal) {
+    const char *s = *p;
+    int c = (unsigned char)*s++;
+    static const char names[] = "abefnrtv";
+    static const char codes[] = "\a\b\033\f\n\r\t\v";
+    const char *named = c != '\0' ? strchr(names, c) : NULL;
+    if (named != NULL) {
+        *p = s;
+        return (unsigned char)codes[named - names];
+    }
+    switch (c) {
+    case 'c':
+        c = -1;
+        break;
+    case '\0':
+        // Trailing backslash: print it as is
+        c = '\\';
+        s--;
+        break;
+    default:
+        if (c >= '0' && c <= '7' && (!zero_octal || c == '0')) {
+            // Up to three octal digits, after the leading 0 in the "\0nnn" style
+            int value = zero_octal ? 0 : c - '0';
+            int digits = zero_octal ? 3 : 2;
+            while (digits-- > 0 && *s >= '0' && *s <= '7') {
+                value = value * 8 + (*s++ - '0');
+            }
+            c = value & 0xff;
+        } else if (c != '\\' && (zero_octal || (c != '"' && c != '\''))) {
+            // Unknown escape: keep the backslash
+            c = '\\';
+            s--;
+        }
+        break;
+    }
+    *p = s;
+    return c;
+}
+
+/**
+ * print_escaped - Write a string to stdout, decoding backslash escapes.
+ * @s: The string.
+ * @zero_octal: Octal escape style, as for unescape_char().
+ * Return: false if a "\c" escape asked to stop all further output, true otherwise.
+ */
+bool print_escaped(const char *s, bool zero_octal) {
+    while (*s != '\0') {
+        if (*s != '\\') {
+            size_t run = strcspn(s, "\\");
+            fwrite(s, 1, run, stdout);
+            s += run;
+            continue;
+        }
+        s++;
+        int c = unescape_char(&s, zero_octal);
+        if (c < 0) {
+            return false;
+        }
+        putchar(c);
+    }
+    return true;
+}
+
+/**
+ * builtin_echo - Implement "echo [-neE] [ARG...]".
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 if stdout could not be written.
+ *
+ * -n suppresses the trailing newline, -e enables backslash escapes and -E disables them.
+ */
+int builtin_echo(Command *cmd) {
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; ++i) {
+        const char *opt = cmd->args[i] + 1;
+        if (opt[strspn(opt, "neE")] != '\0') {
+            break;  // Not an option: print it
+        }
+        for (; *opt != '\0'; ++opt) {
+            if (*opt == 'n') {
+                newline = false;
+            } else {
+                escapes = *opt == 'e';
+            }
+        }
+    }
+    for (; cmd->args[i] != NULL; ++i) {
+        if (escapes) {
+            if (!print_escaped(cmd->args[i], true)) {
+                return 0;
+            }
+        } else {
+            fputs(cmd->args[i], stdout);
+        }
+        if (cmd->args[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return ferror(stdout) ? 1 : 0;
+}
+
+/**
+ * printf_number - Convert a printf argument to an integer.
+ * @text: The argument (NULL counts as 0); "'c" gives the code of character c.
+ * @value: Output parameter for the value.
+ * Return: true on success, false if the argument is not a number (a message is printed).
+ */
+bool printf_number(const char *text, long long *value) {
+    if (text == NULL || *text == '\0') {
+        *value = 0;
+        return true;
+    }
+    if (text[0] == '\'' || text[0] == '"') {
+        *value = (unsigned char)text[1];
+        return true;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 0);
+    if (errno != 0 || *end != '\0') {
+        fprintf(stderr, "printf: %s: invalid number\n", text);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * builtin_printf - Implement "printf FORMAT [ARG...]".
+ * @cmd: The parsed builtin command.
+ * Return: 0 on success, 1 if an argument or the format was invalid, 2 on usage errors.
+ *
+ * Supports the %s %b %c %d %i %u %o %x %X %e %f %g (and upper-case) conversions with flags,
+ * width and precision, plus backslash escapes. The format is reused while arguments remain.
+ */
+int builtin_printf(Command *cmd) {
+    if (cmd->args[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *format = cmd->args[1];
+    char **arg = cmd->args + 2;
+    int status = 0;
+    bool consumed;
+    do {
+        consumed = false;
+        const char *p = format;
+        while (*p != '\0') {
+            if (*p == '\\') {
+                p++;
+                int c = unescape_char(&p, false);
+                if (c < 0) {
+                    return status;
+                }
+                putchar(c);
+                continue;
+            }
+            if (*p != '%') {
+                size_t run = strcspn(p, "\\%");
+                fwrite(p, 1, run, stdout);
+                p += run;
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+            // Copy flags, width and precision into a C format, then add the conversion
+            char spec[48];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 8) {
+                spec[n++] = *p++;
+            }
+            while (isdigit((unsigned char)*p) && n < 18) {
+                spec[n++] = *p++;
+            }
+            if (*p == '.') {
+                spec[n++] = *p++;
+                while (isdigit((unsigned char)*p) && n < 30) {
+                    spec[n++] = *p++;
+                }
+            }
+            char conv = *p;
+            if (conv == '\0') {
+                fprintf(stderr, "printf: %s: missing format character\n", format);
+                return 1;
+            }
+            p++;
+            const char *value = *arg;
+            if (value != NULL) {
+                arg++;
+                consumed = true;
+            }
+            long long number;
+            switch (conv) {
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                printf(spec, value ? value : "");
+                break;
+            case 'b':
+                if (value != NULL && !print_escaped(value, true)) {
+                    return status;
+                }
+                break;
+            case 'c':
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                if (value != NULL && *value != '\0') {
+                    printf(spec, *value);
+                }
+                break;
+            case 'd':
+            case 'i':
+                memcpy(spec + n, "lld", 4);
+                if (!printf_number(value, &number)) {
+                    status = 1;
+                }
+                printf(spec, number);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                if (!printf_number(value, &number)) {
+                    status = 1;
+                }
+                printf(spec, (unsigned long long)number);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G': {
+                spec[n++] = conv;
+                spec[n] = '\0';
+                char *end = NULL;
+                double real = value ? strtod(value, &end) : 0.0;
+                if (value != NULL && (end == value || *end != '\0')) {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    status = 1;
+                }
+                printf(spec, real);
+                break;
+            }
+            default:
+                fprintf(stderr, "printf: %%%c: invalid format character\n", conv);
+                return 1;
+            }
+        }
+    } while (consumed && *arg != NULL);
+    return status;
+}
+
+/**
+ * test_integer - Parse an integer operand of "test".
+ * @parser: The parser (its error flag is set on failure).
+ * @text: The operand.
+ * Return: The value (0 on error).
+ */
+long long test_integer(TestParser *parser, const char *text) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (errno != 0 || end == text || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        parser->error = true;
+        return 0;
+    }
+    return value;
+}
+
+/**
+ * test_is_binary - Check whether an operand is a binary operator of "test".
+ * @op: The operand.
+ * Return: true for =, ==, !=, <, >, -eq, -ne, -lt, -le, -gt, -ge, -nt, -ot and -ef.
+ */
+bool test_is_binary(const char *op) {
+    static const char *const binary[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+                                         "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (size_t i = 0; i < sizeof(binary) / sizeof(binary[0]); ++i) {
+        if (strcmp(op, binary[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * test_binary - Evaluate "LEFT OP RIGHT".
+ * @parser: The parser (for error reporting).
+ * @left: Left operand.
+ * @op: A binary operator (see test_is_binary).
+ * @right: Right operand.
+ * Return: The truth value.
+ */
+bool test_binary(TestParser *parser, const char *left, const char *op, const char *right) {
+    if (op[0] != '-') {
+        int cmp = strcmp(left, right);
+        switch (op[0]) {
+        case '=':
+            return cmp == 0;
+        case '!':
+            return cmp != 0;
+        case '<':
+            return cmp < 0;
+        default:
+            return cmp > 0;
+        }
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        bool have_a = stat(left, &a) == 0;
+        bool have_b = stat(right, &b) == 0;
+        if (op[1] == 'e') {
+            return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        bool newer = have_a && (!have_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        bool older = have_b && (!have_a || b.st_mtim.tv_sec > a.st_mtim.tv_sec ||
+                                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && b.st_mtim.tv_nsec > a.st_mtim.tv_nsec));
+        return op[1] == 'n' ? newer : older;
+    }
+    long long a = test_integer(parser, left);
+    long long b = test_integer(parser, right);
+    if (strcmp(op, "-eq") == 0) {
+        return a == b;
+    }
+    if (strcmp(op, "-ne") == 0) {
+        return a != b;
+    }
+    if (strcmp(op, "-lt") == 0) {
+        return a < b;
+    }
+    if (strcmp(op, "-le") == 0) {
+        return a <= b;
+    }
+    if (strcmp(op, "-gt") == 0) {
+        return a > b;
+    }
+    return a >= b;
+}
+
+/**
+ * test_unary - Evaluate "-OP ARG".
+ * @parser: The parser (for error reporting).
+ * @op: The operator character (e, f, d, r, w, x, s, z, n, L, h, b, c, p, S or t).
+ * @arg: The operand.
+ * Return: The truth value.
+ */
+bool test_unary(TestParser *parser, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+    case 'z':
+        return *arg == '\0';
+    case 'n':
+        return *arg != '\0';
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 't':
+        return isatty((int)test_integer(parser, arg));
+    case 'L':
+    case 'h':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    default:
+        break;
+    }
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op) {
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    default:
+        return true;  // -e
+    }
+}
+
+bool test_or(TestParser *parser);
+
+/**
+ * test_primary - Parse and evaluate a primary: "( EXPR )", "! PRIMARY", a unary or binary
+ * test, or a lone string (true if non-empty).
+ * @parser: The parser.
+ * Return: The truth value.
+ */
+bool test_primary(TestParser *parser) {
+    int left = parser->count - parser->pos;
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = true;
+        return false;
+    }
+    char **arg = parser->args + parser->pos;
+    if (left >= 3 && test_is_binary(arg[1])) {
+        // A binary test takes precedence, so "test ! = x" compares "!" with "x"
+        parser->pos += 3;
+        return test_binary(parser, arg[0], arg[1], arg[2]);
+    }
+    if (strcmp(arg[0], "!") == 0) {
+        parser->pos++;
+        return !test_primary(parser);
+    }
+    if (strcmp(arg[0], "(") == 0 && left >= 2) {
+        parser->pos++;
+        bool value = test_or(parser);
+        if (parser->pos >= parser->count || strcmp(parser->args[parser->pos], ")") != 0) {
+            fprintf(stderr, "test: ')' expected\n");
+            parser->error = true;
+            return false;
+        }
+        parser->pos++;
+        return value;
+    }
+    if (left >= 2 && arg[0][0] == '-' && arg[0][1] != '\0' && arg[0][2] == '\0' &&
+        strchr("efdrwxsznLhbcpSt", arg[0][1]) != NULL) {
+        parser->pos += 2;
+        return test_unary(parser, arg[0][1], arg[1]);
+    }
+    parser->pos++;
+    return arg[0][0] != '\0';
+}
+
+/**
+ * test_and - Parse and evaluate "PRIMARY [-a PRIMARY...]".
+ * @parser: The parser.
+ * Return: The truth value.
+ */
+bool test_and(TestParser *parser) {
+    bool value = test_primary(parser);
+    while (parser->pos < parser->count && strcmp(parser->args[parser->pos], "-a") == 0) {
+        parser->pos++;
+        value = test_primary(parser) && value;
+    }
+    return value;
+}
+
+/**
+ * test_or - Parse and evaluate "AND-EXPR [-o AND-EXPR...]".
+ * @parser: The parser.
+ * Return: The truth value.
+ */
+bool test_or(TestParser *parser) {
+    bool value = test_and(parser);
+    while (parser->pos < parser->count && strcmp(parser->args[parser->pos], "-o") == 0) {
+        parser->pos++;
+        value = test_and(parser) || value;
+    }
+    return value;
+}
+
+/**
+ * builtin_test - Implement "test EXPR" and "[ EXPR ]".
+ * @cmd: The parsed builtin command.
+ * Return: 0 if the expression is true, 1 if it is false, 2 on a syntax error.
+ */
+int builtin_test(Command *cmd) {
+    TestParser parser = {cmd->args + 1, cmd->argc - 1, 0, false};
+    if (strcmp(cmd->args[0], "[") == 0) {
+        if (parser.count == 0 || strcmp(cmd->args[cmd->argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        parser.count--;
+    }
+    if (parser.count == 0) {
+        return 1;
+    }
+    bool value = test_or(&parser);
+    if (!parser.error && parser.pos < parser.count) {
+        fprintf(stderr, "test: %s: unexpected operator\n", parser.args[parser.pos]);
+        parser.error = true;
+    }
+    return parser.error ? 2 : !value;
+}
+
+/**
+ * loop_levels - Parse the optional level count of "break N" / "continue N".
+ * @cmd: The parsed builtin command.
+ * Return: The number of levels (at least 1), or -1 after reporting an error.
+ */
+int loop_levels(const Command *cmd) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", cmd->args[0]);
+        return -1;
+    }
+    if (cmd->args[1] == NULL) {
+        return 1;
+    }
+    char *end;
+    long levels = strtol(cmd->args[1], &end, 10);
+    if (end == cmd->args[1] || *end != '\0' || levels < 1) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", cmd->args[0], cmd->args[1]);
+        return -1;
+    }
+    return levels > loop_depth ? loop_depth : (int)levels;
+}
+
+/**
+ * builtin_break - Implement "break [N]": leave the N innermost loops (default 1).
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 outside a loop or on a bad count.
+ */
+int builtin_break(Command *cmd) {
+    int levels = loop_levels(cmd);
+    if (levels < 0) {
+        return 1;
+    }
+    loop_break = levels;
+    return 0;
+}
+
+/**
+ * builtin_continue - Implement "continue [N]": start the next iteration of the Nth loop.
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 outside a loop or on a bad count.
+ *
+ * The N-1 inner loops are left as with "break"; the remaining one then continues.
+ */
+int builtin_continue(Command *cmd) {
+    int levels = loop_levels(cmd);
+    if (levels < 0) {
+        return 1;
+    }
+    loop_break = levels - 1;
+    loop_continue = true;
+    return 0;
+}
+
+/**
+ * read_line_fd - Read one line from a descriptor without consuming anything after it.
+ * @fd: The descriptor.
+ * @line: In/out: malloc'd buffer that receives the line (without its newline).
+ * @cap: In/out: buffer size.
+ * @len: Offset in the buffer to append the line at.
+ * @eof: Output: set if the input ended before a newline (or on a read error).
+ * Return: The new length of the buffer contents, or -1 on allocation failure.
+ *
+ * A seekable descriptor is read in chunks and the offset moved back to just after the
+ * newline; a pipe or terminal is read one byte at a time, so the rest of the input is left
+ * for the commands that read it next.
+ */
+ssize_t read_line_fd(int fd, char **line, size_t *cap, size_t len, bool *eof) {
+    bool seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    *eof = false;
+    for (;;) {
+        if (len + 513 > *cap) {
+            size_t grown = *cap ? *cap * 2 : 1024;
+            char *buf = realloc(*line, grown);
+            if (buf == NULL) {
+                perror("read: malloc");
+                return -1;
+            }
+            *line = buf;
+            *cap = grown;
+        }
+        if (!seekable && event_feeders > 0 && wait_for_input(fd) < 0) {
+            // A feeder may be the writer on the far side: never block outside the event loop
+            *eof = true;
+            break;
+        }
+        ssize_t n = read(fd, *line + len, seekable ? 512 : 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *eof = true;
+            break;
+        }
+        char *newline = memchr(*line + len, '\n', (size_t)n);
+        if (newline != NULL) {
+            if (seekable) {
+                lseek(fd, (off_t)(newline + 1 - (*line + len)) - n, SEEK_CUR);
+            }
+            len = (size_t)(newline - *line);
+            break;
+        }
+        len += (size_t)n;
+    }
+    (*line)[len] = '\0';
+    return (ssize_t)len;
+}
+
+/**
+ * builtin_read - Implement "read [-r] [-u FD] [NAME...]": read a line into variables.
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 at end of input (the variables are still set from a final partial line).
+ *
+ * The line is split on blanks; each NAME takes one word and the last NAME the rest of the
+ * line. With no NAME the whole line goes to REPLY. Without -r a backslash escapes the next
+ * character and a backslash-newline continues the line. -u reads from descriptor FD instead
+ * of stdin, e.g. a coprocess's output ("read -u $CHECK_OUT result").
+ */
+int builtin_read(Command *cmd) {
+    static char *line;           // Reused across calls: "while read" runs once per line
+    static size_t cap;
+    int name_index = 1;
+    bool raw = false;
+    int fd = STDIN_FILENO;
+    while (cmd->args[name_index] != NULL && cmd->args[name_index][0] == '-') {
+        const char *opt = cmd->args[name_index];
+        if (strcmp(opt, "-r") == 0) {
+            raw = true;
+        } else if (strcmp(opt, "-u") == 0 && cmd->args[name_index + 1] != NULL) {
+            const char *arg = cmd->args[++name_index];
+            size_t len = strlen(arg);
+            if (len == 0 || len > 4 || strspn(arg, "0123456789") != len || fcntl(atoi(arg), F_GETFD) < 0) {
+                fprintf(stderr, "read: %s: invalid file descriptor\n", arg);
+                return 2;
+            }
+            fd = atoi(arg);
+        } else {
+            fprintf(stderr, "read: usage: read [-r] [-u FD] [NAME...]\n");
+            return 2;
+        }
+        name_index++;
+    }
+    for (int i = name_index; i < cmd->argc; ++i) {
+        if (!is_name(cmd->args[i], strlen(cmd->args[i]))) {
+            fprintf(stderr, "read: '%s': not a valid identifier\n", cmd->args[i]);
+            return 2;
+        }
+    }
+    fflush(stdout);
+    size_t len = 0;
+    bool eof;
+    for (;;) {
+        ssize_t n = read_line_fd(fd, &line, &cap, len, &eof);
+        if (n < 0) {
+            return 1;
+        }
+        len = (size_t)n;
+        if (raw || eof || len == 0 || line[len - 1] != '\\') {
+            break;
+        }
+        line[--len] = '\0';  // Backslash-newline: join the next line
+    }
+    if (!raw) {
+        // Drop the escaping backslashes
+        char *out = line;
+        for (char *p = line; *p != '\0'; ++p) {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            *out++ = *p;
+        }
+        *out = '\0';
+    }
+    if (name_index >= cmd->argc) {
+        var_set("REPLY", line);
+        return eof;
+    }
+    char *p = line + strspn(line, " \t");
+    for (int i = name_index; i < cmd->argc; ++i) {
+        char *end = i == cmd->argc - 1 ? p + strlen(p) : p + strcspn(p, " \t");
+        if (i == cmd->argc - 1) {
+            // The last name takes the rest of the line, less trailing blanks
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+        }
+        char saved = *end;
+        *end = '\0';
+        var_set(cmd->args[i], p);
+        *end = saved;
+        p = end + strspn(end, " \t");
+    }
+    return eof;
+}
+
+/**
+ * count_newlines - Count the newline bytes in a buffer.
+ * @p: The bytes.
+ * @n: Number of bytes.
+ * Return: The number of '\n' bytes.
+ *
+ * Compares 16 (SSE2, NEON) or 32 (AVX2) bytes at a time. With SSE2 and AVX2 each compare
+ * subtracts its 0xFF matches from byte counters, which are summed with psadbw only every
+ * 255 blocks before they can overflow.
+ */
+size_t count_newlines(const char *p, size_t n) {
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (n - i >= 32) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int block = 0; block < 255 && n - i >= 32; ++block, i += 32) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(bytes, newline));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+                 (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+    }
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (n - i >= 16) {
+        __m128i acc = _mm_setzero_si128();
+        for (int block = 0; block < 255 && n - i >= 16; ++block, i += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(bytes, newline));
+        }
+        __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si64(sums) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (; n - i >= 16; i += 16) {
+        uint8x16_t bytes = vld1q_u8((const uint8_t *)(p + i));
+        count += vaddvq_u8(vandq_u8(vceqq_u8(bytes, newline), one));
+    }
+#endif
+    for (; i < n; ++i) {
+        count += p[i] == '\n';
+    }
+    return count;
+}
+
+/**
+ * find_fixed - Find the first occurrence of a fixed string.
+ * @p: The text.
+ * @n: Bytes of text.
+ * @needle: The string to look for.
+ * @m: Its length (at least 1).
+ * Return: The first occurrence, or NULL if there is none.
+ *
+ * With SSE2 or AVX2, each block of 16 or 32 positions is tested at once against the first
+ * and the last byte of the string, and only positions matching both are compared in full,
+ * so text such as digits that often contains the first byte is still skipped a block at a
+ * time. One byte is left to memchr(), and other targets use memmem().
+ */
+const char *find_fixed(const char *p, size_t n, const char *needle, size_t m) {
+    if (m == 1) {
+        return memchr(p, needle[0], n);
+    }
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+    const size_t width = 32;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+#else
+    const size_t width = 16;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+#endif
+    for (; i + m - 1 + width <= n; i += width) {
+#if defined(__AVX2__)
+        __m256i head = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), first);
+        __m256i tail = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + m - 1)), last);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(head, tail));
+#else
+        __m128i head = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), first);
+        __m128i tail = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + m - 1)), last);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(head, tail));
+#endif
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(p + at + 1, needle + 1, m - 2) == 0) {
+                return p + at;
+            }
+        }
+    }
+#endif
+    return i < n ? memmem(p + i, n - i, needle, m) : NULL;
+}
+
+/**
+ * filter_count - Parse the count operand of head -n/-c or tail -n.
+ * @text: The operand.
+ * @count: Receives the count.
+ * Return: true if it is a plain decimal number ("-5" and "+5" forms are left to the utilities).
+ */
+bool filter_count(const char *text, long long *count) {
+    char *end;
+    errno = 0;
+    *count = strtoll(text, &end, 10);
+    return isdigit((unsigned char)*text) && *end == '\0' && errno == 0;
+}
+
+/**
+ * filter_parse - Parse the arguments of a builtin text filter.
+ * @cmd: The command (head, tail, grep or wc).
+ * @args: Receives the parsed options.
+ * Return: true if the builtin supports every option given, false to run the utility instead.
+ *
+ * Supported: head [-n N | -c N | -N] [FILE], tail [-n N | -N] [FILE], grep [-Fvcq] PATTERN
+ * [FILE] with a fixed-string pattern, and wc [-lwc] [FILE]. Anything else (several files,
+ * regular expressions, other options) is left to the external command, so enabling the
+ * builtins never changes what a command line does.
+ */
+bool filter_parse(const Command *cmd, FilterArgs *args) {
+    char **argv = cmd->args;
+    const char *name = argv[0];
+    memset(args, 0, sizeof(*args));
+    args->kind = strcmp(name, "head") == 0 ? FILTER_HEAD
+                 : strcmp(name, "tail") == 0 ? FILTER_TAIL
+                 : strcmp(name, "grep") == 0 ? FILTER_GREP
+                                             : FILTER_WC;
+    args->count = 10;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        const char *opt = argv[i] + 1;
+        if (strcmp(opt, "-") == 0) {
+            i++;
+            break;
+        }
+        if (args->kind == FILTER_HEAD || args->kind == FILTER_TAIL) {
+            if (isdigit((unsigned char)*opt)) {
+                if (!filter_count(opt, &args->count)) {
+                    return false;
+                }
+                continue;
+            }
+            if (*opt != 'n' && (*opt != 'c' || args->kind == FILTER_TAIL)) {
+                return false;
+            }
+            args->bytes = *opt == 'c';
+            const char *value = opt[1] != '\0' ? opt + 1 : argv[++i];
+            if (value == NULL || !filter_count(value, &args->count)) {
+                return false;
+            }
+            continue;
+        }
+        const char *accepted = args->kind == FILTER_GREP ? "Fvcq" : "lwc";
+        if (opt[strspn(opt, accepted)] != '\0') {
+            return false;
+        }
+        for (; *opt != '\0'; ++opt) {
+            args->fixed |= *opt == 'F';
+            args->invert |= *opt == 'v';
+            args->count_only |= args->kind == FILTER_GREP && *opt == 'c';
+            args->quiet |= *opt == 'q';
+            args->lines |= *opt == 'l';
+            args->words |= *opt == 'w';
+            args->chars |= args->kind == FILTER_WC && *opt == 'c';
+        }
+    }
+    if (args->kind == FILTER_GREP) {
+        if ((args->pattern = argv[i]) == NULL || strchr(args->pattern, '\n') != NULL ||
+            (!args->fixed && strpbrk(args->pattern, ".[*^$\\") != NULL)) {
+            return false;
+        }
+        i++;
+    }
+    if (args->kind == FILTER_WC && !args->lines && !args->words && !args->chars) {
+        args->lines = args->words = args->chars = true;
+    }
+    if (argv[i] != NULL && argv[i + 1] != NULL) {
+        return false;
+    }
+    args->file = argv[i] != NULL && strcmp(argv[i], "-") != 0 ? argv[i] : NULL;
+    return true;
+}
+
+/**
+ * filter_read - Read the next block of a builtin filter's input.
+ * @fd: The input descriptor.
+ * @buf: Where to read to.
+ * @size: Room in buf.
+ * Return: Bytes read, 0 at end of input, or -1 on error (errno set).
+ *
+ * As with "read", a pipe whose writer may be a feeder is only read once the event loop says
+ * it is readable, so the feeder keeps running while the filter waits.
+ */
+ssize_t filter_read(int fd, char *buf, size_t size) {
+    for (;;) {
+        if (event_feeders > 0 && wait_for_input(fd) < 0) {
+            return -1;
+        }
+        ssize_t n = read(fd, buf, size);
+        if (n >= 0 || errno != EINTR) {
+            if (n > 0) {
+                filter_bytes += (unsigned long long)n;
+                STAT_ADD(filter_bytes, n);
+            }
+            return n;
+        }
+    }
+}
+
+/**
+ * filter_write - Write a builtin filter's output to stdout.
+ * @data: The bytes.
+ * @len: Number of bytes.
+ * Return: true on success, false once stdout is gone (the filter stops quietly).
+ */
+bool filter_write(const char *data, size_t len) {
+    return len == 0 || fwrite(data, 1, len, stdout) == len;
+}
+
+/**
+ * filter_head - Copy the first lines (or bytes) of the input to stdout.
+ * @args: The parsed options.
+ * @fd: The input.
+ * @buf: A FILTER_CHUNK buffer.
+ * Return: 0, 1 if stdout went away, or -1 on a read error (errno set).
+ *
+ * Whole blocks with fewer newlines than are still wanted are copied without looking for
+ * line ends. On a seekable input the offset is moved back to just after the last byte
+ * copied, so "{ head -n 1; cat; } < file" style readers find the rest.
+ */
+int filter_head(const FilterArgs *args, int fd, char *buf) {
+    long long left = args->count;
+    while (left > 0) {
+        ssize_t n = filter_read(fd, buf, FILTER_CHUNK);
+        if (n <= 0) {
+            return n < 0 ? -1 : 0;
+        }
+        size_t take = (size_t)n;
+        long long lines = args->bytes ? 0 : (long long)count_newlines(buf, (size_t)n);
+        if (args->bytes) {
+            take = (long long)take > left ? (size_t)left : take;
+            left -= (long long)take;
+        } else if (lines < left) {
+            left -= lines;
+        } else {
+            const char *p = buf;
+            for (; left > 0; --left) {
+                p = (const char *)memchr(p, '\n', (size_t)(buf + n - p)) + 1;
+            }
+            take = (size_t)(p - buf);
+        }
+        if (take < (size_t)n) {
+            lseek(fd, (off_t)take - n, SEEK_CUR);
+        }
+        if (!filter_write(buf, take)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * tail_start - Find where the last lines of a buffer begin.
+ * @data: The buffer.
+ * @len: Bytes in it.
+ * @count: Lines wanted.
+ * Return: Offset of the first of the last @count lines (0 if there are fewer).
+ *
+ * A final newline ends the last line rather than starting an empty one.
+ */
+size_t tail_start(const char *data, size_t len, long long count) {
+    long long need = count + (len > 0 && data[len - 1] == '\n');
+    if (count == 0) {
+        return len;
+    }
+    const char *end = data + len;
+    while (end > data) {
+        const char *newline = memrchr(data, '\n', (size_t)(end - data));
+        if (newline == NULL || --need == 0) {
+            return newline != NULL ? (size_t)(newline + 1 - data) : 0;
+        }
+        end = newline;
+    }
+    return 0;
+}
+
+/**
+ * filter_tail - Copy the last lines of the input to stdout.
+ * @args: The parsed options.
+ * @fd: The input.
+ * @buf: A FILTER_CHUNK buffer.
+ * Return: 0, 1 if stdout went away or memory ran out, or -1 on a read error (errno set).
+ *
+ * A regular file is scanned backwards from its end with pread(), so only the tail is read.
+ * Anything else is buffered, and the buffer is cut down to its last lines whenever it has
+ * doubled since the last cut, which keeps the work linear in the input.
+ */
+int filter_tail(const FilterArgs *args, int fd, char *buf) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        start = start < 0 ? 0 : start;
+        off_t from = args->count == 0 ? st.st_size : start;
+        off_t pos = st.st_size;
+        long long need = args->count;
+        for (bool last = true; need > 0 && pos > start; last = false) {
+            size_t len = (size_t)(pos - start < FILTER_CHUNK ? pos - start : FILTER_CHUNK);
+            if (pread(fd, buf, len, pos - (off_t)len) != (ssize_t)len) {
+                return -1;
+            }
+            pos -= (off_t)len;
+            // The file's final newline ends its last line
+            size_t at = last && buf[len - 1] == '\n' ? len - 1 : len;
+            const char *newline;
+            while (need > 0 && (newline = memrchr(buf, '\n', at)) != NULL) {
+                at = (size_t)(newline - buf);
+                if (--need == 0) {
+                    from = pos + (off_t)at + 1;
+                }
+            }
+        }
+        ssize_t n;
+        while ((n = pread(fd, buf, FILTER_CHUNK, from)) > 0) {
+            filter_bytes += (unsigned long long)n;
+            STAT_ADD(filter_bytes, n);
+            if (!filter_write(buf, (size_t)n)) {
+                return 1;
+            }
+            from += n;
+        }
+        lseek(fd, from, SEEK_SET);
+        return n < 0 ? -1 : 0;
+    }
+    char *data = NULL;
+    size_t len = 0, cap = 0, cut = FILTER_CHUNK;
+    ssize_t n;
+    while ((n = filter_read(fd, buf, FILTER_CHUNK)) > 0) {
+        if (len + (size_t)n > cap) {
+            size_t grown = cap ? cap * 2 : 2 * FILTER_CHUNK;
+            char *bigger = realloc(data, grown);
+            if (bigger == NULL) {
+                perror("tail: malloc");
+                free(data);
+                return 1;
+            }
+            data = bigger;
+            cap = grown;
+        }
+        memcpy(data + len, buf, (size_t)n);
+        len += (size_t)n;
+        if (len >= 2 * cut) {
+            // Later input can only push the start further on
+            size_t start = tail_start(data, len, args->count);
+            memmove(data, data + start, len - start);
+            len -= start;
+            cut = len > FILTER_CHUNK ? len : FILTER_CHUNK;
+        }
+    }
+    size_t start = tail_start(data, len, args->count);
+    int status = n < 0 ? -1 : !filter_write(data + start, len - start) ? 1 : 0;
+    free(data);
+    return status;
+}
+
+/**
+ * filter_grep - Copy the lines of the input that contain (or with -v lack) a fixed string.
+ * @args: The parsed options.
+ * @fd: The input.
+ * @buf: A FILTER_CHUNK buffer.
+ * Return: 0 if a line was selected, 1 if none was, 2 if stdout went away, or -1 on a read
+ *         error (errno set).
+ *
+ * Without -v the pattern is looked for with find_fixed() across all complete lines of a block
+ * at once, and only a hit is widened to its line, so lines without a match are never split.
+ * A partial last line is carried over to the next block; one longer than the buffer makes it
+ * grow, so every line is matched whole, as coreutils does. -q stops at the first match.
+ */
+int filter_grep(const FilterArgs *args, int fd, char *buf) {
+    size_t plen = strlen(args->pattern);
+    char *data = buf;            // buf, or a larger copy while a line does not fit in it
+    size_t cap = FILTER_CHUNK;
+    size_t kept = 0;
+    long long selected = 0;
+    int status = -2;             // Set once the scan stops early
+    bool eof = false;
+    while (!eof && status == -2) {
+        ssize_t n = filter_read(fd, data + kept, cap - kept);
+        if (n < 0) {
+            status = -1;
+            break;
+        }
+        eof = n == 0;
+        size_t len = kept + (size_t)n;
+        const char *end = eof ? data + len : memrchr(data, '\n', len);
+        if (end == NULL) {
+            if (len == cap) {
+                // A line longer than the buffer: grow it until the line ends
+                char *grown = data == buf ? malloc(cap * 2) : realloc(data, cap * 2);
+                if (grown == NULL) {
+                    status = -1;
+                    break;
+                }
+                if (data == buf) {
+                    memcpy(grown, buf, len);
+                }
+                data = grown;
+                cap *= 2;
+            }
+            kept = len;
+            continue;
+        } else if (!eof) {
+            end++;
+        }
+        const char *p = data;
+        while (p < end) {
+            const char *line_end = memchr(p, '\n', (size_t)(end - p));
+            const char *next = line_end != NULL ? line_end + 1 : end;
+            const char *line = p;
+            if (!args->invert) {
+                const char *hit = plen == 0 ? p : find_fixed(p, (size_t)(end - p), args->pattern, plen);
+                if (hit == NULL) {
+                    break;
+                }
+                line = memrchr(p, '\n', (size_t)(hit - p));
+                line = line != NULL ? line + 1 : p;
+                line_end = memchr(hit, '\n', (size_t)(end - hit));
+                next = line_end != NULL ? line_end + 1 : end;
+            } else if (plen == 0 || find_fixed(p, (size_t)(next - p), args->pattern, plen) != NULL) {
+                p = next;
+                continue;
+            }
+            selected++;
+            if (args->quiet) {
+                status = 0;
+                break;
+            }
+            if (!args->count_only) {
+                size_t line_len = (size_t)((line_end != NULL ? line_end : end) - line);
+                if (!filter_write(line, line_len) || putchar('\n') == EOF) {
+                    status = 2;
+                    break;
+                }
+            }
+            p = next;
+        }
+        kept = (size_t)(data + len - end);
+        memmove(data, end, kept);
+    }
+    if (data != buf) {
+        int saved_errno = errno;
+        free(data);
+        errno = saved_errno;
+    }
+    if (status != -2) {
+        return status;
+    }
+    if (args->count_only) {
+        printf("%lld\n", selected);
+    }
+    return selected > 0 ? 0 : 1;
+}
+
+/**
+ * filter_wc - Count the lines, words and bytes of the input.
+ * @args: The parsed options.
+ * @fd: The input.
+ * @buf: A FILTER_CHUNK buffer.
+ * Return: 0, or -1 on a read error (errno set).
+ *
+ * Lines are counted with count_newlines(); the input is only walked byte by byte for -w.
+ * The byte count of a regular file comes from fstat() when nothing else is asked for. The
+ * counts are laid out as coreutils does: one count alone is not padded, several are padded
+ * to 7 columns for a pipe or to the width of the file size for a regular file.
+ */
+int filter_wc(const FilterArgs *args, int fd, char *buf) {
+    long long lines = 0, words = 0, chars = 0;
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    off_t at = regular ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (regular && at >= 0 && !args->lines && !args->words) {
+        chars = st.st_size > at ? (long long)(st.st_size - at) : 0;
+    } else {
+        bool in_word = false;
+        ssize_t n;
+        while ((n = filter_read(fd, buf, FILTER_CHUNK)) > 0) {
+            chars += n;
+            if (args->lines) {
+                lines += (long long)count_newlines(buf, (size_t)n);
+            }
+            for (ssize_t i = 0; args->words && i < n; ++i) {
+                bool space = isspace((unsigned char)buf[i]) != 0;
+                words += !space && !in_word;
+                in_word = !space;
+            }
+        }
+        if (n < 0) {
+            return -1;
+        }
+    }
+    int shown = args->lines + args->words + args->chars;
+    int width = 1;
+    if (shown > 1) {
+        width = regular ? snprintf(NULL, 0, "%lld", (long long)st.st_size) : 7;
+    }
+    const long long values[] = {lines, words, chars};
+    const bool wanted[] = {args->lines, args->words, args->chars};
+    const char *sep = "";
+    for (int i = 0; i < 3; ++i) {
+        if (wanted[i]) {
+            printf("%s%*lld", sep, width, values[i]);
+            sep = " ";
+        }
+    }
+    if (args->file != NULL) {
+        printf(" %s", args->file);
+    }
+    putchar('\n');
+    return 0;
+}
+
+/**
+ * builtin_filter - Implement the builtin head, tail, grep and wc (set -o builtin-filters).
+ * @cmd: The parsed command (filter_parse() accepted its options).
+ * Return: The exit code of the utility it stands in for.
+ *
+ * As the last stage of a foreground pipeline that reads the pipe before it, it runs in the
+ * shell, reading the pipe directly; elsewhere it is forked without an exec. When head or grep -q returns early,
+ * its end of the pipe is closed straight away, so the writer gets SIGPIPE and stops.
+ */
+int builtin_filter(Command *cmd) {
+    FilterArgs args;
+    if (!filter_parse(cmd, &args)) {
+        fprintf(stderr, "%s: unsupported options\n", cmd->args[0]);
+        return 2;
+    }
+    int fd = STDIN_FILENO;
+    if (args.file != NULL && (fd = open(args.file, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (args.kind == FILTER_HEAD || args.kind == FILTER_TAIL) {
+            fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", cmd->args[0], args.file, strerror(errno));
+        } else {
+            fprintf(stderr, "%s: %s: %s\n", cmd->args[0], args.file, strerror(errno));
+        }
+        return args.kind == FILTER_GREP ? 2 : 1;
+    }
+    char *buf = malloc(FILTER_CHUNK);
+    if (buf == NULL) {
+        perror("shell: malloc");
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        return 1;
+    }
+    filter_runs++;
+    int (*const run[])(const FilterArgs *, int, char *) = {filter_head, filter_tail, filter_grep, filter_wc};
+    int status = run[args.kind](&args, fd, buf);
+    free(buf);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (status < 0) {
+        fprintf(stderr, "%s: read error: %s\n", cmd->args[0], strerror(errno));
+        status = args.kind == FILTER_GREP ? 2 : 1;
+    }
+    return status;
+}
+
+/**
+ * var_compare - qsort() comparator ordering variables by name.
+ * @a: Pointer to a ShellVar pointer.
+ * @b: Pointer to a ShellVar pointer.
+ * Return: strcmp() order of the two names.
+ */
+int var_compare(const void *a, const void *b) {
+    return strcmp((*(ShellVar *const *)a)->name, (*(ShellVar *const *)b)->name);
+}
+
+/**
+ * print_quoted - Print a value in single quotes so that the shell reads it back unchanged.
+ * @value: The value.
+ */
+void print_quoted(const char *value) {
+    putchar('\'');
+    for (const char *p = value; *p != '\0'; ++p) {
+        if (*p == '\'') {
+            fputs("'\\''", stdout);
+        } else {
+            putchar(*p);
+        }
+    }
+    putchar('\'');
+}
+
+/**
+ * builtin_export - Implement "export [-p] [NAME[=VALUE]...]": pass variables to children.
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 if a name is not a valid identifier.
+ *
+ * With no NAME (or -p) the exported variables are listed, sorted, as export commands.
+ */
+int builtin_export(Command *cmd) {
+    int first = cmd->args[1] != NULL && strcmp(cmd->args[1], "-p") == 0 ? 2 : 1;
+    if (cmd->args[first] == NULL) {
+        int count = 0;
+        for (int i = 0; i < VAR_TABLE_SIZE; ++i) {
+            for (const ShellVar *var = shell_vars[i]; var != NULL; var = var->next) {
+                count += var->exported;
+            }
+        }
+        ShellVar **vars = malloc(sizeof(*vars) * (size_t)(count ? count : 1));
+        if (vars == NULL) {
+            perror("export: malloc");
+            return 1;
+        }
+        int n = 0;
+        for (int i = 0; i < VAR_TABLE_SIZE; ++i) {
+            for (ShellVar *var = shell_vars[i]; var != NULL; var = var->next) {
+                if (var->exported) {
+                    vars[n++] = var;
+                }
+            }
+        }
+        qsort(vars, (size_t)n, sizeof(*vars), var_compare);
+        for (int i = 0; i < n; ++i) {
+            printf("export %s", vars[i]->name);
+            if (vars[i]->value != NULL) {
+                putchar('=');
+                print_quoted(vars[i]->value);
+            }
+            putchar('\n');
+        }
+        free(vars);
+        return 0;
+    }
+    int status = 0;
+    for (int i = first; cmd->args[i] != NULL; ++i) {
+        const char *word = cmd->args[i];
+        const char *eq = strchr(word, '=');
+        size_t len = eq ? (size_t)(eq - word) : strlen(word);
+        if (!is_name(word, len)) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", word);
+            status = 1;
+        } else if (eq != NULL) {
+            var_set_word(word, true);
+        } else {
+            ShellVar *var = var_create(word, len);
+            if (var != NULL && !var->exported) {
+                var->exported = true;
+                env_dirty = true;
+            }
+        }
+    }
+    return status;
+}
+
+/**
+ * builtin_unset - Implement "unset [-v] NAME...": remove shell variables.
+ * @cmd: The parsed builtin command.
+ * Return: 0, or 1 if a name is not a valid identifier.
+ */
+int builtin_unset(Command *cmd) {
+    int status = 0;
+    int first = cmd->args[1] != NULL && strcmp(cmd->args[1], "-v") == 0 ? 2 : 1;
+    for (int i = first; cmd->args[i] != NULL; ++i) {
+        if (!is_name(cmd->args[i], strlen(cmd->args[i]))) {
+            fprintf(stderr, "unset: '%s': not a valid identifier\n", cmd->args[i]);
+            status = 1;
+        } else {
+            var_unset(cmd->args[i]);
+        }
+    }
+    return status;
+}
+
+// Defined below: a loop body is a command list
+int execute_list(AndOr *list, AndOr *stop);
+
+/**
+ * run_loop - Run a for, while or until loop.
+ * @loop: The parsed loop.
+ * Return: The status of the last body command run, or 0 if the body never ran.
+ *
+ * The parsed condition and body are run again on every iteration; only the words that
+ * contain '$' are expanded, once per run. "break" and "continue" in the body are reported
+ * through loop_break / loop_continue, which the list runners check after each pipeline.
+ */
+int run_loop(Loop *loop) {
+    int status = 0;
+    ArenaMark mark = arena_mark(&expand_arena);
+    char **words = loop->words;
+    int nwords = loop->nwords;
+    if (loop->kind == LOOP_FOR && loop->expand) {
+        // Expand and split the word list once, when the loop starts
+        words = NULL;
+        nwords = 0;
+        int cap = 0;
+        int failed = push_word(&expand_arena, &words, &nwords, &cap, NULL);
+        nwords = 0;
+        for (int i = 0; failed == 0 && i < loop->nwords; ++i) {
+            failed = !needs_expansion(loop->words[i])
+                         ? push_word(&expand_arena, &words, &nwords, &cap, loop->words[i])
+                         : expand_word(&expand_arena, loop->words[i], true, &words, &nwords, &cap);
+        }
+        if (failed != 0) {
+            perror("shell: malloc");
+            arena_release(&expand_arena, mark);
+            return 1;
+        }
+    }
+    loop_depth++;
+    for (int i = 0;; ++i) {
+        if (loop->kind == LOOP_FOR) {
+            if (i >= nwords || var_set(loop->var, words[i]) != 0) {
+                break;
+            }
+        } else {
+            if (execute_list(loop->condition, NULL) == 2 || loop_break > 0 || loop_continue) {
+                if (loop_continue && loop_break == 0) {
+                    loop_continue = false;
+                    continue;
+                }
+                break;
+            }
+            if ((last_status == 0) == (loop->kind == LOOP_UNTIL) || (job_control && last_status == 128 + SIGINT)) {
+                break;
+            }
+        }
+        execute_list(loop->body, NULL);
+        status = last_status;
+        if (exit_requested || (job_control && last_status == 128 + SIGINT)) {
+            break;
+        }
+        if (loop_break > 0) {
+            break;
+        }
+        loop_continue = false;
+    }
+    loop_depth--;
+    if (loop_break > 0) {
+        // One level left; a pending "continue N" then applies to the enclosing loop
+        loop_break--;
+    }
+    arena_release(&expand_arena, mark);
+    return exit_requested ? last_status : status;
+}
+
+/**
+ * builtin_compound - Run a compound command (a loop) as a builtin.
+ * @cmd: The command; cmd->loop holds the parsed loop.
+ * Return: The loop's exit status.
+ */
+int builtin_compound(Command *cmd) {
+    return run_loop(cmd->loop);
+}
+
+// Defined below: "parallel" launches pipelines of its own
+int builtin_parallel(Command *cmd);
+
+// Defined below: "on" runs its ssh sessions through the parallel worker pool
+int builtin_on(Command *cmd);
+
+// Defined below: completion needs the builtin table
+int builtin_compgen(Command *cmd);
+
+// Defined below: a coprocess is launched like a background pipeline
+int builtin_coproc(Command *cmd);
+
+// Builtin commands, sorted by name for bsearch()
+static const Builtin builtins[] = {
+    {":", builtin_true, true, false},
+    {"[", builtin_test, true, false},
+    {"bg", builtin_bg, false, false},
+    {"break", builtin_break, false, false},
+    {"cd", builtin_cd, false, false},
+    {"compgen", builtin_compgen, true, false},
+    {"continue", builtin_continue, false, false},
+    {"coproc", builtin_coproc, false, true},
+    {"echo", builtin_echo, true, false},
+    {"exit", builtin_exit, false, false},
+    {"export", builtin_export, false, false},
+    {"false", builtin_false, true, false},
+    {"fg", builtin_fg, false, false},
+    {"hash", builtin_hash, false, false},
+    {"history", builtin_history, true, false},
+    {"jobs", builtin_jobs, false, false},
+    {"kill", builtin_kill, false, false},
+    {"on", builtin_on, false, false},
+    {"parallel", builtin_parallel, false, true},
+    {"printf", builtin_printf, true, false},
+    {"pwd", builtin_pwd, true, false},
+    {"read", builtin_read, true, false},
+    {"set", builtin_set, false, false},
+    {"shellstat", builtin_shellstat, true, false},
+    {"test", builtin_test, true, false},
+    {"true", builtin_true, true, false},
+    {"ulimit", builtin_ulimit, false, false},
+    {"unset", builtin_unset, false, false},
+    {"wait", builtin_wait, false, false},
+};
+
+/**
+ * builtin_compare - bsearch() comparator between a command name and a builtin.
+ * @key: The command name.
+ * @entry: A Builtin.
+ * Return: strcmp() order of the two names.
+ */
+int builtin_compare(const void *key, const void *entry) {
+    return strcmp(key, ((const Builtin *)entry)->name);
+}
+
+/**
+ * find_builtin - Look up a command name in the builtin table.
+ * @name: The command name.
+ * Return: The builtin, or NULL if the name is not a builtin.
+ */
+const Builtin *find_builtin(const char *name) {
+    return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(builtins[0]), builtin_compare);
+}
+
+// Loops run through the builtin machinery, so redirections and pipes work on them too
+static const Builtin compound_builtin = {"for", builtin_compound, false, false};
+
+// Text filters that stand in for external utilities with set -o builtin-filters (sorted)
+static const Builtin filter_builtins[] = {
+    {"grep", builtin_filter, true, false},
+    {"head", builtin_filter, true, false},
+    {"tail", builtin_filter, true, false},
+    {"wc", builtin_filter, true, false},
+};
+
+/**
+ * find_filter - Check whether a command can run as a builtin text filter.
+ * @cmd: The command.
+ * Return: The filter, or NULL if builtin filters are off, the name is not one of them, the
+ *         name is pinned to a binary with "hash -p", or an option is not supported.
+ */
+const Builtin *find_filter(const Command *cmd) {
+    if (!builtin_filters) {
+        return NULL;
+    }
+    const Builtin *filter = bsearch(cmd->args[0], filter_builtins, sizeof(filter_builtins) / sizeof(filter_builtins[0]),
+                                    sizeof(filter_builtins[0]), builtin_compare);
+    const PathEntry *entry = filter != NULL ? path_cache_find(cmd->args[0]) : NULL;
+    FilterArgs args;
+    return filter != NULL && (entry == NULL || !entry->pinned) && filter_parse(cmd, &args) ? filter : NULL;
+}
+
+/**
+ * filter_reads_pipe - Check whether a builtin filter stage only reads the pipe before it.
+ * @cmd: The segment (a builtin filter).
+ * @in_fd: The read end of the pipe from the previous stage (-1 if none).
+ * Return: true if the filter's input is that pipe: no file argument and no stdin redirection.
+ *
+ * The interactive shell ignores SIGINT, so a filter it runs itself could not be stopped on a
+ * terminal or an endless file. On a pipe from its own job, Ctrl-C kills the writer instead
+ * and the filter sees end of input; everywhere else the filter is forked.
+ */
+bool filter_reads_pipe(const Command *cmd, int in_fd) {
+    FilterArgs args;
+    if (in_fd < 0 || cmd->input_file != NULL || cmd->here_string != NULL || !filter_parse(cmd, &args) ||
+        args.file != NULL) {
+        return false;
+    }
+    for (int i = 0; i < cmd->nredirs; i++) {
+        if (cmd->redirs[i].fd == STDIN_FILENO) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * command_builtin - Find the builtin that runs a pipeline segment in the shell.
+ * @cmd: The segment.
+ * Return: The builtin (compound_builtin for a loop, a text filter if enabled), or NULL for
+ *         an external command.
+ */
+const Builtin *command_builtin(const Command *cmd) {
+    if (cmd->loop != NULL && cmd->argc == 1) {
+        // A loop after "coproc [NAME]" is that builtin's argument, not the segment itself
+        return &compound_builtin;
+    }
+    if (cmd->argc == 0) {
+        return NULL;
+    }
+    const Builtin *builtin = find_builtin(cmd->args[0]);
+    return builtin != NULL ? builtin : find_filter(cmd);
+}
+
+/**
+ * name_compare - qsort() comparator for an array of strings.
+ * @a: Pointer to a string.
+ * @b: Pointer to a string.
+ * Return: strcmp() order of the two strings.
+ */
+int name_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * completion_dir_fill - List the executables of a PATH directory.
+ * @cd: The index entry (its previous contents are replaced).
+ * Return: 0 on success, -1 if the directory could not be read.
+ *
+ * Subdirectories and files without an execute bit are left out. Symbolic links are
+ * followed, as exec does.
+ */
+int completion_dir_fill(CompletionDir *cd) {
+    DIR *stream = opendir(cd->dir);
+    if (stream == NULL) {
+        return -1;
+    }
+    size_t *offsets = NULL;
+    size_t count = 0, cap = 0, used = 0, pool_cap = 0;
+    char *pool = NULL;
+    struct dirent *entry;
+    bool failed = false;
+    while (!failed && (entry = readdir(stream)) != NULL) {
+        struct stat st;
+        if (entry->d_type == DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(dirfd(stream), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) ||
+            (st.st_mode & 0111) == 0) {
+            continue;
+        }
+        size_t len = strlen(entry->d_name);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            size_t *grown = realloc(offsets, sizeof(size_t) * cap);
+            failed = grown == NULL;
+            offsets = grown ? grown : offsets;
+        }
+        if (!failed && used + len + 1 > pool_cap) {
+            pool_cap = pool_cap ? pool_cap * 2 : 4096;
+            while (used + len + 1 > pool_cap) {
+                pool_cap *= 2;
+            }
+            char *grown = realloc(pool, pool_cap);
+            failed = grown == NULL;
+            pool = grown ? grown : pool;
+        }
+        if (!failed) {
+            memcpy(pool + used, entry->d_name, len + 1);
+            offsets[count++] = used;
+            used += len + 1;
+        }
+    }
+    closedir(stream);
+    char **names = failed ? NULL : malloc(sizeof(char *) * (count ? count : 1));
+    if (names == NULL) {
+        free(offsets);
+        free(pool);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        names[i] = pool + offsets[i];
+    }
+    free(offsets);
+    qsort(names, count, sizeof(char *), name_compare);
+    free(cd->names);
+    free(cd->pool);
+    cd->names = names;
+    cd->pool = pool;
+    cd->count = count;
+    completion_dir_reads++;
+    return 0;
+}
+
+/**
+ * completion_index_update - Bring the executable index in line with PATH and its directories.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * The index has one entry per PATH directory and is rebuilt when PATH changes. A directory
+ * is listed again only when its (device, inode, mtime) no longer matches, so a Tab press
+ * normally costs one stat() per PATH entry. As in the glob cache, a directory changed within
+ * the last DIR_CACHE_RACY_SEC seconds is not trusted until it has been quiet that long.
+ */
+int completion_index_update(void) {
+    const char *path = var_get("PATH", 4);
+    if (path == NULL) {
+        path = "/usr/bin:/bin";
+    }
+    if (completion_path == NULL || strcmp(completion_path, path) != 0) {
+        for (int i = 0; i < completion_ndirs; ++i) {
+            free(completion_dirs[i].dir);
+            free(completion_dirs[i].names);
+            free(completion_dirs[i].pool);
+        }
+        free(completion_dirs);
+        free(completion_path);
+        completion_dirs = NULL;
+        completion_ndirs = 0;
+        completion_path = strdup(path);
+        int count = 1;
+        for (const char *p = path; *p != '\0'; ++p) {
+            count += *p == ':';
+        }
+        completion_dirs = calloc((size_t)count, sizeof(CompletionDir));
+        if (completion_path == NULL || completion_dirs == NULL) {
+            free(completion_path);
+            completion_path = NULL;
+            return -1;
+        }
+        for (const char *p = path;; ++p) {
+            size_t len = strcspn(p, ":");
+            CompletionDir *cd = &completion_dirs[completion_ndirs];
+            cd->dir = len > 0 ? strndup(p, len) : strdup(".");
+            if (cd->dir == NULL) {
+                return -1;
+            }
+            completion_ndirs++;
+            p += len;
+            if (*p == '\0') {
+                break;
+            }
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < completion_ndirs; ++i) {
+        CompletionDir *cd = &completion_dirs[i];
+        struct stat st;
+        if (stat(cd->dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            cd->count = 0;
+            cd->listed = false;
+            continue;
+        }
+        if (cd->listed && !cd->racy && cd->dev == st.st_dev && cd->ino == st.st_ino &&
+            cd->mtime.tv_sec == st.st_mtim.tv_sec && cd->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            continue;
+        }
+        cd->listed = completion_dir_fill(cd) == 0;
+        if (!cd->listed) {
+            cd->count = 0;
+        }
+        cd->dev = st.st_dev;
+        cd->ino = st.st_ino;
+        cd->mtime = st.st_mtim;
+        cd->racy = now.tv_sec - st.st_mtim.tv_sec < DIR_CACHE_RACY_SEC;
+    }
+    return 0;
+}
+
+/**
+ * completion_add - Append a candidate to a completion list.
+ * @list: In/out: the malloc'd candidate array.
+ * @count: In/out: number of candidates.
+ * @cap: In/out: allocated slots.
+ * @name: Candidate text (not copied: it must outlive the list).
+ * @len: Length of name.
+ * @dir: The candidate is a directory.
+ * Return: 0 on success, -1 on allocation failure.
+ */
+int completion_add(Completion **list, size_t *count, size_t *cap, const char *name, size_t len, bool dir) {
+    if (*count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 64;
+        Completion *grown = realloc(*list, sizeof(Completion) * grown_cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        *list = grown;
+        *cap = grown_cap;
+    }
+    (*list)[*count].name = name;
+    (*list)[*count].len = len;
+    (*list)[*count].dir = dir;
+    (*count)++;
+    return 0;
+}
+
+/**
+ * completion_compare - qsort() comparator for completion candidates.
+ * @a: A Completion.
+ * @b: A Completion.
+ * Return: strcmp() order of the two names.
+ */
+int completion_compare(const void *a, const void *b) {
+    return strcmp(((const Completion *)a)->name, ((const Completion *)b)->name);
+}
+
+/**
+ * complete_commands - Collect the builtins and executables whose name starts with a prefix.
+ * @prefix: The typed prefix.
+ * @len: Length of prefix.
+ * @list: In/out: candidate array (see completion_add).
+ * @count: In/out: number of candidates; sorted and free of duplicates on return.
+ * @cap: In/out: allocated slots.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * Every source is sorted, so each one is entered by binary search and read only as far as
+ * the prefix matches: the builtin table, each PATH directory of the executable index,
+ * and the command path cache (which also holds names pinned with "hash -p").
+ */
+int complete_commands(const char *prefix, size_t len, Completion **list, size_t *count, size_t *cap) {
+    if (completion_index_update() != 0) {
+        return -1;
+    }
+    completion_lookups++;
+    size_t nbuiltins = sizeof(builtins) / sizeof(builtins[0]);
+    size_t lo = 0, hi = nbuiltins;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(builtins[mid].name, prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < nbuiltins && strncmp(builtins[lo].name, prefix, len) == 0; ++lo) {
+        if (completion_add(list, count, cap, builtins[lo].name, strlen(builtins[lo].name), false) != 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < completion_ndirs; ++i) {
+        const CompletionDir *cd = &completion_dirs[i];
+        lo = 0;
+        hi = cd->count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (strncmp(cd->names[mid], prefix, len) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < cd->count && strncmp(cd->names[lo], prefix, len) == 0; ++lo) {
+            if (completion_add(list, count, cap, cd->names[lo], strlen(cd->names[lo]), false) != 0) {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+        for (const PathEntry *entry = path_cache[i]; entry != NULL; entry = entry->next) {
+            if (strncmp(entry->name, prefix, len) == 0 &&
+                completion_add(list, count, cap, entry->name, strlen(entry->name), false) != 0) {
+                return -1;
+            }
+        }
+    }
+    qsort(*list, *count, sizeof(Completion), completion_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < *count; ++i) {
+        if (unique == 0 || strcmp((*list)[unique - 1].name, (*list)[i].name) != 0) {
+            (*list)[unique++] = (*list)[i];
+        }
+    }
+    *count = unique;
+    return 0;
+}
+
+/**
+ * complete_files - Collect the entries of a directory that start with a prefix.
+ * @word: The typed word: an optional directory part up to the last '/', then the prefix.
+ * @len: Length of word.
+ * @list: In/out: candidate array (see completion_add); names exclude the directory part.
+ * @count: In/out: number of candidates, sorted on return.
+ * @cap: In/out: allocated slots.
+ * Return: 0 on success (no candidates if the directory cannot be read), -1 on allocation
+ *         failure.
+ *
+ * Directories are listed through the glob cache (dir_cache_get), so completing in the
+ * same directory again costs one stat(). Names starting with '.' are only offered when
+ * the prefix starts with '.'. The candidates point into the cache entry and stay valid
+ * until the next lookup in the glob cache.
+ */
+int complete_files(const char *word, size_t len, Completion **list, size_t *count, size_t *cap) {
+    const char *slash = memrchr(word, '/', len);
+    size_t dir_len = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+    char *dir_path = dir_len == 0 ? strdup(".") : strndup(word, dir_len);
+    if (dir_path == NULL) {
+        return -1;
+    }
+    const char *prefix = word + dir_len;
+    size_t prefix_len = len - dir_len;
+    DirCache *dir = dir_cache_get(dir_path);
+    if (dir == NULL) {
+        free(dir_path);
+        return 0;
+    }
+    size_t lo = 0, hi = dir->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(dir->pool + dir->names[mid].offset, prefix, prefix_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int status = 0;
+    for (; status == 0 && lo < dir->count; ++lo) {
+        const DirName *entry = &dir->names[lo];
+        const char *name = dir->pool + entry->offset;
+        if (strncmp(name, prefix, prefix_len) != 0) {
+            break;
+        }
+        if (name[0] == '.' && prefix[0] != '.') {
+            continue;
+        }
+        bool is_dir = entry->type == DT_DIR;
+        if (entry->type == DT_UNKNOWN || entry->type == DT_LNK) {
+            struct stat st;
+            char *full;
+            if (asprintf(&full, "%s%s", dir_path, name) >= 0) {
+                is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+                free(full);
+            }
+        }
+        status = completion_add(list, count, cap, name, entry->len, is_dir);
+    }
+    free(dir_path);
+    return status;
+}
+
+/**
+ * completion_word - Find the start of the word that ends at the cursor.
+ * @line: The line.
+ * @pos: Cursor offset.
+ * @command: Output parameter: the word is in command position.
+ * Return: Offset of the first byte of the word.
+ *
+ * A word ends at an unescaped blank or operator. It is in command position at the start of
+ * the line, after '|', '&', ';' or '(', and after a reserved word or prefix that is
+ * followed by a command (do, then, else, while, until, time, !).
+ */
+size_t completion_word(const char *line, size_t pos, bool *command) {
+    size_t start = pos;
+    while (start > 0 && (strchr(" \t|&;<>()", line[start - 1]) == NULL ||
+                         (start > 1 && line[start - 2] == '\\'))) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) {
+        before--;
+    }
+    *command = before == 0 || strchr("|&;(", line[before - 1]) != NULL;
+    if (!*command) {
+        size_t word_end = before;
+        while (before > 0 && strchr(" \t|&;<>()", line[before - 1]) == NULL) {
+            before--;
+        }
+        static const char *const leaders[] = {"do", "then", "else", "while", "until", "time", "!"};
+        for (size_t i = 0; i < sizeof(leaders) / sizeof(leaders[0]); ++i) {
+            if (strlen(leaders[i]) == word_end - before && memcmp(line + before, leaders[i], word_end - before) == 0) {
+                *command = before == 0 || strchr(" \t|&;(", line[before - 1]) != NULL;
+            }
+        }
+    }
+    return start;
+}
+
+/**
+ * complete_word - Collect the completions of a typed word.
+ * @raw: The word as typed (it may contain backslash escapes).
+ * @len: Length of raw.
+ * @command: Complete a command name instead of a file name.
+ * @word: Output parameter for the malloc'd word with escapes removed.
+ * @list: Output parameter for the malloc'd candidate array.
+ * @count: Output parameter for the number of candidates.
+ * Return: 0 on success, -1 on allocation failure.
+ *
+ * A command word with a '/' in it completes as a file name.
+ */
+int complete_word(const char *raw, size_t len, bool command, char **word, Completion **list, size_t *count) {
+    *list = NULL;
+    *count = 0;
+    *word = malloc(len + 1);
+    if (*word == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (raw[i] == '\\' && i + 1 < len) {
+            i++;
+        }
+        (*word)[n++] = raw[i];
+    }
+    (*word)[n] = '\0';
+    size_t cap = 0;
+    if (command && memchr(*word, '/', n) == NULL) {
+        return complete_commands(*word, n, list, count, &cap);
+    }
+    return complete_files(*word, n, list, count, &cap);
+}
+
+/**
+ * editor_list_completions - Print the candidates below the edited line, in columns.
+ * @list: The candidates.
+ * @count: Number of candidates (more than one).
+ *
+ * Past COMPLETION_LIST_MAX candidates the user is asked first, as other shells do.
+ */
+void editor_list_completions(const Completion *list, size_t count) {
+    if (count > COMPLETION_LIST_MAX) {
+        printf("\nDisplay all %zu possibilities? (y or n)", count);
+        fflush(stdout);
+        int key = editor_key();
+        if (key != 'y' && key != 'Y') {
+            printf("\n");
+            fflush(stdout);
+            return;
+        }
+    }
+    struct winsize ws;
+    size_t cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t width = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t w = text_columns(list[i].name, list[i].len) + list[i].dir + 2;
+        width = w > width ? w : width;
+    }
+    size_t per_row = cols / width ? cols / width : 1;
+    size_t rows = (count + per_row - 1) / per_row;
+    printf("\n");
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < per_row; ++c) {
+            size_t i = c * rows + r;
+            if (i >= count) {
+                break;
+            }
+            int shown = (int)(text_columns(list[i].name, list[i].len) + list[i].dir);
+            printf("%s%s%*s", list[i].name, list[i].dir ? "/" : "", c + 1 < per_row ? (int)width - shown : 0, "");
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/**
+ * editor_complete - Complete the word before the cursor (Tab).
+ * @ed: The editor.
+ * @list_all: List the candidates if there is nothing to insert (second Tab in a row).
+ * Return: true if text was inserted.
+ *
+ * A single candidate is inserted in full, followed by ' ' (or '/' for a directory). With
+ * several, their longest common prefix is inserted. Inserted characters the shell would
+ * treat specially are backslash-escaped.
+ */
+bool editor_complete(LineEditor *ed, bool list_all) {
+    bool command;
+    size_t start = completion_word(ed->buf, ed->pos, &command);
+    char *word;
+    Completion *list;
+    size_t count;
+    if (complete_word(ed->buf + start, ed->pos - start, command, &word, &list, &count) != 0 || count == 0) {
+        free(word);
+        free(list);
+        return false;
+    }
+    const char *slash = strrchr(word, '/');
+    size_t typed = strlen(slash != NULL ? slash + 1 : word);
+    size_t common = list[0].len;
+    for (size_t i = 1; i < count; ++i) {
+        size_t j = 0;
+        while (j < common && j < list[i].len && list[i].name[j] == list[0].name[j]) {
+            j++;
+        }
+        common = j;
+    }
+    bool inserted = false;
+    for (size_t i = typed; i < common; ++i) {
+        char c = list[0].name[i];
+        if (strchr(WORD_SPECIALS "*?[]$#~", c) != NULL) {
+            editor_insert(ed, "\\", 1);
+        }
+        editor_insert(ed, &c, 1);
+        inserted = true;
+    }
+    if (count == 1) {
+        editor_insert(ed, list[0].dir ? "/" : " ", 1);
+        inserted = true;
+    } else if (!inserted && list_all) {
+        editor_list_completions(list, count);
+    }
+    free(word);
+    free(list);
+    return inserted;
+}
+
+/**
+ * builtin_compgen - "compgen -c|-f|-b [PREFIX]": print the completions of a word.
+ * @cmd: The command.
+ * Return: 0 if something was printed, 1 if there are no completions, 2 on a usage error.
+ *
+ * -c completes command names (builtins, PATH executables, cached paths; a name with a '/'
+ * completes as a file), -b builtins only and -f file names, exactly as Tab does in the
+ * line editor.
+ */
+int builtin_compgen(Command *cmd) {
+    const char *mode = cmd->args[1];
+    if (mode == NULL || (strcmp(mode, "-c") != 0 && strcmp(mode, "-f") != 0 && strcmp(mode, "-b") != 0) ||
+        (cmd->args[2] != NULL && cmd->args[3] != NULL)) {
+        fprintf(stderr, "compgen: usage: compgen -c|-f|-b [PREFIX]\n");
+        return 2;
+    }
+    const char *prefix = cmd->args[2] != NULL ? cmd->args[2] : "";
+    char *word;
+    Completion *list;
+    size_t count;
+    if (complete_word(prefix, strlen(prefix), mode[1] != 'f', &word, &list, &count) != 0) {
+        perror("compgen");
+        free(word);
+        free(list);
+        return 1;
+    }
+    const char *slash = strrchr(word, '/');
+    int dir_len = slash != NULL ? (int)(slash - word) + 1 : 0;
+    size_t shown = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (mode[1] == 'b' && find_builtin(list[i].name) == NULL) {
+            continue;
+        }
+        printf("%.*s%s\n", dir_len, word, list[i].name);
+        shown++;
+    }
+    free(word);
+    free(list);
+    return shown > 0 ? 0 : 1;
+}
+
+/**
+ * builtin_invoke - Call a builtin in the shell process with its prefix assignments in effect.
+ * @builtin: The builtin.
+ * @cmd: The command; "NAME=value" prefixes (cmd->assigns) last for this call only.
+ * Return: The builtin's exit code.
+ */
+int builtin_invoke(const Builtin *builtin, Command *cmd) {
+    if (cmd->nassign == 0) {
+        return builtin->run(cmd);
+    }
+    char **saved = arena_alloc(&expand_arena, sizeof(char *) * (size_t)cmd->nassign);
+    if (saved == NULL) {
+        perror("shell: malloc");
+        return 1;
+    }
+    for (int i = 0; i < cmd->nassign; ++i) {
+        const char *eq = strchr(cmd->assigns[i], '=');
+        const char *old = var_get(cmd->assigns[i], (size_t)(eq - cmd->assigns[i]));
+        saved[i] = old ? arena_strndup(&expand_arena, old, strlen(old)) : NULL;
+        var_set_word(cmd->assigns[i], false);
+    }
+    int status = builtin->run(cmd);
+    for (int i = cmd->nassign - 1; i >= 0; --i) {
+        char *eq = strchr(cmd->assigns[i], '=');
+        *eq = '\0';
+        if (saved[i] != NULL) {
+            var_set(cmd->assigns[i], saved[i]);
+        } else {
+            var_unset(cmd->assigns[i]);
+        }
+        *eq = '=';
+    }
+    return status;
+}
+
+/**
+ * builtin_flush - Flush a builtin's output and fold a failed write into its status.
+ * @cmd: The command (args[0] names it in the message).
+ * @status: The builtin's exit code.
+ * Return: status, or 1 if it was 0 and stdout could not be written ("echo hi > /dev/full").
+ *
+ * The error flag of stdout is cleared afterwards, so the next builtin starts clean.
+ */
+int builtin_flush(const Command *cmd, int status) {
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "shell: %s: write error: %s\n", cmd->args[0], strerror(errno));
+        status = status == 0 ? 1 : status;
+    }
+    clearerr(stdout);
+    return status;
+}
+
+/**
+ * run_builtin_fds - Run a builtin in the shell process with the given stdin/stdout.
+ * @builtin: The builtin.
+ * @cmd: The command (its < and > redirections are applied on top of in_fd and out_fd).
+ * @in_fd: Descriptor to use as stdin (-1 to keep the shell's).
+ * @out_fd: Descriptor to use as stdout (-1 to keep the shell's).
+ * Return: The builtin's exit code.
+ *
+ * The shell's own stdin/stdout are saved above fd 10 and restored afterwards, so no process
+ * is created at all. stdout is flushed on both sides of the swap. Numbered redirections
+ * ("2>err", ">&2") are applied the same way, in order, and undone in reverse.
+ */
+int run_builtin_fds(const Builtin *builtin, Command *cmd, int in_fd, int out_fd) {
+    int redir_in = -1, redir_out = -1;
+    if (!builtin->own_redirections && open_redirections(cmd, &redir_in, &redir_out) != 0) {
+        return 1;
+    }
+    if (redir_in != -1) {
+        in_fd = redir_in;
+    }
+    if (redir_out != -1) {
+        out_fd = redir_out;
+    }
+    if (in_fd == -1 && out_fd == -1 && cmd->nredirs == 0) {
+        return builtin_flush(cmd, builtin_invoke(builtin, cmd));
+    }
+    int saved_in = -1, saved_out = -1;
+    int *saved = NULL;
+    fflush(stdout);
+    fflush(stderr);
+    if (in_fd != -1) {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    int status = 1;
+    if (cmd->nredirs > 0 && (saved = malloc(sizeof(int) * 2 * (size_t)cmd->nredirs)) == NULL) {
+        perror("shell: malloc");
+    } else if (redirect_apply(cmd, saved) == 0) {
+        status = builtin_flush(cmd, builtin_invoke(builtin, cmd));
+        fflush(stderr);
+        if (saved != NULL) {
+            redirect_restore(cmd, saved, cmd->nredirs);
+        }
+    }
+    free(saved);
+    if (in_fd != -1) {
+        if (saved_in != -1) {
+            dup2(saved_in, STDIN_FILENO);
+            close(saved_in);
+        } else {
+            close(STDIN_FILENO);
+        }
+    }
+    if (out_fd != -1) {
+        if (saved_out != -1) {
+            dup2(saved_out, STDOUT_FILENO);
+            close(saved_out);
+        } else {
+            close(STDOUT_FILENO);
+        }
+    }
+    if (redir_in != -1) {
+        close(redir_in);
+    }
+    if (redir_out != -1) {
+        close(redir_out);
+    }
+    return status;
+}
+
+/**
+ * subshell_enter - Turn a forked child into a subshell that runs commands of its own.
+ * Return: 0 on success, -1 if the SIGCHLD pipe could not be recreated.
+ *
+ * The child gets no job control and an empty job table; the parent's jobs are not its own.
+ * It does not exec, so close-on-exec does not apply: every descriptor above stderr except
+ * the trace stream and the coprocess pipes ("echo job >&$W_IN | ...") is closed, or a pipe
+ * end held by the parent (a feeder's write end, say) would keep the child's stdin from ever
+ * reaching end of file. The parent's event loop is dropped and a fresh one set up.
+ * SIGPIPE is back to its default; only feeders (feeder_pump()) shield their writes from it.
+ */
+int subshell_enter(void) {
+    int keep[2 * COPROC_MAX + 1];
+    int nkeep = 0;
+    event_reset();
+    if (trace_out != NULL) {
+        keep[nkeep++] = fileno(trace_out);
+    }
+    for (const Coproc *cp = coproc_list; cp != NULL; cp = cp->next) {
+        keep[nkeep++] = cp->in_fd;
+        keep[nkeep++] = cp->out_fd;
+    }
+    // Sort the few kept descriptors (no malloc or qsort in a freshly forked child)
+    for (int i = 1; i < nkeep; ++i) {
+        for (int j = i; j > 0 && keep[j - 1] > keep[j]; --j) {
+            int fd = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = fd;
+        }
+    }
+    unsigned from = 3;
+    for (int i = 0; i < nkeep; ++i) {
+        if (keep[i] >= (int)from) {
+            if (keep[i] > (int)from) {
+                close_range(from, (unsigned)keep[i] - 1, 0);
+            }
+            from = (unsigned)keep[i] + 1;
+        }
+    }
+    close_range(from, ~0U, 0);
+    job_control = false;
+    job_list = NULL;
+    if (job_signals_init(false) != 0) {
+        return -1;
+    }
+    // A loop writing into a pipe whose reader left ("while true; do echo y; done | head")
+    // must die like an external command would, not spin on EPIPE
+    signal(SIGPIPE, SIG_DFL);
+    sigpipe_default = true;
+    return 0;
+}
+
+/**
+ * spawn_builtin - Run a builtin as a pipeline segment in a forked copy of the shell.
+ * @builtin: The builtin.
+ * @cmd: The command.
+ * @job: The job the process belongs to (pgid 0 starts a new process group).
+ * @in_fd: Pipe read end to use as stdin (-1 to inherit).
+ * @out_fd: Pipe write end to use as stdout (-1 to inherit).
+ * Return: The child's pid, or -1 if fork failed.
+ *
+ * There is no exec: the child runs the builtin and exits with its status, so a builtin
+ * stage costs one fork instead of fork + exec + dynamic loading.
+ */
+pid_t spawn_builtin(const Builtin *builtin, Command *cmd, const Job *job, int in_fd, int out_fd) {
+    // Buffered output would otherwise be written twice
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("shell: fork");
+        spawn_failure = 1;
+        return -1;
+    }
+    if (pid == 0) {
+        child_enter(job, in_fd, out_fd);
+        if (job->limits != NULL && run_limits_enter(job->limits) != 0) {
+            _exit(126);
+        }
+        if (subshell_enter() != 0) {
+            _exit(1);
+        }
+        if (builtin->own_redirections ? redirect_apply(cmd, NULL) != 0 : redirect_io(cmd) != 0) {
+            _exit(1);
+        }
+        for (int i = 0; i < cmd->nassign; ++i) {
+            var_set_word(cmd->assigns[i], true);  // The child is discarded afterwards
+        }
+        _exit(builtin_flush(cmd, builtin->run(cmd)));
+    }
+    if (job_control) {
+        setpgid(pid, job->pgid ? job->pgid : pid);
+    }
+    return pid;
+}
+
+/**
+ * launch_pipeline - Start every segment of a pipeline without waiting for it.
+ * @commands: The pipeline segments.
+ * @num_commands: Number of segments.
+ * @job: The job that receives the launched processes.
+ * @in_fd: Descriptor for the first segment's stdin (-1 to inherit).
+ * @out_fd: Descriptor for the last segment's stdout (-1 to inherit).
+ *
+ * Segments are chained with close-on-exec pipes; the parent keeps no pipe ends afterwards.
+ * Redirections written on the command line still override in_fd and out_fd. A leading
+ * "cat FILE" or "< FILE" segment is fed by the shell with splice(). Builtin segments
+ * run in a forked copy of the shell without exec; a simple builtin (echo, printf, test, ...)
+ * ending a foreground pipeline runs in the shell itself. With set -o pinstages every
+ * launched stage is bound to a CPU next to its neighbours' (pin_pipeline_start).
+ */
+void launch_pipeline(Command *commands, int num_commands, Job *job, int in_fd, int out_fd) {
+    int prev_fd = in_fd;
+    job->start_ns = now_ns();
+    const char *feed_file = feeder_stage_file(commands, num_commands);
+    int pin = pin_pipeline_start(num_commands);
+
+    for (int i = 0; i < num_commands; ++i) {
+        int pipefd[2] = {-1, out_fd};
+        if (i < num_commands - 1) {
+            // Create a pipe for this and the next command
+            if (make_pipe(pipefd, job->pipe_size, pipe_packet_mode) < 0) {
+                perror("shell: pipe");
+                break;
+            }
+        }
+        Command *stage = &commands[i];
+        Command cat_stage;
+        char *cat_args[3];
+        if (i == 0 && feed_file != NULL) {
+            // The feeder owns the write end; a failed open leaves the next stage at EOF
+            int fed = start_feeder(stage, feed_file, pipefd[1]);
+            if (fed < 0) {
+                close(pipefd[1]);
+            }
+            if (fed <= 0) {
+                prev_fd = pipefd[0];
+                continue;
+            }
+            if (stage->argc == 0) {
+                // "< FILE |" on a file the shell does not feed: "cat FILE" opens it itself
+                static char cat_name[] = "cat";
+                cat_args[0] = cat_name;
+                cat_args[1] = stage->input_file;
+                cat_args[2] = NULL;
+                cat_stage = *stage;
+                cat_stage.args = cat_args;
+                cat_stage.argc = 2;
+                cat_stage.input_file = NULL;
+                stage = &cat_stage;
+            }
+        }
+
+        const Builtin *builtin = command_builtin(stage);
+        const PinCpu *stage_cpu = pin >= 0 ? &pin_cpus[(pin + i) % pin_ncpus] : NULL;
+        if (stage_cpu != NULL && pin_mode == PIN_NUMA) {
+            pin_memory(stage_cpu->node);
+        }
+        pin_child_cpu = stage_cpu != NULL ? stage_cpu->cpu : -1;
+        pid_t pid;
+        if (builtin != NULL && builtin->stage_safe && i == num_commands - 1 && job->foreground && out_fd == -1 &&
+            job->limits == NULL && (builtin->run != builtin_filter || filter_reads_pipe(stage, prev_fd))) {
+            // Last stage of a foreground pipeline: run it in the shell, reading the pipe directly
+            struct rusage before;
+            if (job->timed || trace_out != NULL) {
+                getrusage(RUSAGE_SELF, &before);
+            }
+            job->builtin_status = run_builtin_fds(builtin, stage, prev_fd, -1);
+            if (job->timed || trace_out != NULL) {
+                job_shell_stage(job, stage, job->builtin_status, &before);
+            }
+            pid = -1;
+        } else if (builtin != NULL) {
+            pid = spawn_builtin(builtin, stage, job, prev_fd, pipefd[1]);
+        } else {
+            pid = spawn_command(stage, job, prev_fd, pipefd[1]);
+        }
+        bool placed = pin_child_cpu >= 0;
+        pin_child_cpu = -1;
+        if (pid < 0 && i == num_commands - 1 && job->builtin_status < 0) {
+            // The pipeline's status is that of its last stage, even one that never started
+            job->builtin_status = spawn_failure;
+        }
+        commands[i].pid = pid;
+        STAT_ADD(commands, 1);
+        if (pid > 0) {
+            STAT_ADD(processes, 1);
+            job_add_process(job, pid);
+            if (placed) {
+                pin_stages++;
+            }
+            if (job->timed || trace_out != NULL) {
+                job->procs[job->nprocs - 1].name = argv_join(stage->args, stage->argc);
+            }
+        }
+        // Parent keeps only the read end for the next segment
+        if (prev_fd != -1 && prev_fd != in_fd) {
+            close(prev_fd);
+        }
+        prev_fd = -1;
+        if (i < num_commands - 1) {
+            close(pipefd[1]);
+            prev_fd = pipefd[0];
+        }
+    }
+    // Close any remaining pipe read end in parent
+    if (prev_fd != -1 && prev_fd != in_fd) {
+        close(prev_fd);
+    }
+    if (pin >= 0 && pin_mode == PIN_NUMA) {
+        pin_memory(-1);
+    }
+    job->launch_ns = now_ns() - job->start_ns;
+}
+
+/**
+ * coproc_running - Check whether a coprocess has not terminated yet.
+ * @cp: The coprocess.
+ * Return: true while its job still has it as a live process.
+ */
+bool coproc_running(const Coproc *cp) {
+    for (const Job *job = job_list; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; ++i) {
+            if (job->procs[i].pid == cp->pid) {
+                return !job->procs[i].exited;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * coproc_close_input - Close the shell's end of the pipe to a coprocess's stdin.
+ * @cp: The coprocess.
+ *
+ * NAME_IN is unset; NAME_OUT stays open, so a worker that only writes its result once it
+ * sees end of file (sort, wc) can still be read. Closing an already closed input is a no-op.
+ */
+void coproc_close_input(Coproc *cp) {
+    if (cp->in_fd < 0) {
+        return;
+    }
+    char var[NAME_MAX];
+    snprintf(var, sizeof(var), "%s_IN", cp->name);
+    var_unset(var);
+    close(cp->in_fd);
+    cp->in_fd = -1;
+}
+
+/**
+ * coproc_close - Close the shell's ends of a coprocess's pipes and forget it.
+ * @link: Link to the coprocess in coproc_list.
+ *
+ * The NAME_IN, NAME_OUT and NAME_PID variables are unset. A coprocess that reads its
+ * stdin to the end then sees end of file and can exit; its job is reaped as usual.
+ */
+void coproc_close(Coproc **link) {
+    Coproc *cp = *link;
+    char var[NAME_MAX];
+    const char *suffixes[] = {"_IN", "_OUT", "_PID"};
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        snprintf(var, sizeof(var), "%s%s", cp->name, suffixes[i]);
+        var_unset(var);
+    }
+    if (cp->in_fd >= 0) {
+        close(cp->in_fd);
+    }
+    close(cp->out_fd);
+    *link = cp->next;
+    free(cp->name);
+    free(cp);
+    coproc_count--;
+}
+
+/**
+ * builtin_coproc - "coproc [NAME] COMMAND [ARGS...]": start a warm worker with two pipes.
+ * @cmd: The command.
+ * Return: 0 if the coprocess was started, 1 on error, 2 on a usage error.
+ *
+ * COMMAND runs as a background job (it shows up in "jobs") with its stdin and stdout
+ * connected to pipes whose other ends stay open in the shell: write requests to
+ * descriptor $NAME_IN and read replies from $NAME_OUT ("echo $f >&$CHECK_IN; read -u
+ * $CHECK_OUT verdict"); $NAME_PID is its process id. A long-lived interpreter then pays
+ * its startup once instead of once per call. NAME defaults to COPROC; a first word that
+ * is a builtin or a command on PATH is taken as COMMAND, not as a name. COMMAND may also
+ * be a loop ("coproc W while read -r l; do ...; done"), which runs in a forked copy of the
+ * shell like a loop inside a pipeline; the word before it is then always the NAME.
+ *
+ * Other forms: "coproc" lists the coprocesses, "coproc -c [NAME]" closes the shell's write
+ * end of NAME's input pipe only (its stdin reaches end of file; its output can still be
+ * read from $NAME_OUT), and "coproc -d [NAME]" closes both ends, unsets its variables and
+ * forgets it. The pipes are close-on-exec, so other commands only see them when redirected to, and
+ * they are never in packet mode: replies are read a line at a time.
+ */
+int builtin_coproc(Command *cmd) {
+    if (cmd->args[1] == NULL) {
+        for (const Coproc *cp = coproc_list; cp != NULL; cp = cp->next) {
+            printf("%s\tpid=%d in=%d out=%d %s\n", cp->name, (int)cp->pid, cp->in_fd, cp->out_fd,
+                   coproc_running(cp) ? "running" : "done");
+        }
+        return 0;
+    }
+    if (strcmp(cmd->args[1], "-c") == 0 || strcmp(cmd->args[1], "-d") == 0) {
+        const char *name = cmd->args[2] != NULL ? cmd->args[2] : "COPROC";
+        for (Coproc **link = &coproc_list; *link != NULL; link = &(*link)->next) {
+            if (strcmp((*link)->name, name) == 0) {
+                if (cmd->args[1][1] == 'c') {
+                    coproc_close_input(*link);
+                } else {
+                    coproc_close(link);
+                }
+                return 0;
+            }
+        }
+        fprintf(stderr, "coproc: %s: no such coprocess\n", name);
+        return 1;
+    }
+    int first = 1;
+    const char *name = "COPROC";
+    const char *word = cmd->args[1];
+    if (cmd->loop != NULL ? cmd->argc == 3
+                          : cmd->args[2] != NULL && is_name(word, strlen(word)) && find_builtin(word) == NULL &&
+                                lookup_command(word) == NULL) {
+        name = word;
+        first = 2;
+    }
+    if (strlen(name) + 5 > NAME_MAX) {
+        fprintf(stderr, "coproc: %s: name too long\n", name);
+        return 2;
+    }
+    for (Coproc **link = &coproc_list; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            if (coproc_running(*link)) {
+                fprintf(stderr, "coproc: %s: already running (coproc -d %s closes it)\n", name, name);
+                return 1;
+            }
+            coproc_close(link);  // A finished coprocess of the same name is replaced
+            break;
+        }
+    }
+    if (coproc_count >= COPROC_MAX) {
+        fprintf(stderr, "coproc: too many coprocesses (at most %d)\n", COPROC_MAX);
+        return 1;
+    }
+
+    // Same pipes and launch path as a background pipeline of one segment
+    int to_child[2], from_child[2];
+    if (make_pipe(to_child, pipe_size_default, false) < 0) {
+        perror("coproc: pipe");
+        return 1;
+    }
+    if (make_pipe(from_child, pipe_size_default, false) < 0) {
+        perror("coproc: pipe");
+        close(to_child[0]);
+        close(to_child[1]);
+        return 1;
+    }
+    Command worker = *cmd;
+    worker.args = cmd->args + first;
+    worker.argc = cmd->argc - first;
+    worker.background = true;
+    Job *job = job_create(1);
+    Coproc *cp = calloc(1, sizeof(*cp));
+    char *copy = strdup(name);
+    if (job != NULL) {
+        job->foreground = false;
+        job->pipe_size = pipe_size_default;
+        if (cp != NULL && copy != NULL) {
+            launch_pipeline(&worker, 1, job, to_child[0], from_child[1]);
+        }
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (job == NULL || cp == NULL || copy == NULL || job->nprocs == 0) {
+        if (job == NULL || cp == NULL || copy == NULL) {
+            perror("coproc: malloc");
+        }
+        if (job != NULL) {
+            job_remove(job);
+        }
+        free(cp);
+        free(copy);
+        close(to_child[1]);
+        close(from_child[0]);
+        return 1;
+    }
+    job->text = job_text(&worker, 1);
+    job->notified = true;
+    cp->name = copy;
+    cp->pid = job->procs[0].pid;
+    cp->in_fd = to_child[1];
+    cp->out_fd = from_child[0];
+    cp->next = coproc_list;
+    coproc_list = cp;
+    coproc_count++;
+
+    char var[NAME_MAX], value[32];
+    snprintf(var, sizeof(var), "%s_IN", name);
+    snprintf(value, sizeof(value), "%d", cp->in_fd);
+    var_set(var, value);
+    snprintf(var, sizeof(var), "%s_OUT", name);
+    snprintf(value, sizeof(value), "%d", cp->out_fd);
+    var_set(var, value);
+    snprintf(var, sizeof(var), "%s_PID", name);
+    snprintf(value, sizeof(value), "%d", (int)cp->pid);
+    var_set(var, value);
+    if (job_control) {
+        printf("[%d] %d\n", job->id, (int)cp->pid);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/**
+ * sigint_handler - SIGINT handler used while a builtin supervises several jobs.
+ * @sig: The signal number (unused).
+ */
+void sigint_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    interrupted = 1;
+    if (write(sigchld_pipe[1], "i", 1) < 0) {
+        // Pipe full: a wake-up is already pending
+    }
+    errno = saved_errno;
+}
+
+/**
+ * parallel_task_lines - Write the complete lines buffered for a prefixed task.
+ * @task: The task (task->prefix set).
+ * @final: True at end of output: a last line without a newline is written too.
+ * @out: Where output goes.
+ *
+ * Each line is written with the prefix in one write(), so lines of different tasks never mix.
+ */
+void parallel_task_lines(ParallelTask *task, bool final, int out) {
+    size_t prefix_len = strlen(task->prefix);
+    size_t start = 0;
+    while (start < task->len) {
+        const char *nl = memchr(task->buf + start, '\n', task->len - start);
+        if (nl == NULL && !final) {
+            break;
+        }
+        size_t line_len = nl != NULL ? (size_t)(nl - (task->buf + start)) : task->len - start;
+        struct iovec iov[3] = {
+            {(void *)task->prefix, prefix_len},
+            {task->buf + start, line_len},
+            {"\n", 1},
+        };
+        size_t total = prefix_len + line_len + 1;
+        ssize_t n = writev(out, iov, 3);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n >= 0 && (size_t)n < total) {
+            // Short write (a pipe nearly full): finish the line byte-exact
+            char *line = malloc(total);
+            if (line != NULL) {
+                memcpy(mempcpy(mempcpy(line, task->prefix, prefix_len), task->buf + start, line_len), "\n", 1);
+                write_all(out, line + n, total - (size_t)n);
+                free(line);
+            }
+        }
+        start += line_len + (nl != NULL);
+    }
+    memmove(task->buf, task->buf + start, task->len - start);
+    task->len -= start;
+}
+
+/**
+ * parallel_task_output - Route output read from a task's capture pipe.
+ * @task: The task.
+ * @data: Bytes read.
+ * @len: Number of bytes.
+ * @is_head: True if every earlier task has completed, so output can stream directly.
+ * @out: Descriptor receiving the ordered output.
+ */
+void parallel_task_output(ParallelTask *task, const char *data, size_t len, bool is_head, int out) {
+    if (is_head && task->prefix == NULL) {
+        write_all(out, data, len);
+        return;
+    }
+    if (task->len + len > task->cap) {
+        size_t cap = task->cap ? task->cap : READ_CHUNK;
+        while (cap < task->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(task->buf, cap);
+        if (grown == NULL) {
+            perror("parallel: realloc");
+            return;
+        }
+        task->buf = grown;
+        task->cap = cap;
+    }
+    memcpy(task->buf + task->len, data, len);
+    task->len += len;
+    if (task->prefix != NULL) {
+        parallel_task_lines(task, false, out);
+    }
+}
+
+// Defined below: compound task lines run in a forked copy of the shell
+pid_t spawn_subshell(AndOr *list, AndOr *stop, const Job *job, int in_fd, int out_fd);
+
+/**
+ * parallel_launch - Parse one task's command line and start it with a capture pipe.
+ * @task: The task to start.
+ * @in_fd: Descriptor for the task's stdin (-1 to inherit).
+ * Return: 0 if the task is running, -1 if it failed to start (task->code is set).
+ */
+int parallel_launch(ParallelTask *task, int in_fd) {
+    AndOr *list;
+    task->launched = true;
+    long long parse_start = now_ns();
+    if (parse_command(task->line, &line_arena, &list) != 0) {
+        task->code = 2;
+        task->finished = true;
+        return -1;
+    }
+    if (list == NULL) {
+        // Blank task line: nothing to run
+        task->code = 0;
+        task->finished = true;
+        return -1;
+    }
+    // A plain pipeline is launched directly, anything else runs in a subshell
+    bool simple = list->next == NULL && list->first->next == NULL && !list->background;
+    int num_commands = simple ? list->first->num_commands : 1;
+    int capture[2];
+    if (pipe2(capture, O_CLOEXEC) < 0) {
+        perror("parallel: pipe");
+        task->code = 1;
+        task->finished = true;
+        return -1;
+    }
+    task->job = job_create(num_commands);
+    if (task->job == NULL) {
+        perror("parallel: malloc");
+        close(capture[0]);
+        close(capture[1]);
+        task->code = 1;
+        task->finished = true;
+        return -1;
+    }
+    // Supervised by the builtin: keep the job out of "jobs" and notifications
+    task->job->foreground = true;
+    task->job->parse_ns = now_ns() - parse_start;
+    if (simple) {
+        // Words with '$' are still quoted: substitute them as execute_commands() would
+        Command *commands = list->first->commands;
+        ArenaMark mark = arena_mark(&expand_arena);
+        for (int i = 0; i < num_commands; ++i) {
+            if (commands[i].expand) {
+                commands = expand_commands(commands, num_commands);
+                break;
+            }
+        }
+        if (commands != NULL) {
+            launch_pipeline(commands, num_commands, task->job, in_fd, capture[1]);
+        } else {
+            perror("parallel: malloc");
+        }
+        arena_release(&expand_arena, mark);
+    } else {
+        pid_t pid = spawn_subshell(list, NULL, task->job, in_fd, capture[1]);
+        if (pid > 0) {
+            job_add_process(task->job, pid);
+        }
+    }
+    close(capture[1]);
+    task->out_fd = capture[0];
+    return 0;
+}
+
+/**
+ * parallel_run - Run tasks through a bounded worker pool until all of them completed.
+ * @tasks: The tasks (out_fd and watch set to -1).
+ * @ntasks: Number of tasks.
+ * @max_jobs: Most tasks running at once.
+ * @task_in: Descriptor for every task's stdin (-1 to inherit).
+ * @out_fd: Where task output is written.
+ * Return: Number of tasks that failed or never completed.
+ *
+ * The event loop, watching the SIGCHLD self-pipe and the tasks' capture pipes, starts the
+ * next task as soon as one completes. Output is written in task order: the oldest running
+ * task streams straight through, later ones are buffered until every task before them has
+ * completed. Tasks with a prefix stream instead, one prefixed line at a time. SIGINT stops
+ * every running task.
+ */
+int parallel_run(ParallelTask *tasks, int ntasks, long max_jobs, int task_in, int out_fd) {
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    interrupted = 0;
+    sigaction(SIGINT, &sa, &old_sa);
+
+    int next = 0;
+    int head = 0;
+    int running = 0;
+    int failed = 0;
+    char chunk[READ_CHUNK];
+    while (head < ntasks) {
+        // Keep the worker pool full
+        while (!interrupted && running < max_jobs && next < ntasks) {
+            ParallelTask *task = &tasks[next];
+            if (parallel_launch(task, task_in) == 0) {
+                running++;
+                task->watch = event_watch(task->out_fd, POLLIN, event_flag, &task->revents);
+                if (task->watch < 0) {
+                    perror("shell: event loop");
+                    close(task->out_fd);
+                    task->out_fd = -1;
+                }
+            }
+            next++;
+        }
+        // Emit completed tasks in order
+        while (head < ntasks && tasks[head].finished) {
+            head++;
+            if (head < ntasks && tasks[head].prefix == NULL && tasks[head].len > 0) {
+                write_all(out_fd, tasks[head].buf, tasks[head].len);
+                tasks[head].len = 0;
+            }
+        }
+        if (head >= ntasks || (interrupted && running == 0)) {
+            break;
+        }
+
+        // The SIGCHLD watch reaps the workers; capture pipes only flag themselves as ready
+        if (event_run_once() < 0) {
+            perror("shell: event loop");
+            break;
+        }
+        if (interrupted) {
+            for (int i = head; i < next; ++i) {
+                if (tasks[i].job != NULL) {
+                    job_signal(tasks[i].job, SIGINT);
+                }
+            }
+        }
+        for (int i = head; i < next; ++i) {
+            ParallelTask *task = &tasks[i];
+            if (task->revents == 0) {
+                continue;
+            }
+            task->revents = 0;
+            ssize_t got = read(task->out_fd, chunk, sizeof(chunk));
+            if (got > 0) {
+                parallel_task_output(task, chunk, (size_t)got, i == head, out_fd);
+            } else if (got == 0 || errno != EINTR) {
+                event_unwatch(task->watch);
+                task->watch = -1;
+                close(task->out_fd);
+                task->out_fd = -1;
+                if (task->prefix != NULL) {
+                    parallel_task_lines(task, true, out_fd);
+                }
+            }
+        }
+        // A task completes once its processes have exited and its output is drained
+        for (int i = head; i < next; ++i) {
+            ParallelTask *task = &tasks[i];
+            if (task->job != NULL && task->out_fd == -1 && task->job->live == 0) {
+                task->code = job_exit_code(task->job);
+                job_finish(task->job);
+                task->job = NULL;
+                task->finished = true;
+                running--;
+            }
+        }
+    }
+    for (int i = 0; i < ntasks; ++i) {
+        if (tasks[i].job != NULL) {
+            // Interrupted or aborted: do not leave workers behind
+            job_signal(tasks[i].job, SIGTERM);
+            wait_for_job(tasks[i].job);
+            job_remove(tasks[i].job);
+        }
+        if (tasks[i].out_fd != -1) {
+            event_unwatch(tasks[i].watch);
+            close(tasks[i].out_fd);
+        }
+        if ((tasks[i].launched && tasks[i].code != 0) || !tasks[i].finished) {
+            failed++;
+        }
+        free(tasks[i].buf);
+    }
+    sigaction(SIGINT, &old_sa, NULL);
+    return failed;
+}
+
+/**
+ * parallel_substitute - Copy a template word, replacing every "{}" with an ARG.
+ * @p: Where to write (room for the word plus 4 * strlen(arg) + 2 bytes per "{}").
+ * @word: The template word as written; its quotes are read again when the task runs.
+ * @arg: The ARG, unquoted.
+ * @count: Incremented for every "{}" replaced.
+ * Return: The end of the copy (not NUL-terminated).
+ *
+ * ARG must come back as one unchanged word whatever quotes surround the "{}": outside
+ * quotes it is inserted in single quotes, inside '...' each ' becomes '\'', and inside
+ * "..." the characters still special there (\ " $ `) get a backslash.
+ */
+char *parallel_substitute(char *p, const char *word, const char *arg, int *count) {
+    char quote = '\0';
+    for (const char *w = word; *w != '\0'; ++w) {
+        if (w[0] == '{' && w[1] == '}') {
+            if (quote == '\0') {
+                *p++ = '\'';
+            }
+            for (const char *a = arg; *a != '\0'; ++a) {
+                if (quote != '"' && *a == '\'') {
+                    p = stpcpy(p, "'\\''");
+                    continue;
+                }
+                if (quote == '"' && strchr("\\\"$`", *a) != NULL) {
+                    *p++ = '\\';
+                }
+                *p++ = *a;
+            }
+            if (quote == '\0') {
+                *p++ = '\'';
+            }
+            (*count)++;
+            w++;
+            continue;
+        }
+        if (*w == '\\' && quote != '\'' && w[1] != '\0') {
+            *p++ = *w++;
+        } else if (*w == '\'' || *w == '"') {
+            quote = quote == '\0' ? *w : quote == *w ? '\0' : quote;
+        }
+        *p++ = *w;
+    }
+    return p;
+}
+
+/**
+ * builtin_parallel - Implement "parallel [-j N] [TEMPLATE... ::: ARG...]".
+ * @cmd: The parsed builtin command (its < and > redirections are honoured).
+ * Return: Number of failed tasks (capped at 101), or 255 on usage errors.
+ *
+ * Without ":::" each line of stdin (or of the "<" file) is a command line, and so is each
+ * ARG of ":::" without a template. With a template, it is run once per ARG, with every "{}"
+ * replaced by it or ARG appended; ARG is quoted (see parallel_substitute()), so it stays one
+ * word and its ';' or '$' are not run, even inside a quoted "'{}'". At most N tasks
+ * (default: one per online CPU) run at once, through parallel_run(); output is kept in task
+ * order.
+ */
+int builtin_parallel(Command *cmd) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int argi = 1;
+    if (cmd->args[argi] != NULL && strncmp(cmd->args[argi], "-j", 2) == 0) {
+        const char *value = cmd->args[argi][2] ? cmd->args[argi] + 2 : cmd->args[++argi];
+        if (value == NULL || (max_jobs = parse_count(value)) < 0) {
+            fprintf(stderr, "parallel: usage: parallel [-j N] [template ... ::: arg ...]\n");
+            return 255;
+        }
+        argi++;
+    }
+    if (max_jobs <= 0) {
+        max_jobs = 1;
+    }
+
+    // Collect the task command lines into the line arena
+    int sep = argi;
+    while (cmd->args[sep] != NULL && strcmp(cmd->args[sep], ":::") != 0) {
+        sep++;
+    }
+    if (cmd->args[sep] == NULL && sep > argi) {
+        // A template without arguments would silently run stdin instead
+        fprintf(stderr, "parallel: usage: parallel [-j N] [template ... ::: arg ...]\n");
+        return 255;
+    }
+    int in_fd = -1;
+    int out_fd = STDOUT_FILENO;
+    int redir_out = -1;
+    if (open_redirections(cmd, &in_fd, &redir_out) != 0) {
+        return 255;
+    }
+    if (redir_out != -1) {
+        out_fd = redir_out;
+    }
+    ParallelTask *tasks = NULL;
+    int ntasks = 0;
+    char *input = NULL;
+    if (cmd->args[sep] != NULL) {
+        int nargs = cmd->argc - sep - 1;
+        tasks = arena_alloc(&line_arena, sizeof(ParallelTask) * (size_t)(nargs > 0 ? nargs : 1));
+        for (int i = sep + 1; tasks != NULL && cmd->args[i] != NULL; ++i) {
+            const char *arg = cmd->args[i];
+            size_t arglen = strlen(arg);
+            size_t len = 4 * arglen + 3;
+            for (int t = argi; t < sep; ++t) {
+                len += strlen(cmd->args[t]) + 1;
+                for (const char *mark = strstr(cmd->args[t], "{}"); mark != NULL;
+                     mark = strstr(mark + 2, "{}")) {
+                    len += 4 * arglen + 2;
+                }
+            }
+            char *line = arena_alloc(&line_arena, len);
+            if (line == NULL) {
+                perror("parallel: malloc");
+                if (in_fd != -1) {
+                    close(in_fd);
+                }
+                if (redir_out != -1) {
+                    close(redir_out);
+                }
+                return 255;
+            }
+            char *p = line;
+            int placeholders = 0;
+            for (int t = argi; t < sep; ++t) {
+                p = parallel_substitute(p, cmd->args[t], arg, &placeholders);
+                *p++ = ' ';
+            }
+            if (sep == argi) {
+                // No template: the ARG is a whole command line
+                p = stpcpy(p, arg);
+            } else if (placeholders == 0) {
+                p = parallel_substitute(p, "{}", arg, &placeholders);
+            }
+            *p = '\0';
+            memset(&tasks[ntasks], 0, sizeof(ParallelTask));
+            tasks[ntasks].line = line;
+            tasks[ntasks].out_fd = -1;
+            tasks[ntasks].watch = -1;
+            ntasks++;
+        }
+    } else {
+        // One command line per input line; the whole input is read up front
+        LineReader reader;
+        if (reader_open_fd(&reader, in_fd != -1 ? in_fd : STDIN_FILENO) != 0) {
+            perror("parallel: malloc");
+            if (in_fd != -1) {
+                close(in_fd);
+            }
+            if (redir_out != -1) {
+                close(redir_out);
+            }
+            return 255;
+        }
+        int cap = 0;
+        char *line;
+        while ((line = reader_next_line(&reader)) != NULL) {
+            line = trim_whitespace(line);
+            if (*line == '\0' || *line == '#') {
+                continue;
+            }
+            if (ntasks == cap) {
+                cap = cap ? cap * 2 : 64;
+                tasks = arena_grow(&line_arena, tasks, sizeof(ParallelTask) * (size_t)ntasks,
+                                   sizeof(ParallelTask) * (size_t)cap);
+                if (tasks == NULL) {
+                    break;
+                }
+            }
+            memset(&tasks[ntasks], 0, sizeof(ParallelTask));
+            tasks[ntasks].line = (char *)(uintptr_t)(line - reader.buf);
+            tasks[ntasks].out_fd = -1;
+            tasks[ntasks].watch = -1;
+            ntasks++;
+        }
+        // Lines were recorded as offsets because the buffer may move while growing
+        input = reader.buf;
+        for (int i = 0; tasks != NULL && i < ntasks; ++i) {
+            tasks[i].line = input + (uintptr_t)tasks[i].line;
+        }
+        if (in_fd != -1) {
+            close(in_fd);
+            in_fd = -1;
+        }
+    }
+    // Tasks read nothing from the shell's stdin except in ":::" mode with no "<"
+    int task_in = in_fd;
+    if (tasks == NULL && ntasks > 0) {
+        perror("parallel: malloc");
+        ntasks = 0;
+    }
+
+    int failed = parallel_run(tasks, ntasks, max_jobs, task_in, out_fd);
+    free(input);
+    if (task_in != -1) {
+        close(task_in);
+    }
+    if (redir_out != -1) {
+        close(redir_out);
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * on_control_init - Find or create the directory of the ssh control sockets.
+ * Return: 0 on success, -1 on error (a message is printed).
+ *
+ * Sockets live in $XDG_RUNTIME_DIR/shell-ssh, or /tmp/shell-ssh-UID, a directory that must
+ * belong to the user and be closed to everyone else: the sockets are live logins. Every
+ * shell of the user shares it, so a connection opened by one is reused by the next.
+ */
+int on_control_init(void) {
+    if (on_control_dir == NULL) {
+        const char *runtime = getenv("XDG_RUNTIME_DIR");
+        char dir[PATH_MAX];
+        if (runtime != NULL && runtime[0] == '/') {
+            snprintf(dir, sizeof(dir), "%s/shell-ssh", runtime);
+        } else {
+            snprintf(dir, sizeof(dir), "/tmp/shell-ssh-%u", (unsigned)getuid());
+        }
+        struct stat st;
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "on: %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+        if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+            fprintf(stderr, "on: %s: not a private directory of this user\n", dir);
+            return -1;
+        }
+        on_control_dir = strdup(dir);
+        if (on_control_dir == NULL) {
+            perror("on: malloc");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * on_control_path - Build the control socket path of a host.
+ * @host: The host name (already validated).
+ * Return: A line-arena path, or NULL on error (a message is printed).
+ */
+char *on_control_path(const char *host) {
+    if (on_control_init() != 0) {
+        return NULL;
+    }
+    size_t len = strlen(on_control_dir) + strlen(host) + 2;
+    if (len > sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+        fprintf(stderr, "on: %s: host name too long for a control socket\n", host);
+        return NULL;
+    }
+    char *path = arena_alloc(&line_arena, len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%s", on_control_dir, host);
+    }
+    return path;
+}
+
+/**
+ * on_control_alive - Check whether an ssh control master is listening on a socket.
+ * @path: The control socket path.
+ * Return: true if a connect() to it succeeds.
+ *
+ * A stale socket left by a master that died refuses the connection; ssh then replaces it.
+ */
+bool on_control_alive(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    bool alive = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return alive;
+}
+
+/**
+ * on_host_get - Find a host in the connection pool, adding it if new.
+ * @name: The host name.
+ * Return: The pool entry, or NULL on allocation failure.
+ */
+OnHost *on_host_get(const char *name) {
+    for (OnHost *host = on_hosts; host != NULL; host = host->next) {
+        if (strcmp(host->name, name) == 0) {
+            return host;
+        }
+    }
+    OnHost *host = calloc(1, sizeof(*host));
+    if (host == NULL || (host->name = strdup(name)) == NULL) {
+        free(host);
+        return NULL;
+    }
+    host->next = on_hosts;
+    on_hosts = host;
+    return host;
+}
+
+/**
+ * quote_word - Quote a string in single quotes so that the shell reads it back unchanged.
+ * @text: The string.
+ * Return: A line-arena copy such as 'it'\''s', or NULL on allocation failure.
+ */
+char *quote_word(const char *text) {
+    size_t len = 3;
+    for (const char *p = text; *p != '\0'; ++p) {
+        len += *p == '\'' ? 4 : 1;
+    }
+    char *quoted = arena_alloc(&line_arena, len);
+    if (quoted == NULL) {
+        return NULL;
+    }
+    char *q = quoted;
+    *q++ = '\'';
+    for (const char *p = text; *p != '\0'; ++p) {
+        if (*p == '\'') {
+            q = stpcpy(q, "'\\''");
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q++ = '\'';
+    *q = '\0';
+    return quoted;
+}
+
+/**
+ * on_host_valid - Check a host name: letters, digits and "._-:@", not starting with '-'.
+ * @name: The name.
+ * Return: true if the name is safe to pass to ssh (it can never turn into an option).
+ */
+bool on_host_valid(const char *name) {
+    size_t n = strlen(name);
+    return n > 0 && name[0] != '-' &&
+           strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-:@") == n;
+}
+
+/**
+ * on_add_hosts - Append the hosts of one HOSTS argument ("a,b,c" or "@FILE").
+ * @spec: The argument.
+ * @hosts: In/out: line-arena array of host names.
+ * @nhosts: In/out: entries in hosts.
+ * @cap: In/out: capacity of hosts.
+ * Return: 0 on success, -1 on error (a message is printed).
+ *
+ * A host file has one host per line; blank lines and '#' comments are skipped. Every name
+ * must pass on_host_valid().
+ */
+int on_add_hosts(const char *spec, char ***hosts, int *nhosts, int *cap) {
+    char *list;
+    char *input = NULL;
+    char sep = ',';
+    if (spec[0] == '@') {
+        int fd = open(spec + 1, O_RDONLY | O_CLOEXEC);
+        LineReader reader;
+        if (fd < 0 || reader_open_fd(&reader, fd) != 0) {
+            fprintf(stderr, "on: %s: %s\n", spec + 1, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        // Gather the file's lines into one newline-separated list
+        size_t len = 0;
+        char *line;
+        list = NULL;
+        while ((line = reader_next_line(&reader)) != NULL) {
+            line = trim_whitespace(line);
+            if (*line == '\0' || *line == '#') {
+                continue;
+            }
+            size_t n = strlen(line);
+            list = arena_grow(&line_arena, list, len, len + n + 2);
+            if (list == NULL) {
+                break;
+            }
+            memcpy(list + len, line, n);
+            len += n;
+            list[len++] = '\n';
+            list[len] = '\0';
+        }
+        input = reader.buf;
+        close(fd);
+        if (list == NULL) {
+            free(input);
+            return 0;
+        }
+        sep = '\n';
+    } else {
+        list = arena_strndup(&line_arena, spec, strlen(spec));
+        if (list == NULL) {
+            perror("on: malloc");
+            return -1;
+        }
+    }
+    int err = 0;
+    for (char *name = list; err == 0 && *name != '\0';) {
+        char *end = strchr(name, sep);
+        if (end != NULL) {
+            *end = '\0';
+        }
+        size_t n = strlen(name);
+        if (!on_host_valid(name)) {
+            fprintf(stderr, "on: '%s': invalid host name\n", name);
+            err = -1;
+            break;
+        }
+        if (*nhosts == *cap) {
+            int grown = *cap ? *cap * 2 : 16;
+            *hosts = arena_grow(&line_arena, *hosts, sizeof(char *) * (size_t)*cap, sizeof(char *) * (size_t)grown);
+            if (*hosts == NULL) {
+                perror("on: malloc");
+                err = -1;
+                break;
+            }
+            *cap = grown;
+        }
+        (*hosts)[(*nhosts)++] = name;
+        name = end != NULL ? end + 1 : name + n;
+    }
+    free(input);
+    return err;
+}
+
+/**
+ * builtin_on - Implement "on [-j N] HOSTS... -- COMMAND" and "on -x": run a command over ssh.
+ * @cmd: The parsed builtin command.
+ * Return: Number of hosts where the command failed (capped at 101), or 255 on usage errors.
+ *
+ * COMMAND is joined into one line, as ssh does, and checked with the shell's own parser
+ * first, so a syntax error is reported once instead of by every remote shell. Each host gets
+ * an "ssh -o ControlMaster=auto" task with a per-host control socket and ControlPersist: the
+ * first run pays the handshake, later runs start a session over the open connection. The
+ * tasks are scheduled by parallel_run() with at most N at once (default ON_JOBS_DEFAULT),
+ * and their stdout and stderr come back line by line, prefixed with "HOST: ". "on -x" closes
+ * every control connection in the socket directory. shellstat reports how many runs found
+ * their connection already up.
+ */
+int builtin_on(Command *cmd) {
+    long max_jobs = ON_JOBS_DEFAULT;
+    int argi = 1;
+    bool close_all = cmd->args[1] != NULL && strcmp(cmd->args[1], "-x") == 0;
+    if (!close_all && cmd->args[argi] != NULL && strncmp(cmd->args[argi], "-j", 2) == 0) {
+        const char *value = cmd->args[argi][2] ? cmd->args[argi] + 2 : cmd->args[++argi];
+        if (value == NULL || (max_jobs = parse_count(value)) < 0) {
+            max_jobs = 0;
+        }
+        argi++;
+    }
+    int sep = argi;
+    while (cmd->args[sep] != NULL && strcmp(cmd->args[sep], "--") != 0) {
+        sep++;
+    }
+    if (max_jobs == 0 || (!close_all && (sep == argi || cmd->args[sep] == NULL || cmd->args[sep + 1] == NULL)) ||
+        (close_all && cmd->argc != 2)) {
+        fprintf(stderr, "on: usage: on [-j N] HOST[,HOST...]|@FILE... -- COMMAND [ARG...]\n"
+                        "       on -x\n");
+        return 255;
+    }
+
+    char **hosts = NULL;
+    int nhosts = 0;
+    int cap = 0;
+    char *remote = NULL;
+    if (close_all) {
+        // Every socket in the directory, opened by this shell or an earlier one
+        DIR *dir = on_control_init() == 0 ? opendir(on_control_dir) : NULL;
+        if (dir == NULL) {
+            return 1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_type != DT_SOCK || !on_host_valid(entry->d_name)) {
+                continue;
+            }
+            if (nhosts == cap) {
+                int grown = cap ? cap * 2 : 16;
+                hosts = arena_grow(&line_arena, hosts, sizeof(char *) * (size_t)cap, sizeof(char *) * (size_t)grown);
+                if (hosts == NULL) {
+                    break;
+                }
+                cap = grown;
+            }
+            hosts[nhosts] = arena_strndup(&line_arena, entry->d_name, strlen(entry->d_name));
+            if (hosts[nhosts] == NULL) {
+                break;
+            }
+            nhosts++;
+        }
+        closedir(dir);
+        if (entry != NULL) {
+            perror("on: malloc");
+            return 1;
+        }
+    } else {
+        for (int i = argi; i < sep; ++i) {
+            if (on_add_hosts(cmd->args[i], &hosts, &nhosts, &cap) != 0) {
+                return 255;
+            }
+        }
+        remote = argv_join(cmd->args + sep + 1, cmd->argc - sep - 1);
+        if (remote == NULL) {
+            perror("on: malloc");
+            return 1;
+        }
+        // The parser works in place: check a copy
+        char *check = arena_strndup(&line_arena, remote, strlen(remote));
+        AndOr *list;
+        int parsed = check != NULL ? parse_command(check, &line_arena, &list) : -1;
+        if (parsed != 0) {
+            if (parsed > 0) {
+                fprintf(stderr, "on: %s: command is incomplete\n", remote);
+            }
+            free(remote);
+            return 255;
+        }
+    }
+
+    ParallelTask *tasks = arena_alloc(&line_arena, sizeof(ParallelTask) * (size_t)(nhosts > 0 ? nhosts : 1));
+    const char *quoted = remote != NULL ? quote_word(remote) : NULL;
+    free(remote);
+    if (tasks == NULL || (remote != NULL && quoted == NULL)) {
+        perror("on: malloc");
+        return 1;
+    }
+    int ntasks = 0;
+    for (int i = 0; i < nhosts; ++i) {
+        const char *name = hosts[i];
+        OnHost *host = close_all ? NULL : on_host_get(name);
+        char *path = on_control_path(name);
+        const char *control = path != NULL ? quote_word(path) : NULL;
+        char *prefix = arena_alloc(&line_arena, strlen(name) + 3);
+        if ((host == NULL && !close_all) || control == NULL || prefix == NULL) {
+            return 1;
+        }
+        int len;
+        char *line = NULL;
+        if (close_all) {
+            if (!on_control_alive(path)) {
+                continue;
+            }
+            len = snprintf(NULL, 0, "ssh -o ControlPath=%s -O exit %s 2>&1", control, name);
+            line = arena_alloc(&line_arena, (size_t)len + 1);
+            if (line != NULL) {
+                snprintf(line, (size_t)len + 1, "ssh -o ControlPath=%s -O exit %s 2>&1", control, name);
+            }
+        } else {
+            host->runs++;
+            on_runs++;
+            if (on_control_alive(path)) {
+                host->reused++;
+                on_reused++;
+            }
+            const char *fmt = "ssh -n -T -o BatchMode=yes -o ControlMaster=auto -o ControlPersist=%d "
+                              "-o ControlPath=%s %s %s 2>&1";
+            len = snprintf(NULL, 0, fmt, ON_PERSIST_SEC, control, name, quoted);
+            line = arena_alloc(&line_arena, (size_t)len + 1);
+            if (line != NULL) {
+                snprintf(line, (size_t)len + 1, fmt, ON_PERSIST_SEC, control, name, quoted);
+            }
+        }
+        if (line == NULL) {
+            perror("on: malloc");
+            return 1;
+        }
+        stpcpy(stpcpy(prefix, name), ": ");
+        memset(&tasks[ntasks], 0, sizeof(ParallelTask));
+        tasks[ntasks].line = line;
+        tasks[ntasks].out_fd = -1;
+        tasks[ntasks].watch = -1;
+        tasks[ntasks].prefix = prefix;
+        ntasks++;
+    }
+    int failed = parallel_run(tasks, ntasks, max_jobs, -1, STDOUT_FILENO);
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * run_builtin - Run a command in the shell process if it is a built-in.
+ * @cmd: The command (a single pipeline segment).
+ * Return: The builtin's exit code, or -1 if args[0] is not a built-in or is a text filter
+ *         (those are forked when they do not read a pipe, see filter_reads_pipe()).
+ */
+int run_builtin(Command *cmd) {
+    const Builtin *builtin = command_builtin(cmd);
+    if (builtin == NULL || builtin->run == builtin_filter) {
+        return -1;
+    }
+    return run_builtin_fds(builtin, cmd, -1, -1);
+}
+
+/**
+ * run_pipeline - Run one pipeline, in the shell if it is a single builtin, else as a job.
+ * @commands: Array of Command structures to execute (prefixes already stripped).
+ * @num_commands: Number of commands (segments) in the array.
+ * @timed: Report resource usage when the pipeline finishes ("time" prefix).
+ * @pipe_size: Inter-stage pipe buffer size (0 = kernel default).
+ * @limits: Limits of a "run" prefix, applied in every launched process (NULL if none).
+ * Return: 1 to continue the shell loop, or 2 to signal that the shell should exit.
+ *
+ * If a single foreground command is a built-in (see the builtins table), it is handled in the
+ * shell process, unless it has "run" limits: those only apply to a child. With SHELL_TRACE it
+ * still gets a trace line of its own, numbered like a job.
+ * Otherwise, external commands are launched through spawn_command(). If multiple commands
+ * are present (pipeline), pipes are set up between them. Every pipeline is registered in the
+ * job table; foreground jobs are waited for (and kept if stopped), background jobs are not.
+ */
+int run_pipeline(Command *commands, int num_commands, bool timed, long pipe_size, const RunLimits *limits) {
+    STAT_ADD(pipelines, 1);
+    // Handle built-in commands for a single foreground command (no pipeline)
+    if (num_commands == 1 && !commands[0].background && limits == NULL) {
+        Command *cmd = &commands[0];
+        struct rusage before, after;
+        long long start = now_ns();
+        if (timed || trace_out != NULL) {
+            getrusage(RUSAGE_SELF, &before);
+        }
+        int status = run_builtin(cmd);
+        if (status >= 0) {
+            STAT_ADD(commands, 1);
+            last_status = status;
+            if (trace_out != NULL) {
+                // Traced like a one-stage job, so a mostly-builtin script leaves no gaps
+                Job traced = {0};
+                traced.seq = ++job_seq;
+                traced.start_ns = start;
+                traced.parse_ns = last_parse_ns;
+                job_shell_stage(&traced, cmd, status, &before);
+                trace_report(&traced);
+                free(traced.shell_stage.name);
+            }
+            if (timed) {
+                getrusage(RUSAGE_SELF, &after);
+                fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", (double)(now_ns() - start) / 1e9,
+                        (double)(timeval_us(after.ru_utime) - timeval_us(before.ru_utime)) / 1e6,
+                        (double)(timeval_us(after.ru_stime) - timeval_us(before.ru_stime)) / 1e6);
+            }
+            return exit_requested ? 2 : 1;
+        }
+    }
+
+    // Execute external command(s), possibly with pipes, as one job
+    Job *job = job_create(num_commands);
+    if (job == NULL) {
+        perror("shell: malloc");
+        return 1;
+    }
+    job->foreground = !commands[num_commands - 1].background;
+    job->timed = timed;
+    job->pipe_size = pipe_size;
+    job->parse_ns = last_parse_ns;
+    job->limits = limits;
+    launch_pipeline(commands, num_commands, job, -1, -1);
+    job->limits = NULL;
+
+    if (job->nprocs == 0) {
+        last_status = job_exit_code(job);
+        job_remove(job);
+        return 1;
+    }
+    // If last command is to run in background, do not wait for children
+    if (!job->foreground) {
+        job->text = job_text(commands, num_commands);
+        job->notified = true;
+        // Report the job number and the last sub-command that was actually started
+        printf("[%d] %d\n", job->id, job->procs[job->nprocs - 1].pid);
+        fflush(stdout);
+        last_status = 0;
+        return 1;
+    }
+    // Wait for the pipeline; a job stopped with Ctrl-Z stays in the table
+    last_status = job_foreground(job, false);
+    if (job_is_stopped(job)) {
+        job->foreground = false;
+        job->text = job_text(commands, num_commands);
+        printf("\n");
+        job_print(job, false);
+        job->notified = true;
+        fflush(stdout);
+    } else {
+        job_finish(job);
+    }
+    return 1;
+}
+
+/**
+ * pipeline_has_commands - Check that no segment of a pipeline is empty.
+ * @commands: The pipeline segments.
+ * @num_commands: Number of segments.
+ * Return: true if every segment has a command word or is a loop.
+ */
+bool pipeline_has_commands(const Command *commands, int num_commands) {
+    for (int i = 0; i < num_commands; ++i) {
+        if (commands[i].argc == 0 && commands[i].loop == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * proc_subst_spawn - Run the list of a process substitution on one end of a new pipe.
+ * @subst: The substitution.
+ * Return: The shell's end of the pipe (inheritable, to be opened as /dev/fd/N), or -1 if
+ *         the pipe or the process could not be created (a message is printed).
+ *
+ * The list runs in a forked subshell in a process group of its own, with stdout (for
+ * "<(LIST)") or stdin (for ">(LIST)") on the pipe; nothing waits for it, and the SIGCHLD
+ * reaping that sees a pid of no job discards its status.
+ */
+int proc_subst_spawn(const ProcSubst *subst) {
+    int fds[2];
+    if (make_pipe(fds, 0, false) < 0) {
+        perror("shell: pipe");
+        return -1;
+    }
+    int mine = subst->output ? fds[1] : fds[0];
+    int theirs = subst->output ? fds[0] : fds[1];
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("shell: fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        static const Job detached;  // pgid 0, not in the foreground
+        child_enter(&detached, subst->output ? theirs : -1, subst->output ? -1 : theirs);
+        if (subshell_enter() != 0) {
+            _exit(1);
+        }
+        execute_list(subst->list, NULL);
+        fflush(stdout);
+        feeder_detach();
+        _exit(last_status);
+    }
+    close(theirs);
+    fcntl(mine, F_SETFD, 0);  // The command opens /dev/fd/N, or inherits N across exec
+    return mine;
+}
+
+/**
+ * proc_subst_start - Start the process substitutions of an expanded pipeline.
+ * @commands: The expanded copy; each substitution word is replaced by its /dev/fd path.
+ * @num_commands: Number of segments.
+ * @fds: Output parameter for the shell's pipe ends (expand_arena memory), to be closed once
+ *       the pipeline has been run or started.
+ * Return: Number of entries in fds, or -1 on failure (the ends already opened are closed).
+ */
+int proc_subst_start(Command *commands, int num_commands, int **fds) {
+    int total = 0;
+    for (int i = 0; i < num_commands; ++i) {
+        total += commands[i].nsubsts;
+    }
+    *fds = total > 0 ? arena_alloc(&expand_arena, sizeof(int) * (size_t)total) : NULL;
+    if (total > 0 && *fds == NULL) {
+        perror("shell: malloc");
+        return -1;
+    }
+    int count = 0;
+    for (int i = 0; i < num_commands; ++i) {
+        Command *cmd = &commands[i];
+        for (int j = 0; j < cmd->nsubsts; ++j) {
+            const char *word = cmd->substs[j].word;
+            int fd = proc_subst_spawn(&cmd->substs[j]);
+            char *path = fd >= 0 ? arena_alloc(&expand_arena, 24) : NULL;
+            if (path == NULL) {
+                if (fd >= 0) {
+                    perror("shell: malloc");
+                    close(fd);
+                }
+                while (count > 0) {
+                    close((*fds)[--count]);
+                }
+                return -1;
+            }
+            (*fds)[count++] = fd;
+            snprintf(path, 24, "/dev/fd/%d", fd);
+            // The copy shares the parsed word pointers: replace the one this substitution wrote
+            for (int k = 0; k < cmd->argc; ++k) {
+                if (cmd->args[k] == word) {
+                    cmd->args[k] = path;
+                }
+            }
+            if (cmd->input_file == word) {
+                cmd->input_file = path;
+            }
+            if (cmd->output_file == word) {
+                cmd->output_file = path;
+            }
+            if (cmd->here_string == word) {
+                cmd->here_string = path;
+            }
+            for (int k = 0; k < cmd->nredirs; ++k) {
+                if (cmd->redirs[k].target == word) {
+                    cmd->redirs[k].target = path;
+                }
+            }
+        }
+    }
+    return count;
 }
 
 /**
- * parse_command - Parse an input command line into one or more Command structures.
- * @input: The command line string (will be modified during parsing).
- * @commands: Array of Command structures to populate with parsed data.
- * @num_commands: Output parameter for number of commands (pipeline segments) parsed.
- * Return: 0 on successful parse, -1 on syntax error.
+ * memo_hash - Mix bytes into a 64-bit FNV-1a hash.
+ * @h: Hash so far.
+ * @data: Bytes to add.
+ * @len: Number of bytes.
+ * Return: The updated hash.
+ */
+uint64_t memo_hash(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * memo_hash_file - Mix a file's identity into a hash, if the path names a regular file.
+ * @h: Hash so far.
+ * @path: The path (NULL is ignored).
+ * Return: The updated hash.
  *
- * The input is split into separate commands by the '|' pipe character. Each command segment
- * is further tokenized into arguments and checked for I/O redirection tokens ('<' or '>').
- * The background operator '&' is recognized if it appears at the end of the command line.
- * This function prints error messages to stderr for any syntactic errors (e.g., missing command
- * name, missing file for redirection, or misplacement of operators) and returns -1 in such cases.
- * On success, it fills the commands array and sets *num_commands.
+ * Device, inode, size and modification time stand in for the content: a file that is
+ * rewritten or touched gets a new key without the file being read.
  */
-int parse_command(char *input, Command *commands, int *num_commands) {
-    if (input == NULL) {
-        return -1;
+uint64_t memo_hash_file(uint64_t h, const char *path) {
+    struct stat st;
+    if (path == NULL || stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return h;
     }
-    char *line_ptr = input;
-    char *segment;
-    char *segments[MAX_PIPE];
-    int segment_count = 0;
+    int64_t id[5] = {(int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec,
+                     (int64_t)st.st_mtim.tv_nsec};
+    return memo_hash(h, id, sizeof(id));
+}
 
-    // Split the input line into pipeline segments using '|' as a delimiter
-    while ((segment = strsep(&line_ptr, "|")) != NULL) {
-        if (*segment == '\0') {
-            // Empty segment (e.g., "||" or "|" at beginning/end)
-            fprintf(stderr, "shell: syntax error near unexpected token '|'\n");
-            return -1;
+/**
+ * memo_key - Compute the cache key of a "memo" pipeline.
+ * @commands: The pipeline segments (expanded).
+ * @num_commands: Number of segments.
+ * Return: The key.
+ *
+ * The key covers the working directory; every segment's words, the program a word resolves
+ * to, every argument or "<" file that names a regular file, here-strings and the other
+ * redirections; and the environment each segment gets. Environment entries are hashed one
+ * by one and summed, so variable order does not matter.
+ */
+uint64_t memo_key(Command *commands, int num_commands) {
+    uint64_t h = memo_hash(14695981039346656037ull, "memo1", 6);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        h = memo_hash(h, cwd, strlen(cwd) + 1);
+    }
+    for (int i = 0; i < num_commands; ++i) {
+        Command *cmd = &commands[i];
+        h = memo_hash(h, &cmd->argc, sizeof(cmd->argc));
+        for (int j = 0; j < cmd->argc; ++j) {
+            h = memo_hash(h, cmd->args[j], strlen(cmd->args[j]) + 1);
+            h = memo_hash_file(h, j == 0 && command_builtin(cmd) == NULL ? lookup_command(cmd->args[0]) : cmd->args[j]);
         }
-        if (segment_count >= MAX_PIPE) {
-            fprintf(stderr, "shell: too many pipeline segments (max %d)\n", MAX_PIPE);
-            return -1;
+        if (cmd->input_file != NULL) {
+            h = memo_hash_file(memo_hash(h, cmd->input_file, strlen(cmd->input_file) + 1), cmd->input_file);
         }
-        segments[segment_count++] = segment;
+        if (cmd->here_string != NULL) {
+            h = memo_hash(h, cmd->here_string, strlen(cmd->here_string) + 1);
+        }
+        for (int j = 0; j < cmd->nredirs; ++j) {
+            const Redirect *redir = &cmd->redirs[j];
+            int spec[3] = {(int)redir->kind, redir->fd, redir->source};
+            h = memo_hash(h, spec, sizeof(spec));
+            if (redir->target != NULL) {
+                h = memo_hash(h, redir->target, strlen(redir->target) + 1);
+                h = redir->kind == REDIR_READ ? memo_hash_file(h, redir->target) : h;
+            }
+        }
+        uint64_t env = 0;
+        for (char **entry = command_envp(cmd); *entry != NULL; ++entry) {
+            env += memo_hash(14695981039346656037ull, *entry, strlen(*entry));
+        }
+        h = memo_hash(h, &env, sizeof(env));
     }
+    return h;
+}
 
-    // Parse each pipeline segment
-    for (int i = 0; i < segment_count; ++i) {
-        // Trim whitespace around the segment
-        segments[i] = trim_whitespace(segments[i]);
-        if (*segments[i] == '\0') {
-            // Segment has no command (only whitespace)
-            if (segment_count > 1) {
-                fprintf(stderr, "missing command in pipeline\n");
-            } else {
-                fprintf(stderr, "missing command\n");
-            }
+/**
+ * memo_cache_path - Build the cache file path for a key, creating the cache directory once.
+ * @key: The key.
+ * @path: Output buffer.
+ * @size: Size of path.
+ * Return: 0 on success, -1 if there is no usable cache directory.
+ *
+ * Entries live in $XDG_CACHE_HOME/shell-memo, or ~/.cache/shell-memo.
+ */
+int memo_cache_path(uint64_t key, char *path, size_t size) {
+    if (memo_dir == NULL) {
+        const char *base = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        char dir[PATH_MAX];
+        if (base != NULL && base[0] == '/') {
+            mkdir(base, 0700);
+            snprintf(dir, sizeof(dir), "%s/shell-memo", base);
+        } else if (home != NULL && home[0] == '/') {
+            snprintf(dir, sizeof(dir), "%s/.cache", home);
+            mkdir(dir, 0700);
+            snprintf(dir, sizeof(dir), "%s/.cache/shell-memo", home);
+        } else {
             return -1;
         }
-        // Initialize the Command structure
-        Command *cmd = &commands[i];
-        cmd->input_file = NULL;
-        cmd->output_file = NULL;
-        cmd->background = false;
-        for (int j = 0; j < MAX_ARGS; ++j) {
-            cmd->args[j] = NULL;
-        }
-
-        // Tokenize the segment into arguments and redirection tokens
-        char *token_ptr = segments[i];
-        char *token;
-        int arg_index = 0;
-        int input_count = 0;
-        int output_count = 0;
-        while ((token = strsep(&token_ptr, " \t")) != NULL) {
-            if (*token == '\0') {
-                // Skip empty tokens (caused by consecutive spaces)
-                continue;
-            }
-            if (strcmp(token, "<") == 0) {
-                // Input redirection
-                token = strsep(&token_ptr, " \t");
-                while (token && *token == '\0') {
-                    token = strsep(&token_ptr, " \t");
-                }
-                if (token == NULL) {
-                    fprintf(stderr, "syntax error near unexpected token '<'\n");
-                    return -1;
-                }
-                if (input_count++ > 0) {
-                    fprintf(stderr, "cannot redirect input more than once\n");
-                    return -1;
-                }
-                cmd->input_file = token;
-                continue;
-            }
-            if (strcmp(token, ">") == 0) {
-                // Output redirection
-                token = strsep(&token_ptr, " \t");
-                while (token && *token == '\0') {
-                    token = strsep(&token_ptr, " \t");
-                }
-                if (token == NULL) {
-                    fprintf(stderr, "syntax error near unexpected token '>'\n");
-                    return -1;
-                }
-                if (output_count++ > 0) {
-                    fprintf(stderr, "cannot redirect output more than once\n");
-                    return -1;
-                }
-                cmd->output_file = token;
-                continue;
-            }
-            if (strcmp(token, "&") == 0) {
-                // Background operator (must be at end of command line)
-                if (i != segment_count - 1) {
-                    fprintf(stderr, "'&' can only appear at end of command\n");
-                    return -1;
-                }
-                // Ensure no other token follows '&'
-                char *remain = token_ptr;
-                bool only_spaces = true;
-                while (remain && *remain != '\0') {
-                    if (!isspace((unsigned char)*remain)) {
-                        only_spaces = false;
-                        break;
-                    }
-                    remain++;
-                }
-                if (!only_spaces) {
-                    fprintf(stderr, "syntax error near unexpected token '&'\n");
-                    return -1;
-                }
-                cmd->background = true;
-                break;  // stop processing further tokens in this segment
-            }
-            // Normal argument token
-            if (arg_index < MAX_ARGS - 1) {
-                cmd->args[arg_index++] = token;
-            } else {
-                fprintf(stderr, "too many arguments (max %d)\n", MAX_ARGS - 1);
-                return -1;
-            }
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+            return -1;
         }
-        cmd->args[arg_index] = NULL;
-        if (arg_index == 0) {
-            // No command found in this segment (only redirections or '&')
-            fprintf(stderr, "missing command\n");
+        memo_dir = strdup(dir);
+        if (memo_dir == NULL) {
             return -1;
         }
     }
+    return snprintf(path, size, "%s/%016llx", memo_dir, (unsigned long long)key) < (int)size ? 0 : -1;
+}
 
-    // Validate pipeline redirection rules
-    if (segment_count > 1) {
-        for (int i = 0; i < segment_count; ++i) {
-            if (i != 0 && commands[i].input_file != NULL) {
-                fprintf(stderr, "input redirection not allowed for command %d in pipeline\n", i + 1);
-                return -1;
-            }
-            if (i != segment_count - 1 && commands[i].output_file != NULL) {
-                fprintf(stderr, "output redirection not allowed for command %d in pipeline\n", i + 1);
-                return -1;
-            }
+/**
+ * memo_replay - Copy a cached output file to a destination without passing it through the shell.
+ * @from: The cache file, at offset 0.
+ * @to: The destination (a file opened for "> FILE" / ">> FILE", or the shell's stdout).
+ * Return: 0 on success, -1 on error.
+ *
+ * A fresh regular file is first tried as a reflink (FICLONE): on btrfs or XFS the output then
+ * shares the cached extents and nothing is copied, and the offset is moved to its end so
+ * that later writes to the same descriptor (the shell's stdout) follow the output. Otherwise copy_file_range() copies inside
+ * the kernel; a pipe or terminal falls back to sendfile(), and anything else to read/write.
+ */
+int memo_replay(int from, int to) {
+    struct stat st;
+    if (fstat(to, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0 && lseek(to, 0, SEEK_CUR) == 0 &&
+        ioctl(to, FICLONE, from) == 0) {
+        // The clone leaves the offset alone: move it past the data, as writing it would have
+        return lseek(to, 0, SEEK_END) < 0 ? -1 : 0;
+    }
+    ssize_t n;
+    while ((n = copy_file_range(from, NULL, to, NULL, FEEDER_CHUNK, 0)) > 0) {
+        continue;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    while ((n = sendfile(to, from, NULL, FEEDER_CHUNK)) > 0) {
+        continue;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    char buf[READ_CHUNK];
+    while ((n = read(from, buf, sizeof(buf))) > 0) {
+        if (write_all(to, buf, (size_t)n) != 0) {
+            return -1;
         }
     }
-
-    *num_commands = segment_count;
-    return 0;
+    return n == 0 ? 0 : -1;
 }
 
 /**
- * redirect_io - Configure input/output redirection for a command in the child process.
- * @cmd: The Command structure containing redirection info.
- * Return: 0 on success, -1 if an error occurs (and an error message is printed).
+ * memo_replay_to - Replay cached output to where the pipeline's stdout was going.
+ * @cache_fd: The cached (or just captured) output, at offset 0.
+ * @last: The pipeline's last segment: its "> FILE" / ">> FILE", if any, is the destination.
+ * Return: 0 on success, -1 on error (a message is printed).
+ *
+ * The file is opened by open_redirections(), as it would have been for the command. Not
+ * redirect_io(): that one dup2()s over stdin/stdout of the calling process, which here is
+ * the shell itself rather than a child about to exec.
  */
-int redirect_io(const Command *cmd) {
-    if (cmd->input_file) {
-        int fd = open(cmd->input_file, O_RDONLY);
-        if (fd < 0) {
-            fprintf(stderr, "%s : File not found\n", cmd->input_file);
-            return -1;
-        }
-        if (dup2(fd, STDIN_FILENO) < 0) {
-            fprintf(stderr, "error duplicating file descriptor for input: %s\n", strerror(errno));
-            close(fd);
+int memo_replay_to(int cache_fd, const Command *last) {
+    int out_fd = STDOUT_FILENO;
+    if (last->output_file != NULL) {
+        Command target;
+        memset(&target, 0, sizeof(target));
+        target.output_file = last->output_file;
+        target.append = last->append;
+        int unused;
+        if (open_redirections(&target, &unused, &out_fd) != 0) {
             return -1;
         }
-        close(fd);
+    } else {
+        fflush(stdout);
     }
-    if (cmd->output_file) {
-        int fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-            fprintf(stderr, "%s: Cannot create file\n", cmd->output_file);
-            return -1;
+    int err = memo_replay(cache_fd, out_fd);
+    if (err != 0) {
+        perror("memo: write");
+    }
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    return err;
+}
+
+/**
+ * memo_stdin_fixed - Check whether the first segment's stdin is named by the command line.
+ * @cmd: The first segment.
+ * Return: true for a here-string, a "<" from a regular file or /dev/null, or a "cat FILE"
+ *         stage (which never reads stdin); false for an inherited pipe, terminal or the like.
+ *
+ * Only then is the input covered by the key: an inherited stdin may carry different data
+ * on every run, so such a pipeline must not be cached.
+ */
+bool memo_stdin_fixed(const Command *cmd) {
+    if (feeder_stage_file(cmd, 2) != NULL && cmd->argc != 0) {
+        // "cat FILE" (asked as if a segment followed: only cmd itself is looked at)
+        return true;
+    }
+    const char *path = cmd->input_file;
+    bool here = cmd->here_string != NULL;
+    for (int i = 0; i < cmd->nredirs; ++i) {
+        const Redirect *redir = &cmd->redirs[i];
+        if (redir->fd != STDIN_FILENO) {
+            continue;
         }
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-            fprintf(stderr, "error duplicating file descriptor for output: %s\n", strerror(errno));
-            close(fd);
-            return -1;
+        if (redir->kind != REDIR_READ && redir->kind != REDIR_HERE) {
+            return false;  // "<&N" or "<&-": not a fixed input
         }
-        close(fd);
+        here = redir->kind == REDIR_HERE;
+        path = here ? NULL : redir->target;
     }
-    return 0;
+    struct stat st;
+    if (here) {
+        return true;
+    }
+    return path != NULL && stat(path, &st) == 0 &&
+           (S_ISREG(st.st_mode) || (S_ISCHR(st.st_mode) && st.st_rdev == makedev(1, 3)));
+}
+
+/**
+ * memo_run - Run a pipeline behind the "memo" prefix, replaying its output if it is cached.
+ * @commands: The pipeline segments (expanded, prefixes stripped).
+ * @num_commands: Number of segments.
+ * @timed: "time" prefix.
+ * @pipe_size: Inter-stage pipe buffer size.
+ * @limits: "run" limits, or NULL.
+ * Return: As run_pipeline().
+ *
+ * On a hit the pipeline does not run: the stored stdout is copied to "> FILE" (or stdout)
+ * and the status is 0. On a miss the last segment's stdout goes to a temporary file in the
+ * cache directory, which becomes the entry if the pipeline exits with 0 and is replayed in
+ * any case. Background pipelines, ones that redirect descriptor 1 themselves and ones whose
+ * stdin is inherited (memo_stdin_fixed) run uncached; stderr is never cached.
+ */
+int memo_run(Command *commands, int num_commands, bool timed, long pipe_size, const RunLimits *limits) {
+    Command *last = &commands[num_commands - 1];
+    bool cacheable = !last->background && memo_stdin_fixed(&commands[0]);
+    for (int i = 0; i < last->nredirs; ++i) {
+        cacheable = cacheable && last->redirs[i].fd != STDOUT_FILENO;
+    }
+    char path[PATH_MAX];
+    if (!cacheable || memo_cache_path(memo_key(commands, num_commands), path, sizeof(path)) != 0) {
+        return run_pipeline(commands, num_commands, timed, pipe_size, limits);
+    }
+    int cache_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache_fd >= 0) {
+        memo_hits++;
+        last_status = memo_replay_to(cache_fd, last) == 0 ? 0 : 1;
+        close(cache_fd);
+        return 1;
+    }
+    // Miss: capture stdout, then keep it if the pipeline succeeded
+    memo_misses++;
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    char *output_file = last->output_file;
+    bool append = last->append;
+    last->output_file = tmp;
+    last->append = false;
+    int status = run_pipeline(commands, num_commands, timed, pipe_size, limits);
+    last->output_file = output_file;
+    last->append = append;
+    cache_fd = open(tmp, O_RDONLY | O_CLOEXEC);
+    if (cache_fd < 0) {
+        return status;  // Nothing ran (the failure was reported)
+    }
+    if (last_status == 0 && rename(tmp, path) == 0) {
+        memo_stored++;
+    } else {
+        unlink(tmp);
+    }
+    if (memo_replay_to(cache_fd, last) != 0 && last_status == 0) {
+        last_status = 1;
+    }
+    close(cache_fd);
+    return status;
 }
 
 /**
- * execute_commands - Execute the parsed command(s).
+ * execute_commands - Execute the parsed command(s) of one pipeline.
  * @commands: Array of Command structures to execute.
  * @num_commands: Number of commands (segments) in the array.
  * Return: 1 to continue the shell loop, or 2 to signal that the shell should exit.
  *
- * If a single command is a built-in (cd or exit), it is handled in the shell process.
- * Otherwise, external commands are executed by forking child processes. If multiple commands
- * are present (pipeline), pipes are set up between them. The function handles foreground and
- * background execution: for background jobs, it does not wait for the child process to finish.
+ * Strips the "time", "pipesize SIZE", "memo" and "run [--OPTION=VALUE...]" prefixes, runs
+ * the pipeline with run_pipeline() (memo_run() behind "memo"),
+ * then puts the prefixes back: the commands may belong to a cached tree that runs again.
+ * For the same reason variables are substituted into a copy (expand_commands()). Process
+ * substitutions are started in that copy and their words replaced by /dev/fd paths; the
+ * shell's pipe ends are closed once the pipeline has finished (or, in the background, started).
  */
 int execute_commands(Command *commands, int num_commands) {
     if (num_commands <= 0) {
         return 1;  // nothing to execute
     }
-    // Handle built-in commands for a single command (no pipeline)
-    if (num_commands == 1) {
-        Command *cmd = &commands[0];
-        if (cmd->args[0] == NULL) {
-            return 1;
-        }
-        if (strcmp(cmd->args[0], "exit") == 0) {
-            return 2;  // signal to exit the shell
+    for (int i = 0; i < num_commands; ++i) {
+        if (!commands[i].expand) {
+            continue;
         }
-        if (strcmp(cmd->args[0], "cd") == 0) {
-            const char *dir = cmd->args[1];
-            if (dir == NULL) {
-                // Change to HOME directory if no argument
-                dir = getenv("HOME");
-                if (dir == NULL) {
-                    dir = ".";
-                }
+        // Substitute variables into a copy that lives until the pipeline has been started
+        ArenaMark mark = arena_mark(&expand_arena);
+        Command *expanded = expand_commands(commands, num_commands);
+        int status = 1;
+        if (expanded == NULL) {
+            perror("shell: malloc");
+            last_status = 1;
+        } else if (num_commands == 1 && expanded[0].argc == 0) {
+            // Only assignments, or a command that expanded to nothing
+            for (int a = 0; a < expanded[0].nassign; ++a) {
+                var_set_word(expanded[0].assigns[a], false);
             }
-            if (chdir(dir) != 0) {
-                fprintf(stderr, "cd: %s: %s\n", cmd->args[1] ? cmd->args[1] : dir, strerror(errno));
+            last_status = 0;
+        } else if (feeder_stage_file(expanded, num_commands) == NULL && !pipeline_has_commands(expanded, num_commands)) {
+            fprintf(stderr, "missing command\n");
+        } else {
+            int *subst_fds;
+            int nsubst = proc_subst_start(expanded, num_commands, &subst_fds);
+            if (nsubst < 0) {
+                last_status = 1;
+            } else {
+                status = execute_commands(expanded, num_commands);
+                while (nsubst > 0) {
+                    close(subst_fds[--nsubst]);
+                }
             }
-            return 1;
         }
+        arena_release(&expand_arena, mark);
+        return status;
     }
-
-    // Execute external command(s), possibly with pipes
-    pid_t pids[MAX_PIPE];
-    int prev_fd = -1;
-    int launched = 0;
-
-    for (int i = 0; i < num_commands; ++i) {
-        int pipefd[2];
-        if (i < num_commands - 1) {
-            // Create a pipe for this and the next command
-            if (pipe(pipefd) < 0) {
-                perror("shell: pipe");
+    // Pipeline prefixes: "time" reports resource usage of the whole pipeline when it finishes,
+    // "pipesize SIZE" sets the inter-stage pipe buffer size for this pipeline only, "memo"
+    // replays its output from the cache, "run" places it in a cgroup and under resource limits
+    bool timed = false;
+    bool invalid = false;
+    RunLimits limits;
+    bool limited = false;
+    bool memo = false;
+    long pipe_size = pipe_size_default;
+    bool sized = false;
+    char **first_word = commands[0].args;
+    int first_argc = commands[0].argc;
+    while (commands[0].argc > 0) {
+        if (strcmp(commands[0].args[0], "time") == 0) {
+            timed = true;
+            commands[0].args++;
+            commands[0].argc--;
+        } else if (strcmp(commands[0].args[0], "pipesize") == 0 && commands[0].argc > 1) {
+            pipe_size = parse_size(commands[0].args[1]);
+            if (pipe_size < 0) {
+                fprintf(stderr, "pipesize: invalid size '%s'\n", commands[0].args[1]);
+                last_status = 2;
+                invalid = true;
                 break;
             }
-        }
-
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("shell: fork");
-            if (i < num_commands - 1) {
-                close(pipefd[0]);
-                close(pipefd[1]);
+            sized = true;
+            commands[0].args += 2;
+            commands[0].argc -= 2;
+        } else if (strcmp(commands[0].args[0], "memo") == 0 && !memo) {
+            memo = true;
+            commands[0].args++;
+            commands[0].argc--;
+        } else if (strcmp(commands[0].args[0], "run") == 0 && !limited) {
+            int used = run_limits_parse(commands[0].args + 1, &limits);
+            if (used < 0) {
+                last_status = 2;
+                invalid = true;
+                break;
             }
+            limited = true;
+            commands[0].args += 1 + used;
+            commands[0].argc -= 1 + used;
+        } else {
             break;
         }
-        if (pid == 0) {
-            // Child process
-            if (prev_fd != -1) {
-                dup2(prev_fd, STDIN_FILENO);
-            }
-            if (i < num_commands - 1) {
-                dup2(pipefd[1], STDOUT_FILENO);
-            }
-            // Close unused fds in child
-            if (prev_fd != -1) {
-                close(prev_fd);
-            }
-            if (i < num_commands - 1) {
-                close(pipefd[0]);
-                close(pipefd[1]);
-            }
-            if (redirect_io(&commands[i]) != 0) {
-                _exit(1);
-            }
-            execvp(commands[i].args[0], commands[i].args);
-            // If execvp returns, an error occurred
-            fprintf(stderr, "%s: Command not found\n", commands[i].args[0]);
-            _exit(127);
+    }
+    int status = 1;
+    bool bare = commands[0].args != first_word && commands[0].argc == 0 &&
+                feeder_stage_file(commands, num_commands) == NULL;
+    if (invalid) {
+        status = 1;  // Error already reported
+    } else if (bare) {
+        if (memo) {
+            fprintf(stderr, "memo: missing command\n");
+            last_status = 2;
+        } else if (limited) {
+            fprintf(stderr, "run: missing command\n");
+            last_status = 2;
+        } else if (sized) {
+            fprintf(stderr, "pipesize: missing command\n");
+            last_status = 2;
+        } else if (timed && num_commands == 1) {
+            fprintf(stderr, "\nreal\t0.000s\nuser\t0.000s\nsys\t0.000s\n");
         } else {
-            // Parent process
-            pids[launched++] = pid;
-            if (prev_fd != -1) {
-                close(prev_fd);
-            }
-            if (i < num_commands - 1) {
-                close(pipefd[1]);
-                prev_fd = pipefd[0];
-            }
+            fprintf(stderr, "missing command\n");
         }
+    } else if (limited && run_limits_open(&limits) != 0) {
+        last_status = 1;
+    } else if (memo) {
+        status = memo_run(commands, num_commands, timed, pipe_size, limited ? &limits : NULL);
+    } else {
+        status = run_pipeline(commands, num_commands, timed, pipe_size, limited ? &limits : NULL);
     }
-    // Close any remaining pipe read end in parent
-    if (prev_fd != -1) {
-        close(prev_fd);
+    if (limited && limits.cgroup_fd >= 0) {
+        close(limits.cgroup_fd);
     }
+    commands[0].args = first_word;
+    commands[0].argc = first_argc;
+    return status;
+}
 
-    // If last command is to run in background, do not wait for children
-    if (commands[num_commands - 1].background) {
-        printf("[%d]\n", pids[launched - 1]);
+/**
+ * execute_and_or - Run the pipelines of an and-or list, honouring "&&" and "||".
+ * @item: The and-or list.
+ * Return: 1 to continue, 2 if the shell should exit, 0 if the rest of the line is abandoned.
+ *
+ * A pipeline joined by "&&" runs only if the previous exit status is 0, one joined by "||"
+ * only if it is not; a skipped pipeline leaves the status unchanged. Ctrl-C on a pipeline
+ * of an interactive shell abandons the rest of the line, as "break" and "continue" abandon
+ * the rest of a loop body.
+ */
+int execute_and_or(AndOr *item) {
+    for (Pipeline *pipeline = item->first; pipeline != NULL; pipeline = pipeline->next) {
+        if ((pipeline->join == LIST_AND && last_status != 0) || (pipeline->join == LIST_OR && last_status == 0)) {
+            continue;
+        }
+        if (execute_commands(pipeline->commands, pipeline->num_commands) == 2) {
+            return 2;
+        }
+        if (job_control && last_status == 128 + SIGINT) {
+            return 0;
+        }
+        if (loop_break > 0 || loop_continue) {
+            return 0;  // "break" / "continue": the enclosing loop takes over
+        }
+    }
+    return 1;
+}
+
+/**
+ * and_or_text - Build the command text shown for a background and-or list.
+ * @item: The and-or list.
+ * Return: A malloc'd string, or NULL on allocation failure.
+ */
+char *and_or_text(const AndOr *item) {
+    char *text = NULL;
+    size_t len = 0;
+    for (const Pipeline *pipeline = item->first; pipeline != NULL; pipeline = pipeline->next) {
+        char *part = job_text(pipeline->commands, pipeline->num_commands);
+        char *grown = part ? realloc(text, len + strlen(part) + 7) : NULL;
+        if (grown == NULL) {
+            free(part);
+            free(text);
+            return NULL;
+        }
+        text = grown;
+        char *p = text + len;
+        if (pipeline->join != LIST_SEQ) {
+            p = stpcpy(p, pipeline->join == LIST_AND ? " && " : " || ");
+        }
+        p = stpcpy(p, part);
+        len = (size_t)(p - text);
+        free(part);
+    }
+    if (text != NULL && item->background) {
+        strcpy(text + len, " &");
+    }
+    return text;
+}
+
+/**
+ * spawn_subshell - Run part of a command list in a forked copy of the shell.
+ * @list: First and-or list to run.
+ * @stop: And-or list to stop at (NULL for the end of the line).
+ * @job: The job the subshell belongs to (pgid 0 starts a new process group).
+ * @in_fd: Descriptor to use as stdin (-1 to inherit).
+ * @out_fd: Descriptor to use as stdout (-1 to inherit).
+ * Return: The subshell's pid, or -1 if fork failed.
+ *
+ * The subshell has no job control and an empty job table of its own (subshell_enter()); it
+ * exits with the status of the last pipeline it ran.
+ */
+pid_t spawn_subshell(AndOr *list, AndOr *stop, const Job *job, int in_fd, int out_fd) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("shell: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        child_enter(job, in_fd, out_fd);
+        if (subshell_enter() != 0) {
+            _exit(1);
+        }
+        execute_list(list, stop);
         fflush(stdout);
-    } else {
-        // Wait for all child processes in the pipeline
-        for (int j = 0; j < launched; ++j) {
-            waitpid(pids[j], NULL, 0);
+        feeder_detach();
+        _exit(last_status);
+    }
+    if (job_control) {
+        setpgid(pid, job->pgid ? job->pgid : pid);
+    }
+    return pid;
+}
+
+/**
+ * run_background_list - Start an and-or list ending in '&' as one background job.
+ * @item: The and-or list (with more than one pipeline).
+ * Return: 1 (the shell loop always continues).
+ */
+int run_background_list(AndOr *item) {
+    Job *job = job_create(1);
+    if (job == NULL) {
+        perror("shell: malloc");
+        return 1;
+    }
+    // The subshell runs a foreground copy of the list
+    AndOr foreground = *item;
+    foreground.background = false;
+    foreground.next = NULL;
+    pid_t pid = spawn_subshell(&foreground, NULL, job, -1, -1);
+    if (pid < 0) {
+        job_remove(job);
+        last_status = 1;
+        return 1;
+    }
+    job_add_process(job, pid);
+    job->text = and_or_text(item);
+    job->notified = true;
+    printf("[%d] %d\n", job->id, pid);
+    fflush(stdout);
+    last_status = 0;
+    return 1;
+}
+
+/**
+ * execute_list - Run the and-or lists of a parsed command line in order.
+ * @list: First and-or list.
+ * @stop: And-or list to stop at (NULL for the end of the line).
+ * Return: 1 to continue the shell loop, or 2 if the shell should exit.
+ *
+ * Items ended by ';' run in the foreground one after the other; an item ended by '&' is
+ * started in the background (in a subshell if it has several pipelines).
+ */
+int execute_list(AndOr *list, AndOr *stop) {
+    for (AndOr *item = list; item != stop; item = item->next) {
+        int status = item->background && item->first->next != NULL ? run_background_list(item) : execute_and_or(item);
+        if (status != 1) {
+            return status == 2 ? 2 : 1;
         }
     }
     return 1;
 }
 
+#ifdef SHELL_FUZZ
+/**
+ * LLVMFuzzerTestOneInput - libFuzzer entry point ("make fuzz"): parse one input, run nothing.
+ * @data: The input.
+ * @size: Its length.
+ * Return: 0.
+ *
+ * parse_command() splits words in place, so it gets a NUL-terminated copy of exactly the
+ * input, which lets AddressSanitizer catch a read past its end. The tree goes into a scratch
+ * arena that is reset after each input.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static Arena fuzz_arena;
+    char *line = malloc(size + 1);
+    if (line == NULL) {
+        return 0;
+    }
+    memcpy(line, data, size);
+    line[size] = '\0';
+    AndOr *list;
+    parse_command(line, &fuzz_arena, &list);
+    arena_reset(&fuzz_arena);
+    free(line);
+    return 0;
+}
+#else
 /**
  * main - Entry point of the shell program.
- * Return: 0 on normal exit, or a non-zero value on error.
+ * @argc: Argument count.
+ * @argv: Arguments: none (read stdin), "-c COMMAND [NAME [ARG...]]", or a script file path
+ *        and its arguments. NAME (or the script) is $0 and the ARGs are $1, $2, ...
+ * Return: The status given to "exit", or that of the last command at end of input.
  *
  * The main loop reads input lines, parses them, and executes the resulting command(s).
- * It prints a prompt in interactive mode and handles EOF (Ctrl-D) to exit. The shell
+ * It prints a prompt in interactive mode and handles EOF (Ctrl-D) to exit. Interactivity
+ * is decided once at startup: only stdin on a terminal, with no script or -c, prompts.
  */
-int main(void) {
-    char *input_line = NULL;
-    size_t bufsize = 0;
-    Command commands[MAX_PIPE];
-    int num_commands;
+int main(int argc, char **argv) {
+    LineReader reader;
+    AndOr *list;
+    char *pending = NULL;        // Lines of a command that continues on the next line
+    size_t pending_len = 0;
     int status = 1;
+    int script_fd = -1;
+    bool interactive = false;
+
+    if (argc > 1 && strcmp(argv[1], "--stat") == 0) {
+        // Reader mode: report the shared counters of the running shells, then exit
+        char *end = NULL;
+        long interval = argc > 2 ? strtol(argv[2], &end, 10) : 0;
+        if (argc > 3 || (end != NULL && (*end != '\0' || end == argv[2] || interval <= 0 || interval > INT_MAX))) {
+            fprintf(stderr, "shell: usage: %s --stat [SECONDS]\n", argv[0]);
+            return 2;
+        }
+        return stat_report(interval);
+    }
+    var_import_environ();
+    const char *spawn_env = getenv("SHELL_SPAWN");
+    if (spawn_env != NULL && strcmp(spawn_env, "fork") == 0) {
+        spawn_mode = SPAWN_FORK;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "shell: -c: option requires an argument\n");
+            return 2;
+        }
+        if (reader_open_string(&reader, argv[2]) != 0) {
+            perror("shell: malloc");
+            return 1;
+        }
+        positional = argc > 3 ? argv + 3 : argv;
+        npositional = argc > 3 ? argc - 3 : 1;
+    } else if (argc > 1) {
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            fprintf(stderr, "shell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        if (reader_open_fd(&reader, script_fd) != 0) {
+            perror("shell: malloc");
+            return 1;
+        }
+        positional = argv + 1;
+        npositional = argc - 1;
+    } else {
+        positional = argv;
+        npositional = 1;
+        interactive = isatty(STDIN_FILENO);
+        if (reader_open_fd(&reader, STDIN_FILENO) != 0) {
+            perror("shell: malloc");
+            return 1;
+        }
+    }
+
+    if (job_signals_init(interactive) != 0) {
+        return 1;
+    }
+    trace_init();
+    stat_init();
+    const char *term = getenv("TERM");
+    editor_enabled = interactive && isatty(STDOUT_FILENO) && !(term != NULL && strcmp(term, "dumb") == 0);
 
     // Shell read-execute loop
     while (1) {
-        // Print prompt if interactive
-        if (isatty(STDIN_FILENO)) {
-            printf("$ ");
-            fflush(stdout);
+        // Report finished background jobs, then print prompt if interactive
+        job_notify(interactive);
+        char *input_line = editor_enabled ? editor_read_line(pending ? "> " : "$ ") : NULL;
+        if (!editor_enabled) {
+            if (interactive) {
+                printf(pending ? "> " : "$ ");
+                fflush(stdout);
+            }
+            input_line = reader_next_line(&reader);
+        }
+        if (editor_cancelled) {
+            // Ctrl-C: drop the line, and a command still waiting for its continuation
+            free(pending);
+            pending = NULL;
+            continue;
         }
-        // Read a line of input (getline allocates buffer as needed)
-        ssize_t nread = getline(&input_line, &bufsize, stdin);
-        if (nread == -1) {
+        if (input_line == NULL) {
             // Exit on EOF or read error
-            if (isatty(STDIN_FILENO)) {
+            if (interactive) {
                 printf("\n");
             }
+            if (pending != NULL) {
+                fprintf(stderr, "shell: syntax error: unexpected end of file\n");
+                last_status = 2;
+            }
             break;
         }
-        // Remove the trailing newline, if any
-        if (nread > 0 && input_line[nread - 1] == '\n') {
-            input_line[nread - 1] = '\0';
+        if (editor_enabled) {
+            history_add(input_line);
+        }
+        if (pending != NULL) {
+            // Continuation line: parse the whole command again with this line appended
+            size_t len = strlen(input_line);
+            char *grown = realloc(pending, pending_len + len + 2);
+            if (grown == NULL) {
+                perror("shell: malloc");
+                break;
+            }
+            pending = grown;
+            pending[pending_len++] = '\n';
+            memcpy(pending + pending_len, input_line, len + 1);
+            pending_len += len;
+            input_line = pending;
         }
-        // Skip empty lines
-        char *trimmed = trim_whitespace(input_line);
-        if (*trimmed == '\0') {
+        // Parse the command line, or fetch the tree of an identical earlier line
+        long long parse_start = now_ns();
+        int parsed = parse_line(input_line, &list);
+        last_parse_ns = now_ns() - parse_start;
+        STAT_ADD(lines, 1);
+        STAT_ADD(parse_ns, last_parse_ns);
+        if (parsed > 0) {
+            // Open loop or trailing "&&" / "||": keep reading
+            if (pending == NULL) {
+                pending_len = strlen(input_line);
+                pending = malloc(pending_len + 1);
+                if (pending == NULL) {
+                    perror("shell: malloc");
+                    break;
+                }
+                memcpy(pending, input_line, pending_len + 1);
+            }
+            arena_reset(&line_arena);
             continue;
         }
-        // Parse the command line
-        if (parse_command(trimmed, commands, &num_commands) != 0) {
-            // Parsing error (message already printed)
+        free(pending);
+        pending = NULL;
+        if (parsed != 0 || list == NULL) {
+            // Parsing error (message already printed), empty line or comment
+            if (parsed != 0) {
+                last_status = 2;
+            }
+            arena_reset(&line_arena);
             continue;
         }
-        // Execute the parsed command(s)
-        status = execute_commands(commands, num_commands);
+        // Execute the parsed command(s), then drop everything parsed from this line
+        status = execute_list(list, NULL);
+        arena_reset(&line_arena);
         if (status == 2) {
             // "exit" command: break out of loop
             break;
         }
         // Reap any background processes that have finished
-        while (waitpid(-1, NULL, WNOHANG) > 0) {
-            continue;
-        }
+        reap_children();
     }
 
-    free(input_line);
-    return 0;
+    while (coproc_list != NULL) {
+        coproc_close(&coproc_list);
+    }
+    job_hangup_all();
+    feeder_detach();
+    free(pending);
+    free(reader.buf);
+    history_close();
+    stat_close();
+    free(pin_cpus);
+    free(line_editor.buf);
+    free(line_editor.saved);
+    free(line_editor.out);
+    arena_free(&line_arena);
+    arena_free(&expand_arena);
+    arena_free(&env_arena);
+    if (script_fd != -1) {
+        close(script_fd);
+    }
+    path_cache_clear(false);
+    free(path_cache_path);
+    parse_cache_trim(0);
+    return last_status;
 }
+#endif
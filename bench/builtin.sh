@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builtin fast path: run N "echo" / "test" commands through the shell as builtins and as
+# the external /bin utilities, and report the mean cost per command.
+#
+# Usage: bench/builtin.sh [N] [SHELL_BINARY]
+
+N=${1:-5000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    label=$1
+    line=$2
+    i=0
+    while [ "$i" -lt "$N" ]; do
+        echo "$line"
+        i=$((i + 1))
+    done > "$SCRIPT"
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo "$label commands=$N nsec_per_command=$(( (end - start) / N ))"
+}
+
+run "echo=builtin" "echo hello world"
+run "echo=external" "/bin/echo hello world"
+run "test=builtin" "test -d /tmp"
+run "test=external" "/usr/bin/test -d /tmp"
+run "pipe=builtin" "echo hello | tr a-z A-Z"
+run "pipe=external" "/bin/echo hello | tr a-z A-Z"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Completion: put a directory of N executables first in PATH and time command completion
+# with "compgen -c" (the code behind Tab): once cold, when the PATH directories are
+# listed into the executable index, and then M times in a loop against the warm index.
+#
+# Usage: bench/complete.sh [N] [M] [SHELL_BINARY]
+
+N=${1:-5000}
+M=${2:-2000}
+SHELL_BIN=${3:-./output}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+seq -f "$DIR/cmd%05g" 1 "$N" | xargs touch
+chmod +x "$DIR"/*
+PATH=$DIR:$PATH
+export PATH
+# Let the directory's mtime settle so the index trusts it
+sleep 2
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 executables=$N usec=$(( (end - start) / 1000 ))"
+}
+
+echo "true" > "$SCRIPT"
+time_script "startup"
+echo "compgen -c cmd0012" > "$SCRIPT"
+time_script "complete=cold"
+words=$(seq 1 "$M" | tr '\n' ' ')
+echo "for i in $words; do compgen -c cmd0012; done" > "$SCRIPT"
+start=$(date +%s%N); "$SHELL_BIN" "$SCRIPT" > /dev/null; end=$(date +%s%N)
+echo "for i in $words; do true; done" > "$SCRIPT"
+base_start=$(date +%s%N); "$SHELL_BIN" "$SCRIPT" > /dev/null; base_end=$(date +%s%N)
+echo "complete=warm executables=$N nsec_per_lookup=$(( ((end - start) - (base_end - base_start)) / M ))"
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Coprocesses: answer N requests with a small Python filter, once by starting the
+# interpreter for every request (cold) and once by sending each request to a single warm
+# interpreter started with "coproc" (one line out, one line back). Reports the mean cost
+# per request.
+#
+# Usage: bench/coproc.sh [N] [SHELL_BINARY] [INTERPRETER]
+
+N=${1:-200}
+SHELL_BIN=${2:-./output}
+PYTHON=${3:-python3}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/upper.py" <<'PY'
+import sys
+for line in sys.stdin:
+    print(line.strip().upper(), flush=True)
+PY
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$DIR/script" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 requests=$N usec_per_request=$(( (end - start) / 1000 / N ))"
+}
+
+words=$(seq 1 "$N" | tr '\n' ' ')
+echo "for i in $words; do $PYTHON $DIR/upper.py <<< item\$i; done" > "$DIR/script"
+time_script "worker=cold"
+cat > "$DIR/script" <<EOF
+coproc UP $PYTHON $DIR/upper.py
+for i in $words; do echo item\$i >&\$UP_IN; read -u \$UP_OUT reply; echo \$reply; done
+coproc -c UP
+wait
+EOF
+time_script "worker=warm"
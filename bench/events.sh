@@ -0,0 +1,38 @@
+#!/bin/sh
+# Event loop: K background pipelines each fed a SIZE_MB file by the shell ("cat FILE | wc -c &"),
+# then N short "parallel" tasks, once with the io_uring backend and once with epoll
+# (SHELL_EVENTS=epoll). Reports the wall time of each phase; every feeder is driven by the
+# shell's loop, so the shell stays single-threaded however many run at once.
+#
+# Usage: bench/events.sh [K] [SIZE_MB] [N] [SHELL_BINARY]
+
+K=${1:-32}
+SIZE_MB=${2:-16}
+N=${3:-500}
+SHELL_BIN=${4:-./output}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/zero | tr '\0' 'x' > "$DIR/data"
+
+time_script() {
+    start=$(date +%s%N)
+    SHELL_EVENTS=$1 "$SHELL_BIN" "$DIR/script" > /dev/null
+    end=$(date +%s%N)
+    echo "backend=${1:-io_uring} $2 msec=$(( (end - start) / 1000000 ))"
+}
+
+i=0
+while [ "$i" -lt "$K" ]; do
+    echo "cat $DIR/data | wc -c &"
+    i=$((i + 1))
+done > "$DIR/feeders"
+echo "wait" >> "$DIR/feeders"
+echo "parallel -j 8 echo {} ::: $(seq 1 "$N" | tr '\n' ' ')" > "$DIR/tasks"
+
+for backend in "" epoll; do
+    cp "$DIR/feeders" "$DIR/script"
+    time_script "$backend" "feeders=$K size_mb=$SIZE_MB"
+    cp "$DIR/tasks" "$DIR/script"
+    time_script "$backend" "parallel_tasks=$N"
+done
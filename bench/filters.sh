@@ -0,0 +1,41 @@
+#!/bin/sh
+# Builtin text filters versus coreutils: N short pipelines ending in head, tail, wc and a
+# fixed-string grep, then the same filters over a SIZE_MB file, each run with
+# "set -o builtin-filters" off (coreutils) and on (in the shell).
+#
+# Usage: bench/filters.sh [N] [SIZE_MB] [SHELL_BINARY]
+
+N=${1:-2000}
+SIZE_MB=${2:-64}
+SHELL_BIN=${3:-./output}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+seq 1 $((SIZE_MB * 150000)) | head -c $((SIZE_MB * 1024 * 1024)) > "$DIR/data"
+
+time_script() {
+    start=$(date +%s%N)
+    # Not /dev/null: GNU grep stops at the first match when it sees output is discarded
+    "$SHELL_BIN" "$DIR/script" > "$DIR/out"
+    end=$(date +%s%N)
+    echo "$1 msec=$(( (end - start) / 1000000 ))"
+}
+
+for mode in off on; do
+    set_line="set +o builtin-filters"
+    [ "$mode" = on ] && set_line="set -o builtin-filters"
+    { echo "$set_line"
+      i=0
+      while [ "$i" -lt "$N" ]; do
+          echo "echo line | head -n 1; echo line | tail -n 1; echo line | wc -l; echo line | grep -c li"
+          i=$((i + 1))
+      done
+    } > "$DIR/script"
+    time_script "filters=$mode short_pipelines=$((4 * N))"
+    for filter in "wc -l" "grep -c 99999" "tail -n 10" "head -n 5000000"; do
+        printf '%s\n%s\n' "$set_line" "cat $DIR/data | $filter" > "$DIR/script"
+        time_script "filters=$mode size_mb=$SIZE_MB cmd=\"cat | $filter\""
+    done
+    printf '%s\n%s\n' "$set_line" "tail -n 10 $DIR/data" > "$DIR/script"
+    time_script "filters=$mode size_mb=$SIZE_MB cmd=\"tail -n 10 FILE\""
+done
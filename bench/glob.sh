@@ -0,0 +1,48 @@
+#!/bin/sh
+# Glob cache: expand "DIR/*.log" (every file) and "DIR/999?*.log" (a few) over a directory of
+# N files, once (a readdir() pass) and R times in one session (served from the directory
+# cache), and report the cost per glob.
+# The same loop in /bin/sh, which reads the directory every time, is timed for reference.
+#
+# Usage: bench/glob.sh [N] [R] [SHELL_BINARY]
+
+N=${1:-100000}
+R=${2:-50}
+SHELL_BIN=${3:-./output}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+(cd "$DIR" && seq 1 "$N" | sed 's/$/.log/' | xargs touch && touch keep.txt other.dat)
+# Directories changed in the last two seconds are not trusted from the cache
+sleep 3
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo $(( end - start ))
+}
+
+run() {
+    label=$1
+    pattern=$2
+    echo "echo $pattern" > "$SCRIPT"
+    cold=$(time_script)
+    i=0
+    while [ "$i" -lt "$R" ]; do
+        echo "echo $pattern"
+        i=$((i + 1))
+    done > "$SCRIPT"
+    warm=$(time_script)
+    echo "glob=$label-cold entries=$N usec_per_glob=$(( cold / 1000 ))"
+    echo "glob=$label-cached entries=$N globs=$R usec_per_glob=$(( (warm - cold) / (R - 1) / 1000 ))"
+}
+
+run "all" "$DIR/*.log"
+run "few" "$DIR/999?*.log"
+
+start=$(date +%s%N)
+sh -c "i=0; while [ \$i -lt $R ]; do echo $DIR/*.log; i=\$((i + 1)); done" > /dev/null
+end=$(date +%s%N)
+echo "glob=sh entries=$N globs=$R usec_per_glob=$(( (end - start) / R / 1000 ))"
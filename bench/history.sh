@@ -0,0 +1,28 @@
+#!/bin/sh
+# History: build an N-entry history file and time shell startup against it (the file must
+# not be read), then "history 1" twice: the first run builds the offset index, the second
+# finds it up to date and only maps the files.
+#
+# Usage: bench/history.sh [N] [SHELL_BINARY]
+
+N=${1:-1000000}
+SHELL_BIN=${2:-./output}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+HISTFILE=$DIR/history
+export HISTFILE
+
+seq 1 "$N" | sed 's/.*/echo history entry & | grep -c entry/' > "$HISTFILE"
+
+time_run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" -c "$2" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 entries=$N usec=$(( (end - start) / 1000 ))"
+}
+
+time_run "startup" "true"
+time_run "history=index-build" "history 1"
+time_run "history=indexed" "history 1"
+time_run "history=indexed" "history 1"
+echo "index_bytes=$(wc -c < "$HISTFILE.idx") history_bytes=$(wc -c < "$HISTFILE")"
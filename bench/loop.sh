@@ -0,0 +1,28 @@
+#!/bin/sh
+# Loop bodies: run N iterations of a builtin body as one "for" loop and as N separate
+# script lines, and report the mean cost per iteration. The loop is parsed once and its
+# body tree re-run; the unrolled script is parsed (or fetched from the parse cache) per line.
+#
+# Usage: bench/loop.sh [N] [SHELL_BINARY]
+
+N=${1:-20000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 iterations=$N nsec_per_iteration=$(( (end - start) / N ))"
+}
+
+words=$(seq 1 "$N" | tr '\n' ' ')
+echo "for i in $words; do echo item \$i; done" > "$SCRIPT"
+time_script "body=loop"
+seq 1 "$N" | sed 's/^/echo item /' > "$SCRIPT"
+time_script "body=unrolled"
+echo "for i in $words; do test \$i -gt 0 && true; done" > "$SCRIPT"
+time_script "and-or=loop"
+seq 1 "$N" | sed 's/.*/test & -gt 0 \&\& true/' > "$SCRIPT"
+time_script "and-or=unrolled"
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Output memoization: sort a SIZE_MB file N times, once plainly and once behind "memo"
+# (one miss, then hits replayed from the cache with copy_file_range/reflink). Reports the
+# mean wall time per run; the cache lives in a throwaway XDG_CACHE_HOME.
+#
+# Usage: bench/memo.sh [SIZE_MB] [N] [SHELL_BINARY]
+
+SIZE_MB=${1:-32}
+N=${2:-10}
+SHELL_BIN=${3:-./output}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+seq 1 $((SIZE_MB * 150000)) | sort -R | head -c $((SIZE_MB * 1024 * 1024)) > "$DIR/input"
+
+time_script() {
+    start=$(date +%s%N)
+    XDG_CACHE_HOME="$DIR/cache" "$SHELL_BIN" "$DIR/script"
+    end=$(date +%s%N)
+    echo "$1 size_mb=$SIZE_MB runs=$N msec_per_run=$(( (end - start) / 1000000 / N ))"
+}
+
+for mode in plain memo; do
+    prefix=
+    [ "$mode" = memo ] && prefix="memo "
+    seq 1 "$N" | sed "s|.*|${prefix}sort -n < $DIR/input > $DIR/output|" > "$DIR/script"
+    time_script "run=$mode"
+done
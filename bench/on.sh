@@ -0,0 +1,32 @@
+#!/bin/sh
+# Remote fan-out: run "true" R times on every host in HOSTS, once with a fresh ssh login per
+# host and run (ssh -o ControlMaster=no) and once through "on", which keeps one control
+# connection per host open. Reports the mean wall time per round and the reuse counters.
+# Needs key-based ssh access to every host.
+#
+# Usage: bench/on.sh HOSTS [R] [SHELL_BINARY]
+
+HOSTS=${1:?usage: bench/on.sh HOST[,HOST...] [R] [SHELL_BINARY]}
+R=${2:-10}
+SHELL_BIN=${3:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT"
+    end=$(date +%s%N)
+    echo "$1 hosts=$HOSTS rounds=$R msec_per_round=$(( (end - start) / 1000000 / R ))"
+}
+
+round="parallel -j 32 ssh -n -o BatchMode=yes -o ControlMaster=no -o ControlPath=none {} true ::: $(echo "$HOSTS" | tr ',' ' ')"
+seq 1 "$R" | sed "s|.*|$round|" > "$SCRIPT"
+time_script "session=fresh"
+
+{
+    echo "on -x > /dev/null"
+    seq 1 "$R" | sed "s|.*|on $HOSTS -- true|"
+    echo "shellstat | grep remote >&2"
+    echo "on -x > /dev/null"
+} > "$SCRIPT"
+time_script "session=pooled"
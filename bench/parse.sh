@@ -0,0 +1,23 @@
+#!/bin/sh
+# Parser throughput on long lines: N lines of "cd ." followed by 120 arguments
+# (cd ignores the extra words, so nothing is launched) and report MB/sec parsed.
+#
+# Usage: bench/parse.sh [N] [SHELL_BINARY]
+
+N=${1:-20000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$N" 'BEGIN {
+    line = "cd ."
+    for (i = 0; i < 120; i++) line = line "  argument_" i "_abcdefghij"
+    for (i = 0; i < n; i++) print line
+}' > "$SCRIPT"
+
+bytes=$(wc -c < "$SCRIPT")
+start=$(date +%s%N)
+"$SHELL_BIN" < "$SCRIPT"
+end=$(date +%s%N)
+ns=$((end - start))
+echo "parse lines=$N bytes=$bytes lines_per_sec=$(( N * 1000000000 / ns )) mb_per_sec=$(( bytes * 1000 / ns ))"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Parse cache: run N lines cycling over K distinct command shapes (builtins only, so
+# nothing is launched) with the cache off and on, and report the mean cost per line.
+#
+# Usage: bench/parsecache.sh [N] [K] [SHELL_BINARY]
+
+N=${1:-200000}
+K=${2:-200}
+SHELL_BIN=${3:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+for size in 0 256; do
+    awk -v n="$N" -v k="$K" -v size="$size" 'BEGIN {
+        print "set -o parsecache=" size
+        for (i = 0; i < n; i++) {
+            s = i % k
+            printf "true build_%d --flag=%d -o out_%d.o src/file_%d.c ; test -n x%d && : || false\n", s, s, s, s, s
+        }
+    }' > "$SCRIPT"
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT"
+    end=$(date +%s%N)
+    echo "parsecache=$size lines=$N shapes=$K nsec_per_line=$(( (end - start) / N ))"
+done
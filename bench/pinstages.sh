@@ -0,0 +1,30 @@
+#!/bin/sh
+# Pipeline throughput with stage placement: push SIZE_MB through a four-stage pipeline with
+# set -o pinstages off, on, and with NUMA memory binding, and report MB/sec. The difference
+# shows on machines with several cache domains or sockets; on one CPU it is the cost of the
+# extra sched_setaffinity calls.
+#
+# Usage: bench/pinstages.sh [SIZE_MB] [RUNS] [SHELL_BINARY]
+
+SIZE_MB=${1:-1024}
+RUNS=${2:-3}
+SHELL_BIN=${3:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+time_script() {
+    echo "$2" > "$SCRIPT"
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        printf '%s\n' "head -c $((SIZE_MB * 1024 * 1024)) /dev/zero | tr '\\0' a | cat | wc -c > /dev/null"
+        i=$((i + 1))
+    done >> "$SCRIPT"
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT"
+    end=$(date +%s%N)
+    echo "$1 size_mb=$SIZE_MB runs=$RUNS mb_per_sec=$(( SIZE_MB * RUNS * 1000000000 / (end - start) ))"
+}
+
+time_script "pinstages=off" "set +o pinstages"
+time_script "pinstages=cpu" "set -o pinstages"
+time_script "pinstages=numa" "set -o pinstages=numa"
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Pipeline throughput at several inter-stage pipe buffer sizes: stream SIZE_MB through
+# "head -c | cat | cat | wc -c" with the per-pipeline "pipesize" prefix.
+#
+# Usage: bench/pipesize.sh [SIZE_MB] [SHELL_BINARY]
+
+SIZE_MB=${1:-2048}
+SHELL_BIN=${2:-./output}
+BYTES=$((SIZE_MB * 1024 * 1024))
+
+for size in 64K 256K 1M; do
+    start=$(date +%s%N)
+    "$SHELL_BIN" -c "pipesize $size head -c $BYTES /dev/zero | cat | cat | wc -c" > /dev/null
+    end=$(date +%s%N)
+    echo "pipesize=$size size_mb=$SIZE_MB mb_per_sec=$(( SIZE_MB * 1000000000 / (end - start) ))"
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Comparing two command outputs: write both to temporary files and cmp them, versus cmp
+# on two process substitutions that stream through pipes. Reports the time per comparison
+# of two SIZE_MB streams.
+#
+# Usage: bench/procsubst.sh [SIZE_MB] [SHELL_BINARY]
+
+SIZE_MB=${1:-256}
+SHELL_BIN=${2:-./output}
+SHELL_BIN=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/zero > "$DIR/data"
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" -c "$2" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 size_mb=$SIZE_MB msec_per_compare=$(( (end - start) / 1000000 ))"
+}
+
+cd "$DIR" || exit 1
+time_script "compare=tempfiles" "cat data > a.tmp; cat data > b.tmp; cmp a.tmp b.tmp; rm a.tmp b.tmp"
+time_script "compare=procsubst" "cmp <(cat data) <(cat data)"
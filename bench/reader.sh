@@ -0,0 +1,22 @@
+#!/bin/sh
+# Script reader throughput: feed N lines that run no external process ("cd .")
+# through the shell, as a script file and on a pipe, and report lines/sec.
+#
+# Usage: bench/reader.sh [N] [SHELL_BINARY]
+
+N=${1:-100000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "cd ." }' > "$SCRIPT"
+
+start=$(date +%s%N)
+"$SHELL_BIN" "$SCRIPT"
+end=$(date +%s%N)
+echo "mode=script lines=$N lines_per_sec=$(( N * 1000000000 / (end - start) ))"
+
+start=$(date +%s%N)
+"$SHELL_BIN" < "$SCRIPT"
+end=$(date +%s%N)
+echo "mode=stdin lines=$N lines_per_sec=$(( N * 1000000000 / (end - start) ))"
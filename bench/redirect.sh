@@ -0,0 +1,29 @@
+#!/bin/sh
+# Redirections: feed a word to a builtin N times through a "<<<" here-string (an in-memory
+# memfd, no process) and through "echo WORD | ..." (a forked pipeline stage), and append N
+# lines to a log with ">>" versus "| tee -a". Reports the mean cost per iteration.
+#
+# Usage: bench/redirect.sh [N] [SHELL_BINARY]
+
+N=${1:-5000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+LOG=$(mktemp)
+trap 'rm -f "$SCRIPT" "$LOG"' EXIT
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo "$1 iterations=$N nsec_per_iteration=$(( (end - start) / N ))"
+}
+
+words=$(seq 1 "$N" | tr '\n' ' ')
+echo "for i in $words; do read x <<< \"item \$i\"; done" > "$SCRIPT"
+time_script "feed=here-string"
+echo "for i in $words; do echo item \$i | read x; done" > "$SCRIPT"
+time_script "feed=pipe"
+echo "for i in $words; do echo item \$i >> $LOG; done" > "$SCRIPT"
+time_script "append=redirect"
+echo "for i in $words; do echo item \$i | tee -a $LOG; done" > "$SCRIPT"
+time_script "append=tee"
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Per-command launch latency: run N trivial external commands through the shell
+# with each spawn engine and report the mean cost per launch.
+#
+# Usage: bench/spawn.sh [N] [SHELL_BINARY]
+
+N=${1:-5000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ "$i" -lt "$N" ]; do
+    echo "/bin/true"
+    i=$((i + 1))
+done > "$SCRIPT"
+
+for engine in fork posix; do
+    start=$(date +%s%N)
+    SHELL_SPAWN=$engine "$SHELL_BIN" < "$SCRIPT"
+    end=$(date +%s%N)
+    echo "spawn=$engine commands=$N usec_per_launch=$(( (end - start) / N / 1000 ))"
+done
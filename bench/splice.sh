@@ -0,0 +1,42 @@
+#!/bin/sh
+# Input stage cost: "cat FILE | wc -c" with the shell's splice() feeder versus an external
+# cat process (forced with "hash -p"). Reports throughput over a SIZE_MB file and per-pipeline
+# latency over N pipelines reading a small file.
+#
+# Usage: bench/splice.sh [SIZE_MB] [N] [SHELL_BINARY]
+
+SIZE_MB=${1:-512}
+N=${2:-2000}
+SHELL_BIN=${3:-./output}
+DATA=$(mktemp)
+SCRIPT=$(mktemp)
+trap 'rm -f "$DATA" "$SCRIPT"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/zero | tr '\0' 'x' > "$DATA"
+CAT=$(command -v cat)
+
+for mode in feeder process; do
+    if [ "$mode" = process ]; then
+        PREFIX="hash -p $CAT cat
+"
+    else
+        PREFIX=""
+    fi
+    start=$(date +%s%N)
+    "$SHELL_BIN" -c "${PREFIX}cat $DATA | wc -c" > /dev/null
+    end=$(date +%s%N)
+    echo "input=$mode size_mb=$SIZE_MB mb_per_sec=$(( SIZE_MB * 1000000000 / (end - start) ))"
+done
+
+for mode in feeder process; do
+    if [ "$mode" = process ]; then
+        echo "hash -p $CAT cat" > "$SCRIPT"
+    else
+        : > "$SCRIPT"
+    fi
+    awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "cat /etc/hostname | wc -c" }' >> "$SCRIPT"
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    echo "input=$mode pipelines=$N usec_per_pipeline=$(( (end - start) / N / 1000 ))"
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Cold start: launch the shell N times as "SHELL -c true" and report the mean cost per
+# start, next to /bin/true launched the same way so the loop's own fork cost can be told apart.
+#
+# Usage: bench/startup.sh [N] [SHELL_BINARY]
+
+N=${1:-2000}
+SHELL_BIN=${2:-./output}
+
+time_starts() {
+    i=0
+    start=$(date +%s%N)
+    while [ "$i" -lt "$N" ]; do
+        "$@"
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / N / 1000 ))
+}
+
+base=$(time_starts /bin/true)
+shell=$(time_starts "$SHELL_BIN" -c true)
+echo "startup starts=$N usec_per_start=$shell usec_true=$base usec_over_true=$((shell - base))"
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Shared counters: time a script of N short pipelines with SHELL_STATS unset and set, to show
+# what publishing the counters costs, and how long the shell takes to start either way. Then run
+# C such scripts at once and read them all with "--stat" while they are still going.
+#
+# Usage: bench/stats.sh [N] [C] [SHELL_BINARY]
+
+N=${1:-5000}
+C=${2:-4}
+SHELL_BIN=${3:-./output}
+SCRIPT=$(mktemp)
+SLOW=$(mktemp)
+EMPTY=$(mktemp)
+STATS_DIR=/dev/shm/shell-stats-bench-$$
+trap 'rm -rf "$SCRIPT" "$SLOW" "$EMPTY" "$STATS_DIR"' EXIT
+
+seq 1 "$N" | sed 's|.*|echo x \| /bin/true|' > "$SCRIPT"
+{ cat "$SCRIPT"; echo "sleep 2"; } > "$SLOW"
+
+time_script() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$1" > /dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+for stats in "" "$STATS_DIR"; do
+    label=off
+    [ -n "$stats" ] && label=on
+    total=0
+    for i in 1 2 3; do
+        total=$(( total + $(SHELL_STATS=$stats time_script "$SCRIPT") ))
+    done
+    startup=0
+    for i in $(seq 1 200); do
+        startup=$(( startup + $(SHELL_STATS=$stats time_script "$EMPTY") ))
+    done
+    echo "stats=$label pipelines=$N ms_per_run=$(( total / 3 ))" \
+         "startup_us=$(( startup * 1000 / 200 ))"
+done
+
+i=0
+while [ "$i" -lt "$C" ]; do
+    SHELL_STATS=$STATS_DIR "$SHELL_BIN" "$SLOW" > /dev/null &
+    i=$(( i + 1 ))
+done
+sleep 1
+SHELL_STATS=$STATS_DIR "$SHELL_BIN" --stat
+wait
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Launch stress: run N two-stage pipelines with redirections (every 100th one names a missing
+# command or file) under each spawn engine, and report the mean cost per pipeline plus the
+# shell's open descriptors and resident memory before and after, to expose fd or memory leaks.
+# "bench/stress.sh 1000000" is the full million-pipeline run.
+#
+# Usage: bench/stress.sh [N] [SHELL_BINARY]
+
+N=${1:-20000}
+SHELL_BIN=${2:-./output}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+probe='ls /proc/$$/fd | wc -l; grep VmRSS /proc/$$/status'
+{
+    echo "$probe"
+    seq 1 "$N" | sed -e '0~100s|.*|nosuch_command < /nonexistent \| /bin/true|' \
+                     -e 's|^[0-9]*$|/bin/true < /dev/null 3>/dev/null 2>\&3 \| /bin/true > /dev/null|'
+    echo "$probe"
+} > "$SCRIPT"
+
+time_script() {
+    start=$(date +%s%N)
+    engine=$1
+    # Each probe prints "FDS" and "VmRSS: KB kB"
+    set -- $(SHELL_SPAWN=$engine "$SHELL_BIN" "$SCRIPT" 2>/dev/null)
+    end=$(date +%s%N)
+    echo "spawn=$engine pipelines=$N usec_per_pipeline=$(( (end - start) / N / 1000 ))" \
+         "fds=$1->$5 rss_kb=$3->$7"
+}
+
+for engine in fork posix; do
+    time_script "$engine"
+done
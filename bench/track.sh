@@ -0,0 +1,64 @@
+#!/bin/sh
+# Regression tracking: run the startup, spawn and parse benchmarks against one binary,
+# append a line with the results to a results file, and compare every number with the
+# last line recorded for the same binary name at a different commit. Changes beyond
+# THRESHOLD percent in the wrong direction are marked REGRESSION. Used by "make bench".
+#
+# Usage: bench/track.sh [SHELL_BINARY] [RESULTS_FILE] [THRESHOLD]
+
+SHELL_BIN=${1:-./output-release}
+RESULTS=${2:-bench/results.txt}
+THRESHOLD=${3:-10}
+DIR=$(dirname "$0")
+
+# value KEY LINE: print the number after "KEY=" in a benchmark's output line
+value() {
+    echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+startup=$("$DIR/startup.sh" 2000 "$SHELL_BIN")
+spawn=$("$DIR/spawn.sh" 5000 "$SHELL_BIN")
+parse=$("$DIR/parse.sh" 20000 "$SHELL_BIN")
+echo "$startup"
+echo "$spawn"
+echo "$parse"
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD -- 2>/dev/null; then
+    commit="$commit-dirty"
+fi
+binary=$(basename "$SHELL_BIN")
+line="commit=$commit date=$(date +%Y-%m-%dT%H:%M:%S) binary=$binary"
+line="$line startup_usec=$(value usec_per_start "$startup")"
+line="$line spawn_fork_usec=$(value usec_per_launch "$(echo "$spawn" | grep spawn=fork)")"
+line="$line spawn_posix_usec=$(value usec_per_launch "$(echo "$spawn" | grep spawn=posix)")"
+line="$line parse_lines_per_sec=$(value lines_per_sec "$parse")"
+
+# Baseline: the newest recorded run of the same binary at another commit
+previous=""
+if [ -f "$RESULTS" ]; then
+    previous=$(grep " binary=$binary " "$RESULTS" | grep -v "^commit=$commit " | tail -n 1)
+fi
+echo "$line" >> "$RESULTS"
+if [ -z "$previous" ]; then
+    echo "recorded in $RESULTS (no earlier commit to compare with)"
+    exit 0
+fi
+
+# Metrics ending in _usec are better lower; everything else is better higher
+echo "compared with $(echo "$previous" | cut -d' ' -f1):"
+printf '%s\n%s\n' "$previous" "$line" | awk -v threshold="$THRESHOLD" '
+NR == 1 { for (i = 4; i <= NF; i++) { split($i, kv, "="); old[kv[1]] = kv[2] }; next }
+{
+    status = 0
+    for (i = 4; i <= NF; i++) {
+        split($i, kv, "=")
+        if (!(kv[1] in old) || old[kv[1]] == 0) continue
+        change = (kv[2] - old[kv[1]]) * 100 / old[kv[1]]
+        worse = (kv[1] ~ /_usec$/) ? change : -change
+        mark = (worse > threshold) ? "  REGRESSION" : ""
+        if (mark != "") status = 1
+        printf "  %-24s %10s -> %-10s %+6.1f%%%s\n", kv[1], old[kv[1]], kv[2], change, mark
+    }
+    exit status
+}'